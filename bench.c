@@ -0,0 +1,144 @@
+/**
+ * collectfs-bench - time the collection path without fuse.
+ *
+ * Builds a throw-away tree under the given directory and collects
+ * every file in it into a trash folder, repeatedly, timing each
+ * collection.  The files are spread over a number of directories, so
+ * the first round has to create the trash directories, and files
+ * are collected several times a second so the search for a free
+ * trash name gets exercised too.  Run it with and without --io-uring
+ * (and under strace -c -f to count system calls) to compare the
+ * collection backends:
+ *
+ *     collectfs-bench [-n files] [-w dirs] [-r rounds] [-d depth] [--io-uring] dir
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "log.h"
+#include "trash.h"
+#include "uring.h"
+
+static double now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n files] [-w dirs] [-r rounds] [-d depth] [--io-uring] dir\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int files = 1000, dirs = 100, rounds = 3, depth = 4;
+    struct local_context context;
+    char rootdir[PATH_MAX], dirpath[PATH_MAX], path[PATH_MAX], fpath[PATH_MAX];
+    int i, r, d;
+
+    memset(&context, 0, sizeof(context));
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--io-uring") == 0) {
+            context.use_uring = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            files = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            dirs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            depth = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (i != argc - 1 || files <= 0 || dirs <= 0 || rounds <= 0 || depth < 0) {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    set_tracing(0);
+    if (context.use_uring && !uring_available()) {
+        context.use_uring = 0;
+    }
+
+    snprintf(rootdir, sizeof(rootdir), "%s/collectfs-bench.%d", argv[i], (int)getpid());
+    if (mkdir(rootdir, 0700) != 0) {
+        perror(rootdir);
+        return EXIT_FAILURE;
+    }
+    context.rootdir = rootdir;
+    context.trashname = ".trash";
+    context.trashdir = malloc(strlen(rootdir) + strlen(context.trashname) + 2);
+    sprintf(context.trashdir, "%s/%s", rootdir, context.trashname);
+
+    /* The collected files live depth levels down */
+    strcpy(dirpath, "");
+    for (d = 0; d < depth; d++) {
+        char level[32];
+        snprintf(level, sizeof(level), "/level%d", d);
+        strcat(dirpath, level);
+        snprintf(fpath, sizeof(fpath), "%s%s", rootdir, dirpath);
+        mkdir(fpath, 0700);
+    }
+    for (d = 0; d < dirs; d++) {
+        snprintf(fpath, sizeof(fpath), "%s%s/dir%d", rootdir, dirpath, d);
+        mkdir(fpath, 0700);
+    }
+
+    double *samples = malloc(sizeof(double) * files * rounds);
+    double total = 0;
+    int n = 0;
+    for (r = 0; r < rounds; r++) {
+        for (i = 0; i < files; i++) {
+            snprintf(path, sizeof(path), "%s/dir%d/file%d", dirpath, i % dirs, i);
+            snprintf(fpath, sizeof(fpath), "%s%s", rootdir, path);
+            int fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+            if (fd < 0) {
+                perror(fpath);
+                return EXIT_FAILURE;
+            }
+            close(fd);
+            double start = now_us();
+            if (trash_collect_file(&context, fpath, path, time(NULL), NULL) != COLLECT_COLLECTED) {
+                fprintf(stderr, "collect failed for %s: %s\n", path, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            samples[n] = now_us() - start;
+            total += samples[n++];
+        }
+    }
+    qsort(samples, n, sizeof(double), compare_double);
+    printf("backend=%s collections=%d dirs=%d depth=%d mean=%.1fus p50=%.1fus p99=%.1fus max=%.1fus\n",
+           context.use_uring ? "io_uring" : "syscalls", n, dirs, depth, total / n, samples[n / 2],
+           samples[(int)(n * 0.99)], samples[n - 1]);
+    printf("(trash left in %s)\n", rootdir);
+    free(samples);
+    return EXIT_SUCCESS;
+}
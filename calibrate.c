@@ -0,0 +1,134 @@
+/**
+ * Request size calibration.
+ *
+ * Fuse takes reads and writes in requests of up to the sizes
+ * negotiated in fop_init.  Bigger requests mean fewer trips through
+ * the kernel, but past the size the backing filesystem does best with
+ * they only hold up the requests behind them.  With --calibrate,
+ * before the mount serves anything, a scratch file in rootdir - unlinked
+ * as soon as it is created, so nothing shows - is written, synced and
+ * read back from disk at each power of two request size from
+ * CALIBRATE_MIN_SIZE up to the largest fuse offers, CALIBRATE_BYTES at
+ * each.  The smallest size within CALIBRATE_PERCENT of the best
+ * throughput is used for max_write and max_readahead.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "calibrate.h"
+#include "log.h"
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Bytes/second writing and reading back CALIBRATE_BYTES in requests of
+ * size, or 0 if it fails.
+ */
+static double throughput(int fd, char *buffer, size_t size)
+{
+    double write_time, read_time, started;
+    off_t offset;
+
+    started = now();
+    for (offset = 0; offset < CALIBRATE_BYTES; offset += size) {
+        if (pwrite(fd, buffer, size, offset) != (ssize_t)size) {
+            return 0;
+        }
+    }
+    if (fdatasync(fd) != 0) {
+        return 0;
+    }
+    write_time = now() - started;
+
+    /* Read it from the disk, not the page cache */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    started = now();
+    for (offset = 0; offset < CALIBRATE_BYTES; offset += size) {
+        if (pread(fd, buffer, size, offset) != (ssize_t)size) {
+            return 0;
+        }
+    }
+    read_time = now() - started;
+    return write_time + read_time > 0 ? 2.0 * CALIBRATE_BYTES / (write_time + read_time) : 0;
+}
+
+/**
+ * The request size, up to largest, that the filesystem holding dir
+ * does best with, or 0 if it can't be measured.
+ */
+size_t calibrate_request_size(const char *dir, size_t largest)
+{
+    char path[PATH_MAX];
+    double rates[sizeof(size_t) * CHAR_BIT], best = 0;
+    size_t size, chosen = 0;
+    char *buffer;
+    int fd, i;
+
+    if (largest < CALIBRATE_MIN_SIZE) {
+        return largest;
+    }
+    if (snprintf(path, sizeof(path), "%s/.collectfs-calibrate.%d", dir, (int)getpid()) >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        log_errno("Collectfs: cannot calibrate in %s", dir);
+        return 0;
+    }
+    buffer = malloc(largest);
+    if (buffer == NULL) {
+        log_errno("calibrate_request_size");
+        return 0;
+    }
+    memset(buffer, 0x5a, largest);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        log_errno("Collectfs: cannot calibrate with %s", path);
+        free(buffer);
+        return 0;
+    }
+    unlink(path);
+
+    for (size = CALIBRATE_MIN_SIZE, i = 0; size <= largest; size *= 2, i++) {
+        rates[i] = throughput(fd, buffer, size);
+        if (rates[i] == 0) {
+            log_errno("Collectfs: cannot calibrate with %s", path);
+            close(fd);
+            free(buffer);
+            return 0;
+        }
+        if (rates[i] > best) {
+            best = rates[i];
+        }
+    }
+    close(fd);
+    free(buffer);
+
+    for (size = CALIBRATE_MIN_SIZE, i = 0; size <= largest; size *= 2, i++) {
+        if (rates[i] * 100 >= best * CALIBRATE_PERCENT) {
+            chosen = size;
+            break;
+        }
+    }
+    log_info("Collectfs: calibrated %s - %zuKB requests at %.0fMB/s, the best is %.0fMB/s", dir, chosen / 1024,
+             rates[i] / (1024 * 1024), best / (1024 * 1024));
+    return chosen;
+}
@@ -0,0 +1,25 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _CALIBRATE_H_
+#define _CALIBRATE_H_
+
+#include <stddef.h>
+
+/**
+ * Bytes written and read back at each request size
+ */
+#define CALIBRATE_BYTES (8 * 1024 * 1024)
+/**
+ * The smallest request size tried
+ */
+#define CALIBRATE_MIN_SIZE 4096
+/**
+ * A size within this percentage of the best throughput is good enough
+ */
+#define CALIBRATE_PERCENT 90
+
+size_t calibrate_request_size(const char *dir, size_t largest);
+
+#endif
@@ -0,0 +1,520 @@
+/**
+ * Operation capture.
+ *
+ * Synthetic benchmarks don't look like a real build or editing
+ * session.  With --capture=FILE every call the mount serves is
+ * recorded to FILE as it returns: which operation, its paths, flags,
+ * sizes, offsets and file handle, when it was made, how long it took
+ * and what it returned (see capture.h).  Nothing read or written is
+ * kept, only how much, so a capture is small - about 64 bytes and the
+ * paths a call - and can be taken from a mount in real use.
+ *
+ * collectfs-replay issues a capture's calls again, against another
+ * mount or the plain directory, at the recorded pace or as fast as it
+ * can, and compares the latency distributions.
+ *
+ * Capturing works by putting a wrapper around each of the fuse
+ * operations, so collectfs itself doesn't change.  Wrappers for mounts
+ * that aren't being captured cost a call and a test.  Calls are written
+ * through one buffered stream under a lock, so the file is complete
+ * once the mount has been unmounted.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <utime.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
+#include "capture.h"
+#include "collectfs.h"
+#include "log.h"
+
+/**
+ * Buffer for the capture stream - big enough that writing it out is
+ * rare.
+ */
+#define CAPTURE_BUFFER (1024 * 1024)
+
+struct capture {
+    char *path;
+    FILE *fp;
+    pthread_mutex_t lock;
+    struct timespec started;
+    unsigned long long records;
+    /** Stopped writing after an error */
+    int failed;
+};
+
+/**
+ * A call in progress.
+ */
+struct capture_call {
+    struct capture *capture;
+    struct timespec started;
+    struct capture_record record;
+    const char *path;
+    const char *path2;
+};
+
+/** The operations being wrapped */
+static struct fuse_operations real;
+static struct fuse_operations wrapped;
+
+static uint64_t elapsed_ns(const struct timespec *from, const struct timespec *to)
+{
+    int64_t ns = (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+
+    return ns > 0 ? ns : 0;
+}
+
+static void call_begin(struct capture_call *call, int op, const char *path, const char *path2)
+{
+    struct local_context *context = (struct local_context *)fuse_get_context()->private_data;
+
+    memset(&call->record, 0, sizeof(call->record));
+    call->capture = context->capture;
+    call->record.op = op;
+    call->path = path;
+    call->path2 = path2;
+    if (call->capture != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &call->started);
+    }
+}
+
+static int call_end(struct capture_call *call, int result)
+{
+    struct capture *capture = call->capture;
+    struct timespec ended;
+
+    if (capture == NULL) {
+        return result;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ended);
+    call->record.start = elapsed_ns(&capture->started, &call->started);
+    call->record.duration = elapsed_ns(&call->started, &ended);
+    call->record.result = result;
+    call->record.pathlen = call->path != NULL ? strlen(call->path) : 0;
+    call->record.path2len = call->path2 != NULL ? strlen(call->path2) : 0;
+
+    pthread_mutex_lock(&capture->lock);
+    if (!capture->failed) {
+        if (fwrite(&call->record, sizeof(call->record), 1, capture->fp) != 1
+            || fwrite(call->path, 1, call->record.pathlen, capture->fp) != call->record.pathlen
+            || fwrite(call->path2, 1, call->record.path2len, capture->fp) != call->record.path2len) {
+            capture->failed = 1;
+            log_errno("Collectfs: cannot write the capture %s - no longer capturing", capture->path);
+        } else {
+            capture->records++;
+        }
+    }
+    pthread_mutex_unlock(&capture->lock);
+    return result;
+}
+
+static int record_getattr(const char *path, struct stat *statbuf)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_GETATTR, path, NULL);
+    return call_end(&call, real.getattr(path, statbuf));
+}
+
+static int record_readlink(const char *path, char *link, size_t size)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_READLINK, path, NULL);
+    call.record.size = size;
+    return call_end(&call, real.readlink(path, link, size));
+}
+
+static int record_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_MKNOD, path, NULL);
+    call.record.mode = mode;
+    call.record.size = dev;
+    return call_end(&call, real.mknod(path, mode, dev));
+}
+
+static int record_mkdir(const char *path, mode_t mode)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_MKDIR, path, NULL);
+    call.record.mode = mode;
+    return call_end(&call, real.mkdir(path, mode));
+}
+
+static int record_unlink(const char *path)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_UNLINK, path, NULL);
+    return call_end(&call, real.unlink(path));
+}
+
+static int record_rmdir(const char *path)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_RMDIR, path, NULL);
+    return call_end(&call, real.rmdir(path));
+}
+
+static int record_symlink(const char *target, const char *link)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_SYMLINK, link, target);
+    return call_end(&call, real.symlink(target, link));
+}
+
+static int record_rename(const char *path, const char *newpath)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_RENAME, path, newpath);
+    return call_end(&call, real.rename(path, newpath));
+}
+
+static int record_link(const char *path, const char *newpath)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_LINK, path, newpath);
+    return call_end(&call, real.link(path, newpath));
+}
+
+static int record_chmod(const char *path, mode_t mode)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_CHMOD, path, NULL);
+    call.record.mode = mode;
+    return call_end(&call, real.chmod(path, mode));
+}
+
+static int record_chown(const char *path, uid_t uid, gid_t gid)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_CHOWN, path, NULL);
+    call.record.size = uid;
+    call.record.offset = gid;
+    return call_end(&call, real.chown(path, uid, gid));
+}
+
+static int record_truncate(const char *path, off_t newsize)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_TRUNCATE, path, NULL);
+    call.record.size = newsize;
+    return call_end(&call, real.truncate(path, newsize));
+}
+
+static int record_utime(const char *path, struct utimbuf *ubuf)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_UTIME, path, NULL);
+    if (ubuf != NULL) {
+        call.record.size = ubuf->actime;
+        call.record.offset = ubuf->modtime;
+    }
+    return call_end(&call, real.utime(path, ubuf));
+}
+
+static int record_open(const char *path, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+    int rstatus;
+
+    call_begin(&call, CAPTURE_OPEN, path, NULL);
+    call.record.flags = fi->flags;
+    rstatus = real.open(path, fi);
+    call.record.fh = fi->fh;
+    return call_end(&call, rstatus);
+}
+
+static int record_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_READ, path, NULL);
+    call.record.fh = fi->fh;
+    call.record.size = size;
+    call.record.offset = offset;
+    return call_end(&call, real.read(path, buf, size, offset, fi));
+}
+
+static int record_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_WRITE, path, NULL);
+    call.record.fh = fi->fh;
+    call.record.size = size;
+    call.record.offset = offset;
+    return call_end(&call, real.write(path, buf, size, offset, fi));
+}
+
+static int record_statfs(const char *path, struct statvfs *statv)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_STATFS, path, NULL);
+    return call_end(&call, real.statfs(path, statv));
+}
+
+static int record_flush(const char *path, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_FLUSH, path, NULL);
+    call.record.fh = fi->fh;
+    return call_end(&call, real.flush(path, fi));
+}
+
+static int record_release(const char *path, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_RELEASE, path, NULL);
+    call.record.fh = fi->fh;
+    return call_end(&call, real.release(path, fi));
+}
+
+static int record_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_FSYNC, path, NULL);
+    call.record.fh = fi->fh;
+    call.record.flags = datasync;
+    return call_end(&call, real.fsync(path, datasync, fi));
+}
+
+static int record_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_SETXATTR, path, name);
+    call.record.size = size;
+    call.record.flags = flags;
+    return call_end(&call, real.setxattr(path, name, value, size, flags));
+}
+
+static int record_getxattr(const char *path, const char *name, char *value, size_t size)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_GETXATTR, path, name);
+    call.record.size = size;
+    return call_end(&call, real.getxattr(path, name, value, size));
+}
+
+static int record_listxattr(const char *path, char *list, size_t size)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_LISTXATTR, path, NULL);
+    call.record.size = size;
+    return call_end(&call, real.listxattr(path, list, size));
+}
+
+static int record_removexattr(const char *path, const char *name)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_REMOVEXATTR, path, name);
+    return call_end(&call, real.removexattr(path, name));
+}
+
+static int record_opendir(const char *path, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+    int rstatus;
+
+    call_begin(&call, CAPTURE_OPENDIR, path, NULL);
+    rstatus = real.opendir(path, fi);
+    call.record.fh = fi->fh;
+    return call_end(&call, rstatus);
+}
+
+static int record_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+                          struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_READDIR, path, NULL);
+    call.record.fh = fi->fh;
+    call.record.offset = offset;
+    return call_end(&call, real.readdir(path, buf, filler, offset, fi));
+}
+
+static int record_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_RELEASEDIR, path, NULL);
+    call.record.fh = fi->fh;
+    return call_end(&call, real.releasedir(path, fi));
+}
+
+static int record_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_FSYNCDIR, path, NULL);
+    call.record.fh = fi->fh;
+    call.record.flags = datasync;
+    return call_end(&call, real.fsyncdir(path, datasync, fi));
+}
+
+static int record_access(const char *path, int mask)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_ACCESS, path, NULL);
+    call.record.flags = mask;
+    return call_end(&call, real.access(path, mask));
+}
+
+static int record_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+    int rstatus;
+
+    call_begin(&call, CAPTURE_CREATE, path, NULL);
+    call.record.mode = mode;
+    call.record.flags = fi->flags;
+    rstatus = real.create(path, mode, fi);
+    call.record.fh = fi->fh;
+    return call_end(&call, rstatus);
+}
+
+static int record_ftruncate(const char *path, off_t offset, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_FTRUNCATE, path, NULL);
+    call.record.fh = fi->fh;
+    call.record.size = offset;
+    return call_end(&call, real.ftruncate(path, offset, fi));
+}
+
+static int record_fgetattr(const char *path, struct stat *statbuf, struct fuse_file_info *fi)
+{
+    struct capture_call call;
+
+    call_begin(&call, CAPTURE_FGETATTR, path, NULL);
+    call.record.fh = fi->fh;
+    return call_end(&call, real.fgetattr(path, statbuf, fi));
+}
+
+const struct fuse_operations *capture_operations(const struct fuse_operations *ops)
+{
+    real = *ops;
+    /* Anything not wrapped below - init, destroy - passes straight through */
+    wrapped = *ops;
+#define WRAP(op) if (ops->op != NULL) wrapped.op = record_##op
+    WRAP(getattr);
+    WRAP(readlink);
+    WRAP(mknod);
+    WRAP(mkdir);
+    WRAP(unlink);
+    WRAP(rmdir);
+    WRAP(symlink);
+    WRAP(rename);
+    WRAP(link);
+    WRAP(chmod);
+    WRAP(chown);
+    WRAP(truncate);
+    WRAP(utime);
+    WRAP(open);
+    WRAP(read);
+    WRAP(write);
+    WRAP(statfs);
+    WRAP(flush);
+    WRAP(release);
+    WRAP(fsync);
+    WRAP(setxattr);
+    WRAP(getxattr);
+    WRAP(listxattr);
+    WRAP(removexattr);
+    WRAP(opendir);
+    WRAP(readdir);
+    WRAP(releasedir);
+    WRAP(fsyncdir);
+    WRAP(access);
+    WRAP(create);
+    WRAP(ftruncate);
+    WRAP(fgetattr);
+#undef WRAP
+    return &wrapped;
+}
+
+int capture_start(struct local_context *context)
+{
+    struct capture *capture = calloc(1, sizeof(struct capture));
+    struct capture_header header = { CAPTURE_MAGIC, sizeof(struct capture_record), time(NULL) };
+
+    if (capture == NULL) {
+        return log_errno("capture_start");
+    }
+    capture->path = context->capture_path;
+    capture->fp = fopen(capture->path, "w");
+    if (capture->fp == NULL) {
+        log_errno("Collectfs: cannot create the capture %s", capture->path);
+        free(capture);
+        return -1;
+    }
+    setvbuf(capture->fp, NULL, _IOFBF, CAPTURE_BUFFER);
+    if (fwrite(&header, sizeof(header), 1, capture->fp) != 1) {
+        log_errno("Collectfs: cannot write the capture %s", capture->path);
+        fclose(capture->fp);
+        free(capture);
+        return -1;
+    }
+    pthread_mutex_init(&capture->lock, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &capture->started);
+    context->capture = capture;
+    log_info("Collectfs: capturing every operation to %s", capture->path);
+    return 0;
+}
+
+/**
+ * Called once no more operations can arrive.
+ */
+void capture_stop(struct local_context *context)
+{
+    struct capture *capture = context->capture;
+
+    if (capture == NULL) {
+        return;
+    }
+    context->capture = NULL;
+    if (fclose(capture->fp) != 0 && !capture->failed) {
+        log_errno("Collectfs: cannot write the capture %s", capture->path);
+    }
+    log_info("Collectfs: captured %llu operations to %s", capture->records, capture->path);
+    pthread_mutex_destroy(&capture->lock);
+    free(capture);
+}
@@ -0,0 +1,102 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#include "collectfs.h"
+
+#define CAPTURE_MAGIC 0x50434643        /* "CFCP" */
+
+/**
+ * A capture file starts with this, followed by a record for each
+ * call, in the order the calls returned.
+ */
+struct capture_header {
+    uint32_t magic;
+    /** sizeof(struct capture_record) - a reader built differently refuses the file */
+    uint32_t record_size;
+    /** When the capture started, seconds since the epoch */
+    int64_t started;
+};
+
+enum {
+    CAPTURE_GETATTR,
+    CAPTURE_READLINK,
+    CAPTURE_MKNOD,
+    CAPTURE_MKDIR,
+    CAPTURE_UNLINK,
+    CAPTURE_RMDIR,
+    CAPTURE_SYMLINK,
+    CAPTURE_RENAME,
+    CAPTURE_LINK,
+    CAPTURE_CHMOD,
+    CAPTURE_CHOWN,
+    CAPTURE_TRUNCATE,
+    CAPTURE_UTIME,
+    CAPTURE_OPEN,
+    CAPTURE_READ,
+    CAPTURE_WRITE,
+    CAPTURE_STATFS,
+    CAPTURE_FLUSH,
+    CAPTURE_RELEASE,
+    CAPTURE_FSYNC,
+    CAPTURE_SETXATTR,
+    CAPTURE_GETXATTR,
+    CAPTURE_LISTXATTR,
+    CAPTURE_REMOVEXATTR,
+    CAPTURE_OPENDIR,
+    CAPTURE_READDIR,
+    CAPTURE_RELEASEDIR,
+    CAPTURE_FSYNCDIR,
+    CAPTURE_ACCESS,
+    CAPTURE_CREATE,
+    CAPTURE_FTRUNCATE,
+    CAPTURE_FGETATTR,
+    CAPTURE_OPS
+};
+
+/**
+ * One call, in the byte order of the machine that made it, followed by
+ * pathlen bytes of path and path2len bytes of the second argument - the
+ * new path of a rename or link, the target of a symlink (whose path is
+ * the link) or the name of an extended attribute.  Neither is NUL
+ * terminated.  What was read, written or set isn't kept, only how much.
+ */
+struct capture_record {
+    /** Nanoseconds from the start of the capture to the call */
+    uint64_t start;
+    /** Nanoseconds the call took */
+    uint64_t duration;
+    /** The file handle opened or used, to match calls to their open */
+    uint64_t fh;
+    /** Bytes asked for or given, the new size, the device (mknod), access time (utime) or uid (chown) */
+    uint64_t size;
+    /** Offset of a read or write, modification time (utime) or gid (chown) */
+    int64_t offset;
+    /** What the call returned - a count, 0 or -errno */
+    int32_t result;
+    /** Open flags, access mask, datasync or setxattr flags */
+    uint32_t flags;
+    uint32_t mode;
+    /** A CAPTURE_ value */
+    uint32_t op;
+    uint32_t pathlen;
+    uint32_t path2len;
+};
+
+struct fuse_operations;
+
+/**
+ * The operations, each recorded as it returns if its mount is being
+ * captured.
+ */
+const struct fuse_operations *capture_operations(const struct fuse_operations *ops);
+
+int capture_start(struct local_context *context);
+void capture_stop(struct local_context *context);
+
+#endif
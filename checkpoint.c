@@ -0,0 +1,564 @@
+/**
+ * collectfs-checkpoint - snapshot the whole rootdir into the trash.
+ *
+ * Collection keeps the versions of files as they are replaced or
+ * deleted.  Before something that will touch a lot of files (a mass
+ * refactor, git clean, a migration) it is easier to have the lot as
+ * they were.  This clones every file under rootdir into a checkpoint
+ * in the trash:
+ *
+ *     collectfs-checkpoint [-j threads] [-n label] rootdir [trashdir]
+ *
+ * The checkpoint is trashdir/.checkpoints/YYYY-MM-DD.HH:MM:SS[-label]
+ * and mirrors the rootdir.  trashdir defaults to the trash folder at
+ * the top of rootdir ($COLLECTFS_TRASH or .trash), which is skipped.
+ *
+ * Files are reflinked, so a checkpoint costs no space until files
+ * change.  Where the filesystem can't reflink they are hardlinked and
+ * the inodes listed in YYYY-MM-DD.HH:MM:SS[-label].links, and a
+ * mounted collectfs copies a listed file before changing it (see
+ * cow.c) - changes made to the rootdir other than through the mount
+ * would change the checkpoint too.  Failing that they are copied.
+ *
+ * The tree is walked by a thread per CPU (or -j threads).  Each has
+ * its own queue of directories, taking the most recently found from
+ * the end of its own and, when that runs dry, stealing the oldest from
+ * the front of someone else's - the big subtrees near the top.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "copy.h"
+#include "cow.h"
+#include "log.h"
+
+/** How long an idle walker waits before looking for work again */
+#define CHECKPOINT_IDLE_USEC 100
+
+struct walk_queue {
+    pthread_mutex_t lock;
+    /** Directories relative to rootdir - items[top] to items[bottom - 1] */
+    char **items;
+    size_t top;
+    size_t bottom;
+    size_t size;
+};
+
+struct checkpoint {
+    int rootfd;
+    int destfd;
+    int linksfd;
+    dev_t trash_dev;
+    ino_t trash_ino;
+    int nwalkers;
+    struct walk_queue *queues;
+    /** Directories queued or being walked - the walk is over at zero */
+    long pending;
+    /** Set once the filesystem has refused a reflink or hardlink */
+    int no_reflink;
+    int no_link;
+    unsigned long long files;
+    unsigned long long reflinked;
+    unsigned long long linked;
+    unsigned long long copied;
+    unsigned long long dirs;
+    unsigned long long symlinks;
+    unsigned long long skipped;
+    unsigned long long errors;
+};
+
+struct walker {
+    struct checkpoint *checkpoint;
+    int id;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-n label] rootdir [trashdir]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static void count(unsigned long long *counter)
+{
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+static void failed(struct checkpoint *checkpoint, const char *what, const char *rel, const char *name)
+{
+    fprintf(stderr, "collectfs-checkpoint: %s %s%s%s: %s\n", what, rel, rel[0] != '\0' ? "/" : "", name,
+            strerror(errno));
+    count(&checkpoint->errors);
+}
+
+static int push(struct walk_queue *queue, char *rel)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->bottom == queue->size) {
+        if (queue->top > 0) {
+            memmove(queue->items, queue->items + queue->top, (queue->bottom - queue->top) * sizeof(char *));
+            queue->bottom -= queue->top;
+            queue->top = 0;
+        } else {
+            size_t size = queue->size > 0 ? queue->size * 2 : 256;
+            char **items = realloc(queue->items, size * sizeof(char *));
+
+            if (items == NULL) {
+                pthread_mutex_unlock(&queue->lock);
+                return -1;
+            }
+            queue->items = items;
+            queue->size = size;
+        }
+    }
+    queue->items[queue->bottom++] = rel;
+    pthread_mutex_unlock(&queue->lock);
+    return 0;
+}
+
+/**
+ * Take a directory from the end of our own queue, or steal one from
+ * the front of another.
+ */
+static char *take(struct checkpoint *checkpoint, int id)
+{
+    char *rel = NULL;
+    int i;
+
+    for (i = 0; rel == NULL && i < checkpoint->nwalkers; i++) {
+        struct walk_queue *queue = &checkpoint->queues[(id + i) % checkpoint->nwalkers];
+
+        pthread_mutex_lock(&queue->lock);
+        if (queue->bottom > queue->top) {
+            rel = i == 0 ? queue->items[--queue->bottom] : queue->items[queue->top++];
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+    return rel;
+}
+
+static int set_attributes(int fd, const struct stat *sb)
+{
+    struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+
+    if (fchown(fd, sb->st_uid, sb->st_gid) != 0) {
+        /* Not ours to give away - keep going as our own */
+    }
+    return futimens(fd, times);
+}
+
+/**
+ * Reflink name into the checkpoint.
+ */
+static int clone_regular(struct checkpoint *checkpoint, int srcdir, int destdir, const char *name,
+                         const struct stat *sb)
+{
+    int infd, outfd, err;
+
+    infd = openat(srcdir, name, O_RDONLY | O_NOFOLLOW);
+    if (infd < 0) {
+        return -1;
+    }
+    outfd = openat(destdir, name, O_WRONLY | O_CREAT | O_EXCL, sb->st_mode & 07777);
+    if (outfd < 0) {
+        err = errno;
+        close(infd);
+        errno = err;
+        return -1;
+    }
+    if (ioctl(outfd, FICLONE, infd) == 0 && set_attributes(outfd, sb) == 0) {
+        close(infd);
+        if (close(outfd) == 0) {
+            count(&checkpoint->reflinked);
+            return 0;
+        }
+        outfd = -1;
+    }
+    err = errno;
+    if (err == EOPNOTSUPP || err == EXDEV || err == EINVAL || err == ENOTTY || err == ENOSYS) {
+        /* Not on this filesystem - don't try again */
+        __atomic_store_n(&checkpoint->no_reflink, 1, __ATOMIC_RELAXED);
+    }
+    if (outfd >= 0) {
+        close(outfd);
+        close(infd);
+    }
+    unlinkat(destdir, name, 0);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Hardlink name into the checkpoint, listing its inode first so that
+ * a mount will never see the link without knowing about it.
+ */
+static int link_regular(struct checkpoint *checkpoint, int srcdir, int destdir, const char *name,
+                        const struct stat *sb)
+{
+    char line[64];
+    int len = snprintf(line, sizeof(line), "%llu %llu\n", (unsigned long long)sb->st_dev,
+                       (unsigned long long)sb->st_ino);
+
+    if (write(checkpoint->linksfd, line, len) != len) {
+        return -1;
+    }
+    if (linkat(srcdir, name, destdir, name, 0) != 0) {
+        if (errno == EXDEV) {
+            __atomic_store_n(&checkpoint->no_link, 1, __ATOMIC_RELAXED);
+        }
+        return -1;
+    }
+    count(&checkpoint->linked);
+    return 0;
+}
+
+static int copy_regular(struct checkpoint *checkpoint, int srcdir, int destdir, const char *name,
+                        const struct stat *sb)
+{
+    int infd, outfd, err;
+
+    infd = openat(srcdir, name, O_RDONLY | O_NOFOLLOW);
+    if (infd < 0) {
+        return -1;
+    }
+    outfd = openat(destdir, name, O_WRONLY | O_CREAT | O_EXCL, sb->st_mode & 07777);
+    if (outfd < 0) {
+        err = errno;
+        close(infd);
+        errno = err;
+        return -1;
+    }
+    if (copy_file_data(infd, outfd) == 0 && set_attributes(outfd, sb) == 0) {
+        close(infd);
+        if (close(outfd) == 0) {
+            count(&checkpoint->copied);
+            return 0;
+        }
+        outfd = -1;
+    }
+    err = errno;
+    if (outfd >= 0) {
+        close(outfd);
+        close(infd);
+    }
+    unlinkat(destdir, name, 0);
+    errno = err;
+    return -1;
+}
+
+static void checkpoint_regular(struct checkpoint *checkpoint, int srcdir, int destdir, const char *rel,
+                               const char *name, const struct stat *sb)
+{
+    count(&checkpoint->files);
+    if (!__atomic_load_n(&checkpoint->no_reflink, __ATOMIC_RELAXED)
+        && clone_regular(checkpoint, srcdir, destdir, name, sb) == 0) {
+        return;
+    }
+    /* No reflinks - hardlink, or failing that copy */
+    if (!__atomic_load_n(&checkpoint->no_link, __ATOMIC_RELAXED)
+        && link_regular(checkpoint, srcdir, destdir, name, sb) == 0) {
+        return;
+    }
+    if (copy_regular(checkpoint, srcdir, destdir, name, sb) != 0) {
+        failed(checkpoint, "cannot checkpoint", rel, name);
+    }
+}
+
+static void checkpoint_symlink(struct checkpoint *checkpoint, int srcdir, int destdir, const char *rel,
+                               const char *name, const struct stat *sb)
+{
+    char target[PATH_MAX];
+    struct timespec times[2] = { sb->st_atim, sb->st_mtim };
+    ssize_t len = readlinkat(srcdir, name, target, sizeof(target) - 1);
+
+    if (len < 0) {
+        failed(checkpoint, "cannot read symlink", rel, name);
+        return;
+    }
+    target[len] = '\0';
+    if (symlinkat(target, destdir, name) != 0) {
+        failed(checkpoint, "cannot create symlink", rel, name);
+        return;
+    }
+    if (fchownat(destdir, name, sb->st_uid, sb->st_gid, AT_SYMLINK_NOFOLLOW) != 0) {
+        /* Not ours to give away */
+    }
+    utimensat(destdir, name, times, AT_SYMLINK_NOFOLLOW);
+    count(&checkpoint->symlinks);
+}
+
+/**
+ * Checkpoint everything in directory rel, queueing its subdirectories.
+ * The checkpoint's copy of rel already exists.
+ */
+static void walk_directory(struct checkpoint *checkpoint, int id, const char *rel)
+{
+    const char *at = rel[0] != '\0' ? rel : ".";
+    struct dirent *entry;
+    struct stat sb;
+    int srcdir, destdir;
+    DIR *dir;
+
+    destdir = openat(checkpoint->destfd, at, O_RDONLY | O_DIRECTORY);
+    srcdir = openat(checkpoint->rootfd, at, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    dir = srcdir >= 0 ? fdopendir(srcdir) : NULL;
+    if (dir == NULL || destdir < 0) {
+        failed(checkpoint, "cannot walk", rel, "");
+        if (dir == NULL && srcdir >= 0) {
+            close(srcdir);
+        }
+        if (destdir >= 0) {
+            close(destdir);
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
+        return;
+    }
+    count(&checkpoint->dirs);
+    while ((entry = readdir(dir)) != NULL) {
+        const char *name = entry->d_name;
+
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (fstatat(srcdir, name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno != ENOENT) {
+                failed(checkpoint, "cannot stat", rel, name);
+            }
+            continue;
+        }
+        if (S_ISREG(sb.st_mode)) {
+            checkpoint_regular(checkpoint, srcdir, destdir, rel, name, &sb);
+        } else if (S_ISDIR(sb.st_mode)) {
+            char *sub;
+
+            if (sb.st_dev == checkpoint->trash_dev && sb.st_ino == checkpoint->trash_ino) {
+                continue;       /* the trash itself */
+            }
+            /* We must be able to fill it whatever its permissions */
+            if (mkdirat(destdir, name, (sb.st_mode & 07777) | S_IRWXU) != 0) {
+                failed(checkpoint, "cannot create directory", rel, name);
+                continue;
+            }
+            if (fchownat(destdir, name, sb.st_uid, sb.st_gid, 0) != 0) {
+                /* Not ours to give away */
+            }
+            if (asprintf(&sub, "%s%s%s", rel, rel[0] != '\0' ? "/" : "", name) < 0) {
+                failed(checkpoint, "cannot queue", rel, name);
+                continue;
+            }
+            __atomic_add_fetch(&checkpoint->pending, 1, __ATOMIC_SEQ_CST);
+            if (push(&checkpoint->queues[id], sub) != 0) {
+                __atomic_sub_fetch(&checkpoint->pending, 1, __ATOMIC_SEQ_CST);
+                failed(checkpoint, "cannot queue", rel, name);
+                free(sub);
+            }
+        } else if (S_ISLNK(sb.st_mode)) {
+            checkpoint_symlink(checkpoint, srcdir, destdir, rel, name, &sb);
+        } else {
+            /* Devices, fifos and sockets have no content to keep */
+            count(&checkpoint->skipped);
+        }
+    }
+    closedir(dir);
+    close(destdir);
+}
+
+static void *walker(void *arg)
+{
+    struct walker *walker = (struct walker *)arg;
+    struct checkpoint *checkpoint = walker->checkpoint;
+
+    while (__atomic_load_n(&checkpoint->pending, __ATOMIC_SEQ_CST) > 0) {
+        char *rel = take(checkpoint, walker->id);
+
+        if (rel == NULL) {
+            /* Everything left is being walked by others - wait for them to find more */
+            usleep(CHECKPOINT_IDLE_USEC);
+            continue;
+        }
+        walk_directory(checkpoint, walker->id, rel);
+        free(rel);
+        __atomic_sub_fetch(&checkpoint->pending, 1, __ATOMIC_SEQ_CST);
+    }
+    return NULL;
+}
+
+static int open_destination(struct checkpoint *checkpoint, const char *trashdir, const char *label, char *name,
+                            size_t namesize, mode_t mode)
+{
+    char folder[PATH_MAX], links[NAME_MAX + 1];
+    time_t now = time(NULL);
+    struct tm tmbuf;
+    size_t len;
+
+    if (snprintf(folder, sizeof(folder), "%s/%s", trashdir, COW_FOLDER) >= sizeof(folder)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if ((mkdir(trashdir, 0700) != 0 && errno != EEXIST) || (mkdir(folder, 0700) != 0 && errno != EEXIST)) {
+        return -1;
+    }
+    len = strftime(name, namesize, "%Y-%m-%d.%H:%M:%S", localtime_r(&now, &tmbuf));
+    if (len == 0 || (label != NULL && snprintf(name + len, namesize - len, "-%s", label) >= namesize - len)
+        || snprintf(links, sizeof(links), "%s%s", name, COW_LINKS_SUFFIX) >= sizeof(links)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strncat(folder, "/", sizeof(folder) - strlen(folder) - 1);
+    if (strlen(folder) + strlen(links) >= sizeof(folder)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcat(folder, links);
+    checkpoint->linksfd = open(folder, O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+    if (checkpoint->linksfd < 0) {
+        return -1;
+    }
+    folder[strlen(folder) - strlen(COW_LINKS_SUFFIX)] = '\0';
+    if (mkdir(folder, mode | S_IRWXU) != 0) {
+        return -1;
+    }
+    checkpoint->destfd = open(folder, O_RDONLY | O_DIRECTORY);
+    return checkpoint->destfd < 0 ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    struct checkpoint checkpoint;
+    struct walker *walkers;
+    struct timespec started, finished;
+    struct stat sb;
+    pthread_t *threads;
+    char trashpath[PATH_MAX], name[NAME_MAX + 1];
+    const char *rootdir, *trashdir, *label = NULL;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    double elapsed;
+    int opt, t;
+
+    while ((opt = getopt(argc, argv, "j:n:")) != -1) {
+        if (opt == 'j' && (nthreads = atol(optarg)) > 0) {
+            continue;
+        }
+        if (opt != 'n' || optarg[0] == '\0' || strchr(optarg, '/') != NULL) {
+            usage(argv[0]);
+        }
+        label = optarg;
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    rootdir = argv[optind];
+    if (optind == argc - 2) {
+        trashdir = argv[optind + 1];
+    } else {
+        const char *trashname = getenv("COLLECTFS_TRASH") != NULL ? getenv("COLLECTFS_TRASH") : ".trash";
+
+        if (snprintf(trashpath, sizeof(trashpath), "%s/%s", rootdir, trashname) >= sizeof(trashpath)) {
+            fprintf(stderr, "%s: %s\n", rootdir, strerror(ENAMETOOLONG));
+            return EXIT_FAILURE;
+        }
+        trashdir = trashpath;
+    }
+
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.linksfd = checkpoint.destfd = -1;
+    checkpoint.rootfd = open(rootdir, O_RDONLY | O_DIRECTORY);
+    if (checkpoint.rootfd < 0 || fstat(checkpoint.rootfd, &sb) != 0) {
+        fprintf(stderr, "%s: %s\n", rootdir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (open_destination(&checkpoint, trashdir, label, name, sizeof(name), sb.st_mode & 07777) != 0) {
+        fprintf(stderr, "%s/%s/%s: %s\n", trashdir, COW_FOLDER, name, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (stat(trashdir, &sb) == 0) {
+        checkpoint.trash_dev = sb.st_dev;
+        checkpoint.trash_ino = sb.st_ino;
+    }
+
+    if (nthreads > 1024) {
+        nthreads = 1024;
+    }
+    checkpoint.nwalkers = nthreads;
+    checkpoint.queues = calloc(nthreads, sizeof(struct walk_queue));
+    walkers = calloc(nthreads, sizeof(struct walker));
+    threads = calloc(nthreads, sizeof(pthread_t));
+    if (checkpoint.queues == NULL || walkers == NULL || threads == NULL) {
+        perror("collectfs-checkpoint");
+        return EXIT_FAILURE;
+    }
+    for (t = 0; t < nthreads; t++) {
+        pthread_mutex_init(&checkpoint.queues[t].lock, NULL);
+        walkers[t].checkpoint = &checkpoint;
+        walkers[t].id = t;
+    }
+    checkpoint.pending = 1;
+    push(&checkpoint.queues[0], strdup(""));
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (t = 1; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, walker, &walkers[t]) != 0) {
+            break;
+        }
+    }
+    walker(&walkers[0]);
+    while (--t > 0) {
+        pthread_join(threads[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    if (lseek(checkpoint.linksfd, 0, SEEK_END) == 0) {
+        /* Nothing shared - no need for a mount to look */
+        char links[PATH_MAX];
+
+        if (snprintf(links, sizeof(links), "%s/%s/%s%s", trashdir, COW_FOLDER, name, COW_LINKS_SUFFIX)
+            < sizeof(links)) {
+            unlink(links);
+        }
+    }
+    close(checkpoint.linksfd);
+    if (fsync(checkpoint.destfd) != 0) {
+        perror("collectfs-checkpoint");
+        checkpoint.errors++;
+    }
+    close(checkpoint.destfd);
+    close(checkpoint.rootfd);
+
+    printf("checkpoint %s: %llu files (%llu reflinked, %llu hardlinked, %llu copied), %llu directories, "
+           "%llu symlinks, %llu skipped in %.1fs\n", name, checkpoint.files, checkpoint.reflinked, checkpoint.linked,
+           checkpoint.copied, checkpoint.dirs, checkpoint.symlinks, checkpoint.skipped, elapsed);
+    for (t = 0; t < nthreads; t++) {
+        free(checkpoint.queues[t].items);
+        pthread_mutex_destroy(&checkpoint.queues[t].lock);
+    }
+    free(checkpoint.queues);
+    free(walkers);
+    free(threads);
+    if (checkpoint.errors > 0) {
+        fprintf(stderr, "collectfs-checkpoint: %llu errors - the checkpoint is incomplete\n", checkpoint.errors);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,737 @@
+/**
+ * Checksums of trash versions, and a background scrubber that checks
+ * them.
+ *
+ * The trash is the safety net, so it is worth knowing when it has
+ * quietly rotted.  With --scrub, each newly collected version is
+ * queued for a background thread that hashes its content (XXH64, see
+ * hash.c - it runs at memory speed) and appends a line to
+ * trashdir/.scrub/sums:
+ *
+ *     <hash> <size> <path relative to trashdir>\n
+ *
+ * Once a day the thread works through every recorded version at a
+ * limited rate (--scrub=MB/s), reading it back - decoding it first if
+ * it has since been delta encoded, compressed or packed - and
+ * comparing its size and hash.  Damaged versions are logged as they
+ * are found, and each pass leaves a report in trashdir/.scrub/status:
+ *
+ *     finished <time>
+ *     checked <versions> <bytes>
+ *     corrupt <n>
+ *     truncated <n>
+ *     unreadable <n>
+ *     gone <n>
+ *     <result> <path>        for each damaged version
+ *
+ * Versions no longer in the trash (expired or purged) are dropped
+ * from sums at the end of the pass.  collectfs-scrub checks the whole
+ * trash at once, with a thread per CPU.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "checksum.h"
+#include "collectfs.h"
+#include "compress.h"
+#include "delta.h"
+#include "governor.h"
+#include "hash.h"
+#include "index.h"
+#include "log.h"
+#include "pack.h"
+
+#define CHECKSUM_SUMS "sums"
+#define CHECKSUM_STATUS "status"
+#define CHECKSUM_CHUNK (1024 * 1024)
+/** Seconds from the end of one pass to the start of the next */
+#define CHECKSUM_PASS_INTERVAL (24 * 3600)
+/** Versions waiting beyond this are not checksummed */
+#define CHECKSUM_MAX_QUEUE 65536
+
+struct checksum_pending {
+    struct checksum_pending *next;
+    char path[];
+};
+
+struct checksum_entry {
+    struct checksum_entry *next;
+    uint64_t hash;
+    off_t size;
+    char path[];
+};
+
+struct checksum {
+    struct local_context *context;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct checksum_pending *head;
+    struct checksum_pending *tail;
+    int queued;
+    int stopping;
+    /* Everything below belongs to the worker */
+    char dir[PATH_MAX - 32];
+    struct checksum_entry **entries;
+    size_t nbuckets;
+    size_t nentries;
+    FILE *sums;
+    unsigned char *buf;
+    /** The pass under way - a snapshot of the recorded paths */
+    char **pass;
+    size_t npass;
+    size_t next;
+    struct pack_store *store;
+    FILE *report;
+    time_t next_pass;
+    unsigned long long checked, checked_bytes, results[CHECKSUM_GONE + 1];
+};
+
+static const char *result_names[] = { "good", "corrupt", "truncated", "unreadable", "gone" };
+
+const char *checksum_result_name(int result)
+{
+    return result_names[result];
+}
+
+/**
+ * Sleep long enough that reading len bytes, which took started..now,
+ * happens no faster than rate bytes/second.
+ */
+static void throttle(unsigned long long rate, size_t len, const struct timespec *started)
+{
+    struct timespec now;
+    double elapsed, wanted;
+
+    if (rate == 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+    wanted = (double)len / rate;
+    if (wanted > elapsed) {
+        struct timespec pause;
+        pause.tv_sec = (time_t)(wanted - elapsed);
+        pause.tv_nsec = (long)((wanted - elapsed - pause.tv_sec) * 1e9);
+        nanosleep(&pause, NULL);
+    }
+}
+
+static int hash_fd(int fd, unsigned char *buf, size_t bufsize, unsigned long long rate, uint64_t *hash, off_t *size)
+{
+    struct hash_state state;
+    struct timespec started;
+    ssize_t len;
+
+    hash_init(&state);
+    *size = 0;
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        len = read(fd, buf, bufsize);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (len == 0) {
+            break;
+        }
+        hash_update(&state, buf, len);
+        *size += len;
+        throttle(rate, len, &started);
+    }
+    *hash = hash_digest(&state);
+    return 0;
+}
+
+/**
+ * Read the version back and compare it with its record, reading no
+ * faster than rate bytes/second (0 for no limit).  *checked is set to
+ * the bytes read.  Returns a CHECKSUM_ result.
+ */
+int checksum_check(const char *trashdir, struct pack_store *store, const struct checksum_record *record,
+                   unsigned char *buf, size_t bufsize, unsigned long long rate, off_t *checked)
+{
+    uint64_t hash;
+    int fd;
+
+    *checked = 0;
+    fd = index_open_version(trashdir, store, record->path);
+    if (fd < 0) {
+        return errno == ENOENT ? CHECKSUM_GONE : CHECKSUM_UNREADABLE;
+    }
+    if (hash_fd(fd, buf, bufsize, rate, &hash, checked) != 0) {
+        close(fd);
+        return CHECKSUM_UNREADABLE;
+    }
+    close(fd);
+    if (*checked < record->size) {
+        return CHECKSUM_TRUNCATED;
+    }
+    return *checked != record->size || hash != record->hash ? CHECKSUM_CORRUPT : CHECKSUM_GOOD;
+}
+
+/**
+ * Order records by path, then by where they are in the array - the
+ * order they were recorded.
+ */
+static int compare_records(const void *a, const void *b)
+{
+    const struct checksum_record *ra = *(const struct checksum_record **)a;
+    const struct checksum_record *rb = *(const struct checksum_record **)b;
+    int c = strcmp(ra->path, rb->path);
+
+    return c != 0 ? c : (ra < rb ? -1 : ra > rb);
+}
+
+/**
+ * Read trashdir's recorded checksums, sorted by path.  A path
+ * recorded more than once keeps its last record.  Returns how many.
+ */
+size_t checksum_load(const char *trashdir, struct checksum_record **records)
+{
+    char sumspath[PATH_MAX], line[PATH_MAX + 64];
+    unsigned long long hash;
+    long long size;
+    size_t n = 0, capacity = 0;
+    int offset;
+    FILE *fp;
+
+    *records = NULL;
+    snprintf(sumspath, sizeof(sumspath), "%s/%s/%s", trashdir, CHECKSUM_FOLDER, CHECKSUM_SUMS);
+    if ((fp = fopen(sumspath, "r")) == NULL) {
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        /* A torn last line is dropped */
+        if (len == 0 || line[len - 1] != '\n') {
+            continue;
+        }
+        line[len - 1] = '\0';
+        if (sscanf(line, "%llx %lld %n", &hash, &size, &offset) != 2 || line[offset] == '\0') {
+            continue;
+        }
+        if (n == capacity) {
+            struct checksum_record *more;
+            capacity = capacity ? capacity * 2 : 1024;
+            if ((more = realloc(*records, capacity * sizeof(struct checksum_record))) == NULL) {
+                break;
+            }
+            *records = more;
+        }
+        (*records)[n].hash = hash;
+        (*records)[n].size = size;
+        if (((*records)[n].path = strdup(line + offset)) != NULL) {
+            n++;
+        }
+    }
+    fclose(fp);
+
+    struct checksum_record **sorted = malloc((n + 1) * sizeof(struct checksum_record *));
+    struct checksum_record *unique = malloc((n + 1) * sizeof(struct checksum_record));
+    size_t i, kept = 0;
+    if (sorted == NULL || unique == NULL) {
+        /* Duplicates do no harm beyond being checked twice */
+        free(sorted);
+        free(unique);
+        return n;
+    }
+    for (i = 0; i < n; i++) {
+        sorted[i] = &(*records)[i];
+    }
+    qsort(sorted, n, sizeof(struct checksum_record *), compare_records);
+    for (i = 0; i < n; i++) {
+        if (i + 1 < n && strcmp(sorted[i]->path, sorted[i + 1]->path) == 0) {
+            free(sorted[i]->path);
+        } else {
+            unique[kept++] = *sorted[i];
+        }
+    }
+    free(sorted);
+    free(*records);
+    *records = unique;
+    return kept;
+}
+
+static size_t path_hash(const char *path)
+{
+    size_t h = 2166136261u;
+
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+static struct checksum_entry **find_entry(struct checksum *checksum, const char *path)
+{
+    struct checksum_entry **link;
+
+    if (checksum->nbuckets == 0) {
+        return NULL;
+    }
+    for (link = &checksum->entries[path_hash(path) % checksum->nbuckets]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->path, path) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+static int add_entry(struct checksum *checksum, uint64_t hash, off_t size, const char *path)
+{
+    struct checksum_entry **link, *entry;
+    size_t i;
+
+    if (checksum->nentries >= checksum->nbuckets) {
+        size_t nbuckets = checksum->nbuckets ? checksum->nbuckets * 2 : 1024;
+        struct checksum_entry **buckets = calloc(nbuckets, sizeof(struct checksum_entry *));
+        if (buckets == NULL) {
+            return -1;
+        }
+        for (i = 0; i < checksum->nbuckets; i++) {
+            while ((entry = checksum->entries[i]) != NULL) {
+                checksum->entries[i] = entry->next;
+                entry->next = buckets[path_hash(entry->path) % nbuckets];
+                buckets[path_hash(entry->path) % nbuckets] = entry;
+            }
+        }
+        free(checksum->entries);
+        checksum->entries = buckets;
+        checksum->nbuckets = nbuckets;
+    }
+    link = find_entry(checksum, path);
+    if (*link != NULL) {
+        (*link)->hash = hash;
+        (*link)->size = size;
+        return 0;
+    }
+    if ((entry = malloc(sizeof(struct checksum_entry) + strlen(path) + 1)) == NULL) {
+        return -1;
+    }
+    strcpy(entry->path, path);
+    entry->hash = hash;
+    entry->size = size;
+    entry->next = NULL;
+    *link = entry;
+    checksum->nentries++;
+    return 0;
+}
+
+static void remove_entry(struct checksum *checksum, const char *path)
+{
+    struct checksum_entry **link = find_entry(checksum, path), *entry;
+
+    if (link != NULL && (entry = *link) != NULL) {
+        *link = entry->next;
+        free(entry);
+        checksum->nentries--;
+    }
+}
+
+/**
+ * Checksum a version just collected to fpath.
+ */
+static void record(struct checksum *checksum, const char *fpath)
+{
+    size_t trashlen = strlen(checksum->context->trashdir);
+    struct stat statbuf;
+    uint64_t hash;
+    off_t size;
+    int fd;
+
+    if (strncmp(fpath, checksum->context->trashdir, trashlen) != 0 || fpath[trashlen] != '/'
+        || strchr(fpath, '\n') != NULL) {
+        return;
+    }
+    fd = open(fpath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        /* Already packed, or removed */
+        trace_errno(LOG_INDENT("checksum: open %s"), fpath);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    /* Just written, so most likely still cached - not worth throttling */
+    if (S_ISREG(statbuf.st_mode) && hash_fd(fd, checksum->buf, CHECKSUM_CHUNK, 0, &hash, &size) == 0) {
+        const char *path = fpath + trashlen + 1;
+        if (add_entry(checksum, hash, size, path) == 0 && checksum->sums != NULL) {
+            fprintf(checksum->sums, "%016llx %lld %s\n", (unsigned long long)hash, (long long)size, path);
+            fflush(checksum->sums);
+        }
+    }
+    close(fd);
+}
+
+/**
+ * Rewrite sums with just the versions still recorded.
+ */
+static void rewrite_sums(struct checksum *checksum)
+{
+    char sumspath[PATH_MAX], tmppath[PATH_MAX];
+    struct checksum_entry *entry;
+    FILE *fp;
+    size_t i;
+
+    snprintf(sumspath, sizeof(sumspath), "%s/%s", checksum->dir, CHECKSUM_SUMS);
+    snprintf(tmppath, sizeof(tmppath), "%s/%s.tmp", checksum->dir, CHECKSUM_SUMS);
+    if ((fp = fopen(tmppath, "w")) == NULL) {
+        log_errno("Collectfs: cannot rewrite %s", sumspath);
+        return;
+    }
+    for (i = 0; i < checksum->nbuckets; i++) {
+        for (entry = checksum->entries[i]; entry != NULL; entry = entry->next) {
+            fprintf(fp, "%016llx %lld %s\n", (unsigned long long)entry->hash, (long long)entry->size, entry->path);
+        }
+    }
+    if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) != 0) {
+        log_errno("Collectfs: cannot rewrite %s", sumspath);
+        fclose(fp);
+        unlink(tmppath);
+        return;
+    }
+    fclose(fp);
+    if (rename(tmppath, sumspath) != 0) {
+        log_errno("Collectfs: cannot rewrite %s", sumspath);
+        unlink(tmppath);
+        return;
+    }
+    if (checksum->sums != NULL) {
+        fclose(checksum->sums);
+    }
+    checksum->sums = fopen(sumspath, "a");
+}
+
+static void start_pass(struct checksum *checksum)
+{
+    char reportpath[PATH_MAX];
+    struct checksum_entry *entry;
+    size_t i;
+
+    checksum->pass = malloc((checksum->nentries + 1) * sizeof(char *));
+    if (checksum->pass == NULL) {
+        checksum->next_pass = time(NULL) + CHECKSUM_PASS_INTERVAL;
+        return;
+    }
+    checksum->npass = checksum->next = 0;
+    for (i = 0; i < checksum->nbuckets; i++) {
+        for (entry = checksum->entries[i]; entry != NULL; entry = entry->next) {
+            if ((checksum->pass[checksum->npass] = strdup(entry->path)) != NULL) {
+                checksum->npass++;
+            }
+        }
+    }
+    checksum->checked = checksum->checked_bytes = 0;
+    memset(checksum->results, 0, sizeof(checksum->results));
+    checksum->store = pack_store_open(checksum->context->trashdir, 0);
+    snprintf(reportpath, sizeof(reportpath), "%s/%s.tmp", checksum->dir, CHECKSUM_STATUS);
+    checksum->report = fopen(reportpath, "w");
+}
+
+/**
+ * Check the next version of the pass.
+ */
+static void check_next(struct checksum *checksum)
+{
+    char *path = checksum->pass[checksum->next++];
+    struct checksum_entry **link = find_entry(checksum, path);
+    struct checksum_record record;
+    off_t checked;
+    int result;
+
+    if (link != NULL && *link != NULL) {
+        record.hash = (*link)->hash;
+        record.size = (*link)->size;
+        record.path = path;
+        governor_io(checksum->context, GOVERNOR_VERIFY, record.size);
+        result = checksum_check(checksum->context->trashdir, checksum->store, &record, checksum->buf,
+                                CHECKSUM_CHUNK, checksum->context->scrub_rate, &checked);
+        checksum->checked += result != CHECKSUM_GONE;
+        checksum->checked_bytes += checked;
+        checksum->results[result]++;
+        if (result == CHECKSUM_GONE) {
+            remove_entry(checksum, path);
+        } else if (result != CHECKSUM_GOOD) {
+            log_info("Collectfs: scrub found %s %s", checksum_result_name(result), path);
+            if (checksum->report != NULL) {
+                fprintf(checksum->report, "%s %s\n", checksum_result_name(result), path);
+            }
+        }
+    }
+    free(path);
+}
+
+static void finish_pass(struct checksum *checksum)
+{
+    char reportpath[PATH_MAX], statuspath[PATH_MAX];
+    FILE *fp;
+    int r;
+
+    log_info("Collectfs: scrub checked %llu versions, %llu bytes: %llu corrupt, %llu truncated, %llu unreadable",
+             checksum->checked, checksum->checked_bytes, checksum->results[CHECKSUM_CORRUPT],
+             checksum->results[CHECKSUM_TRUNCATED], checksum->results[CHECKSUM_UNREADABLE]);
+    if (checksum->results[CHECKSUM_GONE] > 0) {
+        rewrite_sums(checksum);
+    }
+    /* The summary goes first, so write it and copy the damaged list after it */
+    snprintf(reportpath, sizeof(reportpath), "%s/%s.tmp", checksum->dir, CHECKSUM_STATUS);
+    snprintf(statuspath, sizeof(statuspath), "%s/%s", checksum->dir, CHECKSUM_STATUS);
+    if (checksum->report != NULL) {
+        fclose(checksum->report);
+        checksum->report = NULL;
+    }
+    if ((fp = fopen(statuspath, "w")) != NULL) {
+        FILE *damaged = fopen(reportpath, "r");
+        char line[PATH_MAX + 32];
+        fprintf(fp, "finished %lld\nchecked %llu %llu\n", (long long)time(NULL), checksum->checked,
+                checksum->checked_bytes);
+        for (r = CHECKSUM_CORRUPT; r <= CHECKSUM_GONE; r++) {
+            fprintf(fp, "%s %llu\n", checksum_result_name(r), checksum->results[r]);
+        }
+        while (damaged != NULL && fgets(line, sizeof(line), damaged) != NULL) {
+            fputs(line, fp);
+        }
+        if (damaged != NULL) {
+            fclose(damaged);
+        }
+        fclose(fp);
+    }
+    unlink(reportpath);
+    if (checksum->store != NULL) {
+        pack_store_close(checksum->store);
+        checksum->store = NULL;
+    }
+    free(checksum->pass);
+    checksum->pass = NULL;
+    checksum->npass = checksum->next = 0;
+    checksum->next_pass = time(NULL) + CHECKSUM_PASS_INTERVAL;
+}
+
+static void *checksum_worker(void *arg)
+{
+    struct checksum *checksum = (struct checksum *)arg;
+    struct checksum_pending *pending;
+
+    governor_enter(checksum->context, GOVERNOR_VERIFY);
+    pthread_mutex_lock(&checksum->lock);
+    while (!checksum->stopping) {
+        if (checksum->head != NULL) {
+            /* New versions first - they may not stay where they are for long */
+            pending = checksum->head;
+            checksum->head = checksum->tail = NULL;
+            governor_queued(checksum->context, GOVERNOR_VERIFY, -checksum->queued);
+            checksum->queued = 0;
+            pthread_mutex_unlock(&checksum->lock);
+            while (pending != NULL) {
+                struct checksum_pending *next = pending->next;
+                record(checksum, pending->path);
+                free(pending);
+                pending = next;
+            }
+        } else if (checksum->pass != NULL) {
+            pthread_mutex_unlock(&checksum->lock);
+            if (checksum->next < checksum->npass) {
+                check_next(checksum);
+            } else {
+                finish_pass(checksum);
+            }
+        } else if (time(NULL) >= checksum->next_pass) {
+            pthread_mutex_unlock(&checksum->lock);
+            start_pass(checksum);
+        } else {
+            struct timespec wait;
+            clock_gettime(CLOCK_REALTIME, &wait);
+            wait.tv_sec += checksum->next_pass - time(NULL);
+            pthread_cond_timedwait(&checksum->work, &checksum->lock, &wait);
+            continue;
+        }
+        pthread_mutex_lock(&checksum->lock);
+    }
+    pthread_mutex_unlock(&checksum->lock);
+    return NULL;
+}
+
+/**
+ * When the last pass finished, from its status report.
+ */
+static time_t last_pass(struct checksum *checksum)
+{
+    char statuspath[PATH_MAX];
+    long long finished = 0;
+    FILE *fp;
+
+    snprintf(statuspath, sizeof(statuspath), "%s/%s", checksum->dir, CHECKSUM_STATUS);
+    if ((fp = fopen(statuspath, "r")) != NULL) {
+        if (fscanf(fp, "finished %lld", &finished) != 1) {
+            finished = 0;
+        }
+        fclose(fp);
+    }
+    return finished;
+}
+
+int checksum_start(struct local_context *context)
+{
+    struct checksum *checksum = calloc(1, sizeof(struct checksum));
+    struct checksum_record *records;
+    char sumspath[PATH_MAX];
+    size_t n, i;
+
+    if (checksum == NULL) {
+        return log_errno("checksum_start");
+    }
+    checksum->context = context;
+    if ((checksum->buf = malloc(CHECKSUM_CHUNK)) == NULL) {
+        free(checksum);
+        return log_errno("checksum_start");
+    }
+    if (snprintf(checksum->dir, sizeof(checksum->dir), "%s/%s", context->trashdir, CHECKSUM_FOLDER)
+        >= sizeof(checksum->dir)) {
+        free(checksum->buf);
+        free(checksum);
+        errno = ENAMETOOLONG;
+        return log_errno("Collectfs: cannot scrub %s", context->trashdir);
+    }
+    /* Nothing may have been collected yet */
+    if ((mkdir(context->trashdir, 0700) != 0 && errno != EEXIST)
+        || (mkdir(checksum->dir, 0700) != 0 && errno != EEXIST)) {
+        log_errno("Collectfs: cannot create %s", checksum->dir);
+        free(checksum->buf);
+        free(checksum);
+        return -1;
+    }
+    n = checksum_load(context->trashdir, &records);
+    for (i = 0; i < n; i++) {
+        add_entry(checksum, records[i].hash, records[i].size, records[i].path);
+        free(records[i].path);
+    }
+    free(records);
+    snprintf(sumspath, sizeof(sumspath), "%s/%s", checksum->dir, CHECKSUM_SUMS);
+    checksum->sums = fopen(sumspath, "a");
+    if (checksum->sums == NULL) {
+        log_errno("Collectfs: cannot open %s - checksums are not being recorded", sumspath);
+    }
+    checksum->next_pass = last_pass(checksum) + CHECKSUM_PASS_INTERVAL;
+    pthread_mutex_init(&checksum->lock, NULL);
+    pthread_cond_init(&checksum->work, NULL);
+    if (pthread_create(&checksum->thread, NULL, checksum_worker, checksum) != 0) {
+        log_errno("Collectfs: cannot start scrub thread");
+        checksum->stopping = 1;
+        context->checksum = checksum;
+        checksum_stop(context);
+        return -1;
+    }
+    context->checksum = checksum;
+    log_info("Collectfs: recording checksums and scrubbing the trash (%zu recorded)", checksum->nentries);
+    return 0;
+}
+
+void checksum_stop(struct local_context *context)
+{
+    struct checksum *checksum = context->checksum;
+    struct checksum_pending *pending;
+    struct checksum_entry *entry;
+    char reportpath[PATH_MAX];
+    size_t i;
+
+    if (checksum == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&checksum->lock);
+    if (!checksum->stopping) {
+        checksum->stopping = 1;
+        pthread_cond_signal(&checksum->work);
+        pthread_mutex_unlock(&checksum->lock);
+        pthread_join(checksum->thread, NULL);
+    } else {
+        pthread_mutex_unlock(&checksum->lock);
+    }
+    context->checksum = NULL;
+    if (checksum->queued > 0) {
+        log_info("Collectfs: %d versions were not checksummed", checksum->queued);
+    }
+    while ((pending = checksum->head) != NULL) {
+        checksum->head = pending->next;
+        free(pending);
+    }
+    /* An unfinished pass starts again next time */
+    if (checksum->pass != NULL) {
+        for (i = checksum->next; i < checksum->npass; i++) {
+            free(checksum->pass[i]);
+        }
+        free(checksum->pass);
+    }
+    if (checksum->report != NULL) {
+        fclose(checksum->report);
+        snprintf(reportpath, sizeof(reportpath), "%s/%s.tmp", checksum->dir, CHECKSUM_STATUS);
+        unlink(reportpath);
+    }
+    if (checksum->store != NULL) {
+        pack_store_close(checksum->store);
+    }
+    for (i = 0; i < checksum->nbuckets; i++) {
+        while ((entry = checksum->entries[i]) != NULL) {
+            checksum->entries[i] = entry->next;
+            free(entry);
+        }
+    }
+    if (checksum->sums != NULL) {
+        fclose(checksum->sums);
+    }
+    pthread_cond_destroy(&checksum->work);
+    pthread_mutex_destroy(&checksum->lock);
+    free(checksum->entries);
+    free(checksum->buf);
+    free(checksum);
+}
+
+/**
+ * Queue a version just put in the trash at trashed (a full path) to
+ * have its checksum recorded.
+ */
+void checksum_queue(struct local_context *context, const char *trashed)
+{
+    struct checksum *checksum = context->checksum;
+    struct checksum_pending *pending;
+
+    if (checksum == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&checksum->lock);
+    if (checksum->queued < CHECKSUM_MAX_QUEUE
+        && (pending = malloc(sizeof(struct checksum_pending) + strlen(trashed) + 1)) != NULL) {
+        strcpy(pending->path, trashed);
+        pending->next = NULL;
+        if (checksum->tail != NULL) {
+            checksum->tail->next = pending;
+        } else {
+            checksum->head = pending;
+        }
+        checksum->tail = pending;
+        checksum->queued++;
+        governor_queued(context, GOVERNOR_VERIFY, 1);
+        pthread_cond_signal(&checksum->work);
+    }
+    pthread_mutex_unlock(&checksum->lock);
+}
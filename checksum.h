@@ -0,0 +1,51 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _CHECKSUM_H_
+#define _CHECKSUM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "pack.h"
+
+/**
+ * Checksums and scrub reports live in this folder at the top of the
+ * trash.
+ */
+#define CHECKSUM_FOLDER ".scrub"
+
+/**
+ * What checking a version found.
+ */
+#define CHECKSUM_GOOD 0
+#define CHECKSUM_CORRUPT 1
+#define CHECKSUM_TRUNCATED 2
+#define CHECKSUM_UNREADABLE 3
+/** No longer in the trash - expired or purged */
+#define CHECKSUM_GONE 4
+
+/**
+ * A recorded checksum.  path is relative to trashdir, less any delta
+ * or compressed suffix.
+ */
+struct checksum_record {
+    uint64_t hash;
+    off_t size;
+    char *path;
+};
+
+size_t checksum_load(const char *trashdir, struct checksum_record **records);
+int checksum_check(const char *trashdir, struct pack_store *store, const struct checksum_record *record,
+                   unsigned char *buf, size_t bufsize, unsigned long long rate, off_t *checked);
+const char *checksum_result_name(int result);
+
+int checksum_start(struct local_context *context);
+void checksum_stop(struct local_context *context);
+
+void checksum_queue(struct local_context *context, const char *trashed);
+
+#endif
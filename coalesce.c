@@ -0,0 +1,189 @@
+/**
+ * Version coalescing - keep at most one version of a path in the
+ * trash per interval.
+ *
+ * Some programs replace the same file over and over (editors saving
+ * through a temporary and rename, sed -i loops, indexers rewriting
+ * their state) and each replacement would become a trash entry.  We
+ * remember when each path was last collected, and a version that is
+ * being replaced within the interval is just overwritten - only the
+ * first version in each interval goes in the trash.
+ *
+ * The collection times are held in a hash table of bounded size with
+ * the least recently collected path thrown out when it is full.
+ * Forgetting a path is safe - the next version is simply kept.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coalesce.h"
+
+struct coalesce_entry {
+    /** Hash chain */
+    struct coalesce_entry *next;
+    /** LRU list - most recently collected first */
+    struct coalesce_entry *newer;
+    struct coalesce_entry *older;
+    time_t collected;
+    size_t hash;
+    char path[];
+};
+
+struct coalesce {
+    pthread_mutex_t lock;
+    time_t interval;
+    int max_paths;
+    int count;
+    size_t nbuckets;
+    struct coalesce_entry **buckets;
+    struct coalesce_entry *newest;
+    struct coalesce_entry *oldest;
+};
+
+static size_t hash(const char *path)
+{
+    size_t h = 2166136261u;
+
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+struct coalesce *coalesce_new(time_t interval, int max_paths)
+{
+    struct coalesce *coalesce = calloc(1, sizeof(struct coalesce));
+
+    if (coalesce == NULL) {
+        return NULL;
+    }
+    coalesce->interval = interval;
+    coalesce->max_paths = max_paths > 0 ? max_paths : 1;
+    for (coalesce->nbuckets = 64; coalesce->nbuckets < coalesce->max_paths; coalesce->nbuckets *= 2) {
+    }
+    coalesce->buckets = calloc(coalesce->nbuckets, sizeof(struct coalesce_entry *));
+    if (coalesce->buckets == NULL) {
+        free(coalesce);
+        return NULL;
+    }
+    pthread_mutex_init(&coalesce->lock, NULL);
+    return coalesce;
+}
+
+void coalesce_free(struct coalesce *coalesce)
+{
+    struct coalesce_entry *entry, *next;
+
+    if (coalesce == NULL) {
+        return;
+    }
+    for (entry = coalesce->newest; entry != NULL; entry = next) {
+        next = entry->older;
+        free(entry);
+    }
+    free(coalesce->buckets);
+    pthread_mutex_destroy(&coalesce->lock);
+    free(coalesce);
+}
+
+static struct coalesce_entry **find(struct coalesce *coalesce, const char *path, size_t h)
+{
+    struct coalesce_entry **link = &coalesce->buckets[h & (coalesce->nbuckets - 1)];
+
+    while (*link != NULL && ((*link)->hash != h || strcmp((*link)->path, path) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static void lru_unlink(struct coalesce *coalesce, struct coalesce_entry *entry)
+{
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        coalesce->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        coalesce->oldest = entry->newer;
+    }
+}
+
+static void lru_push(struct coalesce *coalesce, struct coalesce_entry *entry)
+{
+    entry->newer = NULL;
+    entry->older = coalesce->newest;
+    if (coalesce->newest != NULL) {
+        coalesce->newest->newer = entry;
+    } else {
+        coalesce->oldest = entry;
+    }
+    coalesce->newest = entry;
+}
+
+/**
+ * Is a version of path being replaced at time when superseded by one
+ * already in the trash?  If so it needn't be collected.
+ */
+int coalesce_superseded(struct coalesce *coalesce, const char *path, time_t when)
+{
+    struct coalesce_entry *entry;
+    int superseded;
+
+    if (coalesce == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&coalesce->lock);
+    entry = *find(coalesce, path, hash(path));
+    superseded = entry != NULL && when >= entry->collected && when - entry->collected < coalesce->interval;
+    pthread_mutex_unlock(&coalesce->lock);
+    return superseded;
+}
+
+/**
+ * Record that a version of path went into the trash at time when.
+ */
+void coalesce_collected(struct coalesce *coalesce, const char *path, time_t when)
+{
+    struct coalesce_entry **link, *entry;
+    size_t h = hash(path);
+
+    if (coalesce == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&coalesce->lock);
+    link = find(coalesce, path, h);
+    if ((entry = *link) != NULL) {
+        lru_unlink(coalesce, entry);
+    } else {
+        if (coalesce->count >= coalesce->max_paths) {
+            /* Forget the path collected longest ago */
+            struct coalesce_entry *oldest = coalesce->oldest;
+            struct coalesce_entry **oldlink = find(coalesce, oldest->path, oldest->hash);
+            *oldlink = oldest->next;
+            lru_unlink(coalesce, oldest);
+            free(oldest);
+            coalesce->count--;
+            /* Unlinking from a chain may have moved our insertion point */
+            link = find(coalesce, path, h);
+        }
+        entry = malloc(sizeof(struct coalesce_entry) + strlen(path) + 1);
+        if (entry == NULL) {
+            pthread_mutex_unlock(&coalesce->lock);
+            return;
+        }
+        strcpy(entry->path, path);
+        entry->hash = h;
+        entry->next = NULL;
+        *link = entry;
+        coalesce->count++;
+    }
+    entry->collected = when;
+    lru_push(coalesce, entry);
+    pthread_mutex_unlock(&coalesce->lock);
+}
@@ -0,0 +1,18 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _COALESCE_H_
+#define _COALESCE_H_
+
+#include <time.h>
+
+struct coalesce;
+
+struct coalesce *coalesce_new(time_t interval, int max_paths);
+void coalesce_free(struct coalesce *coalesce);
+
+int coalesce_superseded(struct coalesce *coalesce, const char *path, time_t when);
+void coalesce_collected(struct coalesce *coalesce, const char *path, time_t when);
+
+#endif
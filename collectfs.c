@@ -19,8 +19,10 @@
 #include <limits.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -39,57 +41,100 @@
 #define FUSE_USE_VERSION 26
 #include <fuse.h>
 
+#include "calibrate.h"
+#include "capture.h"
+#include "checksum.h"
+#include "coalesce.h"
+#include "collectfs.h"
+#include "compress.h"
+#include "cow.h"
+#include "dedup.h"
+#include "delta.h"
+#include "dircache.h"
+#include "events.h"
+#include "governor.h"
+#include "index.h"
+#include "layout.h"
 #include "log.h"
+#include "mounts.h"
+#include "pack.h"
+#include "pattern.h"
+#include "rmtree.h"
+#include "stage.h"
+#include "stats.h"
+#include "tally.h"
+#include "trash.h"
+#include "undo.h"
+#include "uring.h"
+#include "xattrcache.h"
 
 /**
- * Will show up in logs
+ * Only available on more recent kernels
  */
-#define COLLECTFS_VERSION "1.0.1"
+static int can_collect_open_truncate = 0;
+
+static int help_only = 0;
+
+/** Held while a handle is moved off an inode shared with a checkpoint */
+static pthread_mutex_t switching_handle = PTHREAD_MUTEX_INITIALIZER;
+
+static char *trashname = ".trash";
 
 /**
- * Collect() function return values - different operations
- * may need to know what collect did - e.g. when unlinking,
- * if collect moved the file to the trash, then unlink will
- * have nothing to do. 
+ * Default for --copy-backlog
  */
+#define DEFAULT_COPY_BACKLOG_MB 1024
+
 /**
- * Collected the file - must have been a normal file
+ * Number of paths --coalesce remembers collection times for
  */
-#define COLLECT_COLLECTED 0
+#define COALESCE_MAX_PATHS 16384
+
 /**
- * Asked to collect something that isn't a normal file, 
- * e.g. a named pipe.
+ * Default for --dedup - MB/second read when looking for duplicates
  */
-#define COLLECT_NOT_COLLECTABLE 1
+#define DEFAULT_DEDUP_RATE_MB 32
+
 /**
- * Asked to collect a file that doesn't exist.
+ * Default for --compress-cpu
  */
-#define COLLECT_DOES_NOT_EXIST 2
+#define DEFAULT_COMPRESS_CPU 10
+
 /**
- * A real collection problem, such as file name to long
- * or an error in the underlying real file-system.
+ * Default for --pack - KB
  */
-#define COLLECT_ERROR -1
+#define DEFAULT_PACK_KB 16
 
+/**
+ * Default for --index - KB
+ */
+#define DEFAULT_INDEX_KB 1024
 
 /**
- * We will pass this context to fuse.  Fuse will pass it back
- * to us - so we can attach any context we need here.
- * Currently we just need to know the real root of the directory
- * hierarchy we are protecting.  
+ * Default for --scrub - MB/s
  */
-struct local_context {
-    char *rootdir;
-};
+#define DEFAULT_SCRUB_RATE_MB 16
 
 /**
- * Only available on more recent kernels
+ * Default for --undo - MB
  */
-static int can_collect_open_truncate = 0;
+#define DEFAULT_UNDO_MB 64
 
-static int help_only = 0;
+/**
+ * Default for --dircache - KB
+ */
+#define DEFAULT_DIRCACHE_KB 8192
 
-static char *trashname = ".trash";
+/**
+ * Default for --xattrcache - KB
+ */
+#define DEFAULT_XATTRCACHE_KB 1024
+
+/**
+ * Background requests - read ahead and write back - the kernel may
+ * have outstanding at once, where fuse lets us say (12 otherwise)
+ */
+#define MAX_BACKGROUND_REQUESTS 64
 
 static int fop_create(const char *path, mode_t mode, struct fuse_file_info *fi);
 
@@ -103,6 +148,38 @@ enum {
     ID_VERSION,
     ID_TRACE,
     ID_MONITOR,
+    ID_ASYNC,
+    ID_TRASH_DIR,
+    ID_COPY_BACKLOG,
+    ID_IO_URING,
+    ID_EXCLUDE,
+    ID_INCLUDE,
+    ID_EXCLUDE_FROM,
+    ID_COALESCE,
+    ID_DEDUP,
+    ID_DELTA,
+    ID_COMPRESS,
+    ID_COMPRESS_CPU,
+    ID_PACK,
+    ID_EXPIRE,
+    ID_LAYOUT,
+    ID_EVENTS,
+    ID_INDEX,
+    ID_SCRUB,
+    ID_UNDO,
+    ID_RMTREE,
+    ID_MOUNTS,
+    ID_DIRCACHE,
+    ID_BG_RATE,
+    ID_BG_IOPS,
+    ID_STATS,
+    ID_CAPTURE,
+    ID_MAX_WRITE,
+    ID_MAX_READ,
+    ID_MAX_READAHEAD,
+    ID_SYNC_READ,
+    ID_CALIBRATE,
+    ID_XATTRCACHE,
     ID_CENSOR,
 };
 
@@ -122,6 +199,46 @@ static struct fuse_opt command_options[] = {
     FUSE_OPT_KEY("-t",          ID_TRACE),
     FUSE_OPT_KEY("--trace",     ID_TRACE),
     FUSE_OPT_KEY("-f",          ID_MONITOR),
+    FUSE_OPT_KEY("-a",          ID_ASYNC),
+    FUSE_OPT_KEY("--async",     ID_ASYNC),
+    FUSE_OPT_KEY("--trash-dir=%s", ID_TRASH_DIR),
+    FUSE_OPT_KEY("--copy-backlog=%s", ID_COPY_BACKLOG),
+    FUSE_OPT_KEY("--io-uring",  ID_IO_URING),
+    FUSE_OPT_KEY("--exclude=%s", ID_EXCLUDE),
+    FUSE_OPT_KEY("--include=%s", ID_INCLUDE),
+    FUSE_OPT_KEY("--exclude-from=%s", ID_EXCLUDE_FROM),
+    FUSE_OPT_KEY("--coalesce=%s", ID_COALESCE),
+    FUSE_OPT_KEY("--dedup",     ID_DEDUP),
+    FUSE_OPT_KEY("--dedup=%s",  ID_DEDUP),
+    FUSE_OPT_KEY("--delta",     ID_DELTA),
+    FUSE_OPT_KEY("--compress=%s", ID_COMPRESS),
+    FUSE_OPT_KEY("--compress-cpu=%s", ID_COMPRESS_CPU),
+    FUSE_OPT_KEY("--pack",      ID_PACK),
+    FUSE_OPT_KEY("--pack=%s",   ID_PACK),
+    FUSE_OPT_KEY("--expire=%s", ID_EXPIRE),
+    FUSE_OPT_KEY("--layout=%s", ID_LAYOUT),
+    FUSE_OPT_KEY("--events",    ID_EVENTS),
+    FUSE_OPT_KEY("--index",     ID_INDEX),
+    FUSE_OPT_KEY("--index=%s",  ID_INDEX),
+    FUSE_OPT_KEY("--scrub",     ID_SCRUB),
+    FUSE_OPT_KEY("--scrub=%s",  ID_SCRUB),
+    FUSE_OPT_KEY("--undo",      ID_UNDO),
+    FUSE_OPT_KEY("--undo=%s",   ID_UNDO),
+    FUSE_OPT_KEY("--rmtree",    ID_RMTREE),
+    FUSE_OPT_KEY("--mounts=%s", ID_MOUNTS),
+    FUSE_OPT_KEY("--dircache",  ID_DIRCACHE),
+    FUSE_OPT_KEY("--dircache=%s", ID_DIRCACHE),
+    FUSE_OPT_KEY("--bg-rate=%s", ID_BG_RATE),
+    FUSE_OPT_KEY("--bg-iops=%s", ID_BG_IOPS),
+    FUSE_OPT_KEY("--stats",     ID_STATS),
+    FUSE_OPT_KEY("--capture=%s", ID_CAPTURE),
+    FUSE_OPT_KEY("--max-write=%s", ID_MAX_WRITE),
+    FUSE_OPT_KEY("--max-read=%s", ID_MAX_READ),
+    FUSE_OPT_KEY("--max-readahead=%s", ID_MAX_READAHEAD),
+    FUSE_OPT_KEY("--sync-read", ID_SYNC_READ),
+    FUSE_OPT_KEY("--calibrate", ID_CALIBRATE),
+    FUSE_OPT_KEY("--xattrcache", ID_XATTRCACHE),
+    FUSE_OPT_KEY("--xattrcache=%s", ID_XATTRCACHE),
     FUSE_OPT_KEY("-xxxxx",      ID_CENSOR), /* Not for fuse to see - to be removed */
     FUSE_OPT_END
 };
@@ -130,16 +247,52 @@ static void usage(char *prog)
 {
     fprintf(stderr,
             "\nCollectfs (version %s)\n\n"
-            "Usage: [options|fuse-options] %s rootDir mountPoint\n\n"
+            "Usage: [options|fuse-options] %s rootDir mountPoint\n"
+            "       [options|fuse-options] %s --mounts=FILE\n\n"
             "Options:\n"
             "   -h, --help            collectfs help\n"
             "   -H, --help-fuse       fuse help\n"
             "   -V, --version         collectfs version\n"
             "   -t, --trace           log all file operations\n"
-            "   -f                    run in foreground and log to stderr\n\n"
+            "   -f                    run in foreground and log to stderr\n"
+            "   -a, --async           stage collected files, finish collecting in the background\n"
+            "   --trash-dir=DIR       keep the trash in DIR, which may be on another filesystem\n"
+            "   --copy-backlog=MB     staged MB waiting to be copied to DIR before collection blocks (%d)\n"
+            "   --io-uring            batch the system calls of each collection through io_uring\n"
+            "   --exclude=PATTERN     don't collect files matching PATTERN (e.g. '*.o', 'node_modules/')\n"
+            "   --include=PATTERN     collect files matching PATTERN even if excluded\n"
+            "   --exclude-from=FILE   read exclude patterns from FILE, one per line, !PATTERN to include\n"
+            "   --coalesce=SECONDS    keep at most one replaced version of a file per SECONDS\n"
+            "   --dedup[=MB]          share identical trash versions, reading MB/second (%d, 0 unlimited)\n"
+            "   --delta               store older versions as deltas (see collectfs-restore)\n"
+            "   --compress=DAYS       gzip versions collected more than DAYS ago\n"
+            "   --compress-cpu=PCT    percentage of a CPU compression may use (%d)\n"
+            "   --pack[=KB]           move versions of up to KB into pack files (%d, see collectfs-unpack)\n"
+            "   --expire=DAYS         remove versions collected more than DAYS ago\n"
+            "   --layout=LAYOUT       arrange the trash as mirrored, time or hashed (see collectfs-migrate)\n"
+            "   --events              journal each collection, followable on TRASH/.events/socket\n"
+            "   --index[=KB]          index trash names, and content of up to KB (%d), for collectfs-search\n"
+            "   --scrub[=MB]          checksum versions, recheck them daily reading MB/second (%d, 0 unlimited)\n"
+            "   --undo[=MB]           log bytes overwritten in files of MB or more (%d, see collectfs-rollback)\n"
+            "   --dircache[=KB]       keep up to KB (%d) of directory listings until the directories change\n"
+            "   --rmtree              collect removed directory trees whole, finishing in the background\n"
+            "   --bg-rate=MB          MB/second each class of background work may read and write (0 unlimited)\n"
+            "   --bg-iops=N           I/Os a second each class of background work may do (0 unlimited)\n"
+            "   --stats               write what the mount is doing to TRASH/.stats every %d seconds\n"
+            "   --capture=FILE        record every operation to FILE, for collectfs-replay\n"
+            "   --max-write=KB        largest write request to take (the largest fuse offers)\n"
+            "   --max-read=KB         largest read request to take (no limit)\n"
+            "   --max-readahead=KB    largest read ahead to ask for (the largest the kernel offers)\n"
+            "   --sync-read           one read at a time per file rather than asynchronous reads\n"
+            "   --calibrate           choose request sizes by timing rootdir's filesystem at startup\n"
+            "   --xattrcache[=KB]     keep up to KB (%d) of extended attributes for a few seconds\n"
+            "   --mounts=FILE         serve every 'rootDir mountPoint [options]' line of FILE, rereading it as it changes\n\n"
             "Environment variables:\n"
             "   COLLECTFS_LOGALL      if set, log all filesystem operations.\n"
-            "   COLLECTFS_TRASH       the trash folder name (%s)\n\n", COLLECTFS_VERSION, prog, trashname);
+            "   COLLECTFS_TRASH       the trash folder name (%s)\n\n", COLLECTFS_VERSION, prog, prog,
+            DEFAULT_COPY_BACKLOG_MB, DEFAULT_DEDUP_RATE_MB, DEFAULT_COMPRESS_CPU, DEFAULT_PACK_KB, DEFAULT_INDEX_KB,
+            DEFAULT_SCRUB_RATE_MB, DEFAULT_UNDO_MB, DEFAULT_DIRCACHE_KB, STATS_INTERVAL, DEFAULT_XATTRCACHE_KB,
+            trashname);
 }
 
 static int command_options_processor(void *data, const char *arg, int key, struct fuse_args *outargs)
@@ -147,6 +300,9 @@ static int command_options_processor(void *data, const char *arg, int key, struc
     /* Return -1 to indicate error, 0 to accept parameter,
      * 1 to retain parameter and pase to FUSE
      */
+    struct local_context *context = (struct local_context *)data;
+    int rstatus;
+
     switch (key) {
     case ID_FUSE_HELP:
         fuse_opt_add_arg(outargs, "-ho");       /* add to the args that FUSE will see */
@@ -165,6 +321,213 @@ static int command_options_processor(void *data, const char *arg, int key, struc
         /* force foreground operation */
         set_use_syslog(0);
         return 1;
+    case ID_ASYNC:
+        context->async_collect = 1;
+        return 0;
+    case ID_TRASH_DIR:
+        context->trashdir = realpath(strchr(arg, '=') + 1, NULL);
+        if (context->trashdir == NULL) {
+            fprintf(stderr, "%s: trash directory %s\n", strerror(errno), strchr(arg, '=') + 1);
+            return -1;
+        }
+        return 0;
+    case ID_COPY_BACKLOG:
+        context->copy_backlog = strtoull(strchr(arg, '=') + 1, NULL, 10) * 1024 * 1024;
+        return 0;
+    case ID_IO_URING:
+        context->use_uring = 1;
+        return 0;
+    case ID_EXCLUDE:
+    case ID_INCLUDE:
+    case ID_EXCLUDE_FROM:
+        if (context->patterns == NULL && (context->patterns = pattern_new()) == NULL) {
+            fprintf(stderr, "%s: patterns\n", strerror(errno));
+            return -1;
+        }
+        if (key == ID_EXCLUDE_FROM) {
+            rstatus = pattern_add_file(context->patterns, strchr(arg, '=') + 1);
+        } else {
+            rstatus = pattern_add(context->patterns, strchr(arg, '=') + 1, key == ID_INCLUDE);
+        }
+        if (rstatus != 0) {
+            fprintf(stderr, "%s: pattern %s\n", strerror(errno), strchr(arg, '=') + 1);
+            return -1;
+        }
+        return 0;
+    case ID_COALESCE:
+        if (atoi(strchr(arg, '=') + 1) <= 0) {
+            fprintf(stderr, "collectfs: --coalesce needs a number of seconds\n");
+            return -1;
+        }
+        coalesce_free(context->coalesce);
+        context->coalesce = coalesce_new(atoi(strchr(arg, '=') + 1), COALESCE_MAX_PATHS);
+        if (context->coalesce == NULL) {
+            fprintf(stderr, "%s: coalesce\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    case ID_DEDUP:
+        context->dedup_collect = 1;
+        if (strchr(arg, '=') != NULL) {
+            context->dedup_rate = strtoull(strchr(arg, '=') + 1, NULL, 10) * 1024 * 1024;
+        }
+        return 0;
+    case ID_DELTA:
+        context->delta_collect = 1;
+        return 0;
+    case ID_COMPRESS:
+        context->compress_age = strtod(strchr(arg, '=') + 1, NULL) * 24 * 3600;
+        if (context->compress_age <= 0) {
+            fprintf(stderr, "collectfs: --compress needs a number of days\n");
+            return -1;
+        }
+        return 0;
+    case ID_COMPRESS_CPU:
+        context->compress_cpu = atoi(strchr(arg, '=') + 1);
+        if (context->compress_cpu <= 0 || context->compress_cpu > 100) {
+            fprintf(stderr, "collectfs: --compress-cpu needs a percentage\n");
+            return -1;
+        }
+        return 0;
+    case ID_PACK:
+        context->pack_size = DEFAULT_PACK_KB * 1024;
+        if (strchr(arg, '=') != NULL) {
+            context->pack_size = strtoll(strchr(arg, '=') + 1, NULL, 10) * 1024;
+            if (context->pack_size <= 0) {
+                fprintf(stderr, "collectfs: --pack needs a size in KB\n");
+                return -1;
+            }
+        }
+        return 0;
+    case ID_EXPIRE:
+        context->expire_age = strtod(strchr(arg, '=') + 1, NULL) * 24 * 3600;
+        if (context->expire_age <= 0) {
+            fprintf(stderr, "collectfs: --expire needs a number of days\n");
+            return -1;
+        }
+        return 0;
+    case ID_LAYOUT:
+        context->layout = layout_parse(strchr(arg, '=') + 1);
+        if (context->layout < 0) {
+            fprintf(stderr, "collectfs: --layout needs mirrored, time or hashed\n");
+            return -1;
+        }
+        return 0;
+    case ID_EVENTS:
+        context->events_journal = 1;
+        return 0;
+    case ID_INDEX:
+        context->index_collect = 1;
+        context->index_size = DEFAULT_INDEX_KB * 1024;
+        if (strchr(arg, '=') != NULL) {
+            char *end;
+            context->index_size = strtoll(strchr(arg, '=') + 1, &end, 10) * 1024;
+            if (context->index_size < 0 || *end != '\0' || end == strchr(arg, '=') + 1) {
+                fprintf(stderr, "collectfs: --index needs a size in KB (0 for names only)\n");
+                return -1;
+            }
+        }
+        return 0;
+    case ID_SCRUB:
+        context->scrub_collect = 1;
+        if (strchr(arg, '=') != NULL) {
+            context->scrub_rate = strtoull(strchr(arg, '=') + 1, NULL, 10) * 1024 * 1024;
+        }
+        return 0;
+    case ID_UNDO:
+        context->undo_size = DEFAULT_UNDO_MB * 1024LL * 1024;
+        if (strchr(arg, '=') != NULL) {
+            char *end;
+            context->undo_size = strtoll(strchr(arg, '=') + 1, &end, 10) * 1024 * 1024;
+            if (context->undo_size <= 0 || *end != '\0') {
+                fprintf(stderr, "collectfs: --undo needs a size in MB\n");
+                return -1;
+            }
+        }
+        return 0;
+    case ID_DIRCACHE:
+        context->dircache_size = DEFAULT_DIRCACHE_KB * 1024;
+        if (strchr(arg, '=') != NULL) {
+            char *end;
+            context->dircache_size = strtoull(strchr(arg, '=') + 1, &end, 10) * 1024;
+            if (context->dircache_size == 0 || *end != '\0') {
+                fprintf(stderr, "collectfs: --dircache needs a size in KB\n");
+                return -1;
+            }
+        }
+        return 0;
+    case ID_XATTRCACHE:
+        context->xattrcache_size = DEFAULT_XATTRCACHE_KB * 1024;
+        if (strchr(arg, '=') != NULL) {
+            char *end;
+            context->xattrcache_size = strtoull(strchr(arg, '=') + 1, &end, 10) * 1024;
+            if (context->xattrcache_size == 0 || *end != '\0') {
+                fprintf(stderr, "collectfs: --xattrcache needs a size in KB\n");
+                return -1;
+            }
+        }
+        return 0;
+    case ID_RMTREE:
+        context->rmtree_collect = 1;
+        return 0;
+    case ID_BG_RATE:
+        context->bg_rate = strtoull(strchr(arg, '=') + 1, NULL, 10) * 1024 * 1024;
+        return 0;
+    case ID_BG_IOPS:
+        context->bg_iops = strtoull(strchr(arg, '=') + 1, NULL, 10);
+        return 0;
+    case ID_STATS:
+        context->stats_collect = 1;
+        return 0;
+    case ID_CAPTURE:
+        /* fuse_main changes to / before the file is created */
+        free(context->capture_path);
+        if (strchr(arg, '=')[1] == '/') {
+            context->capture_path = strdup(strchr(arg, '=') + 1);
+        } else {
+            char cwd[PATH_MAX];
+            context->capture_path = NULL;
+            if (getcwd(cwd, sizeof(cwd)) != NULL
+                && (context->capture_path = malloc(strlen(cwd) + strlen(arg) + 2)) != NULL) {
+                sprintf(context->capture_path, "%s/%s", cwd, strchr(arg, '=') + 1);
+            }
+        }
+        if (context->capture_path == NULL) {
+            fprintf(stderr, "%s: capture %s\n", strerror(errno), strchr(arg, '=') + 1);
+            return -1;
+        }
+        return 0;
+    case ID_MAX_WRITE:
+    case ID_MAX_READ:
+    case ID_MAX_READAHEAD: {
+        char *end;
+        unsigned long long kb = strtoull(strchr(arg, '=') + 1, &end, 10);
+        if (kb == 0 || kb > UINT_MAX / 1024 || *end != '\0') {
+            fprintf(stderr, "collectfs: %.*s needs a size in KB\n", (int)(strchr(arg, '=') - arg), arg);
+            return -1;
+        }
+        if (key == ID_MAX_WRITE) {
+            context->max_write = kb * 1024;
+        } else if (key == ID_MAX_READAHEAD) {
+            context->max_readahead = kb * 1024;
+        } else {
+            /* Only fuse can limit reads - at mount time */
+            char option[64];
+            context->max_read = kb * 1024;
+            snprintf(option, sizeof(option), "-omax_read=%u", context->max_read);
+            fuse_opt_add_arg(outargs, option);
+        }
+        return 0;
+    }
+    case ID_SYNC_READ:
+        context->sync_read = 1;
+        return 0;
+    case ID_CALIBRATE:
+        context->calibrate = 1;
+        return 0;
+    case ID_MOUNTS:
+        fprintf(stderr, "collectfs: --mounts can't be given for a single mount\n");
+        return -1;
     case ID_CENSOR:
         /* remove any arg/parameter we don't want fuse to see. */
         return 0;
@@ -215,65 +578,41 @@ static int wrap_op(const char *opname, const int return_status)
     return return_status;
 }
 
-/** 
- * Replicate the original path for the file being trashed
- * rooted in the trash folder. 
- * 
- * Based on code from GNU mkdir with the -p option.
+/**
+ * fpath's extended attributes, mode or owner have changed - with
+ * --xattrcache what is known about its attributes, under any of its
+ * names, is out of date.
  */
-static int mkdir_trash_path(char *fspath)
+static void xattrs_changed(const char *fpath)
 {
-    /* TODO copy permissions from the original path */
-    int parent_mode = 0700;
-    struct stat sb;
-    char *p;
-
-    char npath[PATH_MAX];
-
-    trace_info(LOG_INDENT("make path=%s"), fspath);
-
-    strcpy(npath, fspath);      /* So we can write to it. */
-
-    /* Check whether or not we need to do anything with intermediate dirs. */
-
-    /* Skip leading slashes. */
-    p = npath;
-    while (*p == '/') {
-        p++;
-    }
-
-    while ((p = strchr(p, '/'))) {
-        *p = '\0';
-        if (stat(npath, &sb) != 0) {
-            if (mkdir(npath, parent_mode)) {
-                log_errno("Cannot create directory: '%s'", npath);
-                return -1;
-            }
-        } else if (S_ISDIR(sb.st_mode) == 0) {
-            errno = ENOTDIR;
-            log_errno("File exists but is not a directory: '%s'", npath);
-            return -1;
-        }
+    xattrcache_changed(((struct local_context *)fuse_get_context()->private_data)->xattrcache, fpath);
+}
 
-        *p++ = '/';             /* restore slash */
-        while (*p == '/') {
-            p++;
-        }
-    }
+/**
+ * fpath has been added, removed or renamed - with --dircache the
+ * listing of its directory is out of date, and with --xattrcache
+ * whatever is now at fpath may have other attributes.
+ */
+static void dir_changed(const char *fpath)
+{
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
 
-    return 0;
+    dircache_changed(mycontext->dircache, fpath);
+    xattrcache_replaced(mycontext->xattrcache, fpath);
 }
 
 /** 
  * Move a file to the trash (archive folder).
  * 
  * Called when a file is being unlinked, open-truncate,
- * or overwritten by move, link or symlink.
+ * or overwritten by move, link or symlink.  op names the operation
+ * for the event journal (a string constant).  replacing is 1
+ * unless unlinking - a version being replaced by a newer one
+ * may be dropped if coalescing (the last version never is).
  * Sets errno on error.
  */
-static int collect(const char *path, mode_t * mode)
+static int collect(const char *op, const char *path, mode_t * mode, int replacing)
 {
-    int rstatus = 0;
     char fpath[PATH_MAX];
 
     trace_info(LOG_INDENT("collect(path='%s')"), path);
@@ -282,6 +621,13 @@ static int collect(const char *path, mode_t * mode)
         return COLLECT_ERROR;
     }
 
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
+
+    if (pattern_excluded(mycontext->patterns, path)) {
+        trace_info(LOG_INDENT("OK - excluded from collection path=%s"), path);
+        return COLLECT_NOT_COLLECTABLE;
+    }
+
     struct stat statbuf;
 
     if (stat(fpath, &statbuf) == -1) {
@@ -298,77 +644,80 @@ static int collect(const char *path, mode_t * mode)
         return COLLECT_NOT_COLLECTABLE;
     }
 
+    char trashed[PATH_MAX];
     time_t now = time(NULL);
+    int rstatus;
 
-    struct tm *tmp = localtime(&now);
-    if (tmp == NULL) {
-        log_errno("failed to obtain localtime");
-        return COLLECT_ERROR;
-    }
-    char time_suffix[strlen("-YYYY-MM-DD.HH:MM:SS") + 1];
-    if (strftime(time_suffix, sizeof(time_suffix), ".%Y-%m-%d.%H:%M:%S", tmp) == 0) {
-        log_errno("strftime returned 0");
-        return COLLECT_ERROR;
-    }
-    char trashpath[PATH_MAX];
-    char trashfolder[strlen(trashname) + 1];
-    strcpy(trashfolder, "/");
-    strcat(trashfolder, trashname);
-    if (get_fullpath(trashpath, trashfolder) != 0) {
-        log_errno("Trash folder path too long %s%s", trashpath, trashfolder);
-        return COLLECT_ERROR;
-    }
-    if (strlen(trashpath) + strlen(path) >= PATH_MAX) {
-        errno = ENAMETOOLONG;
-        log_errno("Path too long to use trash %s%s", trashpath, path);
-        return COLLECT_ERROR;
-    }
-    strcat(trashpath, path);
-    if (mkdir_trash_path(trashpath) != 0) {
-        /* errno will have been set and logged */
-        return COLLECT_ERROR;
+    if (replacing && coalesce_superseded(mycontext->coalesce, path, now)) {
+        trace_info(LOG_INDENT("OK - version superseded, not collected path=%s"), path);
+        return COLLECT_NOT_COLLECTABLE;
     }
-    char fnewpath[PATH_MAX];
-    char suffix[15] = "";       /* will fit maxint */
-    int i = 0;
-    for (i = 1;; i++) {         /* If date-time is not unique, add a counter */
-
-        if (strlen(trashpath) + strlen(time_suffix) + strlen(suffix) > PATH_MAX) {
-            errno = ENAMETOOLONG;
-            log_errno("Path too long to use trash %s", path);
-            return COLLECT_ERROR;
-        }
 
-        strcpy(fnewpath, trashpath);
-        strcat(fnewpath, time_suffix);
-        strcat(fnewpath, suffix);
-        struct stat sb;
-        if (stat(fnewpath, &sb) != 0) {
-            break;
+    if (mycontext->stage != NULL) {
+        /* Fast path - the staging worker will finish the job. */
+        rstatus = stage_collect(mycontext, op, fpath, path, statbuf.st_size);
+    } else if (mycontext->trash_remote) {
+        char tag[64];
+        snprintf(tag, sizeof(tag), "%d.%lx", (int)getpid(), (unsigned long)pthread_self());
+        rstatus = trash_transfer_file(mycontext, fpath, path, now, tag, trashed);
+    } else {
+        rstatus = trash_collect_file(mycontext, fpath, path, now, trashed);
+    }
+    if (rstatus == COLLECT_COLLECTED) {
+        tally_collect(mycontext, fuse_get_context()->pid, fuse_get_context()->uid, statbuf.st_size);
+        coalesce_collected(mycontext->coalesce, path, now);
+        dir_changed(fpath);
+        if (mycontext->stage == NULL) {
+            dir_changed(trashed);
+            dedup_queue(mycontext, trashed);
+            delta_queue(mycontext, trashed);
+            pack_queue(mycontext, trashed);
+            index_queue(mycontext, trashed);
+            checksum_queue(mycontext, trashed);
+            events_record(mycontext, op, path, trashed, statbuf.st_size, now);
         }
-        sprintf(suffix, "-%04d", i);
     }
+    return rstatus;
+}
 
-    rstatus = rename(fpath, fnewpath);
-    if (rstatus < 0) {
-        log_errno("collect rename %s", path);
-        return COLLECT_ERROR;
-    }
+/**
+ * With --rmtree removals are deferred (see rmtree.c) - a path that has
+ * been removed, or is beneath a removed directory, no longer exists.
+ */
+static int removed(const char *path)
+{
+    return rmtree_hidden((struct local_context *)fuse_get_context()->private_data, path);
+}
 
-    return COLLECT_COLLECTED;
+/**
+ * Before path is created, or renamed to or from, carry out any deferred
+ * removal of it or of anything beneath it.  Returns 0 or -errno.
+ */
+static int settle_removal(const char *path)
+{
+    if (rmtree_settle((struct local_context *)fuse_get_context()->private_data, path) != 0) {
+        return -errno;
+    }
+    return 0;
 }
 
 static int fop_getattr(const char *path, struct stat *statbuf)
 {
     int rstatus = 0;
     char fpath[PATH_MAX];
+    struct timespec started;
 
     trace_info("fop_getattr(path='%s', statbuf=0x%08x)", path, statbuf);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
+    clock_gettime(CLOCK_MONOTONIC, &started);
     rstatus = wrap_op("fop_getattr (lstat)", lstat(fpath, statbuf));
+    governor_foreground((struct local_context *)fuse_get_context()->private_data, &started);
     trace_stat(statbuf);
 
     return rstatus;
@@ -385,6 +734,9 @@ static int fop_readlink(const char *path, char *link, size_t size)
     char fpath[PATH_MAX];
 
     trace_info("fop_readlink(path='%s', link='%s', size=%d)", path, link, size);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
@@ -404,6 +756,9 @@ static int fop_mknod(const char *path, mode_t mode, dev_t dev)
     char fpath[PATH_MAX];
 
     trace_info("fop_mknod(path='%s', mode=0%3o, dev=%lld)", path, mode, dev);
+    if ((rstatus = settle_removal(path)) != 0) {
+        return rstatus;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
@@ -421,29 +776,48 @@ static int fop_mknod(const char *path, mode_t mode, dev_t dev)
     } else {
         rstatus = wrap_op("fop_mknod (mknod)", mknod(fpath, mode, dev));
     }
+    dir_changed(fpath);
     return rstatus;
 }
 
 static int fop_mkdir(const char *path, mode_t mode)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_mkdir(path='%s', mode=0%3o)", path, mode);
+    if ((rstatus = settle_removal(path)) != 0) {
+        return rstatus;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_mkdir", mkdir(fpath, mode));
+    rstatus = wrap_op("fop_mkdir", mkdir(fpath, mode));
+    dir_changed(fpath);
+    return rstatus;
 }
 
 static int fop_unlink(const char *path)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_unlink(path='%s')", path);
+    if (removed(path)) {
+        return -ENOENT;
+    }
+    switch (rmtree_unlink((struct local_context *)fuse_get_context()->private_data, path)) {
+    case -1:
+        /* Another unlink got there first */
+        return -errno;
+    case 1:
+        /* Removed as far as anyone can see - collected later, perhaps with its directory */
+        return 0;
+    }
 
     /* Save the file being unlinked */
-    int collected = collect(path, NULL);
+    int collected = collect("unlink", path, NULL, 0);
     switch (collected) {
     case COLLECT_COLLECTED:
         /* Saved a file that would have been clobbered -
@@ -451,10 +825,11 @@ static int fop_unlink(const char *path)
          */
         return 0;
     case COLLECT_DOES_NOT_EXIST:
-        /* Unlinking something that is not there?
-         * Think we'll just let unlink handle this.
+        /* Unlinking something that is not there - or a symlink
+         * whose target isn't, since collect() follows links.
+         * Let unlink handle this.
          */
-        /* fall thru */
+        break;
     case COLLECT_ERROR:
         /* Don't allow the file to be unlinked, let the user
          * deal with this error
@@ -471,28 +846,44 @@ static int fop_unlink(const char *path)
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_unlink", unlink(fpath));
+    rstatus = wrap_op("fop_unlink", unlink(fpath));
+    dir_changed(fpath);
+    return rstatus;
 }
 
 static int fop_rmdir(const char *path)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_rmdir(path='%s')", path);
+    if (removed(path)) {
+        return -ENOENT;
+    }
+    if (rmtree_rmdir((struct local_context *)fuse_get_context()->private_data, path)) {
+        /* Nothing left in it but removed entries - collected later as a whole */
+        return 0;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_rmdir", rmdir(fpath));
+    rstatus = wrap_op("fop_rmdir", rmdir(fpath));
+    dir_changed(fpath);
+    return rstatus;
 }
 
 static int fop_symlink(const char *path, const char *link)
 {
     char flink[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_symlink(path='%s', link='%s')", path, link);
+    if ((rstatus = settle_removal(link)) != 0) {
+        return rstatus;
+    }
 
-    int collected = collect(path, NULL);
+    int collected = collect("symlink", path, NULL, 1);
     switch (collected) {
     case COLLECT_COLLECTED:
     case COLLECT_DOES_NOT_EXIST:
@@ -508,17 +899,29 @@ static int fop_symlink(const char *path, const char *link)
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_symlink", symlink(path, flink));
+    rstatus = wrap_op("fop_symlink", symlink(path, flink));
+    dir_changed(flink);
+    return rstatus;
 }
 
 static int fop_rename(const char *path, const char *newpath)
 {
     char fpath[PATH_MAX];
     char fnewpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_rename(fpath='%s', newpath='%s')", path, newpath);
+    if (removed(path)) {
+        return -ENOENT;
+    }
+    if ((rstatus = settle_removal(path)) != 0) {
+        return rstatus;
+    }
+    if ((rstatus = settle_removal(newpath)) != 0) {
+        return rstatus;
+    }
 
-    int collected = collect(newpath, NULL);
+    int collected = collect("rename", newpath, NULL, 1);
     switch (collected) {
     case COLLECT_COLLECTED:
     case COLLECT_DOES_NOT_EXIST:
@@ -537,17 +940,28 @@ static int fop_rename(const char *path, const char *newpath)
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_rename", rename(fpath, fnewpath));
+    rstatus = wrap_op("fop_rename", rename(fpath, fnewpath));
+    dir_changed(fpath);
+    dir_changed(fnewpath);
+    xattrcache_moved(((struct local_context *)fuse_get_context()->private_data)->xattrcache, fpath);
+    return rstatus;
 }
 
 static int fop_link(const char *path, const char *newpath)
 {
     char fpath[PATH_MAX], fnewpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_link(path='%s', newpath='%s')", path, newpath);
+    if (removed(path)) {
+        return -ENOENT;
+    }
+    if ((rstatus = settle_removal(newpath)) != 0) {
+        return rstatus;
+    }
     
     /* Don't let a link clobber an existing file - can this happen? Lets be safe. */
-    int collected = collect(newpath, NULL);
+    int collected = collect("link", newpath, NULL, 1);
     switch (collected) {
     case COLLECT_COLLECTED:
     case COLLECT_DOES_NOT_EXIST:
@@ -565,55 +979,163 @@ static int fop_link(const char *path, const char *newpath)
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_link", link(fpath, fnewpath));
+    rstatus = wrap_op("fop_link", link(fpath, fnewpath));
+    dir_changed(fnewpath);
+    return rstatus;
+}
+
+/**
+ * Before changing a file in place, make sure it isn't shared with a
+ * checkpoint (see cow.c).  Returns 0 or -errno.
+ */
+static int unshare_checkpoint(const char *fpath)
+{
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
+
+    return -cow_unshare(mycontext->cow, fpath);
+}
+
+/**
+ * Before writing or truncating through fi, make sure its handle isn't
+ * on an inode shared with a checkpoint - it may have been opened before
+ * the checkpoint was taken, or another handle may since have unshared
+ * the file.  If it is, unshare the file at path and switch the handle
+ * to it.  Fuse keeps path following the file through renames, so what
+ * is at path is the file the handle was opened on, or its copy.
+ * Returns 0 or -errno.
+ */
+static int unshare_handle(const char *path, struct fuse_file_info *fi)
+{
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
+    char fpath[PATH_MAX];
+    int rstatus = 0, flags, fd;
+
+    if (!cow_shared(mycontext->cow, fi->fh)) {
+        /* The common case */
+        return 0;
+    }
+    pthread_mutex_lock(&switching_handle);
+    /* Look again - another thread writing through the handle may have got here first */
+    if (!cow_shared(mycontext->cow, fi->fh)) {
+        goto done;
+    }
+    if (path == NULL || get_fullpath(fpath, path) != 0) {
+        rstatus = -EIO;
+        log_info("Collectfs: cannot write %s - it is shared with a checkpoint", path != NULL ? path : "a file");
+        goto done;
+    }
+    trace_info(LOG_INDENT("handle on '%s' is shared with a checkpoint - switching it to the file's own copy"), path);
+    if ((rstatus = unshare_checkpoint(fpath)) != 0) {
+        goto done;
+    }
+    if ((flags = fcntl(fi->fh, F_GETFL)) < 0 || (fd = open(fpath, flags)) < 0) {
+        rstatus = -log_errno("cannot reopen %s, shared with a checkpoint", fpath);
+        goto done;
+    }
+    if (cow_shared(mycontext->cow, fd)) {
+        /* Something else, still shared, is there now */
+        close(fd);
+        rstatus = -EIO;
+        log_info("Collectfs: cannot write %s - it is shared with a checkpoint", path);
+        goto done;
+    }
+    undo_release(mycontext, fi->fh);
+    if (dup2(fd, fi->fh) < 0) {
+        rstatus = -log_errno("cannot switch the handle on %s", fpath);
+    } else if (undo_open(mycontext, fpath, path, fi->fh) != 0) {
+        /* Don't let it be written without the undo log */
+        rstatus = -errno;
+    }
+    close(fd);
+  done:
+    pthread_mutex_unlock(&switching_handle);
+    return rstatus;
 }
 
 static int fop_chmod(const char *path, mode_t mode)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_chmod(fpath='%s', mode=0%03o)", path, mode);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_chmod", chmod(fpath, mode));
+    if ((rstatus = unshare_checkpoint(fpath)) != 0) {
+        return rstatus;
+    }
+
+    /* The mode is the ACL's mask */
+    rstatus = wrap_op("fop_chmod", chmod(fpath, mode));
+    xattrs_changed(fpath);
+    return rstatus;
 }
 
 static int fop_chown(const char *path, uid_t uid, gid_t gid)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_chown(path='%s', uid=%d, gid=%d)", path, uid, gid);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_chown", chown(fpath, uid, gid));
+    if ((rstatus = unshare_checkpoint(fpath)) != 0) {
+        return rstatus;
+    }
+
+    /* Changing owner clears security.capability */
+    rstatus = wrap_op("fop_chown", chown(fpath, uid, gid));
+    xattrs_changed(fpath);
+    return rstatus;
 }
 
 static int fop_truncate(const char *path, off_t newsize)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_truncate(path='%s', newsize=%lld)", path, newsize);
+    if (removed(path)) {
+        return -ENOENT;
+    }
 
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
+    if ((rstatus = unshare_checkpoint(fpath)) != 0) {
+        return rstatus;
+    }
+
     return wrap_op("fop_truncate", truncate(fpath, newsize));
 }
 
 static int fop_utime(const char *path, struct utimbuf *ubuf)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_utime(path='%s', ubuf=0x%08x)", path, ubuf);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
+    if ((rstatus = unshare_checkpoint(fpath)) != 0) {
+        return rstatus;
+    }
+
     return wrap_op("fop_utime", utime(fpath, ubuf));
 }
 
@@ -622,15 +1144,19 @@ static int fop_open(const char *path, struct fuse_file_info *fi)
     int rstatus = 0;
     int fd;
     char fpath[PATH_MAX];
+    struct timespec started;
 
     trace_info("fop_open(path'%s', fi=0x%08x)", path, fi);
+    if (removed(path)) {
+        return -ENOENT;
+    }
 
     if (can_collect_open_truncate && (fi->flags & O_TRUNC)) {
         /* If truncating an existing file, collect the existing file
          * and replace it with a new empty one.
          */
         mode_t mode;
-        int collected = collect(path, &mode);
+        int collected = collect("truncate", path, &mode, 1);
         switch (collected) {
         case COLLECT_COLLECTED:
             /* We have collected the file - replace it with new version
@@ -651,9 +1177,21 @@ static int fop_open(const char *path, struct fuse_file_info *fi)
         return -ENAMETOOLONG;
     };
 
+    if ((fi->flags & O_ACCMODE) != O_RDONLY && (rstatus = unshare_checkpoint(fpath)) != 0) {
+        return rstatus;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
     fd = wrap_op("fop_open", open(fpath, fi->flags));
+    governor_foreground((struct local_context *)fuse_get_context()->private_data, &started);
     if (fd < 0) {
         rstatus = fd;
+    } else if ((fi->flags & O_ACCMODE) != O_RDONLY
+               && undo_open((struct local_context *)fuse_get_context()->private_data, fpath, path, fd) != 0) {
+        /* Don't let it be written without the undo log */
+        rstatus = -errno;
+        close(fd);
+        fd = -1;
     }
     fi->fh = fd;
     trace_fi(fi);
@@ -663,18 +1201,44 @@ static int fop_open(const char *path, struct fuse_file_info *fi)
 
 static int fop_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    struct fuse_context *caller = fuse_get_context();
+    struct timespec started;
+    int rstatus;
+
     trace_info("fop_read(path='%s', buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)", path, buf, size, offset, fi);
     trace_fi(fi);
 
-    return wrap_op("fop_read", pread(fi->fh, buf, size, offset));
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    rstatus = wrap_op("fop_read", pread(fi->fh, buf, size, offset));
+    governor_foreground(caller->private_data, &started);
+    if (rstatus > 0) {
+        tally_io(caller->private_data, caller->pid, caller->uid, rstatus, 0);
+    }
+    return rstatus;
 }
 
 static int fop_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+    struct fuse_context *caller = fuse_get_context();
+    struct timespec started;
+    int rstatus;
+
     trace_info("fop_write(path='%s', buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)", path, buf, size, offset, fi);
     trace_fi(fi);
 
-    return wrap_op("fop_write (pwrite)", pwrite(fi->fh, buf, size, offset));
+    if ((rstatus = unshare_handle(path, fi)) != 0) {
+        return rstatus;
+    }
+    if (undo_write(caller->private_data, fi->fh, offset, size) != 0) {
+        return -log_errno("fop_write: cannot save the bytes being overwritten in %s", path);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    rstatus = wrap_op("fop_write (pwrite)", pwrite(fi->fh, buf, size, offset));
+    governor_foreground(caller->private_data, &started);
+    if (rstatus > 0) {
+        tally_io(caller->private_data, caller->pid, caller->uid, 0, rstatus);
+    }
+    return rstatus;
 }
 
 static int fop_statfs(const char *path, struct statvfs *statv)
@@ -715,6 +1279,7 @@ static int fop_release(const char *path, struct fuse_file_info *fi)
 {
     trace_info("fop_release(path='%s', fi=0x%08x)", path, fi);
     trace_fi(fi);
+    undo_release((struct local_context *)fuse_get_context()->private_data, fi->fh);
 
     return wrap_op("fop_release (close)", close(fi->fh));
 }
@@ -726,6 +1291,9 @@ static int fop_fsync(const char *path, int datasync, struct fuse_file_info *fi)
     trace_info("fop_fsync(path='%s', datasync=%d, fi=0x%08x)", path, datasync, fi);
     trace_fi(fi);
 
+    if (undo_sync((struct local_context *)fuse_get_context()->private_data, fi->fh) != 0) {
+        return -log_errno("fop_fsync: cannot sync the undo log of %s", path);
+    }
     if (datasync) {
         rstatus = wrap_op("fop_fsync (fdatasync)", fdatasync(fi->fh));
     } else {
@@ -737,26 +1305,45 @@ static int fop_fsync(const char *path, int datasync, struct fuse_file_info *fi)
 static int fop_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_setxattr(path='%s', name='%s', value='%s', size=%d, flags=0x%08x)", path, name, value, size, flags);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_setxattr (lsetxattr)", lsetxattr(fpath, name, value, size, flags));
+    if ((rstatus = unshare_checkpoint(fpath)) != 0) {
+        return rstatus;
+    }
+
+    rstatus = wrap_op("fop_setxattr (lsetxattr)", lsetxattr(fpath, name, value, size, flags));
+    xattrs_changed(fpath);
+    return rstatus;
 }
 
 static int fop_getxattr(const char *path, const char *name, char *value, size_t size)
 {
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
     int rstatus = 0;
     char fpath[PATH_MAX];
 
     trace_info("fop_getxattr(path = '%s', name = '%s', value = 0x%08x, size = %d)", path, name, value, size);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    rstatus = wrap_op("fop_getxattr (lgetxattr)", lgetxattr(fpath, name, value, size));
+    if (mycontext->xattrcache != NULL) {
+        rstatus = wrap_op("fop_getxattr (xattrcache_get)",
+                          xattrcache_get(mycontext->xattrcache, fpath, name, value, size));
+    } else {
+        rstatus = wrap_op("fop_getxattr (lgetxattr)", lgetxattr(fpath, name, value, size));
+    }
     if (rstatus >= 0) {
         trace_info(LOG_INDENT("value = '%s'"), value);
     }
@@ -765,16 +1352,25 @@ static int fop_getxattr(const char *path, const char *name, char *value, size_t
 
 static int fop_listxattr(const char *path, char *list, size_t size)
 {
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
     int rstatus = 0;
     char fpath[PATH_MAX];
     char *ptr;
 
     trace_info("fop_listxattr(path='%s', list=0x%08x, size=%d)", path, list, size);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    rstatus = wrap_op("fop_listxattr (llistxattr)", llistxattr(fpath, list, size));
+    if (mycontext->xattrcache != NULL) {
+        rstatus = wrap_op("fop_listxattr (xattrcache_get)",
+                          xattrcache_get(mycontext->xattrcache, fpath, NULL, list, size));
+    } else {
+        rstatus = wrap_op("fop_listxattr (llistxattr)", llistxattr(fpath, list, size));
+    }
     trace_info(LOG_INDENT("returned attributes (length %d):"), rstatus);
     for (ptr = list; ptr < list + rstatus; ptr += strlen(ptr) + 1) {
         trace_info(LOG_INDENT("'%s'"), ptr);
@@ -785,13 +1381,23 @@ static int fop_listxattr(const char *path, char *list, size_t size)
 static int fop_removexattr(const char *path, const char *name)
 {
     char fpath[PATH_MAX];
+    int rstatus;
 
     trace_info("fop_removexattr(path='%s', name='%s')", path, name);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
-    return wrap_op("fop_rmovexattr (lremovexattr)", lremovexattr(fpath, name));
+    if ((rstatus = unshare_checkpoint(fpath)) != 0) {
+        return rstatus;
+    }
+
+    rstatus = wrap_op("fop_rmovexattr (lremovexattr)", lremovexattr(fpath, name));
+    xattrs_changed(fpath);
+    return rstatus;
 }
 
 static int fop_opendir(const char *path, struct fuse_file_info *fi)
@@ -799,12 +1405,27 @@ static int fop_opendir(const char *path, struct fuse_file_info *fi)
     DIR *dp;
     int rstatus = 0;
     char fpath[PATH_MAX];
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
 
     trace_info("fop_opendir(path='%s', fi=0x%08x)", path, fi);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
+    if (mycontext->dircache != NULL) {
+        /* The handle is the listing rather than the directory */
+        struct dircache_listing *listing = dircache_open(mycontext->dircache, fpath);
+        if (listing == NULL) {
+            rstatus = wrap_op("fop_opendir (dircache_open)", -1);
+        }
+        fi->fh = (intptr_t) listing;
+        trace_fi(fi);
+        return rstatus;
+    }
+
     dp = opendir(fpath);
     if (dp == NULL) {
         /* fake call to record what what happened - errno will logged  */
@@ -822,8 +1443,26 @@ static int fop_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_
     int rstatus = 0;
     DIR *dp;
     struct dirent *de;
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
 
     trace_info("fop_readdir(path='%s', buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)", path, buf, filler, offset, fi);
+    if (mycontext->dircache != NULL) {
+        struct dircache_listing *listing = (struct dircache_listing *) (uintptr_t) fi->fh;
+        const char *name;
+
+        for (name = dircache_next(listing, NULL); name != NULL; name = dircache_next(listing, name)) {
+            if (rmtree_hidden_entry(mycontext, path, name)) {
+                continue;
+            }
+            trace_info(LOG_INDENT("calling filler with name %s"), name);
+            if (filler(buf, name, NULL, 0) != 0) {
+                trace_info(LOG_INDENT("ERROR fop_readdir filler:  buffer full"));
+                return -ENOMEM;
+            }
+        }
+        trace_fi(fi);
+        return 0;
+    }
     /* once again, no need for fullpath -- but note that I need to cast fi->fh
      */
     dp = (DIR *) (uintptr_t) fi->fh;
@@ -844,6 +1483,10 @@ static int fop_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_
      * read the whole directory; the second means the buffer is full.
      */
     do {
+        if (rmtree_hidden_entry(mycontext, path, de->d_name)) {
+            errno = 0;
+            continue;
+        }
         trace_info(LOG_INDENT("calling filler with name %s"), de->d_name);
         if (filler(buf, de->d_name, NULL, 0) != 0) {
             trace_info(LOG_INDENT("ERROR fop_readdir filler:  buffer full"));
@@ -864,27 +1507,98 @@ static int fop_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_
 
 static int fop_releasedir(const char *path, struct fuse_file_info *fi)
 {
+    struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
+
     trace_info("fop_releasedir(path='%s', fi=0x%08x)", path, fi);
     trace_fi(fi);
 
+    if (mycontext->dircache != NULL) {
+        dircache_close(mycontext->dircache, (struct dircache_listing *) (uintptr_t) fi->fh);
+        return 0;
+    }
     return wrap_op("fop_releasedir (closedir)", closedir((DIR *) (uintptr_t) fi->fh));
 }
 
 static int fop_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
 {
     int rstatus = 0;
+    int fd;
+    char fpath[PATH_MAX];
 
     trace_info("fop_fsyncdir(path='%s', datasync=%d, fi=0x%08x)", path, datasync, fi);
     trace_fi(fi);
-    /* TODO - how to test this one? */
+    /* The handle isn't a file descriptor - it is a DIR or a listing */
+    if (get_fullpath(fpath, path) != 0) {
+        return -ENAMETOOLONG;
+    };
+    fd = wrap_op("fop_fsyncdir (open)", open(fpath, O_RDONLY));
+    if (fd < 0) {
+        return fd;
+    }
     if (datasync) {
-        rstatus = wrap_op("fop_fsyncdir (fdatasync)", fdatasync(fi->fh));
+        rstatus = wrap_op("fop_fsyncdir (fdatasync)", fdatasync(fd));
     } else {
-        rstatus = wrap_op("fop_fsyncdir (fsync)", fsync(fi->fh));
+        rstatus = wrap_op("fop_fsyncdir (fsync)", fsync(fd));
     }
+    close(fd);
     return rstatus;
 }
 
+/**
+ * Streaming reads and writes go in requests of at most the sizes
+ * agreed here.  Ask for the largest the kernel and fuse offer, or the
+ * size --calibrate found best, unless --max-write or --max-readahead
+ * say otherwise, and take big writes and asynchronous reads wherever
+ * they are available.  fuse on its own would leave writes a page at a
+ * time.
+ */
+static void negotiate_requests(struct local_context *context, struct fuse_conn_info *conn)
+{
+    unsigned int calibrated = 0;
+    int big_writes = 0;
+
+    if (context->calibrate && (context->max_write == 0 || context->max_readahead == 0)) {
+        calibrated = calibrate_request_size(context->rootdir,
+                                            conn->max_write > conn->max_readahead ? conn->max_write
+                                                                                   : conn->max_readahead);
+    }
+#ifdef FUSE_CAP_BIG_WRITES
+    if ((unsigned int)conn->capable & FUSE_CAP_BIG_WRITES) {
+        conn->want |= FUSE_CAP_BIG_WRITES;
+        big_writes = 1;
+    }
+#endif
+    if (context->max_write > 0 && context->max_write < conn->max_write) {
+        conn->max_write = context->max_write;
+    } else if (context->max_write == 0 && calibrated > 0 && calibrated < conn->max_write) {
+        conn->max_write = calibrated;
+    }
+    if (context->max_readahead > 0 && context->max_readahead < conn->max_readahead) {
+        conn->max_readahead = context->max_readahead;
+    } else if (context->max_readahead == 0 && calibrated > 0 && calibrated < conn->max_readahead) {
+        conn->max_readahead = calibrated;
+    }
+    conn->async_read = !context->sync_read;
+#ifdef FUSE_CAP_ASYNC_READ
+    if (context->sync_read) {
+        conn->want &= ~FUSE_CAP_ASYNC_READ;
+    } else if ((unsigned int)conn->capable & FUSE_CAP_ASYNC_READ) {
+        conn->want |= FUSE_CAP_ASYNC_READ;
+    }
+#endif
+#if FUSE_VERSION >= 29
+    /* Room for the kernel to keep read ahead and write back going in parallel */
+    if (conn->max_background < MAX_BACKGROUND_REQUESTS) {
+        conn->max_background = MAX_BACKGROUND_REQUESTS;
+        conn->congestion_threshold = MAX_BACKGROUND_REQUESTS * 3 / 4;
+    }
+#endif
+    log_info("Collectfs %s: requests of up to %uKB written%s, %uKB read ahead, %s%s", COLLECTFS_VERSION,
+             (big_writes ? conn->max_write : 4096) / 1024, big_writes ? "" : " (no big writes in this kernel)",
+             conn->max_readahead / 1024, conn->async_read ? "asynchronous reads" : "one read at a time",
+             context->max_read > 0 ? ", reads limited by max_read" : "");
+}
+
 void *fop_init(struct fuse_conn_info *conn)
 {
     struct local_context *mycontext = (struct local_context *)fuse_get_context()->private_data;
@@ -905,6 +1619,81 @@ void *fop_init(struct fuse_conn_info *conn)
 #endif
         log_info("Collectfs %s: WARNING, cannot collect open truncate - not supported by this kernel.", COLLECTFS_VERSION);
     }
+    negotiate_requests(mycontext, conn);
+
+    if (mycontext->use_uring && !uring_available()) {
+        /* uring_available() has logged why */
+        mycontext->use_uring = 0;
+    }
+
+    if (pattern_count(mycontext->patterns) > 0) {
+        log_info("Collectfs %s: %d include/exclude patterns", COLLECTFS_VERSION, pattern_count(mycontext->patterns));
+    }
+    if (mycontext->layout != LAYOUT_MIRRORED) {
+        log_info("Collectfs %s: %s trash layout", COLLECTFS_VERSION, layout_name(mycontext->layout));
+    }
+
+    /* Before the modules whose background work it schedules */
+    if (governor_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, background work is not being scheduled.", COLLECTFS_VERSION);
+    }
+    if (mycontext->events_journal && events_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot journal collection events.", COLLECTFS_VERSION);
+    }
+    if (mycontext->dedup_collect && dedup_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot start deduplication.", COLLECTFS_VERSION);
+    }
+    if (mycontext->delta_collect && delta_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot start delta encoding.", COLLECTFS_VERSION);
+    }
+    if (mycontext->compress_age > 0 && compress_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot start compression.", COLLECTFS_VERSION);
+    }
+    if ((mycontext->pack_size > 0 || mycontext->expire_age > 0) && pack_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot start packing.", COLLECTFS_VERSION);
+    }
+    if (mycontext->index_collect && index_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot start the search index.", COLLECTFS_VERSION);
+    }
+    if (mycontext->scrub_collect && checksum_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot start scrubbing.", COLLECTFS_VERSION);
+    }
+    if (mycontext->undo_size > 0 && undo_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot keep undo logs.", COLLECTFS_VERSION);
+    }
+    mycontext->cow = cow_new(mycontext->trashdir);
+    if (mycontext->cow == NULL) {
+        log_info("Collectfs %s: WARNING, cannot protect checkpoints from writes through hardlinks.", COLLECTFS_VERSION);
+    }
+    if (mycontext->dircache_size > 0 && (mycontext->dircache = dircache_new(mycontext->dircache_size)) == NULL) {
+        log_info("Collectfs %s: WARNING, cannot cache directory listings.", COLLECTFS_VERSION);
+    }
+    if (mycontext->xattrcache_size > 0 && (mycontext->xattrcache = xattrcache_new(mycontext->xattrcache_size)) == NULL) {
+        log_info("Collectfs %s: WARNING, cannot cache extended attributes.", COLLECTFS_VERSION);
+    }
+    if (mycontext->rmtree_collect && rmtree_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot defer removals - collecting them one by one.", COLLECTFS_VERSION);
+    }
+
+    if (mycontext->async_collect) {
+        if (stage_start(mycontext) == 0) {
+            log_info("Collectfs %s: asynchronous collection via %s", COLLECTFS_VERSION, mycontext->trashdir);
+        } else {
+            log_info("Collectfs %s: WARNING, cannot stage collections - collecting synchronously.", COLLECTFS_VERSION);
+        }
+    } else {
+        /* Finish anything an earlier asynchronous mount left staged */
+        stage_recover(mycontext);
+    }
+    if (mycontext->stats_collect && tally_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot tally collections by program.", COLLECTFS_VERSION);
+    }
+    if (mycontext->stats_collect && stats_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot write stats.", COLLECTFS_VERSION);
+    }
+    if (mycontext->capture_path != NULL && capture_start(mycontext) != 0) {
+        log_info("Collectfs %s: WARNING, cannot capture operations.", COLLECTFS_VERSION);
+    }
 
     return mycontext;
 }
@@ -912,6 +1701,28 @@ void *fop_init(struct fuse_conn_info *conn)
 void fop_destroy(void *userdata)
 {
     trace_info("fop_destroy(userdata=0x%08x)", userdata);
+    capture_stop((struct local_context *)userdata);
+    stats_stop((struct local_context *)userdata);
+    tally_stop((struct local_context *)userdata);
+    stage_stop((struct local_context *)userdata);
+    /* Before the modules its collections are queued to */
+    rmtree_stop((struct local_context *)userdata);
+    dedup_stop((struct local_context *)userdata);
+    delta_stop((struct local_context *)userdata);
+    compress_stop((struct local_context *)userdata);
+    pack_stop((struct local_context *)userdata);
+    index_stop((struct local_context *)userdata);
+    checksum_stop((struct local_context *)userdata);
+    events_stop((struct local_context *)userdata);
+    undo_stop((struct local_context *)userdata);
+    cow_free(((struct local_context *)userdata)->cow);
+    ((struct local_context *)userdata)->cow = NULL;
+    dircache_free(((struct local_context *)userdata)->dircache);
+    ((struct local_context *)userdata)->dircache = NULL;
+    xattrcache_free(((struct local_context *)userdata)->xattrcache);
+    ((struct local_context *)userdata)->xattrcache = NULL;
+    /* After every module that schedules background work */
+    governor_stop((struct local_context *)userdata);
 }
 
 static int fop_access(const char *path, int mask)
@@ -919,6 +1730,9 @@ static int fop_access(const char *path, int mask)
     char fpath[PATH_MAX];
 
     trace_info("fop_access(path='%s', mask=0%o)", path, mask);
+    if (removed(path)) {
+        return -ENOENT;
+    }
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
@@ -933,12 +1747,16 @@ static int fop_create(const char *path, mode_t mode, struct fuse_file_info *fi)
     int fd;
 
     trace_info("fop_create(path='%s', mode=0%03o, fi=0x%08x)", path, mode, fi);
+    if ((rstatus = settle_removal(path)) != 0) {
+        return rstatus;
+    }
 
     if (get_fullpath(fpath, path) != 0) {
         return -ENAMETOOLONG;
     };
 
     fd = wrap_op("fop_create", creat(fpath, mode));
+    dir_changed(fpath);
     if (fd < 0) {               /* return error status */
         rstatus = fd;
         fi->fh = -1;
@@ -957,6 +1775,13 @@ static int fop_ftruncate(const char *path, off_t offset, struct fuse_file_info *
     /* TODO - check - maybe we should check if offset is zero
      * and collect the file in that case only.
      */
+    int rstatus = unshare_handle(path, fi);
+    if (rstatus != 0) {
+        return rstatus;
+    }
+    if (undo_truncate((struct local_context *)fuse_get_context()->private_data, fi->fh, offset) != 0) {
+        return -log_errno("fop_ftruncate: cannot save the bytes being cut from %s", path);
+    }
     return wrap_op("fop_ftruncate", ftruncate(fi->fh, offset));
 }
 
@@ -1011,6 +1836,151 @@ struct fuse_operations fuse_ops = {
     .fgetattr = fop_fgetattr
 };
 
+/**
+ * Work out where the trash goes.  Unless --trash-dir says otherwise
+ * it is the trash folder at the top of rootdir.  A trash on another
+ * filesystem can't be collected into with rename, so collection is
+ * done by staging and copying in the background.
+ */
+static int setup_trash(struct local_context *context)
+{
+    struct stat rootsb, trashsb;
+
+    if (context->trashdir == NULL) {
+        context->trashdir = malloc(strlen(context->rootdir) + strlen(context->trashname) + 2);
+        if (context->trashdir == NULL) {
+            perror("Failed to initialise - failed to allocate memory for trash path.\n");
+            return -1;
+        }
+        sprintf(context->trashdir, "%s/%s", context->rootdir, context->trashname);
+        return 0;
+    }
+    if (stat(context->trashdir, &trashsb) != 0 || !S_ISDIR(trashsb.st_mode)) {
+        fprintf(stderr, "Trash directory must be a directory: %s\n", context->trashdir);
+        return -1;
+    }
+    if (stat(context->rootdir, &rootsb) != 0) {
+        perror(context->rootdir);
+        return -1;
+    }
+    if (rootsb.st_dev != trashsb.st_dev) {
+        context->trash_remote = 1;
+        context->async_collect = 1;
+        fprintf(stderr, "Trash %s is on another filesystem - collecting by background copy.\n", context->trashdir);
+    }
+    return 0;
+}
+
+/**
+ * Take the trash folder name from COLLECTFS_TRASH if it is set.
+ */
+static int choose_trashname(void)
+{
+    if (getenv("COLLECTFS_TRASH") != NULL) {
+        trashname = getenv("COLLECTFS_TRASH");
+        if (strchr(trashname, '/') != NULL) {
+            fprintf(stderr, "COLLECTFS_TRASH must be a directory at the filesystem root - a path is not allowed.\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Settings a mount starts with before its options are applied.
+ */
+static void context_defaults(struct local_context *context)
+{
+    context->trashname = trashname;
+    context->copy_backlog = DEFAULT_COPY_BACKLOG_MB * 1024ULL * 1024;
+    context->dedup_rate = DEFAULT_DEDUP_RATE_MB * 1024ULL * 1024;
+    context->scrub_rate = DEFAULT_SCRUB_RATE_MB * 1024ULL * 1024;
+    context->compress_cpu = DEFAULT_COMPRESS_CPU;
+}
+
+static void free_mount_context(struct local_context *context)
+{
+    pattern_free(context->patterns);
+    coalesce_free(context->coalesce);
+    free(context->capture_path);
+    free(context->trashdir);
+    free(context->rootdir);
+    free(context);
+}
+
+/**
+ * The context of one of the mounts in a --mounts file (see mounts.c).
+ */
+static struct local_context *mount_context(const char *rootdir, struct fuse_args *args)
+{
+    struct local_context *context = calloc(sizeof(struct local_context), 1);
+    struct stat sb;
+
+    if (context == NULL) {
+        log_errno("Cannot allocate the context for %s", rootdir);
+        return NULL;
+    }
+    context->rootdir = realpath(rootdir, NULL);
+    if (context->rootdir == NULL || stat(context->rootdir, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+        log_info("Root path must be a directory: %s", rootdir);
+        free_mount_context(context);
+        return NULL;
+    }
+    context_defaults(context);
+    if (fuse_opt_parse(args, context, command_options, command_options_processor) != 0
+        || setup_trash(context) != 0) {
+        log_info("Cannot use the options given for %s", rootdir);
+        free_mount_context(context);
+        return NULL;
+    }
+    return context;
+}
+
+/**
+ * Serve all the mounts in a --mounts file from this one process.  The
+ * other command line options apply to each of them.
+ */
+static int serve_mounts(int argc, char *argv[], int mounts_index)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    char *mountsfile, *mountpoint = NULL;
+    int multithreaded, foreground, i, rstatus;
+
+    mountsfile = realpath(strchr(argv[mounts_index], '=') + 1, NULL);
+    if (mountsfile == NULL) {
+        fprintf(stderr, "%s: mounts file %s\n", strerror(errno), strchr(argv[mounts_index], '=') + 1);
+        return EXIT_FAILURE;
+    }
+    if (choose_trashname() != 0) {
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < argc; i++) {
+        if (i != mounts_index) {
+            fuse_opt_add_arg(&args, argv[i]);
+        }
+    }
+    /* Takes out -f, -d and -s, which are for the process rather than each mount */
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) != 0 || mountpoint != NULL) {
+        fprintf(stderr, "With --mounts the root paths and mount points are given in %s.\n", mountsfile);
+        return EXIT_FAILURE;
+    }
+    if (foreground) {
+        set_use_syslog(0);
+    }
+    log_open();
+    fprintf(stderr, "\nCollectfs %s (mounts=%s, trash=%s)\n\n", COLLECTFS_VERSION, mountsfile, trashname);
+    if (fuse_daemonize(foreground) != 0) {
+        return EXIT_FAILURE;
+    }
+    log_info("Collectfs %s: serving the mounts in %s", COLLECTFS_VERSION, mountsfile);
+    /* Any of the mounts may be captured */
+    rstatus = mounts_serve(mountsfile, &args, capture_operations(&fuse_ops), mount_context, free_mount_context);
+    log_info("Collectfs exiting: [%s]", mountsfile);
+    fuse_opt_free_args(&args);
+    free(mountsfile);
+    return rstatus == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char *argv[])
 {
     int rstatus=0;
@@ -1032,6 +2002,12 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    for (param_index = 1; param_index < argc; param_index++) {
+        if (strncmp(argv[param_index], "--mounts=", strlen("--mounts=")) == 0) {
+            return serve_mounts(argc, argv, param_index);
+        }
+    }
+
     context = calloc(sizeof(struct local_context), 1);
     if (context == NULL) {
         perror("Failed to initialise - failed to allocate memory for internal context (via calloc).\n");
@@ -1086,20 +2062,21 @@ int main(int argc, char *argv[])
             }
         }
 
-        if (getenv("COLLECTFS_TRASH") != NULL) {
-            trashname = getenv("COLLECTFS_TRASH");
-            if (strchr(trashname, '/') != NULL) {
-                fprintf(stderr, "COLLECTFS_TRASH must be a directory at the filesystem root - a path is not allowed.\n");
-                return EXIT_FAILURE;
-            }
+        if (choose_trashname() != 0) {
+            return EXIT_FAILURE;
         }
+        context_defaults(context);
         log_open();
         fprintf(stderr, "\nCollectfs %s (trash=%s)\n\n", COLLECTFS_VERSION, trashname);
     }
 
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
-    if (fuse_opt_parse(&args, NULL, command_options, command_options_processor) == 0) {
-        rstatus = fuse_main(args.argc, args.argv, &fuse_ops, context);
+    if (fuse_opt_parse(&args, context, command_options, command_options_processor) == 0) {
+        if (context->rootdir != NULL && setup_trash(context) != 0) {
+            return EXIT_FAILURE;
+        }
+        rstatus = fuse_main(args.argc, args.argv,
+                            context->capture_path != NULL ? capture_operations(&fuse_ops) : &fuse_ops, context);
     }
     if (help_only) {
         usage(argv[0]);
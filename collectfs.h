@@ -0,0 +1,176 @@
+/**
+ * Definitions shared between the collectfs modules.
+ *
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _COLLECTFS_H_
+#define _COLLECTFS_H_
+
+#include <time.h>
+
+/**
+ * Will show up in logs
+ */
+#define COLLECTFS_VERSION "1.0.1"
+
+/**
+ * Collect() function return values - different operations
+ * may need to know what collect did - e.g. when unlinking,
+ * if collect moved the file to the trash, then unlink will
+ * have nothing to do.
+ */
+/**
+ * Collected the file - must have been a normal file
+ */
+#define COLLECT_COLLECTED 0
+/**
+ * Asked to collect something that isn't a normal file,
+ * e.g. a named pipe.
+ */
+#define COLLECT_NOT_COLLECTABLE 1
+/**
+ * Asked to collect a file that doesn't exist.
+ */
+#define COLLECT_DOES_NOT_EXIST 2
+/**
+ * A real collection problem, such as file name to long
+ * or an error in the underlying real file-system.
+ */
+#define COLLECT_ERROR -1
+
+struct stage;
+struct pattern_list;
+struct coalesce;
+struct dedup;
+struct delta;
+struct compress;
+struct pack;
+struct events;
+struct index;
+struct checksum;
+struct cow;
+struct undo;
+struct rmtree;
+struct dircache;
+struct xattrcache;
+struct governor;
+struct stats;
+struct tally;
+struct capture;
+
+/**
+ * We will pass this context to fuse.  Fuse will pass it back
+ * to us - so we can attach any context we need here.
+ * The real root of the directory hierarchy we are protecting,
+ * where its trash lives, and the per-mount collection settings.
+ * Background workers are handed this context directly because
+ * fuse_get_context() is only meaningful on fuse threads.
+ */
+struct local_context {
+    char *rootdir;
+    /** Name of the trash folder at the top of rootdir */
+    const char *trashname;
+    /** Full path of the trash folder - maybe on another filesystem */
+    char *trashdir;
+    /** How versions are arranged in the trash - a LAYOUT_ value */
+    int layout;
+    /** Trash is on a different filesystem - collect by copying */
+    int trash_remote;
+    /** Stage collections and finalise them in the background */
+    int async_collect;
+    /** Bytes that may wait in staging for a copy to a remote trash */
+    unsigned long long copy_backlog;
+    /** Batch collection system calls through io_uring where available */
+    int use_uring;
+    /** Staging area state - NULL unless staging has been started */
+    struct stage *stage;
+    /** Files not worth collecting - NULL if everything is collected */
+    struct pattern_list *patterns;
+    /** When each path was last collected - NULL unless coalescing */
+    struct coalesce *coalesce;
+    /** Share the blocks of identical trash versions in the background */
+    int dedup_collect;
+    /** Bytes/second deduplication may read (0 for no limit) */
+    unsigned long long dedup_rate;
+    /** Deduplication state - NULL unless deduplication has been started */
+    struct dedup *dedup;
+    /** Store older versions as deltas against a base version */
+    int delta_collect;
+    /** Delta encoding state - NULL unless delta encoding has been started */
+    struct delta *delta;
+    /** Compress versions collected more than this many seconds ago (0 for never) */
+    time_t compress_age;
+    /** Percentage of a CPU compression may use */
+    int compress_cpu;
+    /** Compression state - NULL unless compression has been started */
+    struct compress *compress;
+    /** Move versions of at most this many bytes into pack files (0 for never) */
+    off_t pack_size;
+    /** Remove versions collected more than this many seconds ago (0 for never) */
+    time_t expire_age;
+    /** Packing and expiry state - NULL unless packing has been started */
+    struct pack *pack;
+    /** Journal every collection and serve the journal to followers */
+    int events_journal;
+    /** Event journal state - NULL unless the journal has been started */
+    struct events *events;
+    /** Keep a search index of trash names and content */
+    int index_collect;
+    /** Index the content of versions of at most this many bytes (0 for names only) */
+    off_t index_size;
+    /** Search index state - NULL unless indexing has been started */
+    struct index *index;
+    /** Record checksums of collected versions and scrub them in the background */
+    int scrub_collect;
+    /** Bytes/second scrubbing may read (0 for no limit) */
+    unsigned long long scrub_rate;
+    /** Checksum and scrub state - NULL unless scrubbing has been started */
+    struct checksum *checksum;
+    /** Defer removals and collect removed directories whole */
+    int rmtree_collect;
+    /** Deferred removal state - NULL unless deferring removals */
+    struct rmtree *rmtree;
+    /** Keep undo logs of writes to open files of at least this many bytes (0 for none) */
+    off_t undo_size;
+    /** Undo log state - NULL unless undo logs have been started */
+    struct undo *undo;
+    /** Bytes of directory listings to keep (0 for none) */
+    size_t dircache_size;
+    /** Directory listing cache - NULL unless caching listings */
+    struct dircache *dircache;
+    /** Bytes of extended attribute answers to keep (0 for none) */
+    size_t xattrcache_size;
+    /** Extended attribute cache - NULL unless caching them */
+    struct xattrcache *xattrcache;
+    /** Bytes/second each class of background work may read and write (0 for no limit) */
+    unsigned long long bg_rate;
+    /** I/Os a second each class of background work may do (0 for no limit) */
+    unsigned long long bg_iops;
+    /** Background work scheduling - NULL before it has been started */
+    struct governor *governor;
+    /** Write statistics to the trash */
+    int stats_collect;
+    /** Statistics writer - NULL unless writing statistics */
+    struct stats *stats;
+    /** Collections and I/O by program - NULL unless writing statistics */
+    struct tally *tally;
+    /** Largest write request to take, in bytes (0 for the largest fuse offers) */
+    unsigned int max_write;
+    /** Largest read ahead to ask for, in bytes (0 for the largest the kernel offers) */
+    unsigned int max_readahead;
+    /** Largest read request, in bytes, given to fuse as -o max_read (0 for no limit) */
+    unsigned int max_read;
+    /** Don't let the kernel have more than one read of a file outstanding */
+    int sync_read;
+    /** Measure rootdir's filesystem to choose request sizes */
+    int calibrate;
+    /** Record every operation to this file - NULL for none */
+    char *capture_path;
+    /** Operation capture - NULL unless capturing */
+    struct capture *capture;
+    /** Unshares files hardlinked into checkpoints before they change - NULL if it could not be set up */
+    struct cow *cow;
+};
+
+#endif
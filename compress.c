@@ -0,0 +1,390 @@
+/**
+ * Background compression of aged trash versions.
+ *
+ * Versions that have been in the trash for a while are rarely wanted
+ * back.  A background thread walks the trash every so often and
+ * gzips each version collected more than --compress=DAYS ago in
+ * place: f.<stamp> becomes f.<stamp>.gz with the same owner,
+ * permissions and times, so the name and time stamps still say which
+ * version it is.  gunzip, or collectfs-restore, gets it back.
+ *
+ * Versions that share their blocks with others (hardlinked by
+ * --dedup or pinned as a --delta base) are left alone - compressing
+ * one copy would only use more space - as are deltas, which are tiny
+ * already.  A version that doesn't shrink by at least a tenth is
+ * marked with the user.collectfs.compress attribute so it isn't
+ * tried again.
+ *
+ * The thread does its I/O in the idle I/O scheduling class, runs at
+ * the lowest CPU priority, answers to the background scheduler (see
+ * governor.c) and also keeps to a CPU budget
+ * (--compress-cpu=PERCENT of one CPU) by sleeping in proportion to
+ * the CPU time each chunk took, so compression never competes with
+ * the foreground.  Each pass logs the bytes compressed, the
+ * compression ratio and the bytes reclaimed.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "collectfs.h"
+#include "compress.h"
+#include "delta.h"
+#include "governor.h"
+#include "log.h"
+
+#define COMPRESS_CHUNK (256 * 1024)
+/** Smaller versions fit in a block whole */
+#define COMPRESS_MIN_SIZE 4096
+/** Seconds between passes over the trash */
+#define COMPRESS_INTERVAL 3600
+#define COMPRESS_TMP ".gz.tmp"
+#define COMPRESS_XATTR "user.collectfs.compress"
+
+struct compress {
+    struct local_context *context;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stopping;
+    unsigned char *buf;
+    /* Totals for this pass and since mounting */
+    unsigned long long pass_files, pass_in, pass_out;
+    unsigned long long total_files, total_in, total_out;
+};
+
+static int stopping(struct compress *compress)
+{
+    int rstatus;
+
+    pthread_mutex_lock(&compress->lock);
+    rstatus = compress->stopping;
+    pthread_mutex_unlock(&compress->lock);
+    return rstatus;
+}
+
+static double thread_cpu(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Having used cpu seconds, sleep long enough to stay within the CPU
+ * budget.
+ */
+static void budget(struct compress *compress, double cpu)
+{
+    int percent = compress->context->compress_cpu;
+
+    if (percent > 0 && percent < 100 && cpu > 0) {
+        double pause = cpu * (100 - percent) / percent;
+        struct timespec ts;
+        ts.tv_sec = (time_t)pause;
+        ts.tv_nsec = (long)((pause - ts.tv_sec) * 1e9);
+        nanosleep(&ts, NULL);
+    }
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+
+    return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+/**
+ * Compress one version, returning the bytes reclaimed.
+ */
+static long long compress_file(struct compress *compress, const char *path)
+{
+    char gzpath[PATH_MAX], tmppath[PATH_MAX];
+    struct stat statbuf, after, gzstat;
+    gzFile gz = NULL;
+    long long reclaimed = 0;
+    int fd, outfd = -1, ok = 0;
+    char mark;
+
+    if (snprintf(gzpath, sizeof(gzpath), "%s%s", path, COMPRESS_SUFFIX) >= sizeof(gzpath)
+        || snprintf(tmppath, sizeof(tmppath), "%s%s", path, COMPRESS_TMP) >= sizeof(tmppath)) {
+        return 0;
+    }
+    fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return 0;
+    }
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_nlink != 1
+        || statbuf.st_size < COMPRESS_MIN_SIZE
+        || statbuf.st_ctime > time(NULL) - compress->context->compress_age
+        || fgetxattr(fd, COMPRESS_XATTR, &mark, sizeof(mark)) >= 0) {
+        close(fd);
+        return 0;
+    }
+    outfd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600);
+    if (outfd < 0 || (gz = gzdopen(dup(outfd), "wb6")) == NULL) {
+        log_errno("Collectfs: cannot compress to %s", tmppath);
+        goto done;
+    }
+    for (;;) {
+        double cpu = thread_cpu();
+        ssize_t len = read(fd, compress->buf, COMPRESS_CHUNK);
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len < 0) {
+            log_errno("Collectfs: cannot read %s to compress", path);
+            goto done;
+        }
+        if (len == 0) {
+            break;
+        }
+        governor_io(compress->context, GOVERNOR_MAINTAIN, len);
+        if (gzwrite(gz, compress->buf, len) != len) {
+            log_errno("Collectfs: cannot compress to %s", tmppath);
+            goto done;
+        }
+        budget(compress, thread_cpu() - cpu);
+        if (stopping(compress)) {
+            goto done;
+        }
+    }
+    if (gzclose(gz) != Z_OK) {
+        gz = NULL;
+        log_errno("Collectfs: cannot compress to %s", tmppath);
+        goto done;
+    }
+    gz = NULL;
+    if (fstat(outfd, &gzstat) != 0) {
+        goto done;
+    }
+    if (gzstat.st_size > statbuf.st_size - statbuf.st_size / 10) {
+        trace_info(LOG_INDENT("compress: %s doesn't compress"), path);
+        mark = 'n';
+        fsetxattr(fd, COMPRESS_XATTR, &mark, sizeof(mark), 0);
+        goto done;
+    }
+    /* Stand in for the version - same metadata */
+    struct timespec times[2] = { statbuf.st_atim, statbuf.st_mtim };
+    if (fchown(outfd, statbuf.st_uid, statbuf.st_gid) != 0) {
+        trace_errno(LOG_INDENT("compress: fchown %s"), tmppath);
+    }
+    if (fchmod(outfd, statbuf.st_mode & 07777) != 0 || futimens(outfd, times) != 0 || fsync(outfd) != 0) {
+        log_errno("Collectfs: cannot compress to %s", tmppath);
+        goto done;
+    }
+    /* Someone may have changed it while we worked */
+    if (fstat(fd, &after) != 0 || after.st_size != statbuf.st_size
+        || after.st_mtim.tv_sec != statbuf.st_mtim.tv_sec || after.st_mtim.tv_nsec != statbuf.st_mtim.tv_nsec
+        || after.st_nlink != 1) {
+        goto done;
+    }
+    if (rename(tmppath, gzpath) != 0) {
+        log_errno("Collectfs: cannot rename %s", tmppath);
+        goto done;
+    }
+    if (unlink(path) != 0) {
+        log_errno("Collectfs: cannot remove %s after compressing it", path);
+        unlink(gzpath);
+        goto done;
+    }
+    ok = 1;
+    reclaimed = (long long)statbuf.st_blocks * 512 - (long long)gzstat.st_blocks * 512;
+    compress->pass_files++;
+    compress->pass_in += statbuf.st_size;
+    compress->pass_out += gzstat.st_size;
+    trace_info(LOG_INDENT("compress: %s %lld -> %lld bytes"), path, (long long)statbuf.st_size,
+               (long long)gzstat.st_size);
+
+  done:
+    if (gz != NULL) {
+        gzclose(gz);
+    }
+    if (outfd >= 0) {
+        close(outfd);
+        if (!ok) {
+            unlink(tmppath);
+        }
+    }
+    close(fd);
+    return reclaimed;
+}
+
+/**
+ * Compress everything old enough below dir.  Folders starting with a
+ * dot at the top of the trash are collectfs' own.
+ */
+static long long compress_dir(struct compress *compress, const char *dir, int top)
+{
+    struct dirent *dirent;
+    char path[PATH_MAX];
+    long long reclaimed = 0;
+    DIR *dp = opendir(dir);
+
+    if (dp == NULL) {
+        trace_errno(LOG_INDENT("compress: opendir %s"), dir);
+        return 0;
+    }
+    while ((dirent = readdir(dp)) != NULL && !stopping(compress)) {
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || (top && name[0] == '.')) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= sizeof(path)) {
+            continue;
+        }
+        if (dirent->d_type == DT_DIR) {
+            reclaimed += compress_dir(compress, path, 0);
+        } else if (has_suffix(name, COMPRESS_TMP)) {
+            /* Left by a pass that was interrupted */
+            unlink(path);
+        } else if (!has_suffix(name, COMPRESS_SUFFIX) && !has_suffix(name, DELTA_SUFFIX)) {
+            reclaimed += compress_file(compress, path);
+        }
+    }
+    closedir(dp);
+    return reclaimed;
+}
+
+static void *compress_worker(void *arg)
+{
+    struct compress *compress = (struct compress *)arg;
+    unsigned long long reclaimed;
+    struct timespec next;
+
+    /* Only use the disk when nobody else wants it, and the CPU likewise */
+    governor_enter(compress->context, GOVERNOR_MAINTAIN);
+
+    for (;;) {
+        compress->pass_files = compress->pass_in = compress->pass_out = 0;
+        reclaimed = compress_dir(compress, compress->context->trashdir, 1);
+        compress->total_files += compress->pass_files;
+        compress->total_in += compress->pass_in;
+        compress->total_out += compress->pass_out;
+        if (compress->pass_files > 0) {
+            log_info("Collectfs: compressed %llu versions, %llu -> %llu bytes (ratio %.2f), reclaimed %llu bytes",
+                     compress->pass_files, compress->pass_in, compress->pass_out,
+                     (double)compress->pass_in / (compress->pass_out ? compress->pass_out : 1), reclaimed);
+        }
+
+        pthread_mutex_lock(&compress->lock);
+        clock_gettime(CLOCK_REALTIME, &next);
+        next.tv_sec += COMPRESS_INTERVAL;
+        while (!compress->stopping && pthread_cond_timedwait(&compress->wake, &compress->lock, &next) != ETIMEDOUT) {
+        }
+        if (compress->stopping) {
+            pthread_mutex_unlock(&compress->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&compress->lock);
+    }
+}
+
+int compress_start(struct local_context *context)
+{
+    struct compress *compress = calloc(1, sizeof(struct compress));
+
+    if (compress == NULL || (compress->buf = malloc(COMPRESS_CHUNK)) == NULL) {
+        free(compress);
+        return log_errno("compress_start");
+    }
+    compress->context = context;
+    pthread_mutex_init(&compress->lock, NULL);
+    pthread_cond_init(&compress->wake, NULL);
+    if (pthread_create(&compress->thread, NULL, compress_worker, compress) != 0) {
+        log_errno("Collectfs: cannot start compression thread");
+        pthread_cond_destroy(&compress->wake);
+        pthread_mutex_destroy(&compress->lock);
+        free(compress->buf);
+        free(compress);
+        return -1;
+    }
+    context->compress = compress;
+    log_info("Collectfs: compressing versions older than %ld days using %d%% CPU",
+             (long)(context->compress_age / (24 * 3600)), context->compress_cpu);
+    return 0;
+}
+
+void compress_stop(struct local_context *context)
+{
+    struct compress *compress = context->compress;
+
+    if (compress == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&compress->lock);
+    compress->stopping = 1;
+    pthread_cond_signal(&compress->wake);
+    pthread_mutex_unlock(&compress->lock);
+    pthread_join(compress->thread, NULL);
+    context->compress = NULL;
+
+    log_info("Collectfs: compression reclaimed space from %llu versions, %llu -> %llu bytes (ratio %.2f)",
+             compress->total_files, compress->total_in, compress->total_out,
+             (double)compress->total_in / (compress->total_out ? compress->total_out : 1));
+    pthread_cond_destroy(&compress->wake);
+    pthread_mutex_destroy(&compress->lock);
+    free(compress->buf);
+    free(compress);
+}
+
+/**
+ * Decompress the version at gzpath to outfd.
+ */
+int compress_restore(const char *gzpath, int outfd)
+{
+    char buf[64 * 1024];
+    gzFile gz;
+    int len, rstatus = 0;
+
+    gz = gzopen(gzpath, "rb");
+    if (gz == NULL) {
+        if (errno == 0) {
+            errno = ENOMEM;
+        }
+        return -1;
+    }
+    while ((len = gzread(gz, buf, sizeof(buf))) > 0) {
+        char *p = buf;
+        while (len > 0) {
+            ssize_t n = write(outfd, p, len);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0) {
+                gzclose(gz);
+                return -1;
+            }
+            p += n;
+            len -= n;
+        }
+    }
+    if (len < 0) {
+        errno = EINVAL;
+        rstatus = -1;
+    }
+    if (gzclose(gz) != Z_OK && rstatus == 0) {
+        errno = EINVAL;
+        rstatus = -1;
+    }
+    return rstatus;
+}
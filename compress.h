@@ -0,0 +1,20 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#include "collectfs.h"
+
+/**
+ * Compressed versions have this appended to their trash name.
+ */
+#define COMPRESS_SUFFIX ".gz"
+
+int compress_start(struct local_context *context);
+void compress_stop(struct local_context *context);
+
+int compress_restore(const char *gzpath, int outfd);
+
+#endif
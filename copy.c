@@ -0,0 +1,259 @@
+/**
+ * Copying files between filesystems - used when the trash lives on
+ * a different filesystem to the hierarchy being collected, so a
+ * rename can't be used.
+ *
+ * Only the data extents are copied (holes are found with SEEK_DATA
+ * and SEEK_HOLE) so sparse files stay sparse.  Each extent is
+ * streamed in the kernel with copy_file_range(), falling back to
+ * sendfile() and then to plain read/write where those aren't
+ * supported for the pair of filesystems involved.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+
+#include "copy.h"
+#include "log.h"
+
+#define COPY_CHUNK (1024 * 1024)
+
+enum copy_method {
+    COPY_RANGE,
+    COPY_SENDFILE,
+    COPY_READ_WRITE
+};
+
+static ssize_t copy_read_write(int infd, int outfd, off_t offset, size_t len)
+{
+    static __thread char *buf = NULL;
+
+    if (buf == NULL && (buf = malloc(COPY_CHUNK)) == NULL) {
+        return -1;
+    }
+    if (len > COPY_CHUNK) {
+        len = COPY_CHUNK;
+    }
+    ssize_t got = pread(infd, buf, len, offset);
+    if (got <= 0) {
+        return got;
+    }
+    ssize_t done = 0;
+    while (done < got) {
+        ssize_t put = pwrite(outfd, buf + done, got - done, offset + done);
+        if (put < 0) {
+            return -1;
+        }
+        done += put;
+    }
+    return got;
+}
+
+/**
+ * Copy len bytes at offset in infd to the same offset in outfd.
+ */
+static int copy_extent(int infd, int outfd, off_t offset, off_t len, enum copy_method *method)
+{
+    while (len > 0) {
+        size_t chunk = len > COPY_CHUNK ? COPY_CHUNK : len;
+        ssize_t done = -1;
+        off_t in_off = offset, out_off = offset;
+
+        switch (*method) {
+        case COPY_RANGE:
+            done = copy_file_range(infd, &in_off, outfd, &out_off, chunk, 0);
+            if (done < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                *method = COPY_SENDFILE;
+                continue;
+            }
+            break;
+        case COPY_SENDFILE:
+            /* sendfile writes at the current output offset */
+            if (lseek(outfd, offset, SEEK_SET) < 0) {
+                return -1;
+            }
+            done = sendfile(outfd, infd, &in_off, chunk);
+            if (done < 0 && (errno == ENOSYS || errno == EINVAL)) {
+                *method = COPY_READ_WRITE;
+                continue;
+            }
+            break;
+        case COPY_READ_WRITE:
+            done = copy_read_write(infd, outfd, offset, chunk);
+            break;
+        }
+        if (done < 0) {
+            return -1;
+        }
+        if (done == 0) {
+            break;              /* the file shrank under us */
+        }
+        offset += done;
+        len -= done;
+    }
+    return 0;
+}
+
+/**
+ * Copy the data of infd to outfd preserving holes.
+ * Sets errno on error.
+ */
+int copy_file_data(int infd, int outfd)
+{
+    struct stat sb;
+    enum copy_method method = COPY_RANGE;
+    off_t data, hole = 0;
+
+    if (fstat(infd, &sb) != 0) {
+        return -1;
+    }
+    while (hole < sb.st_size) {
+        data = lseek(infd, hole, SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO) {
+                break;          /* only a hole left */
+            }
+            if (errno != EINVAL) {
+                return -1;
+            }
+            /* No SEEK_DATA on this filesystem - copy the lot */
+            data = hole;
+            hole = sb.st_size;
+        } else {
+            hole = lseek(infd, data, SEEK_HOLE);
+            if (hole < 0) {
+                return -1;
+            }
+        }
+        if (copy_extent(infd, outfd, data, hole - data, &method) != 0) {
+            return -1;
+        }
+    }
+    /* Extend over any trailing hole */
+    return ftruncate(outfd, sb.st_size);
+}
+
+/**
+ * Copy the extended attributes of infd - ACLs and security labels
+ * among them - to outfd.  One the destination won't take (no xattrs
+ * on its filesystem, or trusted.* when we aren't root) is skipped.
+ * Sets errno on error.
+ */
+int copy_xattrs(int infd, int outfd)
+{
+    char *names, *name, *value = NULL;
+    ssize_t len, vlen;
+    int err;
+
+    len = flistxattr(infd, NULL, 0);
+    if (len <= 0) {
+        return len == 0 || errno == ENOTSUP ? 0 : -1;
+    }
+    names = malloc(len);
+    if (names == NULL || (len = flistxattr(infd, names, len)) < 0) {
+        goto fail;
+    }
+    for (name = names; name < names + len; name += strlen(name) + 1) {
+        char *grown;
+
+        vlen = fgetxattr(infd, name, NULL, 0);
+        if (vlen < 0 && errno == ENODATA) {
+            continue;           /* removed since we listed it */
+        }
+        if (vlen < 0 || (grown = realloc(value, vlen + 1)) == NULL) {
+            goto fail;
+        }
+        value = grown;
+        if ((vlen = fgetxattr(infd, name, value, vlen)) < 0) {
+            goto fail;
+        }
+        if (fsetxattr(outfd, name, value, vlen, 0) != 0) {
+            if (errno != ENOTSUP && errno != EPERM) {
+                goto fail;
+            }
+            trace_errno(LOG_INDENT("copy: cannot keep attribute %s"), name);
+        }
+    }
+    free(value);
+    free(names);
+    return 0;
+
+  fail:
+    err = errno;
+    free(value);
+    free(names);
+    errno = err;
+    return -1;
+}
+
+/**
+ * Copy the file from to a new file to, keeping its data, mode,
+ * times, extended attributes and (where allowed) ownership.  The copy is synced to disk
+ * before returning.  On failure the partial copy is removed.
+ * Sets errno on error.
+ */
+int copy_file(const char *from, const char *to)
+{
+    struct stat sb;
+    int infd, outfd;
+    int err;
+
+    infd = open(from, O_RDONLY);
+    if (infd < 0) {
+        return log_errno("copy: cannot open %s", from);
+    }
+    if (fstat(infd, &sb) != 0) {
+        err = log_errno("copy: cannot stat %s", from);
+        close(infd);
+        return err;
+    }
+    outfd = open(to, O_WRONLY | O_CREAT | O_EXCL, sb.st_mode & 07777);
+    if (outfd < 0) {
+        err = log_errno("copy: cannot create %s", to);
+        close(infd);
+        return err;
+    }
+    if (copy_file_data(infd, outfd) != 0) {
+        goto fail;
+    }
+    if (fchown(outfd, sb.st_uid, sb.st_gid) != 0) {
+        trace_errno(LOG_INDENT("copy: cannot keep ownership of %s"), to);
+    }
+    /* After the chown, which would clear a security.capability */
+    if (copy_xattrs(infd, outfd) != 0) {
+        goto fail;
+    }
+    struct timespec times[2] = { sb.st_atim, sb.st_mtim };
+    if (futimens(outfd, times) != 0 || fsync(outfd) != 0) {
+        goto fail;
+    }
+    close(infd);
+    if (close(outfd) != 0) {
+        outfd = -1;
+        goto fail;
+    }
+    return 0;
+
+  fail:
+    err = log_errno("copy: failed copying %s to %s", from, to);
+    close(infd);
+    if (outfd >= 0) {
+        close(outfd);
+    }
+    unlink(to);
+    errno = err;
+    return -1;
+}
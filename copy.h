@@ -0,0 +1,12 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _COPY_H_
+#define _COPY_H_
+
+int copy_file_data(int infd, int outfd);
+int copy_xattrs(int infd, int outfd);
+int copy_file(const char *from, const char *to);
+
+#endif
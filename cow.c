@@ -0,0 +1,360 @@
+/**
+ * Copy on write for checkpoint files shared by hardlink.
+ *
+ * collectfs-checkpoint clones every file in the rootdir into a
+ * checkpoint in the trash.  Where the filesystem cannot reflink, the
+ * checkpoint hardlinks the file instead, and the checkpoint and the
+ * rootdir then share one inode - writing the file in place would
+ * change the checkpoint too.  Before each hardlink is made its device
+ * and inode are appended to the checkpoint's .links file, and before
+ * anything changes a file with more than one link we look it up in
+ * the set of them all.  A shared file is copied - data, mode, times,
+ * owner and extended attributes, ACLs among them - and the copy renamed
+ * over it, so the checkpoint keeps the old inode and the write goes
+ * to a new one.  Any other hardlinks to the file, of the user's own,
+ * stay with the old inode too: the name written through no longer
+ * shares its contents with them.
+ *
+ * The set is read lazily - only when a shared file is opened for
+ * writing and isn't already known.  New .links files (a new
+ * checkpoint, or one removed) change the folder's modification time
+ * and the set is read again from scratch, otherwise we just read
+ * whatever has been appended since last time.
+ *
+ * A handle opened for writing before the checkpoint was taken, or
+ * still on the old inode after another handle has unshared the file,
+ * would write to the checkpoint's inode.  So each write or truncate
+ * through a handle asks cow_shared first, and collectfs switches the
+ * handle to the file's own copy.  That is on every write, so it only
+ * brings the set up to date once a second, and while there are no
+ * checkpoints it doesn't even fstat the handle.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "copy.h"
+#include "cow.h"
+#include "log.h"
+
+#define COW_READ_CHUNK (64 * 1024)
+
+struct cow_inode {
+    dev_t dev;
+    /** Zero for an empty slot */
+    ino_t ino;
+};
+
+struct cow_links {
+    char *name;
+    /** How much of the file has been read */
+    off_t done;
+};
+
+struct cow {
+    pthread_mutex_t lock;
+    char folder[PATH_MAX];
+    /** Modification time of the folder when last read */
+    struct timespec mtime;
+    /** When cow_shared last brought the set up to date - read without the lock */
+    time_t checked;
+    /** Open addressed set of shared inodes */
+    struct cow_inode *inodes;
+    size_t nslots;
+    /** Changed under lock, but read without it to skip the lock while there are no checkpoints */
+    size_t count;
+    struct cow_links *links;
+    /** Changed under lock, but read without it - no .links files, no checkpoints */
+    size_t nlinks;
+};
+
+static size_t slot_of(struct cow *cow, dev_t dev, ino_t ino)
+{
+    unsigned long long h = ((unsigned long long)ino * 0x9e3779b97f4a7c15ULL) ^ (unsigned long long)dev;
+
+    return (h ^ (h >> 29)) & (cow->nslots - 1);
+}
+
+static int is_shared(struct cow *cow, dev_t dev, ino_t ino)
+{
+    size_t i;
+
+    if (cow->count == 0) {
+        return 0;
+    }
+    for (i = slot_of(cow, dev, ino); cow->inodes[i].ino != 0; i = (i + 1) & (cow->nslots - 1)) {
+        if (cow->inodes[i].ino == ino && cow->inodes[i].dev == dev) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int add_shared(struct cow *cow, dev_t dev, ino_t ino)
+{
+    size_t i;
+
+    if (ino == 0 || is_shared(cow, dev, ino)) {
+        return 0;
+    }
+    if ((cow->count + 1) * 2 > cow->nslots) {
+        struct cow_inode *old = cow->inodes;
+        size_t oldslots = cow->nslots;
+        size_t newslots = oldslots > 0 ? oldslots * 2 : 1024;
+        struct cow_inode *inodes = calloc(newslots, sizeof(struct cow_inode));
+
+        if (inodes == NULL) {
+            return -1;
+        }
+        cow->inodes = inodes;
+        cow->nslots = newslots;
+        for (i = 0; i < oldslots; i++) {
+            if (old[i].ino != 0) {
+                size_t j = slot_of(cow, old[i].dev, old[i].ino);
+
+                while (inodes[j].ino != 0) {
+                    j = (j + 1) & (newslots - 1);
+                }
+                inodes[j] = old[i];
+            }
+        }
+        free(old);
+    }
+    for (i = slot_of(cow, dev, ino); cow->inodes[i].ino != 0; i = (i + 1) & (cow->nslots - 1)) {
+    }
+    cow->inodes[i].dev = dev;
+    cow->inodes[i].ino = ino;
+    __atomic_add_fetch(&cow->count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void forget_all(struct cow *cow)
+{
+    size_t i;
+
+    for (i = 0; i < cow->nlinks; i++) {
+        free(cow->links[i].name);
+    }
+    free(cow->links);
+    cow->links = NULL;
+    __atomic_store_n(&cow->nlinks, 0, __ATOMIC_RELAXED);
+    free(cow->inodes);
+    cow->inodes = NULL;
+    cow->nslots = 0;
+    __atomic_store_n(&cow->count, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Read whatever has been appended to one .links file since we last
+ * looked.  Only whole lines are taken - a checkpoint still being
+ * written may have half of one.
+ */
+static void read_links(struct cow *cow, int dirfd, struct cow_links *links)
+{
+    char buf[COW_READ_CHUNK + 1];
+    int fd = openat(dirfd, links->name, O_RDONLY);
+    ssize_t n;
+
+    if (fd < 0) {
+        return;
+    }
+    while ((n = pread(fd, buf, COW_READ_CHUNK, links->done)) > 0) {
+        char *line = buf, *end;
+
+        buf[n] = '\0';
+        while ((end = strchr(line, '\n')) != NULL) {
+            unsigned long long dev, ino;
+
+            if (sscanf(line, "%llu %llu", &dev, &ino) == 2 && add_shared(cow, (dev_t)dev, (ino_t)ino) != 0) {
+                log_errno("cow: cannot remember shared inodes");
+                close(fd);
+                return;
+            }
+            line = end + 1;
+        }
+        if (line == buf) {
+            break;              /* a partial line - wait for the rest */
+        }
+        links->done += line - buf;
+    }
+    close(fd);
+}
+
+/**
+ * Bring the set up to date with the .links files.  Called with the
+ * lock held.
+ */
+static void refresh(struct cow *cow)
+{
+    struct stat sb;
+    struct dirent *entry;
+    DIR *dir;
+    size_t i;
+
+    if (stat(cow->folder, &sb) != 0) {
+        forget_all(cow);
+        return;
+    }
+    if (sb.st_mtim.tv_sec != cow->mtime.tv_sec || sb.st_mtim.tv_nsec != cow->mtime.tv_nsec) {
+        /* A checkpoint has come or gone */
+        forget_all(cow);
+        cow->mtime = sb.st_mtim;
+        dir = opendir(cow->folder);
+        if (dir == NULL) {
+            return;
+        }
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            struct cow_links *grown;
+
+            if (len <= strlen(COW_LINKS_SUFFIX) ||
+                strcmp(entry->d_name + len - strlen(COW_LINKS_SUFFIX), COW_LINKS_SUFFIX) != 0) {
+                continue;
+            }
+            grown = realloc(cow->links, (cow->nlinks + 1) * sizeof(struct cow_links));
+            if (grown == NULL) {
+                break;
+            }
+            cow->links = grown;
+            cow->links[cow->nlinks].name = strdup(entry->d_name);
+            cow->links[cow->nlinks].done = 0;
+            if (cow->links[cow->nlinks].name != NULL) {
+                __atomic_store_n(&cow->nlinks, cow->nlinks + 1, __ATOMIC_RELAXED);
+            }
+        }
+        closedir(dir);
+    }
+    if (cow->nlinks > 0) {
+        int dirfd = open(cow->folder, O_RDONLY | O_DIRECTORY);
+
+        if (dirfd >= 0) {
+            for (i = 0; i < cow->nlinks; i++) {
+                read_links(cow, dirfd, &cow->links[i]);
+            }
+            close(dirfd);
+        }
+    }
+}
+
+struct cow *cow_new(const char *trashdir)
+{
+    struct cow *cow = calloc(1, sizeof(struct cow));
+
+    if (cow == NULL) {
+        return NULL;
+    }
+    if (snprintf(cow->folder, sizeof(cow->folder), "%s/%s", trashdir, COW_FOLDER) >= sizeof(cow->folder)) {
+        free(cow);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    pthread_mutex_init(&cow->lock, NULL);
+    return cow;
+}
+
+void cow_free(struct cow *cow)
+{
+    if (cow == NULL) {
+        return;
+    }
+    forget_all(cow);
+    pthread_mutex_destroy(&cow->lock);
+    free(cow);
+}
+
+/**
+ * Make sure fpath doesn't share its inode with a checkpoint before it
+ * is changed.  Returns 0 if it doesn't (or no longer does), otherwise
+ * errno.
+ */
+int cow_unshare(struct cow *cow, const char *fpath)
+{
+    char tmppath[PATH_MAX];
+    struct stat sb;
+    int err = 0;
+
+    if (cow == NULL || lstat(fpath, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_nlink < 2) {
+        /* The common case - nothing to do */
+        return 0;
+    }
+    pthread_mutex_lock(&cow->lock);
+    /* Look again - another thread may have got here first */
+    if (lstat(fpath, &sb) != 0 || sb.st_nlink < 2) {
+        goto done;
+    }
+    if (!is_shared(cow, sb.st_dev, sb.st_ino)) {
+        refresh(cow);
+        if (!is_shared(cow, sb.st_dev, sb.st_ino)) {
+            goto done;          /* an ordinary hardlink */
+        }
+    }
+    if (snprintf(tmppath, sizeof(tmppath), "%s.collectfs-cow", fpath) >= sizeof(tmppath)) {
+        err = ENAMETOOLONG;
+        goto done;
+    }
+    trace_info(LOG_INDENT("cow: unsharing %s from a checkpoint"), fpath);
+    unlink(tmppath);            /* left by a crash */
+    if (copy_file(fpath, tmppath) != 0) {
+        err = errno;
+        goto done;
+    }
+    if (rename(tmppath, fpath) != 0) {
+        err = log_errno("cow: cannot replace %s", fpath);
+        unlink(tmppath);
+    }
+  done:
+    pthread_mutex_unlock(&cow->lock);
+    return err;
+}
+
+/**
+ * Is the file open on fd an inode a checkpoint shares?  An inode left
+ * with only the checkpoint's link, once another handle has unshared
+ * the file, still counts.  The set may be up to a second out of date.
+ */
+int cow_shared(struct cow *cow, int fd)
+{
+    struct stat sb;
+    time_t now = time(NULL);
+    int shared;
+
+    if (cow == NULL) {
+        return 0;
+    }
+    if (now != __atomic_load_n(&cow->checked, __ATOMIC_RELAXED)) {
+        /* A checkpoint may have come or gone - look at most once a second */
+        pthread_mutex_lock(&cow->lock);
+        if (now != cow->checked) {
+            __atomic_store_n(&cow->checked, now, __ATOMIC_RELAXED);
+            refresh(cow);
+        }
+        pthread_mutex_unlock(&cow->lock);
+    }
+    if (__atomic_load_n(&cow->nlinks, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)
+        || (sb.st_nlink < 2 && __atomic_load_n(&cow->count, __ATOMIC_RELAXED) == 0)) {
+        return 0;
+    }
+    pthread_mutex_lock(&cow->lock);
+    shared = is_shared(cow, sb.st_dev, sb.st_ino);
+    pthread_mutex_unlock(&cow->lock);
+    return shared;
+}
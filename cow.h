@@ -0,0 +1,23 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _COW_H_
+#define _COW_H_
+
+/**
+ * Checkpoints live in this folder at the top of the trash, each with
+ * a list of the files it shares with the rootdir beside it.
+ */
+#define COW_FOLDER ".checkpoints"
+#define COW_LINKS_SUFFIX ".links"
+
+struct cow;
+
+struct cow *cow_new(const char *trashdir);
+void cow_free(struct cow *cow);
+
+int cow_unshare(struct cow *cow, const char *fpath);
+int cow_shared(struct cow *cow, int fd);
+
+#endif
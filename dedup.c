@@ -0,0 +1,537 @@
+/**
+ * Content deduplication of trash versions.
+ *
+ * Regenerated files and repeated checkouts put many byte-identical
+ * versions in the trash.  Each newly collected version is queued for
+ * a background thread that hashes it (XXH64, see hash.c) and looks
+ * the hash up in a table of the content already in the trash.  A
+ * version whose content is already there is made to share the
+ * existing copy's blocks:
+ *
+ *  - by FIDEDUPERANGE where the filesystem can reflink (btrfs, xfs)
+ *    - the kernel checks the bytes really are the same and each
+ *    version keeps its own inode, so its own times, mode and owner;
+ *  - otherwise by a hardlink, but only when the two versions' mode,
+ *    owner and modification time are identical, so nothing a user
+ *    can see about either version changes.  The bytes are compared
+ *    first.
+ *
+ * The table is kept in trashdir/.dedup, one line per distinct
+ * content:
+ *
+ *     <hash> <size> <path relative to trashdir>\n
+ *
+ * and entries are checked when used, so versions since deleted from
+ * the trash just drop out.  Files are read a chunk at a time at a
+ * limited rate (--dedup=MB/s) so hashing a large version doesn't
+ * starve the foreground of disk bandwidth.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "dedup.h"
+#include "governor.h"
+#include "hash.h"
+#include "log.h"
+#include "trash.h"
+
+#define DEDUP_INDEX "/.dedup"
+/** Versions smaller than a block can't share anything */
+#define DEDUP_MIN_SIZE 4096
+/** Versions waiting beyond this are not deduplicated */
+#define DEDUP_MAX_QUEUE 65536
+#define DEDUP_CHUNK (1024 * 1024)
+/** Largest range one FIDEDUPERANGE call is sure to accept */
+#define DEDUP_RANGE_MAX (16 * 1024 * 1024)
+
+struct dedup_pending {
+    struct dedup_pending *next;
+    char path[];
+};
+
+/**
+ * Content already in the trash.  path is relative to trashdir.
+ */
+struct dedup_object {
+    struct dedup_object *next;
+    uint64_t hash;
+    off_t size;
+    char path[];
+};
+
+struct dedup {
+    struct local_context *context;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct dedup_pending *head;
+    struct dedup_pending *tail;
+    int queued;
+    int stopping;
+    /* Everything below belongs to the worker */
+    struct dedup_object **objects;
+    size_t nbuckets;
+    size_t nobjects;
+    FILE *index;
+    unsigned char *buf1;
+    unsigned char *buf2;
+    unsigned long long shared;
+};
+
+/**
+ * Sleep long enough that reading len bytes, which took started..now,
+ * happens no faster than the configured rate, then as long as the
+ * background governor wants.
+ */
+static void throttle(struct dedup *dedup, size_t len, const struct timespec *started)
+{
+    struct timespec now;
+    double elapsed, wanted;
+
+    governor_io(dedup->context, GOVERNOR_MAINTAIN, len);
+    if (dedup->context->dedup_rate == 0) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+    wanted = (double)len / dedup->context->dedup_rate;
+    if (wanted > elapsed) {
+        struct timespec pause;
+        pause.tv_sec = (time_t)(wanted - elapsed);
+        pause.tv_nsec = (long)((wanted - elapsed - pause.tv_sec) * 1e9);
+        nanosleep(&pause, NULL);
+    }
+}
+
+static int hash_file(struct dedup *dedup, int fd, uint64_t *hash)
+{
+    struct hash_state state;
+    struct timespec started;
+    ssize_t len;
+
+    hash_init(&state);
+    for (;;) {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        len = read(fd, dedup->buf1, DEDUP_CHUNK);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (len == 0) {
+            break;
+        }
+        hash_update(&state, dedup->buf1, len);
+        throttle(dedup, len, &started);
+    }
+    *hash = hash_digest(&state);
+    return 0;
+}
+
+/**
+ * Returns 1 if the two files have the same content, 0 if not, -1 on
+ * error.
+ */
+static int same_content(struct dedup *dedup, int fd1, int fd2)
+{
+    struct timespec started;
+    off_t offset = 0;
+    ssize_t len1, len2;
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        len1 = pread(fd1, dedup->buf1, DEDUP_CHUNK, offset);
+        len2 = pread(fd2, dedup->buf2, DEDUP_CHUNK, offset);
+        if (len1 < 0 || len2 < 0) {
+            return -1;
+        }
+        if (len1 != len2 || memcmp(dedup->buf1, dedup->buf2, len1) != 0) {
+            return 0;
+        }
+        offset += len1;
+        throttle(dedup, len1 + len2, &started);
+    } while (len1 > 0);
+    return 1;
+}
+
+/**
+ * Share the extents of src with dst.  Returns 0 if all of dst now
+ * shares src's blocks, 1 if the content differs, -1 if the filesystem
+ * can't do it.
+ */
+static int share_extents(int srcfd, int dstfd, off_t size)
+{
+    struct file_dedupe_range *range = alloca(sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+    off_t offset = 0;
+
+    while (offset < size) {
+        memset(range, 0, sizeof(struct file_dedupe_range) + sizeof(struct file_dedupe_range_info));
+        range->src_offset = offset;
+        range->src_length = size - offset > DEDUP_RANGE_MAX ? DEDUP_RANGE_MAX : size - offset;
+        range->dest_count = 1;
+        range->info[0].dest_fd = dstfd;
+        range->info[0].dest_offset = offset;
+        if (ioctl(srcfd, FIDEDUPERANGE, range) != 0) {
+            return -1;
+        }
+        if (range->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) {
+            return 1;
+        }
+        if (range->info[0].status < 0) {
+            errno = -range->info[0].status;
+            return -1;
+        }
+        if (range->info[0].bytes_deduped == 0) {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        offset += range->info[0].bytes_deduped;
+    }
+    return 0;
+}
+
+/**
+ * Replace the version at fpath with a hardlink to the identical one
+ * at fobject.  The link is made beside the version and renamed over
+ * it, so the version is never missing.
+ */
+static int share_inode(const char *fobject, const char *fpath)
+{
+    char tmppath[PATH_MAX];
+
+    if (snprintf(tmppath, sizeof(tmppath), "%s.dedup", fpath) >= sizeof(tmppath)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (link(fobject, tmppath) != 0) {
+        return -1;
+    }
+    if (rename(tmppath, fpath) != 0) {
+        int err = errno;
+        unlink(tmppath);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int same_metadata(const struct stat *a, const struct stat *b)
+{
+    return a->st_mode == b->st_mode && a->st_uid == b->st_uid && a->st_gid == b->st_gid
+        && a->st_mtim.tv_sec == b->st_mtim.tv_sec && a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static int add_object(struct dedup *dedup, uint64_t hash, off_t size, const char *path)
+{
+    struct dedup_object *object;
+    size_t i;
+
+    if (dedup->nobjects >= dedup->nbuckets) {
+        size_t nbuckets = dedup->nbuckets ? dedup->nbuckets * 2 : 1024;
+        struct dedup_object **objects = calloc(nbuckets, sizeof(struct dedup_object *));
+        if (objects == NULL) {
+            return -1;
+        }
+        for (i = 0; i < dedup->nbuckets; i++) {
+            while ((object = dedup->objects[i]) != NULL) {
+                dedup->objects[i] = object->next;
+                object->next = objects[object->hash & (nbuckets - 1)];
+                objects[object->hash & (nbuckets - 1)] = object;
+            }
+        }
+        free(dedup->objects);
+        dedup->objects = objects;
+        dedup->nbuckets = nbuckets;
+    }
+    object = malloc(sizeof(struct dedup_object) + strlen(path) + 1);
+    if (object == NULL) {
+        return -1;
+    }
+    object->hash = hash;
+    object->size = size;
+    strcpy(object->path, path);
+    object->next = dedup->objects[hash & (dedup->nbuckets - 1)];
+    dedup->objects[hash & (dedup->nbuckets - 1)] = object;
+    dedup->nobjects++;
+    return 0;
+}
+
+/**
+ * Find the version already in the trash with the content of the one
+ * at fpath (open on fd) and share it.  Returns 1 if shared, 0 if this
+ * is new content.
+ */
+static int share_object(struct dedup *dedup, const char *fpath, int fd, const struct stat *statbuf, uint64_t hash)
+{
+    struct dedup_object **link;
+    struct dedup_object *object;
+    char fobject[PATH_MAX];
+    struct stat objstat;
+
+    if (dedup->nbuckets == 0) {
+        return 0;
+    }
+    link = &dedup->objects[hash & (dedup->nbuckets - 1)];
+    while ((object = *link) != NULL) {
+        if (object->hash != hash || object->size != statbuf->st_size) {
+            link = &object->next;
+            continue;
+        }
+        snprintf(fobject, sizeof(fobject), "%s/%s", dedup->context->trashdir, object->path);
+        int objfd = open(fobject, O_RDONLY | O_NOFOLLOW);
+        if (objfd < 0 || fstat(objfd, &objstat) != 0 || objstat.st_size != object->size) {
+            /* Gone from the trash (or changed) - forget it */
+            trace_info(LOG_INDENT("dedup: forgetting %s"), object->path);
+            if (objfd >= 0) {
+                close(objfd);
+            }
+            *link = object->next;
+            free(object);
+            dedup->nobjects--;
+            continue;
+        }
+        if (objstat.st_ino == statbuf->st_ino && objstat.st_dev == statbuf->st_dev) {
+            close(objfd);
+            return 1;
+        }
+        int rstatus = share_extents(objfd, fd, statbuf->st_size);
+        if (rstatus < 0 && same_metadata(&objstat, statbuf) && same_content(dedup, objfd, fd) == 1) {
+            rstatus = share_inode(fobject, fpath);
+        }
+        close(objfd);
+        if (rstatus == 0) {
+            trace_info(LOG_INDENT("dedup: %s shares %s"), fpath, object->path);
+            dedup->shared += statbuf->st_size;
+            return 1;
+        }
+        link = &object->next;
+    }
+    return 0;
+}
+
+static void dedup_file(struct dedup *dedup, const char *fpath)
+{
+    size_t trashlen = strlen(dedup->context->trashdir);
+    struct stat statbuf;
+    uint64_t hash;
+    int fd;
+
+    if (strncmp(fpath, dedup->context->trashdir, trashlen) != 0 || fpath[trashlen] != '/'
+        || strchr(fpath, '\n') != NULL) {
+        return;
+    }
+    /* O_RDWR as FIDEDUPERANGE needs the destination open for writing */
+    fd = open(fpath, O_RDWR | O_NOFOLLOW);
+    if (fd < 0 || fstat(fd, &statbuf) != 0) {
+        trace_errno(LOG_INDENT("dedup: open %s"), fpath);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    if (S_ISREG(statbuf.st_mode) && statbuf.st_size >= DEDUP_MIN_SIZE && hash_file(dedup, fd, &hash) == 0) {
+        if (!share_object(dedup, fpath, fd, &statbuf, hash)) {
+            const char *path = fpath + trashlen + 1;
+            if (add_object(dedup, hash, statbuf.st_size, path) == 0 && dedup->index != NULL) {
+                fprintf(dedup->index, "%016llx %lld %s\n", (unsigned long long)hash, (long long)statbuf.st_size,
+                        path);
+                fflush(dedup->index);
+            }
+        }
+    }
+    close(fd);
+}
+
+static void load_index(struct dedup *dedup, const char *indexpath)
+{
+    FILE *fp = fopen(indexpath, "r");
+    char line[PATH_MAX + 64];
+    unsigned long long hash;
+    long long size;
+    int offset;
+
+    if (fp == NULL) {
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        if (len == 0 || line[len - 1] != '\n') {
+            /* Torn by a crash - or absurdly long */
+            continue;
+        }
+        line[len - 1] = '\0';
+        if (sscanf(line, "%llx %lld %n", &hash, &size, &offset) == 2 && line[offset] != '\0') {
+            add_object(dedup, hash, size, line + offset);
+        }
+    }
+    fclose(fp);
+}
+
+static void *dedup_worker(void *arg)
+{
+    struct dedup *dedup = (struct dedup *)arg;
+    struct dedup_pending *pending;
+
+    governor_enter(dedup->context, GOVERNOR_MAINTAIN);
+    pthread_mutex_lock(&dedup->lock);
+    for (;;) {
+        while (dedup->head == NULL && !dedup->stopping) {
+            pthread_cond_wait(&dedup->work, &dedup->lock);
+        }
+        if (dedup->stopping) {
+            break;
+        }
+        pending = dedup->head;
+        dedup->head = pending->next;
+        if (dedup->head == NULL) {
+            dedup->tail = NULL;
+        }
+        dedup->queued--;
+        governor_queued(dedup->context, GOVERNOR_MAINTAIN, -1);
+        pthread_mutex_unlock(&dedup->lock);
+
+        dedup_file(dedup, pending->path);
+        free(pending);
+
+        pthread_mutex_lock(&dedup->lock);
+    }
+    pthread_mutex_unlock(&dedup->lock);
+    return NULL;
+}
+
+int dedup_start(struct local_context *context)
+{
+    char indexpath[PATH_MAX];
+    struct dedup *dedup = calloc(1, sizeof(struct dedup));
+
+    if (dedup == NULL) {
+        return log_errno("dedup_start");
+    }
+    dedup->context = context;
+    dedup->buf1 = malloc(DEDUP_CHUNK);
+    dedup->buf2 = malloc(DEDUP_CHUNK);
+    if (dedup->buf1 == NULL || dedup->buf2 == NULL) {
+        free(dedup->buf1);
+        free(dedup->buf2);
+        free(dedup);
+        return log_errno("dedup_start");
+    }
+
+    snprintf(indexpath, sizeof(indexpath), "%s%s", context->trashdir, DEDUP_INDEX);
+    if (mkdir_trash_path(indexpath) != 0) {
+        log_errno("Collectfs: cannot create %s", context->trashdir);
+    }
+    load_index(dedup, indexpath);
+    dedup->index = fopen(indexpath, "a");
+    if (dedup->index == NULL) {
+        log_errno("Collectfs: cannot open %s - deduplicating without remembering content", indexpath);
+    }
+    pthread_mutex_init(&dedup->lock, NULL);
+    pthread_cond_init(&dedup->work, NULL);
+    if (pthread_create(&dedup->thread, NULL, dedup_worker, dedup) != 0) {
+        log_errno("Collectfs: cannot start dedup thread");
+        dedup->stopping = 1;
+        context->dedup = dedup;
+        dedup_stop(context);
+        return -1;
+    }
+    context->dedup = dedup;
+    log_info("Collectfs: deduplicating trash content (%zu known)", dedup->nobjects);
+    return 0;
+}
+
+void dedup_stop(struct local_context *context)
+{
+    struct dedup *dedup = context->dedup;
+    struct dedup_pending *pending;
+    struct dedup_object *object;
+    size_t i;
+
+    if (dedup == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dedup->lock);
+    if (!dedup->stopping) {
+        dedup->stopping = 1;
+        pthread_cond_signal(&dedup->work);
+        pthread_mutex_unlock(&dedup->lock);
+        pthread_join(dedup->thread, NULL);
+    } else {
+        pthread_mutex_unlock(&dedup->lock);
+    }
+    context->dedup = NULL;
+    if (dedup->queued > 0) {
+        log_info("Collectfs: %d versions were not deduplicated", dedup->queued);
+    }
+    log_info("Collectfs: deduplication shared %llu bytes", dedup->shared);
+    while ((pending = dedup->head) != NULL) {
+        dedup->head = pending->next;
+        free(pending);
+    }
+    for (i = 0; i < dedup->nbuckets; i++) {
+        while ((object = dedup->objects[i]) != NULL) {
+            dedup->objects[i] = object->next;
+            free(object);
+        }
+    }
+    if (dedup->index != NULL) {
+        fclose(dedup->index);
+    }
+    pthread_cond_destroy(&dedup->work);
+    pthread_mutex_destroy(&dedup->lock);
+    free(dedup->objects);
+    free(dedup->buf1);
+    free(dedup->buf2);
+    free(dedup);
+}
+
+/**
+ * Queue a version just put in the trash at trashed (a full path)
+ * for deduplication.
+ */
+void dedup_queue(struct local_context *context, const char *trashed)
+{
+    struct dedup *dedup = context->dedup;
+    struct dedup_pending *pending;
+
+    if (dedup == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&dedup->lock);
+    if (dedup->queued < DEDUP_MAX_QUEUE
+        && (pending = malloc(sizeof(struct dedup_pending) + strlen(trashed) + 1)) != NULL) {
+        strcpy(pending->path, trashed);
+        pending->next = NULL;
+        if (dedup->tail != NULL) {
+            dedup->tail->next = pending;
+        } else {
+            dedup->head = pending;
+        }
+        dedup->tail = pending;
+        dedup->queued++;
+        governor_queued(context, GOVERNOR_MAINTAIN, 1);
+        pthread_cond_signal(&dedup->work);
+    }
+    pthread_mutex_unlock(&dedup->lock);
+}
@@ -0,0 +1,15 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _DEDUP_H_
+#define _DEDUP_H_
+
+#include "collectfs.h"
+
+int dedup_start(struct local_context *context);
+void dedup_stop(struct local_context *context);
+
+void dedup_queue(struct local_context *context, const char *trashed);
+
+#endif
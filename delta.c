@@ -0,0 +1,710 @@
+/**
+ * Delta storage of successive versions of a file.
+ *
+ * Most versions of a source file in the trash differ from the one
+ * before by a small edit.  When a new version of a file arrives in
+ * the trash a background thread looks at the previous version and
+ * re-encodes it as a delta against an older full version of the same
+ * file, the base:
+ *
+ *     f.2011-06-01.10:00:00          base (full)
+ *     f.2011-06-01.10:05:00.delta    delta against the base
+ *     f.2011-06-01.10:09:00.delta    delta against the base
+ *     f.2011-06-01.10:12:00          newest (full)
+ *
+ * Every delta is against a full version, never another delta, so
+ * reconstructing any version is one read of the base and one pass
+ * over the delta.  The newest version stays whole as it's the one
+ * most likely to be wanted back.  When a version has drifted so far
+ * from the base that its delta would be more than half its size it
+ * is left whole and becomes the base for the versions after it.
+ *
+ * A base is pinned by a hardlink in trashdir/.bases named by its
+ * content hash, so cleaning old versions out of the trash never
+ * orphans the deltas that depend on it.
+ *
+ * Deltas are found rsync style: the base is cut into blocks which are
+ * indexed by a rolling hash, the version is scanned a byte at a time
+ * rolling the hash along, and each hit is verified and extended in
+ * both directions.  A delta file is a text header followed by
+ * copy/add instructions:
+ *
+ *     collectfs-delta 1\n
+ *     <base, relative to the delta's directory>\n
+ *     <size> <XXH64 of the version>\n
+ *     C <offset> <length>        copy from the base
+ *     A <length> <bytes>         literal bytes
+ *     E                          end
+ *
+ * where C, A and E are single bytes and the numbers are LEB128
+ * varints.  delta_apply() rebuilds a version and checks its hash;
+ * collectfs-restore uses it to turn deltas back into files.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "delta.h"
+#include "governor.h"
+#include "hash.h"
+#include "log.h"
+#include "trash.h"
+
+#define DELTA_MAGIC "collectfs-delta 1\n"
+#define DELTA_BASES ".bases"
+#define DELTA_BLOCK 32
+#define DELTA_MULT 0x01000193u
+/** Smaller versions fit in a block whole */
+#define DELTA_MIN_SIZE 4096
+/** Bigger versions are left whole - we work in memory */
+#define DELTA_MAX_SIZE (64 * 1024 * 1024)
+/** Versions waiting beyond this are left whole */
+#define DELTA_MAX_QUEUE 65536
+
+struct delta_pending {
+    struct delta_pending *next;
+    char path[];
+};
+
+struct delta {
+    struct local_context *context;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct delta_pending *head;
+    struct delta_pending *tail;
+    int queued;
+    int stopping;
+    /* Belongs to the worker */
+    unsigned long long saved;
+};
+
+struct buffer {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+static int buffer_put(struct buffer *buffer, const void *data, size_t len, size_t limit)
+{
+    if (buffer->len + len > limit) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (buffer->len + len > buffer->cap) {
+        size_t cap = buffer->cap ? buffer->cap * 2 : 4096;
+        while (cap < buffer->len + len) {
+            cap *= 2;
+        }
+        unsigned char *data = realloc(buffer->data, cap);
+        if (data == NULL) {
+            return -1;
+        }
+        buffer->data = data;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 0;
+}
+
+static int put_op(struct buffer *buffer, char op, uint64_t a, uint64_t b, int nargs, size_t limit)
+{
+    unsigned char tmp[21];
+    int n = 0, i;
+
+    tmp[n++] = op;
+    for (i = 0; i < nargs; i++) {
+        uint64_t v = i == 0 ? a : b;
+        do {
+            tmp[n] = v & 0x7f;
+            v >>= 7;
+            if (v != 0) {
+                tmp[n] |= 0x80;
+            }
+            n++;
+        } while (v != 0);
+    }
+    return buffer_put(buffer, tmp, n, limit);
+}
+
+static int put_add(struct buffer *buffer, const unsigned char *data, size_t len, size_t limit)
+{
+    if (len == 0) {
+        return 0;
+    }
+    if (put_op(buffer, 'A', len, 0, 1, limit) != 0) {
+        return -1;
+    }
+    return buffer_put(buffer, data, len, limit);
+}
+
+static uint32_t block_hash(const unsigned char *p)
+{
+    uint32_t h = 0;
+    int i;
+
+    for (i = 0; i < DELTA_BLOCK; i++) {
+        h = h * DELTA_MULT + p[i];
+    }
+    return h;
+}
+
+/**
+ * Append the instructions that build target from base to out.  Fails
+ * with EFBIG as soon as out would grow beyond limit.
+ */
+static int encode(const unsigned char *base, size_t blen, const unsigned char *target, size_t tlen,
+                  struct buffer *out, size_t limit)
+{
+    uint32_t *table, power = 1, h = 0;
+    size_t nbuckets = 1024, off, i = 0, pending = 0;
+    int bits = 10, rstatus = -1;
+
+    for (i = 1; i < DELTA_BLOCK; i++) {
+        power *= DELTA_MULT;
+    }
+    while (nbuckets < (blen / DELTA_BLOCK) * 2) {
+        nbuckets *= 2;
+        bits++;
+    }
+    table = calloc(nbuckets, sizeof(uint32_t));
+    if (table == NULL) {
+        return -1;
+    }
+    /* Slots hold offset + 1, the first block at an offset wins */
+    for (off = 0; off + DELTA_BLOCK <= blen; off += DELTA_BLOCK) {
+        uint32_t slot = (block_hash(base + off) * 2654435761u) >> (32 - bits);
+        if (table[slot] == 0) {
+            table[slot] = off + 1;
+        }
+    }
+
+    i = 0;
+    if (tlen >= DELTA_BLOCK) {
+        h = block_hash(target);
+    }
+    while (i + DELTA_BLOCK <= tlen) {
+        uint32_t slot = table[(h * 2654435761u) >> (32 - bits)];
+        if (slot != 0 && memcmp(base + slot - 1, target + i, DELTA_BLOCK) == 0) {
+            size_t len = DELTA_BLOCK;
+            off = slot - 1;
+            while (i + len < tlen && off + len < blen && base[off + len] == target[i + len]) {
+                len++;
+            }
+            while (i > pending && off > 0 && base[off - 1] == target[i - 1]) {
+                i--;
+                off--;
+                len++;
+            }
+            if (put_add(out, target + pending, i - pending, limit) != 0
+                || put_op(out, 'C', off, len, 2, limit) != 0) {
+                goto done;
+            }
+            i += len;
+            pending = i;
+            if (i + DELTA_BLOCK <= tlen) {
+                h = block_hash(target + i);
+            }
+            continue;
+        }
+        if (i + DELTA_BLOCK < tlen) {
+            h = (h - target[i] * power) * DELTA_MULT + target[i + DELTA_BLOCK];
+        }
+        i++;
+    }
+    if (put_add(out, target + pending, tlen - pending, limit) == 0 && buffer_put(out, "E", 1, limit) == 0) {
+        rstatus = 0;
+    }
+  done:
+    free(table);
+    return rstatus;
+}
+
+/**
+ * Read a whole file of at most max bytes into memory.
+ */
+static int read_file(const char *path, size_t max, unsigned char **data, size_t *len, struct stat *statbuf)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    size_t done = 0;
+
+    *data = NULL;
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, statbuf) != 0) {
+        goto fail;
+    }
+    if (!S_ISREG(statbuf->st_mode) || statbuf->st_size > max) {
+        errno = EFBIG;
+        goto fail;
+    }
+    *data = malloc(statbuf->st_size + 1);
+    if (*data == NULL) {
+        goto fail;
+    }
+    while (done < statbuf->st_size) {
+        ssize_t n = read(fd, *data + done, statbuf->st_size - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            goto fail;
+        }
+        done += n;
+    }
+    *len = done;
+    close(fd);
+    return 0;
+
+  fail:
+    {
+        int err = errno;
+        free(*data);
+        *data = NULL;
+        close(fd);
+        errno = err;
+    }
+    return -1;
+}
+
+static int get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+    int shift = 0;
+
+    *v = 0;
+    while (*p < end && shift < 64) {
+        unsigned char byte = *(*p)++;
+        *v |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+        shift += 7;
+    }
+    return -1;
+}
+
+static int write_all(int fd, const unsigned char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Rebuild the version held in the delta file at deltapath, writing it
+ * to outfd.  Fails with EINVAL if the delta is damaged or its base
+ * isn't the one it was made against.
+ */
+int delta_apply(const char *deltapath, int outfd)
+{
+    unsigned char *delta = NULL, *base = NULL;
+    size_t deltalen, baselen;
+    struct stat statbuf;
+    struct hash_state state;
+    unsigned long long size, hash;
+    char basepath[PATH_MAX];
+    const unsigned char *p, *end, *nl;
+    uint64_t written = 0, a, b;
+    int rstatus = -1;
+
+    if (read_file(deltapath, DELTA_MAX_SIZE, &delta, &deltalen, &statbuf) != 0) {
+        return -1;
+    }
+    p = delta;
+    end = delta + deltalen;
+    errno = EINVAL;
+    if (deltalen < strlen(DELTA_MAGIC) || memcmp(p, DELTA_MAGIC, strlen(DELTA_MAGIC)) != 0) {
+        goto done;
+    }
+    p += strlen(DELTA_MAGIC);
+    nl = memchr(p, '\n', end - p);
+    if (nl == NULL || nl == p) {
+        goto done;
+    }
+    /* The base is relative to the directory holding the delta */
+    const char *slash = strrchr(deltapath, '/');
+    int dirlen = slash == NULL ? 0 : slash - deltapath + 1;
+    if (dirlen + (nl - p) >= sizeof(basepath)) {
+        goto done;
+    }
+    memcpy(basepath, deltapath, dirlen);
+    memcpy(basepath + dirlen, p, nl - p);
+    basepath[dirlen + (nl - p)] = '\0';
+    p = nl + 1;
+    nl = memchr(p, '\n', end - p);
+    if (nl == NULL || sscanf((const char *)p, "%llu %llx", &size, &hash) != 2) {
+        goto done;
+    }
+    p = nl + 1;
+
+    if (read_file(basepath, DELTA_MAX_SIZE, &base, &baselen, &statbuf) != 0) {
+        log_errno("Cannot read base %s of %s", basepath, deltapath);
+        goto done;
+    }
+
+    hash_init(&state);
+    while (p < end && *p != 'E') {
+        char op = *p++;
+        errno = EINVAL;
+        if (op == 'C') {
+            if (get_varint(&p, end, &a) != 0 || get_varint(&p, end, &b) != 0 || a > baselen || b > baselen - a) {
+                goto done;
+            }
+            if (write_all(outfd, base + a, b) != 0) {
+                goto done;
+            }
+            hash_update(&state, base + a, b);
+        } else if (op == 'A') {
+            if (get_varint(&p, end, &b) != 0 || b > end - p) {
+                goto done;
+            }
+            if (write_all(outfd, p, b) != 0) {
+                goto done;
+            }
+            hash_update(&state, p, b);
+            p += b;
+        } else {
+            goto done;
+        }
+        written += b;
+    }
+    errno = EINVAL;
+    if (p < end && written == size && hash_digest(&state) == hash) {
+        rstatus = 0;
+    }
+  done:
+    {
+        int err = errno;
+        free(delta);
+        free(base);
+        errno = err;
+    }
+    return rstatus;
+}
+
+/**
+ * If entry is a trash version name - name.YYYY-MM-DD.HH:MM:SS with
+ * maybe a -NNNN count and a .delta suffix - return the length of the
+ * name, otherwise 0.
+ */
+static size_t stamp_at(const char *entry)
+{
+    static const char *format = ".dddd-dd-dd.dd:dd:dd";
+    const char *dot;
+
+    for (dot = strchr(entry + 1, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+        const char *p = dot;
+        const char *f;
+        for (f = format; *f != '\0' && *p != '\0'; f++, p++) {
+            if (*f == 'd' ? !isdigit((unsigned char)*p) : *p != *f) {
+                break;
+            }
+        }
+        if (*f != '\0') {
+            continue;
+        }
+        if (p[0] == '-' && isdigit((unsigned char)p[1]) && isdigit((unsigned char)p[2])
+            && isdigit((unsigned char)p[3]) && isdigit((unsigned char)p[4])) {
+            p += 5;
+        }
+        if (strcmp(p, DELTA_SUFFIX) == 0) {
+            p += strlen(DELTA_SUFFIX);
+        }
+        if (*p == '\0') {
+            return dot - entry;
+        }
+    }
+    return 0;
+}
+
+static int is_delta(const char *entry)
+{
+    size_t len = strlen(entry);
+
+    return len > strlen(DELTA_SUFFIX) && strcmp(entry + len - strlen(DELTA_SUFFIX), DELTA_SUFFIX) == 0;
+}
+
+/**
+ * Write the delta for dir/prev against dir/base, then replace dir/prev
+ * with it.  Returns the bytes saved, 0 if the delta wasn't worth it.
+ */
+static long long encode_version(struct delta *delta, const char *dir, const char *base, const char *prev)
+{
+    const char *trashdir = delta->context->trashdir;
+    char path[PATH_MAX], basepath[PATH_MAX], pinned[PATH_MAX], deltapath[PATH_MAX], tmppath[PATH_MAX];
+    unsigned char *basedata = NULL, *prevdata = NULL;
+    size_t baselen, prevlen;
+    struct stat basestat, prevstat;
+    struct buffer out = { NULL, 0, 0 };
+    char header[PATH_MAX + 64];
+    const char *p;
+    long long saved = 0;
+    int fd = -1, depth = 0, n;
+
+    if (snprintf(basepath, sizeof(basepath), "%s/%s", dir, base) >= sizeof(basepath)
+        || snprintf(path, sizeof(path), "%s/%s", dir, prev) >= sizeof(path)
+        || snprintf(deltapath, sizeof(deltapath), "%s%s", path, DELTA_SUFFIX) >= sizeof(deltapath)
+        || snprintf(tmppath, sizeof(tmppath), "%s.tmp", deltapath) >= sizeof(tmppath)) {
+        return 0;
+    }
+    if (read_file(path, DELTA_MAX_SIZE, &prevdata, &prevlen, &prevstat) != 0 || prevlen < DELTA_MIN_SIZE
+        || read_file(basepath, DELTA_MAX_SIZE, &basedata, &baselen, &basestat) != 0) {
+        goto done;
+    }
+    governor_io(delta->context, GOVERNOR_MAINTAIN, prevlen + baselen);
+
+    /* The base's pinned name, relative to dir */
+    for (p = dir + strlen(trashdir); *p != '\0'; p++) {
+        depth += *p == '/';
+    }
+    snprintf(pinned, sizeof(pinned), "%s/%s/%016llx-%lld", trashdir, DELTA_BASES,
+             (unsigned long long)hash_bytes(basedata, baselen), (long long)baselen);
+    n = snprintf(header, sizeof(header), "%s", DELTA_MAGIC);
+    while (depth-- > 0) {
+        n += snprintf(header + n, sizeof(header) - n, "../");
+    }
+    n += snprintf(header + n, sizeof(header) - n, "%s\n%llu %016llx\n", pinned + strlen(trashdir) + 1,
+                  (unsigned long long)prevlen, (unsigned long long)hash_bytes(prevdata, prevlen));
+    if (n >= sizeof(header) || buffer_put(&out, header, n, prevlen / 2) != 0
+        || encode(basedata, baselen, prevdata, prevlen, &out, prevlen / 2) != 0) {
+        trace_info(LOG_INDENT("delta: %s not worth encoding against %s"), prev, base);
+        goto done;
+    }
+
+    /* Pin the base before anything depends on it */
+    if (mkdir_trash_path(pinned) != 0 || (link(basepath, pinned) != 0 && errno != EEXIST)) {
+        log_errno("Collectfs: cannot pin delta base %s", basepath);
+        goto done;
+    }
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0600);
+    if (fd < 0 || write_all(fd, out.data, out.len) != 0) {
+        log_errno("Collectfs: cannot write delta %s", tmppath);
+        goto done;
+    }
+    /* The delta stands in for the version, so it keeps its metadata */
+    struct timespec times[2] = { prevstat.st_atim, prevstat.st_mtim };
+    if (fchown(fd, prevstat.st_uid, prevstat.st_gid) != 0) {
+        trace_errno(LOG_INDENT("delta: fchown %s"), tmppath);
+    }
+    if (fchmod(fd, prevstat.st_mode & 07777) != 0 || futimens(fd, times) != 0 || fsync(fd) != 0) {
+        log_errno("Collectfs: cannot write delta %s", tmppath);
+        goto done;
+    }
+    if (rename(tmppath, deltapath) != 0) {
+        log_errno("Collectfs: cannot rename delta %s", tmppath);
+        goto done;
+    }
+    if (unlink(path) != 0) {
+        log_errno("Collectfs: cannot remove %s after delta encoding", path);
+        unlink(deltapath);
+        goto done;
+    }
+    saved = (long long)prevlen - (long long)out.len;
+    trace_info(LOG_INDENT("delta: %s stored as %zu byte delta against %s"), prev, out.len, base);
+
+  done:
+    if (fd >= 0) {
+        close(fd);
+        if (saved == 0) {
+            unlink(tmppath);
+        }
+    }
+    free(out.data);
+    free(basedata);
+    free(prevdata);
+    return saved;
+}
+
+/**
+ * A new version has arrived at fnewest: delta encode the previous
+ * version of the same file against the newest full version before
+ * that.
+ */
+static void delta_version(struct delta *delta, const char *fnewest)
+{
+    char dir[PATH_MAX], prev[NAME_MAX + 1] = "", base[NAME_MAX + 1] = "";
+    const char *newest;
+    struct dirent *dirent;
+    size_t namelen;
+    DIR *dp;
+
+    newest = strrchr(fnewest, '/');
+    if (newest == NULL || newest - fnewest >= sizeof(dir) || is_delta(newest + 1)) {
+        return;
+    }
+    memcpy(dir, fnewest, newest - fnewest);
+    dir[newest - fnewest] = '\0';
+    newest++;
+    if ((namelen = stamp_at(newest)) == 0) {
+        return;
+    }
+
+    dp = opendir(dir);
+    if (dp == NULL) {
+        trace_errno(LOG_INDENT("delta: opendir %s"), dir);
+        return;
+    }
+    /* Find the two newest whole versions older than this one */
+    while ((dirent = readdir(dp)) != NULL) {
+        const char *entry = dirent->d_name;
+        if (strncmp(entry, newest, namelen) != 0 || stamp_at(entry) != namelen || is_delta(entry)
+            || strcmp(entry, newest) >= 0) {
+            continue;
+        }
+        if (strcmp(entry, prev) > 0) {
+            strcpy(base, prev);
+            strcpy(prev, entry);
+        } else if (strcmp(entry, base) > 0) {
+            strcpy(base, entry);
+        }
+    }
+    closedir(dp);
+
+    if (prev[0] != '\0' && base[0] != '\0') {
+        delta->saved += encode_version(delta, dir, base, prev);
+    }
+}
+
+static void *delta_worker(void *arg)
+{
+    struct delta *delta = (struct delta *)arg;
+    struct delta_pending *pending;
+
+    governor_enter(delta->context, GOVERNOR_MAINTAIN);
+    pthread_mutex_lock(&delta->lock);
+    for (;;) {
+        while (delta->head == NULL && !delta->stopping) {
+            pthread_cond_wait(&delta->work, &delta->lock);
+        }
+        if (delta->stopping) {
+            break;
+        }
+        pending = delta->head;
+        delta->head = pending->next;
+        if (delta->head == NULL) {
+            delta->tail = NULL;
+        }
+        delta->queued--;
+        governor_queued(delta->context, GOVERNOR_MAINTAIN, -1);
+        pthread_mutex_unlock(&delta->lock);
+
+        delta_version(delta, pending->path);
+        free(pending);
+
+        pthread_mutex_lock(&delta->lock);
+    }
+    pthread_mutex_unlock(&delta->lock);
+    return NULL;
+}
+
+int delta_start(struct local_context *context)
+{
+    struct delta *delta = calloc(1, sizeof(struct delta));
+
+    if (delta == NULL) {
+        return log_errno("delta_start");
+    }
+    delta->context = context;
+    pthread_mutex_init(&delta->lock, NULL);
+    pthread_cond_init(&delta->work, NULL);
+    if (pthread_create(&delta->thread, NULL, delta_worker, delta) != 0) {
+        log_errno("Collectfs: cannot start delta thread");
+        pthread_cond_destroy(&delta->work);
+        pthread_mutex_destroy(&delta->lock);
+        free(delta);
+        return -1;
+    }
+    context->delta = delta;
+    log_info("Collectfs: delta encoding older versions");
+    return 0;
+}
+
+void delta_stop(struct local_context *context)
+{
+    struct delta *delta = context->delta;
+    struct delta_pending *pending;
+
+    if (delta == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&delta->lock);
+    delta->stopping = 1;
+    pthread_cond_signal(&delta->work);
+    pthread_mutex_unlock(&delta->lock);
+    pthread_join(delta->thread, NULL);
+    context->delta = NULL;
+
+    if (delta->queued > 0) {
+        log_info("Collectfs: %d versions were not delta encoded", delta->queued);
+    }
+    log_info("Collectfs: delta encoding saved %llu bytes", delta->saved);
+    while ((pending = delta->head) != NULL) {
+        delta->head = pending->next;
+        free(pending);
+    }
+    pthread_cond_destroy(&delta->work);
+    pthread_mutex_destroy(&delta->lock);
+    free(delta);
+}
+
+/**
+ * Queue a version just put in the trash at trashed (a full path) -
+ * its predecessor may now be delta encoded.
+ */
+void delta_queue(struct local_context *context, const char *trashed)
+{
+    struct delta *delta = context->delta;
+    struct delta_pending *pending;
+
+    if (delta == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&delta->lock);
+    if (delta->queued < DELTA_MAX_QUEUE
+        && (pending = malloc(sizeof(struct delta_pending) + strlen(trashed) + 1)) != NULL) {
+        strcpy(pending->path, trashed);
+        pending->next = NULL;
+        if (delta->tail != NULL) {
+            delta->tail->next = pending;
+        } else {
+            delta->head = pending;
+        }
+        delta->tail = pending;
+        delta->queued++;
+        governor_queued(context, GOVERNOR_MAINTAIN, 1);
+        pthread_cond_signal(&delta->work);
+    }
+    pthread_mutex_unlock(&delta->lock);
+}
@@ -0,0 +1,22 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _DELTA_H_
+#define _DELTA_H_
+
+#include "collectfs.h"
+
+/**
+ * Delta encoded versions have this appended to their trash name.
+ */
+#define DELTA_SUFFIX ".delta"
+
+int delta_start(struct local_context *context);
+void delta_stop(struct local_context *context);
+
+void delta_queue(struct local_context *context, const char *trashed);
+
+int delta_apply(const char *deltapath, int outfd);
+
+#endif
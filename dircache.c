@@ -0,0 +1,334 @@
+/**
+ * Directory listing cache.
+ *
+ * Build systems and find list the same directories over and over, and
+ * each listing went to the real directory with opendir and readdir.
+ * With --dircache the names in a directory are kept, keyed on its full
+ * path, and handed out again while the directory is unchanged - its
+ * device, inode, mtime and ctime are as they were when it was read.
+ * That costs one stat per opendir instead of reading the directory.
+ *
+ * The mtime check catches changes made beside the mount as well as
+ * through it, except for changes in the same tick of the filesystem's
+ * clock as the listing was read; so a listing of a directory that
+ * changed in the last DIRCACHE_RACY_SECONDS is used once and not kept.
+ * Collectfs also drops the listing of any directory it changes itself
+ * (dircache_changed) rather than waiting to notice.
+ *
+ * The listings are held in a hash table, up to a total size, with the
+ * least recently used thrown out first.  A listing still open when it
+ * is thrown out or replaced lives until it is closed.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dircache.h"
+
+#define DIRCACHE_BUCKETS 4096
+
+struct dircache_listing {
+    /** Hash chain */
+    struct dircache_listing *next;
+    /** LRU list - most recently opened first */
+    struct dircache_listing *newer;
+    struct dircache_listing *older;
+    /** The directory as it was when read */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    /** Open handles on it */
+    int refs;
+    /** In the table rather than just open */
+    int cached;
+    size_t hash;
+    size_t size;
+    char *fpath;
+    /** The names, each ending in a '\0', then an empty one */
+    char names[];
+};
+
+struct dircache {
+    pthread_mutex_t lock;
+    size_t max_size;
+    size_t size;
+    struct dircache_listing *buckets[DIRCACHE_BUCKETS];
+    struct dircache_listing *newest;
+    struct dircache_listing *oldest;
+};
+
+static size_t hash(const char *path)
+{
+    size_t h = 2166136261u;
+
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+struct dircache *dircache_new(size_t size)
+{
+    struct dircache *dircache = calloc(1, sizeof(struct dircache));
+
+    if (dircache == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&dircache->lock, NULL);
+    dircache->max_size = size;
+    return dircache;
+}
+
+/**
+ * Take listing out of the table, freeing it unless it is open.
+ * Called with the lock held.
+ */
+static void drop(struct dircache *dircache, struct dircache_listing *listing)
+{
+    struct dircache_listing **link = &dircache->buckets[listing->hash % DIRCACHE_BUCKETS];
+
+    while (*link != listing) {
+        link = &(*link)->next;
+    }
+    *link = listing->next;
+    if (listing->newer != NULL) {
+        listing->newer->older = listing->older;
+    } else {
+        dircache->newest = listing->older;
+    }
+    if (listing->older != NULL) {
+        listing->older->newer = listing->newer;
+    } else {
+        dircache->oldest = listing->newer;
+    }
+    dircache->size -= listing->size;
+    listing->cached = 0;
+    if (listing->refs == 0) {
+        free(listing);
+    }
+}
+
+void dircache_free(struct dircache *dircache)
+{
+    if (dircache == NULL) {
+        return;
+    }
+    while (dircache->oldest != NULL) {
+        drop(dircache, dircache->oldest);
+    }
+    pthread_mutex_destroy(&dircache->lock);
+    free(dircache);
+}
+
+static struct dircache_listing *find(struct dircache *dircache, const char *fpath, size_t h)
+{
+    struct dircache_listing *listing;
+
+    for (listing = dircache->buckets[h % DIRCACHE_BUCKETS]; listing != NULL; listing = listing->next) {
+        if (listing->hash == h && strcmp(listing->fpath, fpath) == 0) {
+            return listing;
+        }
+    }
+    return NULL;
+}
+
+static int unchanged(const struct dircache_listing *listing, const struct stat *sb)
+{
+    return listing->dev == sb->st_dev && listing->ino == sb->st_ino
+        && listing->mtime.tv_sec == sb->st_mtim.tv_sec && listing->mtime.tv_nsec == sb->st_mtim.tv_nsec
+        && listing->ctime.tv_sec == sb->st_ctim.tv_sec && listing->ctime.tv_nsec == sb->st_ctim.tv_nsec;
+}
+
+/**
+ * Read the names in the directory fpath, which was as sb describes
+ * before reading started.
+ */
+static struct dircache_listing *read_listing(const char *fpath, const struct stat *sb, size_t h)
+{
+    size_t used = 0, allocated = 4096, pathlen = strlen(fpath) + 1;
+    struct dircache_listing *listing;
+    struct dirent *de;
+    char *names;
+    DIR *dp;
+
+    dp = opendir(fpath);
+    if (dp == NULL) {
+        return NULL;
+    }
+    names = malloc(allocated);
+    for (errno = 0; names != NULL && (de = readdir(dp)) != NULL; errno = 0) {
+        size_t len = strlen(de->d_name) + 1;
+
+        if (used + len + 1 > allocated) {
+            char *more = realloc(names, allocated * 2 + len);
+
+            if (more == NULL) {
+                free(names);
+                names = NULL;
+                break;
+            }
+            names = more;
+            allocated = allocated * 2 + len;
+        }
+        memcpy(names + used, de->d_name, len);
+        used += len;
+    }
+    if (names == NULL || errno != 0) {
+        int err = names == NULL ? ENOMEM : errno;
+
+        free(names);
+        closedir(dp);
+        errno = err;
+        return NULL;
+    }
+    closedir(dp);
+    names[used++] = '\0';
+
+    listing = malloc(sizeof(struct dircache_listing) + used + pathlen);
+    if (listing == NULL) {
+        free(names);
+        return NULL;
+    }
+    memset(listing, 0, sizeof(struct dircache_listing));
+    memcpy(listing->names, names, used);
+    free(names);
+    listing->fpath = listing->names + used;
+    memcpy(listing->fpath, fpath, pathlen);
+    listing->size = sizeof(struct dircache_listing) + used + pathlen;
+    listing->hash = h;
+    listing->dev = sb->st_dev;
+    listing->ino = sb->st_ino;
+    listing->mtime = sb->st_mtim;
+    listing->ctime = sb->st_ctim;
+    listing->refs = 1;
+    return listing;
+}
+
+/**
+ * Open the listing of the directory fpath, from the cache if it is
+ * unchanged.  Returns NULL, with errno set, if it can't be read.
+ */
+struct dircache_listing *dircache_open(struct dircache *dircache, const char *fpath)
+{
+    struct dircache_listing *listing, *other;
+    size_t h = hash(fpath);
+    struct stat sb;
+
+    if (stat(fpath, &sb) != 0) {
+        return NULL;
+    }
+    if (!S_ISDIR(sb.st_mode)) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    pthread_mutex_lock(&dircache->lock);
+    listing = find(dircache, fpath, h);
+    if (listing != NULL && unchanged(listing, &sb)) {
+        listing->refs++;
+        if (listing != dircache->newest) {
+            /* Move it to the front */
+            listing->newer->older = listing->older;
+            if (listing->older != NULL) {
+                listing->older->newer = listing->newer;
+            } else {
+                dircache->oldest = listing->newer;
+            }
+            listing->newer = NULL;
+            listing->older = dircache->newest;
+            dircache->newest->newer = listing;
+            dircache->newest = listing;
+        }
+        pthread_mutex_unlock(&dircache->lock);
+        return listing;
+    }
+    if (listing != NULL) {
+        drop(dircache, listing);
+    }
+    pthread_mutex_unlock(&dircache->lock);
+
+    listing = read_listing(fpath, &sb, h);
+    if (listing == NULL) {
+        return NULL;
+    }
+    if (sb.st_mtime >= time(NULL) - DIRCACHE_RACY_SECONDS || sb.st_ctime >= time(NULL) - DIRCACHE_RACY_SECONDS
+        || listing->size > dircache->max_size / 4) {
+        /* Just for this handle */
+        return listing;
+    }
+    pthread_mutex_lock(&dircache->lock);
+    other = find(dircache, fpath, h);
+    if (other != NULL) {
+        drop(dircache, other);
+    }
+    listing->cached = 1;
+    listing->next = dircache->buckets[h % DIRCACHE_BUCKETS];
+    dircache->buckets[h % DIRCACHE_BUCKETS] = listing;
+    listing->older = dircache->newest;
+    if (dircache->newest != NULL) {
+        dircache->newest->newer = listing;
+    } else {
+        dircache->oldest = listing;
+    }
+    dircache->newest = listing;
+    dircache->size += listing->size;
+    while (dircache->size > dircache->max_size) {
+        drop(dircache, dircache->oldest);
+    }
+    pthread_mutex_unlock(&dircache->lock);
+    return listing;
+}
+
+/**
+ * The name after name in listing, the first if name is NULL, or NULL
+ * after the last.
+ */
+const char *dircache_next(struct dircache_listing *listing, const char *name)
+{
+    name = name == NULL ? listing->names : name + strlen(name) + 1;
+    return *name != '\0' ? name : NULL;
+}
+
+void dircache_close(struct dircache *dircache, struct dircache_listing *listing)
+{
+    pthread_mutex_lock(&dircache->lock);
+    if (--listing->refs == 0 && !listing->cached) {
+        free(listing);
+    }
+    pthread_mutex_unlock(&dircache->lock);
+}
+
+/**
+ * Collectfs has added, removed or renamed fpath - forget the listing
+ * of the directory it is in.
+ */
+void dircache_changed(struct dircache *dircache, const char *fpath)
+{
+    struct dircache_listing *listing;
+    const char *slash;
+    char dir[PATH_MAX];
+
+    if (dircache == NULL || (slash = strrchr(fpath, '/')) == NULL || slash - fpath >= sizeof(dir)) {
+        return;
+    }
+    memcpy(dir, fpath, slash - fpath);
+    dir[slash - fpath] = '\0';
+    pthread_mutex_lock(&dircache->lock);
+    listing = find(dircache, dir, hash(dir));
+    if (listing != NULL) {
+        drop(dircache, listing);
+    }
+    pthread_mutex_unlock(&dircache->lock);
+}
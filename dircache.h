@@ -0,0 +1,29 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+
+#include <stddef.h>
+
+/**
+ * A listing isn't kept if its directory changed this recently - a
+ * change in the same tick of the filesystem clock wouldn't show in
+ * its mtime.
+ */
+#define DIRCACHE_RACY_SECONDS 1
+
+struct dircache;
+struct dircache_listing;
+
+struct dircache *dircache_new(size_t size);
+void dircache_free(struct dircache *dircache);
+
+struct dircache_listing *dircache_open(struct dircache *dircache, const char *fpath);
+const char *dircache_next(struct dircache_listing *listing, const char *name);
+void dircache_close(struct dircache *dircache, struct dircache_listing *listing);
+
+void dircache_changed(struct dircache *dircache, const char *fpath);
+
+#endif
@@ -0,0 +1,617 @@
+/**
+ * Collection events - a journal of everything collected, and a socket
+ * to follow it on.
+ *
+ * With --events every collection appends a record to an append-only
+ * journal in the trash:
+ *
+ *     trashdir/.events/journal      the newest events
+ *     trashdir/.events/journal.1    the events before those
+ *     trashdir/.events/socket       where followers connect
+ *
+ * A record is a text header followed by the raw paths (paths may
+ * contain any character other than nul), the original path as the
+ * fuse path and the version's path relative to trashdir:
+ *
+ *     <seq> <time> <op> <size> <path length> <trashed length>\n<path>\n<trashed>\n
+ *
+ * seq numbers every event since the journal was created, op is the
+ * operation that caused the collection - unlink, rename, link,
+ * symlink or truncate (or recovered, for versions staged by --async
+ * before a crash).
+ *
+ * The record is written as the collection happens, but fsync()ed by a
+ * background thread that flushes whatever has arrived every
+ * EVENTS_SYNC_MS, so collecting never waits on the disk.  Only flushed
+ * events are sent to followers, so a follower never sees an event the
+ * journal could lose.  When the journal passes EVENTS_MAX_SIZE it
+ * replaces journal.1 and a new one is started.
+ *
+ * A follower connects to the socket and sends the last seq it has
+ * seen (0 for everything):
+ *
+ *     FOLLOW <seq>\n
+ *
+ * It is sent every record after that one still in the journals, then
+ * new records as they are flushed, until it disconnects.  Something
+ * like
+ *
+ *     echo FOLLOW 0 | socat - UNIX-CONNECT:trashdir/.events/socket
+ *
+ * will do to watch.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "collectfs.h"
+#include "events.h"
+#include "log.h"
+
+#define EVENTS_JOURNAL "journal"
+#define EVENTS_OLD_JOURNAL "journal.1"
+#define EVENTS_SOCKET "socket"
+/** Flush the journal this often while events are arriving */
+#define EVENTS_SYNC_MS 50
+/** Start a new journal beyond this size */
+#define EVENTS_MAX_SIZE (64 * 1024 * 1024)
+/** Biggest record header */
+#define EVENTS_HEADER_MAX 128
+
+struct events {
+    struct local_context *context;
+    char dir[PATH_MAX - 32];
+    int fd;
+    /** The last seq given out */
+    unsigned long long seq;
+    /** Bytes written to the journal, and how many of those are flushed */
+    off_t size;
+    off_t synced;
+    /** Counts new journals, so followers notice */
+    unsigned generation;
+    int stopping;
+    int listen_fd;
+    /** Followers still running */
+    int followers;
+    pthread_mutex_t lock;
+    /** Signalled as events are written */
+    pthread_cond_t written;
+    /** Signalled as they are flushed, and as followers finish */
+    pthread_cond_t flushed;
+    pthread_t syncer;
+    pthread_t listener;
+};
+
+struct follower {
+    struct events *events;
+    int fd;
+};
+
+/**
+ * How long the record at the start of buf is, if buf holds all of it,
+ * and its seq.  0 if buf doesn't hold all of it, -1 if it's no record.
+ */
+static ssize_t record_length(const char *buf, size_t len, unsigned long long *seq)
+{
+    char header[EVENTS_HEADER_MAX + 1];
+    const char *nl = memchr(buf, '\n', len < EVENTS_HEADER_MAX ? len : EVENTS_HEADER_MAX);
+    size_t pathlen, trashedlen;
+    char op[16];
+    long when;
+    long long size;
+    int used;
+
+    if (nl == NULL) {
+        return len < EVENTS_HEADER_MAX ? 0 : -1;
+    }
+    memcpy(header, buf, nl + 1 - buf);
+    header[nl + 1 - buf] = '\0';
+    if (sscanf(header, "%llu %ld %15s %lld %zu %zu\n%n", seq, &when, op, &size, &pathlen, &trashedlen, &used) != 6
+        || used != nl + 1 - buf || pathlen >= PATH_MAX || trashedlen >= PATH_MAX) {
+        return -1;
+    }
+    if (used + pathlen + trashedlen + 2 > len) {
+        return 0;
+    }
+    if (buf[used + pathlen] != '\n' || buf[used + pathlen + 1 + trashedlen] != '\n') {
+        return -1;
+    }
+    return used + pathlen + trashedlen + 2;
+}
+
+/**
+ * Find the last seq in a journal and the end of its last whole record.
+ */
+static int scan_journal(int fd, unsigned long long *seq, off_t *end)
+{
+    char buf[2 * PATH_MAX + EVENTS_HEADER_MAX];
+    size_t have = 0;
+    off_t offset = 0;
+    ssize_t n;
+
+    *end = 0;
+    for (;;) {
+        n = pread(fd, buf + have, sizeof(buf) - have, offset + have);
+        if (n < 0) {
+            return -1;
+        }
+        have += n;
+        size_t used = 0;
+        ssize_t len;
+        while ((len = record_length(buf + used, have - used, seq)) > 0) {
+            used += len;
+        }
+        offset += used;
+        *end = offset;
+        if (len < 0 || n == 0) {
+            return 0;
+        }
+        memmove(buf, buf + used, have - used);
+        have -= used;
+    }
+}
+
+static int events_path(char path[PATH_MAX], struct events *events, const char *name)
+{
+    return snprintf(path, PATH_MAX, "%s/%s", events->dir, name);
+}
+
+/**
+ * Write all of buf to a follower.
+ */
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * Send the records in journal fd from *offset up to end with seq after
+ * cursor.  *offset is moved past every whole record.
+ */
+static int send_records(int sock, int fd, off_t *offset, off_t end, unsigned long long cursor)
+{
+    char buf[2 * PATH_MAX + EVENTS_HEADER_MAX];
+    unsigned long long seq;
+    size_t have = 0;
+
+    while (*offset + have < end) {
+        size_t want = sizeof(buf) - have;
+        ssize_t n;
+        if (want > end - *offset - have) {
+            want = end - *offset - have;
+        }
+        n = pread(fd, buf + have, want, *offset + have);
+        if (n <= 0) {
+            return n == 0 ? 0 : -1;
+        }
+        have += n;
+
+        size_t used = 0, from = 0;
+        ssize_t len;
+        while ((len = record_length(buf + used, have - used, &seq)) > 0) {
+            if (seq <= cursor) {
+                from = used + len;
+            }
+            used += len;
+        }
+        if (len < 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        if (used > from && send_all(sock, buf + from, used - from) != 0) {
+            return -1;
+        }
+        *offset += used;
+        memmove(buf, buf + used, have - used);
+        have -= used;
+    }
+    return 0;
+}
+
+static void *follower_thread(void *arg)
+{
+    struct follower *follower = (struct follower *)arg;
+    struct events *events = follower->events;
+    unsigned long long cursor;
+    char request[64], path[PATH_MAX];
+    struct timeval timeout = { 10, 0 };
+    unsigned generation;
+    off_t offset = 0, synced;
+    ssize_t n;
+    int fd;
+
+    setsockopt(follower->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    n = recv(follower->fd, request, sizeof(request) - 1, 0);
+    if (n <= 0) {
+        goto done;
+    }
+    request[n] = '\0';
+    if (sscanf(request, "FOLLOW %llu", &cursor) != 1) {
+        send_all(follower->fd, "ERROR expected FOLLOW <seq>\n", 28);
+        goto done;
+    }
+
+    /* Catch up from the previous journal, then follow this one */
+    pthread_mutex_lock(&events->lock);
+    generation = events->generation;
+    events_path(path, events, EVENTS_JOURNAL);
+    fd = open(path, O_RDONLY);
+    pthread_mutex_unlock(&events->lock);
+    if (fd < 0) {
+        goto done;
+    }
+    events_path(path, events, EVENTS_OLD_JOURNAL);
+    int oldfd = open(path, O_RDONLY);
+    if (oldfd >= 0) {
+        struct stat sb;
+        off_t oldoffset = 0;
+        int rstatus = fstat(oldfd, &sb) == 0 ? send_records(follower->fd, oldfd, &oldoffset, sb.st_size, cursor) : -1;
+        close(oldfd);
+        if (rstatus != 0) {
+            close(fd);
+            goto done;
+        }
+    }
+
+    pthread_mutex_lock(&events->lock);
+    for (;;) {
+        while (!events->stopping && events->generation == generation && events->synced <= offset) {
+            pthread_cond_wait(&events->flushed, &events->lock);
+        }
+        if (events->stopping) {
+            break;
+        }
+        if (events->generation != generation) {
+            /* Finish the old journal - it was flushed before being replaced */
+            pthread_mutex_unlock(&events->lock);
+            struct stat sb;
+            int rstatus = fstat(fd, &sb) == 0 ? send_records(follower->fd, fd, &offset, sb.st_size, cursor) : -1;
+            close(fd);
+            pthread_mutex_lock(&events->lock);
+            if (rstatus != 0) {
+                fd = -1;
+                break;
+            }
+            generation = events->generation;
+            events_path(path, events, EVENTS_JOURNAL);
+            fd = open(path, O_RDONLY);
+            offset = 0;
+            if (fd < 0) {
+                break;
+            }
+            continue;
+        }
+        synced = events->synced;
+        pthread_mutex_unlock(&events->lock);
+        int rstatus = send_records(follower->fd, fd, &offset, synced, cursor);
+        pthread_mutex_lock(&events->lock);
+        if (rstatus != 0) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&events->lock);
+    if (fd >= 0) {
+        close(fd);
+    }
+
+  done:
+    close(follower->fd);
+    pthread_mutex_lock(&events->lock);
+    events->followers--;
+    pthread_cond_broadcast(&events->flushed);
+    pthread_mutex_unlock(&events->lock);
+    free(follower);
+    return NULL;
+}
+
+static void *listener_thread(void *arg)
+{
+    struct events *events = (struct events *)arg;
+    pthread_attr_t attr;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (;;) {
+        int fd = accept(events->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            break;
+        }
+        struct follower *follower = malloc(sizeof(struct follower));
+        pthread_t thread;
+        pthread_mutex_lock(&events->lock);
+        if (events->stopping || follower == NULL) {
+            pthread_mutex_unlock(&events->lock);
+            free(follower);
+            close(fd);
+            break;
+        }
+        follower->events = events;
+        follower->fd = fd;
+        events->followers++;
+        if (pthread_create(&thread, &attr, follower_thread, follower) != 0) {
+            log_errno("Collectfs: cannot start event follower");
+            events->followers--;
+            free(follower);
+            close(fd);
+        }
+        pthread_mutex_unlock(&events->lock);
+    }
+    pthread_attr_destroy(&attr);
+    return NULL;
+}
+
+/**
+ * Call with events->lock held.  Start a new journal, keeping the
+ * current one as the previous.
+ */
+static void rotate(struct events *events)
+{
+    char path[PATH_MAX], oldpath[PATH_MAX];
+    int fd;
+
+    events_path(path, events, EVENTS_JOURNAL);
+    events_path(oldpath, events, EVENTS_OLD_JOURNAL);
+    if (fdatasync(events->fd) != 0 || rename(path, oldpath) != 0) {
+        log_errno("Collectfs: cannot start a new event journal in %s", events->dir);
+        return;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (fd < 0) {
+        log_errno("Collectfs: cannot start a new event journal in %s", events->dir);
+        rename(oldpath, path);
+        return;
+    }
+    close(events->fd);
+    events->fd = fd;
+    events->size = events->synced = 0;
+    events->generation++;
+    pthread_cond_broadcast(&events->flushed);
+}
+
+static void *syncer_thread(void *arg)
+{
+    struct events *events = (struct events *)arg;
+
+    pthread_mutex_lock(&events->lock);
+    for (;;) {
+        while (!events->stopping && events->synced == events->size) {
+            pthread_cond_wait(&events->written, &events->lock);
+        }
+        if (events->synced == events->size) {
+            break;
+        }
+        /* Let the batch build up */
+        struct timespec wait;
+        clock_gettime(CLOCK_REALTIME, &wait);
+        wait.tv_nsec += EVENTS_SYNC_MS * 1000000L;
+        if (wait.tv_nsec >= 1000000000L) {
+            wait.tv_sec++;
+            wait.tv_nsec -= 1000000000L;
+        }
+        while (!events->stopping && pthread_cond_timedwait(&events->written, &events->lock, &wait) != ETIMEDOUT) {
+        }
+
+        off_t size = events->size;
+        unsigned generation = events->generation;
+        int fd = events->fd;
+        pthread_mutex_unlock(&events->lock);
+        int rstatus = fdatasync(fd);
+        pthread_mutex_lock(&events->lock);
+        if (rstatus != 0) {
+            log_errno("Collectfs: cannot flush the event journal in %s", events->dir);
+            if (events->stopping) {
+                break;
+            }
+        } else if (generation == events->generation) {
+            events->synced = size;
+            pthread_cond_broadcast(&events->flushed);
+        }
+        if (events->size >= EVENTS_MAX_SIZE) {
+            rotate(events);
+        }
+    }
+    pthread_mutex_unlock(&events->lock);
+    return NULL;
+}
+
+int events_start(struct local_context *context)
+{
+    struct events *events = calloc(1, sizeof(struct events));
+    char path[PATH_MAX];
+    struct sockaddr_un addr;
+    off_t end;
+
+    if (events == NULL) {
+        return log_errno("events_start");
+    }
+    events->context = context;
+    events->fd = events->listen_fd = -1;
+    if (snprintf(events->dir, sizeof(events->dir), "%s/%s", context->trashdir, EVENTS_FOLDER)
+        >= sizeof(events->dir)) {
+        errno = ENAMETOOLONG;
+        goto fail;
+    }
+    if ((mkdir(context->trashdir, 0700) != 0 && errno != EEXIST) || (mkdir(events->dir, 0700) != 0 && errno != EEXIST)) {
+        goto fail;
+    }
+
+    /* Carry on numbering from the last whole record, dropping a torn one */
+    events_path(path, events, EVENTS_OLD_JOURNAL);
+    int oldfd = open(path, O_RDONLY);
+    if (oldfd >= 0) {
+        scan_journal(oldfd, &events->seq, &end);
+        close(oldfd);
+    }
+    events_path(path, events, EVENTS_JOURNAL);
+    events->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (events->fd < 0 || scan_journal(events->fd, &events->seq, &end) != 0) {
+        goto fail;
+    }
+    if (ftruncate(events->fd, end) != 0) {
+        goto fail;
+    }
+    events->size = events->synced = end;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", events->dir, EVENTS_SOCKET) >= sizeof(addr.sun_path)) {
+        log_info("Collectfs: %s is too long a path for the event socket - journal only", events->dir);
+    } else {
+        unlink(addr.sun_path);
+        events->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (events->listen_fd < 0 || bind(events->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(events->listen_fd, 16) != 0) {
+            log_errno("Collectfs: cannot listen on %s - journal only", addr.sun_path);
+            if (events->listen_fd >= 0) {
+                close(events->listen_fd);
+                events->listen_fd = -1;
+            }
+        }
+    }
+
+    pthread_mutex_init(&events->lock, NULL);
+    pthread_cond_init(&events->written, NULL);
+    pthread_cond_init(&events->flushed, NULL);
+    if (pthread_create(&events->syncer, NULL, syncer_thread, events) != 0) {
+        pthread_mutex_destroy(&events->lock);
+        pthread_cond_destroy(&events->written);
+        pthread_cond_destroy(&events->flushed);
+        goto fail;
+    }
+    if (events->listen_fd >= 0 && pthread_create(&events->listener, NULL, listener_thread, events) != 0) {
+        log_errno("Collectfs: cannot start the event listener - journal only");
+        close(events->listen_fd);
+        events->listen_fd = -1;
+    }
+    context->events = events;
+    log_info("Collectfs: journalling collections in %s (last event %llu)", events->dir, events->seq);
+    return 0;
+
+  fail:
+    log_errno("Collectfs: cannot open the event journal in %s/%s", context->trashdir, EVENTS_FOLDER);
+    if (events->fd >= 0) {
+        close(events->fd);
+    }
+    free(events);
+    return -1;
+}
+
+void events_stop(struct local_context *context)
+{
+    struct events *events = context->events;
+    char path[PATH_MAX];
+
+    if (events == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&events->lock);
+    events->stopping = 1;
+    pthread_cond_broadcast(&events->written);
+    pthread_cond_broadcast(&events->flushed);
+    pthread_mutex_unlock(&events->lock);
+    pthread_join(events->syncer, NULL);
+    if (events->listen_fd >= 0) {
+        /* Wakes the listener out of accept() */
+        shutdown(events->listen_fd, SHUT_RDWR);
+        pthread_join(events->listener, NULL);
+        close(events->listen_fd);
+        events_path(path, events, EVENTS_SOCKET);
+        unlink(path);
+    }
+    pthread_mutex_lock(&events->lock);
+    while (events->followers > 0) {
+        pthread_cond_wait(&events->flushed, &events->lock);
+    }
+    pthread_mutex_unlock(&events->lock);
+    context->events = NULL;
+
+    fdatasync(events->fd);
+    close(events->fd);
+    log_info("Collectfs: last event %llu", events->seq);
+    pthread_cond_destroy(&events->written);
+    pthread_cond_destroy(&events->flushed);
+    pthread_mutex_destroy(&events->lock);
+    free(events);
+}
+
+/**
+ * Journal a collection - op caused path to be collected at when as
+ * trashed (a full path), a version of size bytes.
+ */
+void events_record(struct local_context *context, const char *op, const char *path, const char *trashed,
+                   off_t size, time_t when)
+{
+    struct events *events = context->events;
+    size_t trashlen = strlen(context->trashdir);
+    size_t pathlen, trashedlen, len;
+    char *record;
+
+    if (events == NULL) {
+        return;
+    }
+    if (strncmp(trashed, context->trashdir, trashlen) == 0 && trashed[trashlen] == '/') {
+        trashed += trashlen + 1;
+    }
+    pathlen = strlen(path);
+    trashedlen = strlen(trashed);
+    record = malloc(EVENTS_HEADER_MAX + pathlen + trashedlen + 2);
+    if (record == NULL) {
+        log_errno("Collectfs: no memory to journal the collection of %s", path);
+        return;
+    }
+
+    pthread_mutex_lock(&events->lock);
+    len = snprintf(record, EVENTS_HEADER_MAX, "%llu %ld %s %lld %zu %zu\n", events->seq + 1, (long)when, op,
+                   (long long)size, pathlen, trashedlen);
+    memcpy(record + len, path, pathlen);
+    len += pathlen;
+    record[len++] = '\n';
+    memcpy(record + len, trashed, trashedlen);
+    len += trashedlen;
+    record[len++] = '\n';
+    /* A single write to the O_APPEND journal, in seq order */
+    if (write(events->fd, record, len) == (ssize_t)len) {
+        events->seq++;
+        events->size += len;
+        pthread_cond_signal(&events->written);
+    } else {
+        log_errno("Collectfs: cannot write the event journal in %s", events->dir);
+        /* Don't leave part of a record for the next one to follow */
+        if (ftruncate(events->fd, events->size) != 0) {
+            log_errno("Collectfs: cannot truncate the event journal in %s", events->dir);
+        }
+    }
+    pthread_mutex_unlock(&events->lock);
+    free(record);
+}
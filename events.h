@@ -0,0 +1,24 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _EVENTS_H_
+#define _EVENTS_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "collectfs.h"
+
+/**
+ * The journal and socket live in this folder at the top of the trash.
+ */
+#define EVENTS_FOLDER ".events"
+
+int events_start(struct local_context *context);
+void events_stop(struct local_context *context);
+
+void events_record(struct local_context *context, const char *op, const char *path, const char *trashed,
+                   off_t size, time_t when);
+
+#endif
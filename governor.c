@@ -0,0 +1,296 @@
+/**
+ * Background work governor.
+ *
+ * Staging, dedup, delta, compression, packing and expiry, indexing,
+ * rmtree and scrubbing each have a worker thread of their own, and
+ * left alone they compete with the foreground for the disk.  They all
+ * answer to this:
+ *
+ *  - each worker runs in a priority class (governor.h).  Finishing
+ *    collections runs at the lowest best-effort I/O priority and
+ *    nice 5, everything else at idle I/O priority and nice 19 - the
+ *    kernel's I/O scheduler then serves the foreground first;
+ *
+ *  - with --bg-rate=MB and/or --bg-iops=N, the maintenance and
+ *    verification classes each get that many bytes and I/Os a second
+ *    between all their workers, on top of any per-module rate
+ *    (--dedup=MB, --scrub=MB);
+ *
+ *  - the time taken by foreground reads, writes, getattrs and opens
+ *    is followed by a fast and a slow moving average.  While the fast
+ *    one is more than GOVERNOR_CONGESTED times the slow one, the
+ *    maintenance and verification classes pause before each I/O, for
+ *    longer the worse it is.
+ *
+ * Workers call governor_enter when they start and governor_io before
+ * each read or write, and modules with queues keep governor_queued up
+ * to date.  Queue depths, work done and time spent throttled are
+ * reported in the stats (see stats.c).
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "governor.h"
+#include "log.h"
+
+/* From linux/ioprio.h, which isn't always installed */
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | (data))
+
+struct governor_class {
+    pthread_mutex_t lock;
+    /** When the budget allows the next I/O, on CLOCK_MONOTONIC in ns */
+    int64_t next;
+    /** Everything below is read without the lock for the stats */
+    int threads;
+    int queued;
+    unsigned long long ios;
+    unsigned long long bytes;
+    /** Time spent waiting for the budget and backing off, ns */
+    unsigned long long budget_ns;
+    unsigned long long backoff_ns;
+};
+
+struct governor {
+    unsigned long long rate;
+    unsigned long long iops;
+    /** Moving averages of foreground operation times, ns */
+    uint64_t fast_ns;
+    uint64_t slow_ns;
+    unsigned long long foreground_ops;
+    struct governor_class classes[GOVERNOR_CLASSES];
+};
+
+static const char *class_names[GOVERNOR_CLASSES] = { "finish", "maintain", "verify" };
+
+static int64_t now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void sleep_ns(int64_t ns)
+{
+    struct timespec pause;
+
+    pause.tv_sec = ns / 1000000000LL;
+    pause.tv_nsec = ns % 1000000000LL;
+    nanosleep(&pause, NULL);
+}
+
+int governor_start(struct local_context *context)
+{
+    struct governor *governor = calloc(1, sizeof(struct governor));
+    int c;
+
+    if (governor == NULL) {
+        return log_errno("governor_start");
+    }
+    governor->rate = context->bg_rate;
+    governor->iops = context->bg_iops;
+    for (c = 0; c < GOVERNOR_CLASSES; c++) {
+        pthread_mutex_init(&governor->classes[c].lock, NULL);
+    }
+    context->governor = governor;
+    if (governor->rate > 0 || governor->iops > 0) {
+        log_info("Collectfs: background work limited to %llu MB/s and %llu I/Os a second per class",
+                 governor->rate / (1024 * 1024), governor->iops);
+    }
+    return 0;
+}
+
+/**
+ * Called after every module that uses it has stopped.
+ */
+void governor_stop(struct local_context *context)
+{
+    struct governor *governor = context->governor;
+    int c;
+
+    if (governor == NULL) {
+        return;
+    }
+    context->governor = NULL;
+    for (c = 0; c < GOVERNOR_CLASSES; c++) {
+        pthread_mutex_destroy(&governor->classes[c].lock);
+    }
+    free(governor);
+}
+
+/**
+ * The calling thread does background work of class from now on.  Its
+ * priorities are set even if the scheduler couldn't be started.
+ */
+void governor_enter(struct local_context *context, int class)
+{
+    struct governor *governor = context->governor;
+    pid_t tid = syscall(SYS_gettid);
+    int ioprio = class == GOVERNOR_FINISH ? IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 7)
+                                          : IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0);
+
+    /* Both of these are per thread on Linux */
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, ioprio) != 0) {
+        trace_errno(LOG_INDENT("governor: ioprio_set"));
+    }
+    if (setpriority(PRIO_PROCESS, tid, class == GOVERNOR_FINISH ? 5 : 19) != 0) {
+        trace_errno(LOG_INDENT("governor: setpriority"));
+    }
+    if (governor != NULL) {
+        __atomic_add_fetch(&governor->classes[class].threads, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * How long to back off for while the foreground is congested, or 0.
+ */
+static int64_t backoff(struct governor *governor)
+{
+    uint64_t fast = __atomic_load_n(&governor->fast_ns, __ATOMIC_RELAXED);
+    uint64_t slow = __atomic_load_n(&governor->slow_ns, __ATOMIC_RELAXED);
+    int64_t pause;
+
+    if (fast < GOVERNOR_CONGESTED_NS || fast < GOVERNOR_CONGESTED * slow) {
+        return 0;
+    }
+    /* 10ms at the threshold, doubling with each further doubling of the ratio */
+    pause = 10000000LL * fast / (GOVERNOR_CONGESTED * (slow > 0 ? slow : 1));
+    return pause < GOVERNOR_MAX_BACKOFF_NS ? pause : GOVERNOR_MAX_BACKOFF_NS;
+}
+
+/**
+ * A background worker of class is about to do an I/O of bytes (0 for
+ * one that moves no data, such as a rename).  Returns when the class's
+ * budget allows it and the foreground isn't congested.
+ */
+void governor_io(struct local_context *context, int class, off_t bytes)
+{
+    struct governor *governor = context->governor;
+    struct governor_class *sc;
+    int64_t now, wait = 0, pause;
+
+    if (governor == NULL) {
+        return;
+    }
+    sc = &governor->classes[class];
+    __atomic_add_fetch(&sc->ios, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&sc->bytes, bytes, __ATOMIC_RELAXED);
+    if (class == GOVERNOR_FINISH) {
+        /* Collection waits on it - priority is all it gets */
+        return;
+    }
+    if (governor->rate > 0 || governor->iops > 0) {
+        now = now_ns();
+        pthread_mutex_lock(&sc->lock);
+        /* Budget unused for more than a second is lost */
+        if (sc->next < now - 1000000000LL) {
+            sc->next = now - 1000000000LL;
+        }
+        if (governor->rate > 0) {
+            /* In two parts - a whole file can be big enough to overflow 1000000000LL * bytes */
+            long long rate = governor->rate;
+            sc->next += bytes / rate * 1000000000LL + bytes % rate * 1000000000LL / rate;
+        }
+        if (governor->iops > 0) {
+            sc->next += 1000000000LL / (long long)governor->iops;
+        }
+        wait = sc->next - now;
+        pthread_mutex_unlock(&sc->lock);
+        if (wait > 0) {
+            __atomic_add_fetch(&sc->budget_ns, wait, __ATOMIC_RELAXED);
+            sleep_ns(wait);
+        }
+    }
+    while ((pause = backoff(governor)) > 0 && context->governor != NULL) {
+        __atomic_add_fetch(&sc->backoff_ns, pause, __ATOMIC_RELAXED);
+        sleep_ns(pause);
+        /* The averages only move with foreground operations - let them fade if there are none */
+        if (__atomic_load_n(&governor->fast_ns, __ATOMIC_RELAXED) > 0) {
+            __atomic_store_n(&governor->fast_ns, __atomic_load_n(&governor->fast_ns, __ATOMIC_RELAXED) * 3 / 4,
+                             __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/**
+ * change items have been added to (or taken off, if negative) a queue
+ * of class.
+ */
+void governor_queued(struct local_context *context, int class, int change)
+{
+    if (context->governor != NULL) {
+        __atomic_add_fetch(&context->governor->classes[class].queued, change, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * A foreground operation that began at started has finished.
+ */
+void governor_foreground(struct local_context *context, const struct timespec *started)
+{
+    struct governor *governor = context->governor;
+    struct timespec now;
+    int64_t took;
+    uint64_t fast, slow;
+
+    if (governor == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    took = (now.tv_sec - started->tv_sec) * 1000000000LL + now.tv_nsec - started->tv_nsec;
+    if (took < 0) {
+        return;
+    }
+    /* Lost updates between threads only make the averages a little rougher */
+    fast = __atomic_load_n(&governor->fast_ns, __ATOMIC_RELAXED);
+    slow = __atomic_load_n(&governor->slow_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&governor->fast_ns, fast + (took - (int64_t)fast) / 8, __ATOMIC_RELAXED);
+    __atomic_store_n(&governor->slow_ns, slow == 0 ? took : slow + (took - (int64_t)slow) / 1024, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&governor->foreground_ops, 1, __ATOMIC_RELAXED);
+}
+
+void governor_report(struct local_context *context, FILE *fp)
+{
+    struct governor *governor = context->governor;
+    int c;
+
+    if (governor == NULL) {
+        return;
+    }
+    fprintf(fp, "foreground ops %llu recent %.3fms usual %.3fms%s\n",
+            __atomic_load_n(&governor->foreground_ops, __ATOMIC_RELAXED),
+            __atomic_load_n(&governor->fast_ns, __ATOMIC_RELAXED) / 1e6,
+            __atomic_load_n(&governor->slow_ns, __ATOMIC_RELAXED) / 1e6, backoff(governor) > 0 ? " congested" : "");
+    fprintf(fp, "background %-8s %7s %7s %12s %16s %12s %12s\n", "class", "threads", "queued", "ios", "bytes",
+            "budget-s", "backoff-s");
+    for (c = 0; c < GOVERNOR_CLASSES; c++) {
+        struct governor_class *sc = &governor->classes[c];
+
+        fprintf(fp, "background %-8s %7d %7d %12llu %16llu %12.1f %12.1f\n", class_names[c],
+                __atomic_load_n(&sc->threads, __ATOMIC_RELAXED), __atomic_load_n(&sc->queued, __ATOMIC_RELAXED),
+                __atomic_load_n(&sc->ios, __ATOMIC_RELAXED), __atomic_load_n(&sc->bytes, __ATOMIC_RELAXED),
+                __atomic_load_n(&sc->budget_ns, __ATOMIC_RELAXED) / 1e9,
+                __atomic_load_n(&sc->backoff_ns, __ATOMIC_RELAXED) / 1e9);
+    }
+}
@@ -0,0 +1,49 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _GOVERNOR_H_
+#define _GOVERNOR_H_
+
+#include <stdio.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+
+/**
+ * Priority classes of background work, most urgent first.
+ */
+enum {
+    /** Finishing staged collections - the trash isn't complete until done */
+    GOVERNOR_FINISH,
+    /** Making the trash smaller or easier to search - dedup, delta, compress, pack, index, rmtree */
+    GOVERNOR_MAINTAIN,
+    /** Checking the trash - scrubbing */
+    GOVERNOR_VERIFY,
+    GOVERNOR_CLASSES
+};
+
+/**
+ * Background work backs off while foreground operations are taking
+ * more than GOVERNOR_CONGESTED times their usual time, and at least
+ * GOVERNOR_CONGESTED_NS.
+ */
+#define GOVERNOR_CONGESTED 2
+#define GOVERNOR_CONGESTED_NS 1000000
+
+/** The longest a single backoff lasts */
+#define GOVERNOR_MAX_BACKOFF_NS 1000000000
+
+int governor_start(struct local_context *context);
+void governor_stop(struct local_context *context);
+
+void governor_enter(struct local_context *context, int class);
+void governor_io(struct local_context *context, int class, off_t bytes);
+void governor_queued(struct local_context *context, int class, int change);
+
+void governor_foreground(struct local_context *context, const struct timespec *started);
+
+void governor_report(struct local_context *context, FILE *fp);
+
+#endif
@@ -0,0 +1,154 @@
+/**
+ * XXH64 - a fast non-cryptographic 64 bit hash, used to spot trash
+ * versions with identical content.
+ *
+ * The main loop works on four independent 64 bit lanes, so a
+ * superscalar CPU keeps several multiplies in flight at once and it
+ * runs at memory speed.  Collisions are harmless: anything that
+ * hashes the same is compared byte for byte before being shared.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#include <string.h>
+
+#include "hash.h"
+
+#define P1 11400714785074694791ULL
+#define P2 14029467366897019727ULL
+#define P3 1609587929392839161ULL
+#define P4 9650029242287828579ULL
+#define P5 2870177450012600261ULL
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+}
+
+static inline uint64_t merge64(uint64_t acc, uint64_t v)
+{
+    acc ^= round64(0, v);
+    return acc * P1 + P4;
+}
+
+void hash_init(struct hash_state *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->v[0] = P1 + P2;
+    state->v[1] = P2;
+    state->v[2] = 0;
+    state->v[3] = -P1;
+}
+
+/**
+ * Hash 32 byte stripes - the four lanes are independent.
+ */
+static const unsigned char *stripes(uint64_t v[4], const unsigned char *p, const unsigned char *end)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+
+    while (p + 32 <= end) {
+        v0 = round64(v0, read64(p));
+        v1 = round64(v1, read64(p + 8));
+        v2 = round64(v2, read64(p + 16));
+        v3 = round64(v3, read64(p + 24));
+        p += 32;
+    }
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    return p;
+}
+
+void hash_update(struct hash_state *state, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+
+    state->total += len;
+    if (state->buffered + len < 32) {
+        memcpy(state->buf + state->buffered, p, len);
+        state->buffered += len;
+        return;
+    }
+    if (state->buffered > 0) {
+        size_t fill = 32 - state->buffered;
+        memcpy(state->buf + state->buffered, p, fill);
+        stripes(state->v, state->buf, state->buf + 32);
+        p += fill;
+        state->buffered = 0;
+    }
+    p = stripes(state->v, p, end);
+    memcpy(state->buf, p, end - p);
+    state->buffered = end - p;
+}
+
+uint64_t hash_digest(const struct hash_state *state)
+{
+    const unsigned char *p = state->buf;
+    const unsigned char *end = p + state->buffered;
+    uint64_t h;
+
+    if (state->total >= 32) {
+        h = rotl(state->v[0], 1) + rotl(state->v[1], 7) + rotl(state->v[2], 12) + rotl(state->v[3], 18);
+        h = merge64(h, state->v[0]);
+        h = merge64(h, state->v[1]);
+        h = merge64(h, state->v[2]);
+        h = merge64(h, state->v[3]);
+    } else {
+        h = P5;
+    }
+    h += state->total;
+    for (; p + 8 <= end; p += 8) {
+        h ^= round64(0, read64(p));
+        h = rotl(h, 27) * P1 + P4;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * P1;
+        h = rotl(h, 23) * P2 + P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * P5;
+        h = rotl(h, 11) * P1;
+    }
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    struct hash_state state;
+
+    hash_init(&state);
+    hash_update(&state, data, len);
+    return hash_digest(&state);
+}
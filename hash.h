@@ -0,0 +1,28 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _HASH_H_
+#define _HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Incremental XXH64 state - feed it with hash_update() as data
+ * arrives then take the result with hash_digest().
+ */
+struct hash_state {
+    uint64_t total;
+    uint64_t v[4];
+    unsigned char buf[32];
+    size_t buffered;
+};
+
+void hash_init(struct hash_state *state);
+void hash_update(struct hash_state *state, const void *data, size_t len);
+uint64_t hash_digest(const struct hash_state *state);
+
+uint64_t hash_bytes(const void *data, size_t len);
+
+#endif
@@ -0,0 +1,1429 @@
+/**
+ * Search index - which trash versions have a name or content
+ * containing some text.
+ *
+ * "Which deleted file mentioned FooManager?" otherwise means grepping
+ * the whole trash.  With --index, each newly collected version is
+ * queued for a background thread that breaks its original path
+ * (folded to lower case) and, if it is at most a given size and not
+ * binary, its content into trigrams - every run of three bytes - and
+ * adds the version to a posting list for each distinct trigram.
+ * collectfs-search looks up the trigrams of the text it is given,
+ * intersects their lists, and checks just the versions left.
+ *
+ * The index lives in trashdir/.search as immutable segments, each
+ * written whole, flushed and renamed into place:
+ *
+ *     seg-000001    header, versions, trigram table, posting lists, strings
+ *     forgotten     versions removed from the trash since the last merge
+ *
+ * A segment is written every few seconds while versions are being
+ * collected.  When there are too many segments, or too much of the
+ * index has been forgotten, they are merged into one and forgotten
+ * is emptied.  Versions leave the index when --expire removes them,
+ * and every hour the thread walks the trash (and the packs) to index
+ * versions it missed - e.g. those collected before --index was given
+ * - and to forget versions purged by hand.
+ *
+ * Delta encoded, compressed and packed versions are searched by
+ * decoding them into an anonymous file.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "compress.h"
+#include "delta.h"
+#include "governor.h"
+#include "index.h"
+#include "layout.h"
+#include "log.h"
+#include "pack.h"
+
+#define INDEX_MAGIC 0x58494643u  /* "CFIX" */
+#define INDEX_SEGMENT "seg-%06u"
+#define INDEX_FORGOTTEN "forgotten"
+/** Name trigrams are kept apart from content trigrams by this bit */
+#define INDEX_NAME_BIT (1u << 24)
+/** Seconds to let a segment build up */
+#define INDEX_BATCH_DELAY 5
+/** Versions in a segment before it is written regardless */
+#define INDEX_BATCH_MAX 4096
+/** Segments before they are merged */
+#define INDEX_MAX_SEGMENTS 16
+/** Seconds between walks of the trash */
+#define INDEX_SWEEP_INTERVAL 3600
+/** Versions waiting beyond this are left for the next walk */
+#define INDEX_MAX_QUEUE 65536
+/** Content with a NUL in this many leading bytes is binary - only its name is indexed */
+#define INDEX_BINARY_PROBE 8192
+#define INDEX_CHUNK (1024 * 1024)
+
+struct index_header {
+    uint32_t magic;
+    uint32_t ndocs;
+    uint32_t ntrigrams;
+    uint32_t reserved;
+    /** Offset of the strings, which run to the end */
+    uint64_t strings;
+    /** Of the whole segment */
+    uint64_t size;
+};
+
+/**
+ * A version in a segment.  The strings are offsets from the start of
+ * the segment's strings.
+ */
+struct index_doc {
+    uint64_t relpath;
+    uint64_t path;
+    int64_t when;
+    int64_t size;
+};
+
+/**
+ * The trigram table is sorted by trigram.  Each one's posting list is
+ * count ascending version numbers starting first entries into the
+ * postings, which follow the table.
+ */
+struct index_trigram {
+    uint32_t trigram;
+    uint32_t count;
+    uint64_t first;
+};
+
+struct index_name {
+    struct index_name *next;
+    char name[];
+};
+
+/**
+ * A set of version paths.
+ */
+struct index_names {
+    struct index_name **buckets;
+    size_t nbuckets;
+    size_t count;
+};
+
+/**
+ * A trigram's posting list being built.  key is the trigram plus one,
+ * so 0 is a free slot.
+ */
+struct index_list {
+    uint32_t key;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *ids;
+};
+
+/**
+ * A segment being built.
+ */
+struct index_builder {
+    struct index_list *lists;
+    size_t nslots;
+    size_t nlists;
+    struct index_doc *docs;
+    uint32_t ndocs;
+    uint32_t capdocs;
+    char *strings;
+    uint64_t nstrings;
+    uint64_t capstrings;
+};
+
+struct index_segment {
+    unsigned number;
+    unsigned char *map;
+    size_t size;
+    const struct index_header *header;
+    const struct index_doc *docs;
+    const struct index_trigram *trigrams;
+    const uint32_t *postings;
+    uint64_t npostings;
+    const char *strings;
+    uint64_t nstrings;
+};
+
+struct index_reader {
+    char trashdir[PATH_MAX];
+    struct index_segment *segments;
+    int nsegments;
+    struct index_names forgotten;
+    struct pack_store *store;
+    int store_tried;
+};
+
+struct index_pending {
+    struct index_pending *next;
+    int forget;
+    char path[];
+};
+
+struct index {
+    struct local_context *context;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct index_pending *head;
+    struct index_pending *tail;
+    int queued;
+    int stopping;
+    /* Everything below belongs to the worker */
+    char dir[PATH_MAX - 32];
+    struct index_builder builder;
+    /** Versions in written segments or the builder, less those forgotten */
+    struct index_names indexed;
+    struct index_names forgotten;
+    int forgotten_fd;
+    unsigned next_segment;
+    int nsegments;
+    unsigned long long added, removed;
+};
+
+static size_t name_hash(const char *name)
+{
+    size_t h = 2166136261u;
+
+    for (; *name != '\0'; name++) {
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    }
+    return h;
+}
+
+static struct index_name **names_find(struct index_names *names, const char *name)
+{
+    struct index_name **link;
+
+    if (names->nbuckets == 0) {
+        return NULL;
+    }
+    for (link = &names->buckets[name_hash(name) % names->nbuckets]; *link != NULL; link = &(*link)->next) {
+        if (strcmp((*link)->name, name) == 0) {
+            break;
+        }
+    }
+    return link;
+}
+
+static int names_has(struct index_names *names, const char *name)
+{
+    struct index_name **link = names_find(names, name);
+
+    return link != NULL && *link != NULL;
+}
+
+static int names_add(struct index_names *names, const char *name)
+{
+    struct index_name **link, *entry;
+    size_t i;
+
+    if (names->count >= names->nbuckets) {
+        size_t nbuckets = names->nbuckets ? names->nbuckets * 2 : 1024;
+        struct index_name **buckets = calloc(nbuckets, sizeof(struct index_name *));
+        if (buckets == NULL) {
+            return -1;
+        }
+        for (i = 0; i < names->nbuckets; i++) {
+            while ((entry = names->buckets[i]) != NULL) {
+                names->buckets[i] = entry->next;
+                entry->next = buckets[name_hash(entry->name) % nbuckets];
+                buckets[name_hash(entry->name) % nbuckets] = entry;
+            }
+        }
+        free(names->buckets);
+        names->buckets = buckets;
+        names->nbuckets = nbuckets;
+    }
+    link = names_find(names, name);
+    if (*link != NULL) {
+        return 0;
+    }
+    entry = malloc(sizeof(struct index_name) + strlen(name) + 1);
+    if (entry == NULL) {
+        return -1;
+    }
+    strcpy(entry->name, name);
+    entry->next = NULL;
+    *link = entry;
+    names->count++;
+    return 1;
+}
+
+static void names_remove(struct index_names *names, const char *name)
+{
+    struct index_name **link = names_find(names, name), *entry;
+
+    if (link != NULL && (entry = *link) != NULL) {
+        *link = entry->next;
+        free(entry);
+        names->count--;
+    }
+}
+
+static void names_clear(struct index_names *names)
+{
+    struct index_name *entry;
+    size_t i;
+
+    for (i = 0; i < names->nbuckets; i++) {
+        while ((entry = names->buckets[i]) != NULL) {
+            names->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    free(names->buckets);
+    memset(names, 0, sizeof(*names));
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+    uint32_t ka = *(const uint32_t *)a, kb = *(const uint32_t *)b;
+
+    return ka < kb ? -1 : ka > kb;
+}
+
+/**
+ * Append the trigrams of text to keys, returning how many.  Names
+ * are folded to lower case.
+ */
+static size_t text_keys(const unsigned char *text, size_t len, int names, uint32_t *keys)
+{
+    size_t n = 0, i;
+
+    for (i = 0; i + 2 < len; i++) {
+        if (names) {
+            keys[n++] = INDEX_NAME_BIT | tolower(text[i]) << 16 | tolower(text[i + 1]) << 8 | tolower(text[i + 2]);
+        } else {
+            keys[n++] = text[i] << 16 | text[i + 1] << 8 | text[i + 2];
+        }
+    }
+    return n;
+}
+
+static size_t sort_unique(uint32_t *keys, size_t n)
+{
+    size_t i, out = 0;
+
+    qsort(keys, n, sizeof(uint32_t), compare_keys);
+    for (i = 0; i < n; i++) {
+        if (out == 0 || keys[out - 1] != keys[i]) {
+            keys[out++] = keys[i];
+        }
+    }
+    return out;
+}
+
+static void builder_free(struct index_builder *builder)
+{
+    size_t i;
+
+    for (i = 0; i < builder->nslots; i++) {
+        free(builder->lists[i].ids);
+    }
+    free(builder->lists);
+    free(builder->docs);
+    free(builder->strings);
+    memset(builder, 0, sizeof(*builder));
+}
+
+static int builder_string(struct index_builder *builder, const char *s, uint64_t *offset)
+{
+    size_t len = strlen(s) + 1;
+
+    if (builder->nstrings + len > builder->capstrings) {
+        uint64_t capacity = builder->capstrings ? builder->capstrings * 2 : 64 * 1024;
+        char *strings;
+        while (capacity < builder->nstrings + len) {
+            capacity *= 2;
+        }
+        if ((strings = realloc(builder->strings, capacity)) == NULL) {
+            return -1;
+        }
+        builder->strings = strings;
+        builder->capstrings = capacity;
+    }
+    memcpy(builder->strings + builder->nstrings, s, len);
+    *offset = builder->nstrings;
+    builder->nstrings += len;
+    return 0;
+}
+
+/**
+ * Add a version to the segment, returning its number in it.
+ */
+static int64_t builder_doc(struct index_builder *builder, const char *relpath, const char *path, time_t when,
+                           off_t size)
+{
+    struct index_doc *doc;
+
+    if (builder->ndocs == builder->capdocs) {
+        uint32_t capacity = builder->capdocs ? builder->capdocs * 2 : 1024;
+        struct index_doc *docs = realloc(builder->docs, capacity * sizeof(struct index_doc));
+        if (docs == NULL) {
+            return -1;
+        }
+        builder->docs = docs;
+        builder->capdocs = capacity;
+    }
+    doc = &builder->docs[builder->ndocs];
+    if (builder_string(builder, relpath, &doc->relpath) != 0 || builder_string(builder, path, &doc->path) != 0) {
+        return -1;
+    }
+    doc->when = when;
+    doc->size = size;
+    return builder->ndocs++;
+}
+
+static struct index_list *builder_slot(struct index_list *lists, size_t nslots, uint32_t key)
+{
+    size_t i = (key * 2654435761u) & (nslots - 1);
+
+    while (lists[i].key != 0 && lists[i].key != key) {
+        i = (i + 1) & (nslots - 1);
+    }
+    return &lists[i];
+}
+
+/**
+ * Add version id to trigram's posting list.  Versions are added in
+ * order, so the lists stay sorted.
+ */
+static int builder_add(struct index_builder *builder, uint32_t trigram, uint32_t id)
+{
+    struct index_list *list;
+    size_t i;
+
+    if (builder->nlists * 2 >= builder->nslots) {
+        size_t nslots = builder->nslots ? builder->nslots * 2 : 4096;
+        struct index_list *lists = calloc(nslots, sizeof(struct index_list));
+        if (lists == NULL) {
+            return -1;
+        }
+        for (i = 0; i < builder->nslots; i++) {
+            if (builder->lists[i].key != 0) {
+                *builder_slot(lists, nslots, builder->lists[i].key) = builder->lists[i];
+            }
+        }
+        free(builder->lists);
+        builder->lists = lists;
+        builder->nslots = nslots;
+    }
+    list = builder_slot(builder->lists, builder->nslots, trigram + 1);
+    if (list->key == 0) {
+        list->key = trigram + 1;
+        builder->nlists++;
+    }
+    if (list->count > 0 && list->ids[list->count - 1] == id) {
+        return 0;
+    }
+    if (list->count == list->capacity) {
+        uint32_t capacity = list->capacity ? list->capacity * 2 : 4;
+        uint32_t *ids = realloc(list->ids, capacity * sizeof(uint32_t));
+        if (ids == NULL) {
+            return -1;
+        }
+        list->ids = ids;
+        list->capacity = capacity;
+    }
+    list->ids[list->count++] = id;
+    return 0;
+}
+
+static int compare_lists(const void *a, const void *b)
+{
+    return compare_keys(&((const struct index_list *)a)->key, &((const struct index_list *)b)->key);
+}
+
+/**
+ * Write the builder out as segment number in dir.  The builder's
+ * table is sorted in the process, so it can only be freed after.
+ */
+static int builder_write(struct index_builder *builder, const char *dir, unsigned number)
+{
+    char segpath[PATH_MAX], tmppath[PATH_MAX];
+    struct index_header header;
+    size_t i, n = 0;
+    uint64_t first = 0;
+    FILE *fp;
+
+    snprintf(segpath, sizeof(segpath), "%s/" INDEX_SEGMENT, dir, number);
+    snprintf(tmppath, sizeof(tmppath), "%s/" INDEX_SEGMENT ".tmp", dir, number);
+    for (i = 0; i < builder->nslots; i++) {
+        if (builder->lists[i].key != 0) {
+            builder->lists[n++] = builder->lists[i];
+        }
+    }
+    /* The ids now belong to the packed entries only */
+    for (i = n; i < builder->nslots; i++) {
+        memset(&builder->lists[i], 0, sizeof(struct index_list));
+    }
+    qsort(builder->lists, n, sizeof(struct index_list), compare_lists);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.ndocs = builder->ndocs;
+    header.ntrigrams = n;
+    header.strings = sizeof(header) + (uint64_t)builder->ndocs * sizeof(struct index_doc)
+        + n * sizeof(struct index_trigram);
+    for (i = 0; i < n; i++) {
+        header.strings += builder->lists[i].count * sizeof(uint32_t);
+    }
+    header.size = header.strings + builder->nstrings;
+
+    if ((fp = fopen(tmppath, "w")) == NULL) {
+        return -1;
+    }
+    fwrite(&header, sizeof(header), 1, fp);
+    fwrite(builder->docs, sizeof(struct index_doc), builder->ndocs, fp);
+    for (i = 0; i < n; i++) {
+        struct index_trigram trigram = { builder->lists[i].key - 1, builder->lists[i].count, first };
+        fwrite(&trigram, sizeof(trigram), 1, fp);
+        first += trigram.count;
+    }
+    for (i = 0; i < n; i++) {
+        fwrite(builder->lists[i].ids, sizeof(uint32_t), builder->lists[i].count, fp);
+    }
+    fwrite(builder->strings, 1, builder->nstrings, fp);
+    if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) != 0) {
+        fclose(fp);
+        unlink(tmppath);
+        return -1;
+    }
+    fclose(fp);
+    if (rename(tmppath, segpath) != 0) {
+        unlink(tmppath);
+        return -1;
+    }
+    return 0;
+}
+
+static void segment_unmap(struct index_segment *segment)
+{
+    if (segment->map != NULL) {
+        munmap(segment->map, segment->size);
+    }
+    segment->map = NULL;
+}
+
+/**
+ * Map segment number in dir, checking it hangs together.
+ */
+static int segment_map(struct index_segment *segment, const char *dir, unsigned number)
+{
+    char segpath[PATH_MAX];
+    struct stat statbuf;
+    uint64_t postings;
+    int fd;
+
+    memset(segment, 0, sizeof(*segment));
+    segment->number = number;
+    snprintf(segpath, sizeof(segpath), "%s/" INDEX_SEGMENT, dir, number);
+    if ((fd = open(segpath, O_RDONLY)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &statbuf) != 0 || statbuf.st_size < sizeof(struct index_header)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    segment->size = statbuf.st_size;
+    segment->map = mmap(NULL, segment->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment->map == MAP_FAILED) {
+        segment->map = NULL;
+        return -1;
+    }
+    segment->header = (const struct index_header *)segment->map;
+    postings = sizeof(struct index_header) + (uint64_t)segment->header->ndocs * sizeof(struct index_doc)
+        + (uint64_t)segment->header->ntrigrams * sizeof(struct index_trigram);
+    if (segment->header->magic != INDEX_MAGIC || segment->header->size != segment->size
+        || segment->header->strings < postings || segment->header->strings > segment->size
+        || (segment->header->strings < segment->size && segment->map[segment->size - 1] != '\0')) {
+        log_info("Collectfs: ignoring damaged search segment %s", segpath);
+        segment_unmap(segment);
+        errno = EINVAL;
+        return -1;
+    }
+    segment->docs = (const struct index_doc *)(segment->map + sizeof(struct index_header));
+    segment->trigrams = (const struct index_trigram *)(segment->docs + segment->header->ndocs);
+    segment->postings = (const uint32_t *)(segment->trigrams + segment->header->ntrigrams);
+    segment->npostings = (segment->header->strings - postings) / sizeof(uint32_t);
+    segment->strings = (const char *)segment->map + segment->header->strings;
+    segment->nstrings = segment->size - segment->header->strings;
+    return 0;
+}
+
+static const char *segment_string(const struct index_segment *segment, uint64_t offset)
+{
+    return offset < segment->nstrings ? segment->strings + offset : NULL;
+}
+
+/**
+ * The posting list for trigram, or NULL if no version has it.
+ */
+static const uint32_t *segment_list(const struct index_segment *segment, uint32_t trigram, uint32_t *count)
+{
+    const struct index_trigram *found;
+    struct index_trigram key;
+
+    key.trigram = trigram;
+    found = bsearch(&key, segment->trigrams, segment->header->ntrigrams, sizeof(struct index_trigram),
+                    compare_keys);
+    if (found == NULL || found->first + found->count > segment->npostings) {
+        return NULL;
+    }
+    *count = found->count;
+    return segment->postings + found->first;
+}
+
+/**
+ * List the segment numbers in dir, in order.
+ */
+static int list_segments(const char *dir, unsigned **numbers)
+{
+    struct dirent *dirent;
+    unsigned number;
+    int n = 0, used;
+    DIR *dp;
+
+    *numbers = NULL;
+    if ((dp = opendir(dir)) == NULL) {
+        return -1;
+    }
+    while ((dirent = readdir(dp)) != NULL) {
+        if (sscanf(dirent->d_name, "seg-%u%n", &number, &used) == 1 && dirent->d_name[used] == '\0') {
+            unsigned *more = realloc(*numbers, (n + 1) * sizeof(unsigned));
+            if (more != NULL) {
+                *numbers = more;
+                (*numbers)[n++] = number;
+            }
+        }
+    }
+    closedir(dp);
+    qsort(*numbers, n, sizeof(unsigned), compare_keys);
+    return n;
+}
+
+/**
+ * Read the names in dir/forgotten, each NUL terminated.
+ */
+static void load_forgotten(const char *dir, struct index_names *forgotten)
+{
+    char fpath[PATH_MAX];
+    struct stat statbuf;
+    char *data, *p;
+    int fd;
+
+    snprintf(fpath, sizeof(fpath), "%s/%s", dir, INDEX_FORGOTTEN);
+    if ((fd = open(fpath, O_RDONLY)) < 0) {
+        return;
+    }
+    if (fstat(fd, &statbuf) == 0 && (data = malloc(statbuf.st_size + 1)) != NULL) {
+        ssize_t len = read(fd, data, statbuf.st_size);
+        if (len > 0) {
+            /* A torn last name is dropped */
+            data[len] = '\0';
+            for (p = data; p < data + len && memchr(p, '\0', data + len - p) != NULL; p += strlen(p) + 1) {
+                names_add(forgotten, p);
+            }
+        }
+        free(data);
+    }
+    close(fd);
+}
+
+/**
+ * Open the version at relpath (relative to trashdir and less any
+ * suffix) for reading.  Delta encoded, compressed and, given their
+ * store, packed versions are decoded into an anonymous file.
+ */
+int index_open_version(const char *trashdir, struct pack_store *store, const char *relpath)
+{
+    char fpath[PATH_MAX], encoded[PATH_MAX], dir[PATH_MAX];
+    int fd, rstatus, saved;
+
+    if (snprintf(fpath, sizeof(fpath), "%s/%s", trashdir, relpath) >= sizeof(fpath)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    fd = open(fpath, O_RDONLY | O_NOFOLLOW);
+    if (fd >= 0 || errno != ENOENT) {
+        return fd;
+    }
+    snprintf(dir, sizeof(dir), "%s/%s", trashdir, INDEX_FOLDER);
+    if ((fd = open(dir, O_TMPFILE | O_RDWR, 0600)) < 0 && (fd = open(P_tmpdir, O_TMPFILE | O_RDWR, 0600)) < 0) {
+        return -1;
+    }
+    if (snprintf(encoded, sizeof(encoded), "%s%s", fpath, COMPRESS_SUFFIX) < sizeof(encoded)
+        && access(encoded, F_OK) == 0) {
+        rstatus = compress_restore(encoded, fd);
+    } else if (snprintf(encoded, sizeof(encoded), "%s%s", fpath, DELTA_SUFFIX) < sizeof(encoded)
+               && access(encoded, F_OK) == 0) {
+        rstatus = delta_apply(encoded, fd);
+    } else if (store != NULL) {
+        rstatus = pack_store_extract(store, relpath, fd, NULL);
+    } else {
+        errno = ENOENT;
+        rstatus = -1;
+    }
+    if (rstatus != 0 || lseek(fd, 0, SEEK_SET) != 0) {
+        saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+struct index_reader *index_reader_open(const char *trashdir)
+{
+    struct index_reader *reader = calloc(1, sizeof(struct index_reader));
+    char dir[PATH_MAX];
+    unsigned *numbers;
+    int n, i;
+
+    if (reader == NULL) {
+        return NULL;
+    }
+    snprintf(reader->trashdir, sizeof(reader->trashdir), "%s", trashdir);
+    snprintf(dir, sizeof(dir), "%s/%s", trashdir, INDEX_FOLDER);
+    if ((n = list_segments(dir, &numbers)) < 0) {
+        free(reader);
+        return NULL;
+    }
+    reader->segments = calloc(n ? n : 1, sizeof(struct index_segment));
+    if (reader->segments == NULL) {
+        free(numbers);
+        free(reader);
+        return NULL;
+    }
+    for (i = 0; i < n; i++) {
+        /* A merge may have removed it since */
+        if (segment_map(&reader->segments[reader->nsegments], dir, numbers[i]) == 0) {
+            reader->nsegments++;
+        }
+    }
+    free(numbers);
+    load_forgotten(dir, &reader->forgotten);
+    return reader;
+}
+
+void index_reader_close(struct index_reader *reader)
+{
+    int i;
+
+    for (i = 0; i < reader->nsegments; i++) {
+        segment_unmap(&reader->segments[i]);
+    }
+    if (reader->store != NULL) {
+        pack_store_close(reader->store);
+    }
+    names_clear(&reader->forgotten);
+    free(reader->segments);
+    free(reader);
+}
+
+/**
+ * The versions in segment having every one of keys, or every version
+ * if there are no keys.  Returns how many.
+ */
+static size_t candidates(const struct index_segment *segment, const uint32_t *keys, size_t nkeys, uint32_t **ids)
+{
+    const uint32_t *list;
+    size_t n = 0, i, k;
+    uint32_t count;
+
+    *ids = NULL;
+    if (nkeys == 0) {
+        if ((*ids = malloc((segment->header->ndocs + 1) * sizeof(uint32_t))) == NULL) {
+            return 0;
+        }
+        for (n = 0; n < segment->header->ndocs; n++) {
+            (*ids)[n] = n;
+        }
+        return n;
+    }
+    for (k = 0; k < nkeys; k++) {
+        if ((list = segment_list(segment, keys[k], &count)) == NULL) {
+            free(*ids);
+            *ids = NULL;
+            return 0;
+        }
+        if (k == 0) {
+            if ((*ids = malloc(count * sizeof(uint32_t))) == NULL) {
+                return 0;
+            }
+            memcpy(*ids, list, count * sizeof(uint32_t));
+            n = count;
+            continue;
+        }
+        /* Both lists are sorted */
+        size_t out = 0;
+        for (i = 0; i < n && count > 0;) {
+            if ((*ids)[i] < *list) {
+                i++;
+            } else if ((*ids)[i] > *list) {
+                list++;
+                count--;
+            } else {
+                (*ids)[out++] = (*ids)[i++];
+            }
+        }
+        n = out;
+    }
+    return n;
+}
+
+/**
+ * Does the version at relpath contain text?
+ */
+static int version_contains(struct index_reader *reader, const char *relpath, const char *text, size_t len)
+{
+    char *buf = malloc(INDEX_CHUNK + len);
+    size_t kept = 0;
+    int fd, found = 0;
+    ssize_t n;
+
+    if (buf == NULL) {
+        return 0;
+    }
+    if (reader->store == NULL && !reader->store_tried) {
+        reader->store = pack_store_open(reader->trashdir, 0);
+        reader->store_tried = 1;
+    }
+    if ((fd = index_open_version(reader->trashdir, reader->store, relpath)) < 0) {
+        free(buf);
+        return 0;
+    }
+    while (!found && (n = read(fd, buf + kept, INDEX_CHUNK)) > 0) {
+        size_t have = kept + n;
+        found = memmem(buf, have, text, len) != NULL;
+        /* Keep enough of the end to find text spanning two reads */
+        kept = have < len - 1 ? have : len - 1;
+        memmove(buf, buf + have - kept, kept);
+    }
+    close(fd);
+    free(buf);
+    return found;
+}
+
+/**
+ * Call callback for each version whose original path (ignoring case)
+ * or content, as where asks, contains text, until it returns non
+ * zero.  Content searches need three or more characters.  Returns
+ * how many matched.
+ */
+int index_reader_search(struct index_reader *reader, const char *text, int where,
+                        int (*callback)(void *arg, const struct index_match *match), void *arg)
+{
+    size_t len = strlen(text), nnamekeys = 0, ncontentkeys = 0;
+    uint32_t *namekeys, *contentkeys;
+    struct index_names reported;
+    int matches = 0, stop = 0, s;
+
+    if ((where & INDEX_CONTENT) && len < 3) {
+        errno = EINVAL;
+        return -1;
+    }
+    namekeys = malloc((len + 1) * sizeof(uint32_t));
+    contentkeys = malloc((len + 1) * sizeof(uint32_t));
+    if (namekeys == NULL || contentkeys == NULL) {
+        free(namekeys);
+        free(contentkeys);
+        return -1;
+    }
+    nnamekeys = sort_unique(namekeys, text_keys((const unsigned char *)text, len, 1, namekeys));
+    ncontentkeys = sort_unique(contentkeys, text_keys((const unsigned char *)text, len, 0, contentkeys));
+    memset(&reported, 0, sizeof(reported));
+
+    for (s = 0; s < reader->nsegments && !stop; s++) {
+        const struct index_segment *segment = &reader->segments[s];
+        uint32_t *names = NULL, *contents = NULL;
+        size_t nnames = 0, ncontents = 0, i = 0, j = 0;
+
+        if (where & INDEX_NAMES) {
+            nnames = candidates(segment, namekeys, nnamekeys, &names);
+        }
+        if (where & INDEX_CONTENT) {
+            ncontents = candidates(segment, contentkeys, ncontentkeys, &contents);
+        }
+        while ((i < nnames || j < ncontents) && !stop) {
+            uint32_t id = j >= ncontents || (i < nnames && names[i] < contents[j]) ? names[i] : contents[j];
+            int in_names = i < nnames && names[i] == id, in_contents = j < ncontents && contents[j] == id;
+            struct index_match match;
+
+            i += in_names;
+            j += in_contents;
+            if (id >= segment->header->ndocs) {
+                continue;
+            }
+            match.relpath = segment_string(segment, segment->docs[id].relpath);
+            match.path = segment_string(segment, segment->docs[id].path);
+            if (match.relpath == NULL || match.path == NULL || names_has(&reader->forgotten, match.relpath)
+                || names_has(&reported, match.relpath)) {
+                continue;
+            }
+            match.when = segment->docs[id].when;
+            match.size = segment->docs[id].size;
+            match.where = 0;
+            if (in_names && strcasestr(match.path, text) != NULL) {
+                match.where |= INDEX_NAMES;
+            }
+            if (in_contents && version_contains(reader, match.relpath, text, len)) {
+                match.where |= INDEX_CONTENT;
+            }
+            if (match.where != 0) {
+                names_add(&reported, match.relpath);
+                matches++;
+                stop = callback(arg, &match) != 0;
+            }
+        }
+        free(names);
+        free(contents);
+    }
+    names_clear(&reported);
+    free(namekeys);
+    free(contentkeys);
+    return matches;
+}
+
+/**
+ * The path of trashed relative to the trash folder, less any delta
+ * or compressed suffix.
+ */
+static int version_relpath(struct index *index, const char *trashed, char relpath[PATH_MAX])
+{
+    const char *trashdir = index->context->trashdir;
+    size_t trashlen = strlen(trashdir), len;
+
+    if (strncmp(trashed, trashdir, trashlen) != 0 || trashed[trashlen] != '/') {
+        return -1;
+    }
+    snprintf(relpath, PATH_MAX, "%s", trashed + trashlen + 1);
+    len = strlen(relpath);
+    if (len > strlen(DELTA_SUFFIX) && strcmp(relpath + len - strlen(DELTA_SUFFIX), DELTA_SUFFIX) == 0) {
+        relpath[len - strlen(DELTA_SUFFIX)] = '\0';
+    } else if (len > strlen(COMPRESS_SUFFIX) && strcmp(relpath + len - strlen(COMPRESS_SUFFIX), COMPRESS_SUFFIX) == 0) {
+        relpath[len - strlen(COMPRESS_SUFFIX)] = '\0';
+    }
+    return 0;
+}
+
+/**
+ * Add the version at relpath, whose content can be read from fd, to
+ * the segment being built.
+ */
+static void index_version(struct index *index, const char *relpath, int fd, time_t when)
+{
+    struct index_builder *builder = &index->builder;
+    unsigned char *content = NULL;
+    char path[PATH_MAX];
+    struct stat statbuf;
+    const char *stamp;
+    uint32_t *keys;
+    ssize_t len = 0;
+    size_t nkeys, i;
+    int64_t id;
+
+    if (fstat(fd, &statbuf) != 0) {
+        return;
+    }
+    if (layout_original_path(index->context->layout, relpath, path, &stamp) != 0) {
+        snprintf(path, sizeof(path), "/%s", relpath);
+    }
+    if (statbuf.st_size > 0 && statbuf.st_size <= index->context->index_size
+        && (content = malloc(statbuf.st_size)) != NULL) {
+        governor_io(index->context, GOVERNOR_MAINTAIN, statbuf.st_size);
+        len = pread(fd, content, statbuf.st_size, 0);
+        if (len < 0 || memchr(content, '\0', len < INDEX_BINARY_PROBE ? len : INDEX_BINARY_PROBE) != NULL) {
+            len = 0;
+        }
+    }
+    keys = malloc((strlen(path) + len + 1) * sizeof(uint32_t));
+    if (keys == NULL || (id = builder_doc(builder, relpath, path, when, statbuf.st_size)) < 0) {
+        log_errno("Collectfs: cannot index %s", relpath);
+        free(keys);
+        free(content);
+        return;
+    }
+    nkeys = text_keys((const unsigned char *)path, strlen(path), 1, keys);
+    nkeys += text_keys(content, len, 0, keys + nkeys);
+    nkeys = sort_unique(keys, nkeys);
+    for (i = 0; i < nkeys; i++) {
+        if (builder_add(builder, keys[i], id) != 0) {
+            log_errno("Collectfs: cannot index %s", relpath);
+            break;
+        }
+    }
+    free(keys);
+    free(content);
+    names_add(&index->indexed, relpath);
+    index->added++;
+}
+
+static void merge(struct index *index);
+
+/**
+ * Write the segment being built.
+ */
+static void flush_segment(struct index *index)
+{
+    if (index->builder.ndocs == 0) {
+        return;
+    }
+    if (builder_write(&index->builder, index->dir, index->next_segment) == 0) {
+        index->next_segment++;
+        index->nsegments++;
+    } else {
+        log_errno("Collectfs: cannot write search segment %u", index->next_segment);
+    }
+    builder_free(&index->builder);
+    if (index->nsegments > INDEX_MAX_SEGMENTS
+        || (index->forgotten.count > 0 && index->forgotten.count * 4 > index->indexed.count)) {
+        merge(index);
+    }
+}
+
+/**
+ * Merge every segment into one, leaving out forgotten versions.
+ */
+static void merge(struct index *index)
+{
+    struct index_builder merged;
+    struct index_segment segment;
+    struct index_names seen;
+    char fpath[PATH_MAX];
+    unsigned *numbers;
+    int64_t *ids;
+    int n, i, failed = 0;
+    uint32_t d, t, p;
+
+    if ((n = list_segments(index->dir, &numbers)) <= 0) {
+        return;
+    }
+    memset(&merged, 0, sizeof(merged));
+    memset(&seen, 0, sizeof(seen));
+    for (i = 0; i < n && !failed; i++) {
+        if (segment_map(&segment, index->dir, numbers[i]) != 0) {
+            continue;
+        }
+        if ((ids = malloc((segment.header->ndocs + 1) * sizeof(int64_t))) == NULL) {
+            segment_unmap(&segment);
+            failed = 1;
+            break;
+        }
+        for (d = 0; d < segment.header->ndocs; d++) {
+            const char *relpath = segment_string(&segment, segment.docs[d].relpath);
+            const char *path = segment_string(&segment, segment.docs[d].path);
+            ids[d] = -1;
+            /* A crash part way through a merge leaves versions in two segments */
+            if (relpath != NULL && path != NULL && !names_has(&index->forgotten, relpath)
+                && names_add(&seen, relpath) > 0) {
+                ids[d] = builder_doc(&merged, relpath, path, segment.docs[d].when, segment.docs[d].size);
+                failed |= ids[d] < 0;
+            }
+        }
+        for (t = 0; t < segment.header->ntrigrams && !failed; t++) {
+            const struct index_trigram *trigram = &segment.trigrams[t];
+            if (trigram->first + trigram->count > segment.npostings) {
+                continue;
+            }
+            for (p = 0; p < trigram->count; p++) {
+                uint32_t id = segment.postings[trigram->first + p];
+                if (id < segment.header->ndocs && ids[id] >= 0 && builder_add(&merged, trigram->trigram, ids[id]) != 0) {
+                    failed = 1;
+                    break;
+                }
+            }
+        }
+        free(ids);
+        segment_unmap(&segment);
+    }
+    names_clear(&seen);
+    if (failed || (merged.ndocs > 0 && builder_write(&merged, index->dir, index->next_segment) != 0)) {
+        log_errno("Collectfs: cannot merge the search index");
+        builder_free(&merged);
+        free(numbers);
+        return;
+    }
+    index->nsegments = merged.ndocs > 0;
+    index->next_segment += merged.ndocs > 0;
+    builder_free(&merged);
+    for (i = 0; i < n; i++) {
+        snprintf(fpath, sizeof(fpath), "%s/" INDEX_SEGMENT, index->dir, numbers[i]);
+        unlink(fpath);
+    }
+    free(numbers);
+    /* Only now is nothing forgotten left in a segment */
+    if (index->forgotten_fd >= 0 && ftruncate(index->forgotten_fd, 0) != 0) {
+        log_errno("Collectfs: cannot empty %s/%s", index->dir, INDEX_FORGOTTEN);
+    }
+    names_clear(&index->forgotten);
+}
+
+static void forget(struct index *index, const char *relpath)
+{
+    if (!names_has(&index->indexed, relpath)) {
+        return;
+    }
+    names_remove(&index->indexed, relpath);
+    names_add(&index->forgotten, relpath);
+    if (index->forgotten_fd >= 0 && write(index->forgotten_fd, relpath, strlen(relpath) + 1) < 0) {
+        log_errno("Collectfs: cannot write %s/%s", index->dir, INDEX_FORGOTTEN);
+    }
+    index->removed++;
+}
+
+struct index_sweep {
+    struct index *index;
+    struct pack_store *store;
+    struct index_names seen;
+};
+
+/**
+ * Note and, if need be, index each version under dir.
+ */
+static void sweep_trash(struct index_sweep *sweep, const char *dir, int top)
+{
+    struct index *index = sweep->index;
+    char fpath[PATH_MAX], relpath[PATH_MAX];
+    struct dirent *dirent;
+    struct stat sb;
+    DIR *dp = opendir(dir);
+    int fd;
+
+    if (dp == NULL) {
+        return;
+    }
+    while ((dirent = readdir(dp)) != NULL && !index->stopping) {
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+            || snprintf(fpath, sizeof(fpath), "%s/%s", dir, name) >= sizeof(fpath) || lstat(fpath, &sb) != 0) {
+            continue;
+        }
+        /* collectfs's own - versions of hidden files always have a stamp */
+        if (top && name[0] == '.' && (S_ISDIR(sb.st_mode) || strchr(name + 1, '.') == NULL)) {
+            continue;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            sweep_trash(sweep, fpath, 0);
+        } else if (S_ISREG(sb.st_mode) && layout_stamp_at(name) != 0 && version_relpath(index, fpath, relpath) == 0) {
+            names_add(&sweep->seen, relpath);
+            if (!names_has(&index->indexed, relpath)
+                && (fd = index_open_version(index->context->trashdir, NULL, relpath)) >= 0) {
+                index_version(index, relpath, fd, sb.st_ctime);
+                close(fd);
+            }
+        }
+    }
+    closedir(dp);
+}
+
+static int sweep_packed(void *arg, const struct pack_version *version)
+{
+    struct index_sweep *sweep = (struct index_sweep *)arg;
+    struct index *index = sweep->index;
+    int fd;
+
+    names_add(&sweep->seen, version->path);
+    if (!names_has(&index->indexed, version->path)
+        && (fd = index_open_version(index->context->trashdir, sweep->store, version->path)) >= 0) {
+        index_version(index, version->path, fd, version->when);
+        close(fd);
+    }
+    return index->stopping;
+}
+
+/**
+ * Index the versions in the trash that aren't, and forget those that
+ * are no longer there.
+ */
+static void sweep(struct index *index)
+{
+    struct index_sweep sweep;
+    struct index_name *entry;
+    char **gone = NULL;
+    size_t ngone = 0, i;
+
+    memset(&sweep, 0, sizeof(sweep));
+    sweep.index = index;
+    index->added = index->removed = 0;
+    /* The walk comes first - packing removes a version from the trash after it is in a pack */
+    sweep_trash(&sweep, index->context->trashdir, 1);
+    if ((sweep.store = pack_store_open(index->context->trashdir, 0)) != NULL) {
+        pack_store_foreach(sweep.store, sweep_packed, &sweep);
+        pack_store_close(sweep.store);
+    }
+    if (!index->stopping && index->indexed.count > 0) {
+        gone = malloc(index->indexed.count * sizeof(char *));
+    }
+    for (i = 0; gone != NULL && i < index->indexed.nbuckets; i++) {
+        for (entry = index->indexed.buckets[i]; entry != NULL; entry = entry->next) {
+            if (!names_has(&sweep.seen, entry->name)) {
+                gone[ngone++] = strdup(entry->name);
+            }
+        }
+    }
+    for (i = 0; i < ngone; i++) {
+        if (gone[i] != NULL) {
+            forget(index, gone[i]);
+            free(gone[i]);
+        }
+    }
+    free(gone);
+    names_clear(&sweep.seen);
+    if (index->added > 0 || index->removed > 0) {
+        log_info("Collectfs: search index added %llu versions, removed %llu", index->added, index->removed);
+    }
+    flush_segment(index);
+}
+
+static void *index_worker(void *arg)
+{
+    struct index *index = (struct index *)arg;
+    struct index_pending *pending;
+    char relpath[PATH_MAX];
+    time_t next_sweep = 0, flush_at = 0;
+    int fd;
+
+    governor_enter(index->context, GOVERNOR_MAINTAIN);
+    pthread_mutex_lock(&index->lock);
+    while (!index->stopping) {
+        struct timespec wait;
+
+        if (time(NULL) >= next_sweep) {
+            pthread_mutex_unlock(&index->lock);
+            sweep(index);
+            flush_at = 0;
+            next_sweep = time(NULL) + INDEX_SWEEP_INTERVAL;
+            pthread_mutex_lock(&index->lock);
+            continue;
+        }
+        if (flush_at != 0 && time(NULL) >= flush_at) {
+            pthread_mutex_unlock(&index->lock);
+            flush_segment(index);
+            flush_at = 0;
+            pthread_mutex_lock(&index->lock);
+            continue;
+        }
+        if (index->head == NULL) {
+            clock_gettime(CLOCK_REALTIME, &wait);
+            wait.tv_sec += (flush_at != 0 ? flush_at : next_sweep) - time(NULL);
+            pthread_cond_timedwait(&index->work, &index->lock, &wait);
+            continue;
+        }
+        pending = index->head;
+        index->head = index->tail = NULL;
+        governor_queued(index->context, GOVERNOR_MAINTAIN, -index->queued);
+        index->queued = 0;
+        pthread_mutex_unlock(&index->lock);
+
+        while (pending != NULL) {
+            struct index_pending *next = pending->next;
+            if (version_relpath(index, pending->path, relpath) == 0) {
+                if (pending->forget) {
+                    forget(index, relpath);
+                } else if (!names_has(&index->indexed, relpath)
+                           && (fd = open(pending->path, O_RDONLY | O_NOFOLLOW)) >= 0) {
+                    /* Gone already (e.g. packed) - the next sweep will find it */
+                    struct stat sb;
+                    if (fstat(fd, &sb) == 0) {
+                        index_version(index, relpath, fd, sb.st_ctime);
+                    }
+                    close(fd);
+                }
+            }
+            free(pending);
+            pending = next;
+        }
+        if (index->builder.ndocs >= INDEX_BATCH_MAX) {
+            flush_segment(index);
+            flush_at = 0;
+        } else if (index->builder.ndocs > 0 && flush_at == 0) {
+            flush_at = time(NULL) + INDEX_BATCH_DELAY;
+        }
+
+        pthread_mutex_lock(&index->lock);
+    }
+    pthread_mutex_unlock(&index->lock);
+    return NULL;
+}
+
+/**
+ * Note what the segments already hold.
+ */
+static void load_segments(struct index *index)
+{
+    struct index_segment segment;
+    unsigned *numbers;
+    int n, i;
+    uint32_t d;
+
+    load_forgotten(index->dir, &index->forgotten);
+    n = list_segments(index->dir, &numbers);
+    for (i = 0; i < n; i++) {
+        index->next_segment = numbers[i] + 1;
+        if (segment_map(&segment, index->dir, numbers[i]) != 0) {
+            continue;
+        }
+        index->nsegments++;
+        for (d = 0; d < segment.header->ndocs; d++) {
+            const char *relpath = segment_string(&segment, segment.docs[d].relpath);
+            if (relpath != NULL && !names_has(&index->forgotten, relpath)) {
+                names_add(&index->indexed, relpath);
+            }
+        }
+        segment_unmap(&segment);
+    }
+    free(numbers);
+    if (index->next_segment == 0) {
+        index->next_segment = 1;
+    }
+}
+
+int index_start(struct local_context *context)
+{
+    struct index *index = calloc(1, sizeof(struct index));
+    char fpath[PATH_MAX];
+
+    if (index == NULL) {
+        return log_errno("index_start");
+    }
+    index->context = context;
+    index->forgotten_fd = -1;
+    if (snprintf(index->dir, sizeof(index->dir), "%s/%s", context->trashdir, INDEX_FOLDER) >= sizeof(index->dir)) {
+        free(index);
+        errno = ENAMETOOLONG;
+        return log_errno("Collectfs: cannot index %s", context->trashdir);
+    }
+    /* Nothing may have been collected yet */
+    if ((mkdir(context->trashdir, 0700) != 0 && errno != EEXIST) || (mkdir(index->dir, 0700) != 0 && errno != EEXIST)) {
+        log_errno("Collectfs: cannot create %s", index->dir);
+        free(index);
+        return -1;
+    }
+    load_segments(index);
+    snprintf(fpath, sizeof(fpath), "%s/%s", index->dir, INDEX_FORGOTTEN);
+    index->forgotten_fd = open(fpath, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (index->forgotten_fd < 0) {
+        log_errno("Collectfs: cannot open %s - removed versions stay in the index until the next merge", fpath);
+    }
+    pthread_mutex_init(&index->lock, NULL);
+    pthread_cond_init(&index->work, NULL);
+    if (pthread_create(&index->thread, NULL, index_worker, index) != 0) {
+        log_errno("Collectfs: cannot start index thread");
+        pthread_cond_destroy(&index->work);
+        pthread_mutex_destroy(&index->lock);
+        if (index->forgotten_fd >= 0) {
+            close(index->forgotten_fd);
+        }
+        names_clear(&index->indexed);
+        names_clear(&index->forgotten);
+        free(index);
+        return -1;
+    }
+    context->index = index;
+    log_info("Collectfs: indexing trash names and content of up to %lld bytes (%zu versions indexed)",
+             (long long)context->index_size, index->indexed.count);
+    return 0;
+}
+
+void index_stop(struct local_context *context)
+{
+    struct index *index = context->index;
+    struct index_pending *pending;
+
+    if (index == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&index->lock);
+    index->stopping = 1;
+    pthread_cond_signal(&index->work);
+    pthread_mutex_unlock(&index->lock);
+    pthread_join(index->thread, NULL);
+    context->index = NULL;
+
+    flush_segment(index);
+    if (index->queued > 0) {
+        log_info("Collectfs: %d versions were left for the next index sweep", index->queued);
+    }
+    while ((pending = index->head) != NULL) {
+        index->head = pending->next;
+        free(pending);
+    }
+    if (index->forgotten_fd >= 0) {
+        close(index->forgotten_fd);
+    }
+    builder_free(&index->builder);
+    names_clear(&index->indexed);
+    names_clear(&index->forgotten);
+    pthread_cond_destroy(&index->work);
+    pthread_mutex_destroy(&index->lock);
+    free(index);
+}
+
+static void enqueue(struct local_context *context, const char *trashed, int forget)
+{
+    struct index *index = context->index;
+    struct index_pending *pending;
+
+    if (index == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&index->lock);
+    if (index->queued < INDEX_MAX_QUEUE
+        && (pending = malloc(sizeof(struct index_pending) + strlen(trashed) + 1)) != NULL) {
+        strcpy(pending->path, trashed);
+        pending->forget = forget;
+        pending->next = NULL;
+        if (index->tail != NULL) {
+            index->tail->next = pending;
+        } else {
+            index->head = pending;
+        }
+        index->tail = pending;
+        index->queued++;
+        governor_queued(context, GOVERNOR_MAINTAIN, 1);
+        pthread_cond_signal(&index->work);
+    }
+    pthread_mutex_unlock(&index->lock);
+}
+
+/**
+ * Queue a version just put in the trash at trashed (a full path) for
+ * indexing.
+ */
+void index_queue(struct local_context *context, const char *trashed)
+{
+    enqueue(context, trashed, 0);
+}
+
+/**
+ * Queue the removal from the index of a version just removed from the
+ * trash.
+ */
+void index_forget(struct local_context *context, const char *trashed)
+{
+    enqueue(context, trashed, 1);
+}
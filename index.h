@@ -0,0 +1,50 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _INDEX_H_
+#define _INDEX_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "collectfs.h"
+#include "pack.h"
+
+/**
+ * The search index lives in this folder at the top of the trash.
+ */
+#define INDEX_FOLDER ".search"
+
+/**
+ * What a search looks at, and what matched.
+ */
+#define INDEX_NAMES 1
+#define INDEX_CONTENT 2
+
+struct index_reader;
+
+struct index_match {
+    /** The version, relative to trashdir, less any delta or compressed suffix */
+    const char *relpath;
+    /** Where it was collected from */
+    const char *path;
+    time_t when;
+    off_t size;
+    int where;
+};
+
+struct index_reader *index_reader_open(const char *trashdir);
+void index_reader_close(struct index_reader *reader);
+int index_reader_search(struct index_reader *reader, const char *text, int where,
+                        int (*callback)(void *arg, const struct index_match *match), void *arg);
+
+int index_open_version(const char *trashdir, struct pack_store *store, const char *relpath);
+
+int index_start(struct local_context *context);
+void index_stop(struct local_context *context);
+
+void index_queue(struct local_context *context, const char *trashed);
+void index_forget(struct local_context *context, const char *trashed);
+
+#endif
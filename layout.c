@@ -0,0 +1,267 @@
+/**
+ * Trash layouts - where in the trash folder a collected version goes.
+ *
+ *     mirrored  trashdir/<original path>.<stamp>
+ *     time      trashdir/<YYYY-MM-DD.HH>/<original path>.<stamp>
+ *     hashed    trashdir/<xx>/<yy>/<escaped original path>.<stamp>
+ *
+ * where <stamp> is YYYY-MM-DD.HH:MM:SS[-NNNN].  Mirrored is the
+ * original layout.  Time partitions the trash into an hourly bucket
+ * per collection time so that expiring old versions removes whole
+ * buckets.  Hashed spreads versions over 65536 directories by a hash
+ * of the original path, so no directory grows large however many hot
+ * files share a folder.  Its names are the whole original path with /
+ * escaped as %2F (and % as %25), so every version of a file sits in
+ * the same directory; a path too long to escape into a single name
+ * falls back to the mirrored layout.
+ *
+ * collectfs-migrate moves a trash from one layout to another.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "compress.h"
+#include "delta.h"
+#include "layout.h"
+
+/** Room left in an escaped name for the stamp and an encoding suffix */
+#define LAYOUT_STAMP_ROOM 40
+
+static const char *names[] = { "mirrored", "time", "hashed" };
+
+int layout_parse(const char *name)
+{
+    int layout;
+
+    for (layout = 0; layout < sizeof(names) / sizeof(names[0]); layout++) {
+        if (strcmp(name, names[layout]) == 0) {
+            return layout;
+        }
+    }
+    return -1;
+}
+
+const char *layout_name(int layout)
+{
+    return names[layout];
+}
+
+static unsigned path_hash(const char *path)
+{
+    unsigned h = 2166136261u;
+
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * Escape path, less its leading slashes, into a single name.
+ */
+static int escape(const char *path, char *name, size_t size)
+{
+    size_t n = 0;
+
+    while (*path == '/') {
+        path++;
+    }
+    for (; *path != '\0'; path++) {
+        if (n + 4 > size) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (*path == '/' || *path == '%') {
+            n += sprintf(name + n, "%%%02X", (unsigned char)*path);
+        } else {
+            name[n++] = *path;
+        }
+    }
+    name[n] = '\0';
+    return 0;
+}
+
+static int unescape(const char *name, size_t len, char *path, size_t size)
+{
+    size_t n = 0, i;
+
+    path[n++] = '/';
+    for (i = 0; i < len; i++) {
+        unsigned c;
+        if (n + 1 >= size) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        if (name[i] == '%' && i + 2 < len && sscanf(name + i + 1, "%2X", &c) == 1) {
+            path[n++] = c;
+            i += 2;
+        } else {
+            path[n++] = name[i];
+        }
+    }
+    path[n] = '\0';
+    return 0;
+}
+
+/**
+ * Build the trash path - all but the stamp - for a version of path (a
+ * fuse path, starting with /) collected at when.
+ * Sets errno on error.
+ */
+int layout_trash_path(int layout, const char *trashdir, const char *path, time_t when, char trashpath[PATH_MAX])
+{
+    char name[NAME_MAX + 1];
+    struct tm tmbuf;
+    int n;
+
+    switch (layout) {
+    case LAYOUT_TIME:
+        if (localtime_r(&when, &tmbuf) == NULL) {
+            return -1;
+        }
+        n = snprintf(trashpath, PATH_MAX, "%s/%04d-%02d-%02d.%02d%s", trashdir, tmbuf.tm_year + 1900,
+                     tmbuf.tm_mon + 1, tmbuf.tm_mday, tmbuf.tm_hour, path);
+        break;
+    case LAYOUT_HASHED:
+        if (escape(path, name, sizeof(name) - LAYOUT_STAMP_ROOM) == 0) {
+            unsigned h = path_hash(path);
+            n = snprintf(trashpath, PATH_MAX, "%s/%02x/%02x/%s", trashdir, h >> 24, (h >> 16) & 0xff, name);
+            break;
+        }
+        /* Too long for one name - fall through to mirrored */
+    default:
+        n = snprintf(trashpath, PATH_MAX, "%s%s", trashdir, path);
+        break;
+    }
+    if (n >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Where in name the stamp starts - the dot before
+ * YYYY-MM-DD.HH:MM:SS, which may be followed by -NNNN and a delta or
+ * compressed suffix.  0 if name isn't a version.
+ */
+size_t layout_stamp_at(const char *name)
+{
+    static const char *format = ".dddd-dd-dd.dd:dd:dd";
+    const char *dot;
+
+    for (dot = strchr(name + 1, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+        const char *p = dot;
+        const char *f;
+        for (f = format; *f != '\0' && *p != '\0'; f++, p++) {
+            if (*f == 'd' ? !isdigit((unsigned char)*p) : *p != *f) {
+                break;
+            }
+        }
+        if (*f != '\0') {
+            continue;
+        }
+        if (p[0] == '-' && isdigit((unsigned char)p[1]) && isdigit((unsigned char)p[2])
+            && isdigit((unsigned char)p[3]) && isdigit((unsigned char)p[4])) {
+            p += 5;
+        }
+        if (strcmp(p, DELTA_SUFFIX) == 0 || strcmp(p, COMPRESS_SUFFIX) == 0) {
+            p += strlen(p);
+        }
+        if (*p == '\0') {
+            return dot - name;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Is name a time layout bucket?  If so set *start to the beginning
+ * of its hour.
+ */
+int layout_bucket_time(const char *name, time_t *start)
+{
+    struct tm tmbuf;
+    int used = 0;
+
+    memset(&tmbuf, 0, sizeof(tmbuf));
+    if (sscanf(name, "%4d-%2d-%2d.%2d%n", &tmbuf.tm_year, &tmbuf.tm_mon, &tmbuf.tm_mday, &tmbuf.tm_hour, &used) != 4
+        || used != 13 || name[used] != '\0') {
+        return 0;
+    }
+    tmbuf.tm_year -= 1900;
+    tmbuf.tm_mon -= 1;
+    tmbuf.tm_isdst = -1;
+    *start = mktime(&tmbuf);
+    return *start != -1;
+}
+
+static int is_hex_dir(const char *name, size_t len)
+{
+    return len == 2 && isxdigit((unsigned char)name[0]) && isxdigit((unsigned char)name[1]);
+}
+
+/**
+ * Work out the original path (a fuse path) of the version at relpath,
+ * relative to the trash folder, in the given layout.  *stamp is set
+ * to where the stamp starts in relpath.
+ * Fails with EINVAL if relpath isn't a version in that layout.
+ */
+int layout_original_path(int layout, const char *relpath, char path[PATH_MAX], const char **stamp)
+{
+    const char *name = strrchr(relpath, '/') ? strrchr(relpath, '/') + 1 : relpath;
+    size_t at = layout_stamp_at(name);
+    const char *slash;
+    time_t start;
+
+    if (at == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    *stamp = name + at;
+    switch (layout) {
+    case LAYOUT_TIME:
+        slash = strchr(relpath, '/');
+        if (slash == NULL) {
+            break;
+        }
+        char bucket[16];
+        if (slash - relpath >= sizeof(bucket)) {
+            break;
+        }
+        memcpy(bucket, relpath, slash - relpath);
+        bucket[slash - relpath] = '\0';
+        if (!layout_bucket_time(bucket, &start) || *stamp - slash >= PATH_MAX) {
+            break;
+        }
+        memcpy(path, slash, *stamp - slash);
+        path[*stamp - slash] = '\0';
+        return 0;
+    case LAYOUT_HASHED:
+        if (name - relpath == 6 && is_hex_dir(relpath, 2) && relpath[2] == '/' && is_hex_dir(relpath + 3, 2)
+            && relpath[5] == '/') {
+            return unescape(name, at, path, PATH_MAX);
+        }
+        /* Fell back to mirrored */
+    default:
+        if (*stamp - relpath + 1 >= PATH_MAX) {
+            break;
+        }
+        path[0] = '/';
+        memcpy(path + 1, relpath, *stamp - relpath);
+        path[*stamp - relpath + 1] = '\0';
+        return 0;
+    }
+    errno = EINVAL;
+    return -1;
+}
@@ -0,0 +1,29 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <limits.h>
+#include <time.h>
+
+/**
+ * How collected versions are arranged in the trash folder.
+ */
+enum {
+    LAYOUT_MIRRORED,
+    LAYOUT_TIME,
+    LAYOUT_HASHED,
+};
+
+int layout_parse(const char *name);
+const char *layout_name(int layout);
+
+int layout_trash_path(int layout, const char *trashdir, const char *path, time_t when, char trashpath[PATH_MAX]);
+int layout_original_path(int layout, const char *relpath, char path[PATH_MAX], const char **stamp);
+
+size_t layout_stamp_at(const char *name);
+int layout_bucket_time(const char *name, time_t *start);
+
+#endif
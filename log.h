@@ -10,6 +10,11 @@
 
 #define LOG_INDENT(str) ("    " str)
 
+struct fuse_file_info;
+struct stat;
+struct statvfs;
+struct utimbuf;
+
 void log_open();
 
 void log_info(const char *format, ...);
@@ -0,0 +1,325 @@
+/**
+ * collectfs-migrate - move a trash folder from one layout to another.
+ *
+ * Every version found in the trash in the --from layout is renamed to
+ * where the --to layout would have put it, keeping its stamp (and any
+ * delta or compressed suffix), and directories left empty are
+ * removed.  The trash should not be in use - unmount it first:
+ *
+ *     collectfs-migrate [-n] --from=LAYOUT --to=LAYOUT trashdir
+ *
+ * With -n the moves are listed but not made.  Deltas refer to their
+ * base by a path relative to their own directory, so a delta that
+ * moves to a different depth has that path rewritten.  Versions held
+ * in pack files keep the names they were packed under, and
+ * deduplication starts over remembering content.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "delta.h"
+#include "layout.h"
+#include "log.h"
+#include "trash.h"
+
+struct versions {
+    char **relpaths;
+    size_t count;
+    size_t capacity;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n] --from=mirrored|time|hashed --to=mirrored|time|hashed trashdir\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static void add_version(struct versions *versions, const char *relpath)
+{
+    if (versions->count == versions->capacity) {
+        versions->capacity = versions->capacity ? versions->capacity * 2 : 1024;
+        versions->relpaths = realloc(versions->relpaths, versions->capacity * sizeof(char *));
+        if (versions->relpaths == NULL) {
+            perror("collectfs-migrate");
+            exit(EXIT_FAILURE);
+        }
+    }
+    versions->relpaths[versions->count++] = strdup(relpath);
+}
+
+/**
+ * Is a top level entry one of collectfs's own - the dedup index,
+ * delta bases, packs, staging - rather than part of the layout?
+ */
+static int is_internal(const char *name, const struct stat *sb)
+{
+    return name[0] == '.' && (S_ISDIR(sb->st_mode) || strchr(name + 1, '.') == NULL);
+}
+
+static int is_hex_dir(const char *name)
+{
+    return strlen(name) == 2 && strspn(name, "0123456789abcdef") == 2;
+}
+
+/**
+ * Find the versions in the directory trashdir/relpath, which is depth
+ * levels down.  Only the levels that belong to the layout are looked
+ * at - buckets for time, two levels of hex directories for hashed.
+ */
+static void find_versions(const char *trashdir, const char *relpath, int layout, int depth,
+                          struct versions *versions)
+{
+    char dir[PATH_MAX], child[PATH_MAX], fpath[PATH_MAX];
+    struct dirent *dirent;
+    struct stat sb;
+    time_t start;
+    DIR *dp;
+
+    snprintf(dir, sizeof(dir), "%s%s%s", trashdir, relpath[0] ? "/" : "", relpath);
+    if ((dp = opendir(dir)) == NULL) {
+        perror(dir);
+        return;
+    }
+    while ((dirent = readdir(dp)) != NULL) {
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+            || snprintf(child, sizeof(child), "%s%s%s", relpath, relpath[0] ? "/" : "", name) >= sizeof(child)
+            || snprintf(fpath, sizeof(fpath), "%s/%s", trashdir, child) >= sizeof(fpath) || lstat(fpath, &sb) != 0) {
+            continue;
+        }
+        if (depth == 0 && is_internal(name, &sb)) {
+            continue;
+        }
+        if (layout == LAYOUT_TIME && depth == 0 && !(S_ISDIR(sb.st_mode) && layout_bucket_time(name, &start))) {
+            continue;
+        }
+        if (layout == LAYOUT_HASHED && depth < 2 && !(S_ISDIR(sb.st_mode) && is_hex_dir(name))) {
+            continue;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            if (layout != LAYOUT_HASHED || depth < 2) {
+                find_versions(trashdir, child, layout, depth + 1, versions);
+            }
+        } else if (S_ISREG(sb.st_mode) && layout_stamp_at(name) != 0) {
+            add_version(versions, child);
+        }
+    }
+    closedir(dp);
+}
+
+/**
+ * Remove the directories under trashdir/relpath left empty.
+ */
+static void remove_empty(const char *trashdir, const char *relpath, int depth)
+{
+    char dir[PATH_MAX], fpath[PATH_MAX];
+    struct dirent *dirent;
+    struct stat sb;
+    DIR *dp;
+
+    snprintf(dir, sizeof(dir), "%s%s%s", trashdir, relpath[0] ? "/" : "", relpath);
+    if ((dp = opendir(dir)) == NULL) {
+        return;
+    }
+    while ((dirent = readdir(dp)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0
+            || snprintf(fpath, sizeof(fpath), "%s/%s", dir, dirent->d_name) >= sizeof(fpath)
+            || lstat(fpath, &sb) != 0 || !S_ISDIR(sb.st_mode) || (depth == 0 && is_internal(dirent->d_name, &sb))) {
+            continue;
+        }
+        remove_empty(trashdir, fpath + strlen(trashdir) + 1, depth + 1);
+        rmdir(fpath);
+    }
+    closedir(dp);
+}
+
+static int depth_of(const char *relpath)
+{
+    int depth = 0;
+
+    for (; *relpath != '\0'; relpath++) {
+        depth += *relpath == '/';
+    }
+    return depth;
+}
+
+/**
+ * Point the delta at fpath, which was olddepth levels down, at its
+ * base from its new depth.
+ */
+static int rebase_delta(const char *fpath, int olddepth, int newdepth)
+{
+    char tmppath[PATH_MAX];
+    struct stat statbuf;
+    char *data = NULL;
+    int fd, outfd = -1, i;
+
+    if (olddepth == newdepth) {
+        return 0;
+    }
+    if (snprintf(tmppath, sizeof(tmppath), "%s.migrate", fpath) >= sizeof(tmppath)
+        || (fd = open(fpath, O_RDONLY | O_NOFOLLOW)) < 0) {
+        return -1;
+    }
+    if (fstat(fd, &statbuf) != 0 || (data = malloc(statbuf.st_size + 1)) == NULL
+        || read(fd, data, statbuf.st_size) != statbuf.st_size) {
+        goto fail;
+    }
+    data[statbuf.st_size] = '\0';
+    /* Line two is the base: olddepth ../ then the pinned name */
+    char *nl = memchr(data, '\n', statbuf.st_size);
+    if (nl == NULL) {
+        errno = EINVAL;
+        goto fail;
+    }
+    char *base = nl + 1;
+    for (i = 0; i < olddepth; i++) {
+        if (strncmp(base, "../", 3) != 0) {
+            errno = EINVAL;
+            goto fail;
+        }
+        base += 3;
+    }
+    outfd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (outfd < 0 || write(outfd, data, nl + 1 - data) != nl + 1 - data) {
+        goto fail;
+    }
+    for (i = 0; i < newdepth; i++) {
+        if (write(outfd, "../", 3) != 3) {
+            goto fail;
+        }
+    }
+    size_t rest = statbuf.st_size - (base - data);
+    struct timespec times[2] = { statbuf.st_atim, statbuf.st_mtim };
+    if (write(outfd, base, rest) != rest || (fchown(outfd, statbuf.st_uid, statbuf.st_gid) != 0 && errno != EPERM)
+        || fchmod(outfd, statbuf.st_mode & 07777) != 0 || futimens(outfd, times) != 0 || fsync(outfd) != 0) {
+        goto fail;
+    }
+    close(outfd);
+    close(fd);
+    free(data);
+    return rename(tmppath, fpath);
+
+  fail:
+    if (outfd >= 0) {
+        close(outfd);
+        unlink(tmppath);
+    }
+    close(fd);
+    free(data);
+    return -1;
+}
+
+/**
+ * Move the version at relpath from one layout to the other.  Returns
+ * 1 if it moved, 0 if it was already in place and -1 on error.
+ */
+static int migrate(const char *trashdir, const char *relpath, int from, int to, int dry_run)
+{
+    char path[PATH_MAX], oldpath[PATH_MAX], newpath[PATH_MAX];
+    const char *stamp;
+    struct tm tmbuf;
+    time_t when;
+
+    memset(&tmbuf, 0, sizeof(tmbuf));
+    if (layout_original_path(from, relpath, path, &stamp) != 0
+        || strptime(stamp + 1, "%Y-%m-%d.%H:%M:%S", &tmbuf) == NULL) {
+        fprintf(stderr, "%s: not a %s layout version\n", relpath, layout_name(from));
+        return -1;
+    }
+    tmbuf.tm_isdst = -1;
+    when = mktime(&tmbuf);
+    if (layout_trash_path(to, trashdir, path, when, newpath) != 0
+        || strlen(newpath) + strlen(stamp) >= sizeof(newpath)) {
+        fprintf(stderr, "%s: %s\n", relpath, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    strcat(newpath, stamp);
+    snprintf(oldpath, sizeof(oldpath), "%s/%s", trashdir, relpath);
+    if (strcmp(oldpath, newpath) == 0) {
+        return 0;
+    }
+    if (dry_run) {
+        printf("%s -> %s\n", relpath, newpath + strlen(trashdir) + 1);
+        return 1;
+    }
+    if (mkdir_trash_path(newpath) != 0) {
+        return -1;
+    }
+    if (renameat2(AT_FDCWD, oldpath, AT_FDCWD, newpath, RENAME_NOREPLACE) != 0) {
+        if (errno != EINVAL && errno != ENOSYS) {
+            perror(newpath);
+            return -1;
+        }
+        /* No RENAME_NOREPLACE here - link() never replaces */
+        if (link(oldpath, newpath) != 0 || unlink(oldpath) != 0) {
+            perror(newpath);
+            return -1;
+        }
+    }
+    if (strlen(stamp) > strlen(DELTA_SUFFIX) && strcmp(stamp + strlen(stamp) - strlen(DELTA_SUFFIX), DELTA_SUFFIX) == 0
+        && rebase_delta(newpath, depth_of(relpath), depth_of(newpath + strlen(trashdir) + 1)) != 0) {
+        fprintf(stderr, "%s: cannot point the delta at its base: %s\n", newpath, strerror(errno));
+        return -1;
+    }
+    return 1;
+}
+
+int main(int argc, char *argv[])
+{
+    int from = -1, to = -1, dry_run = 0, moved = 0, failed = 0, i;
+    struct versions versions = { NULL, 0, 0 };
+    const char *trashdir = NULL;
+    size_t v;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0) {
+            dry_run = 1;
+        } else if (strncmp(argv[i], "--from=", 7) == 0) {
+            from = layout_parse(argv[i] + 7);
+        } else if (strncmp(argv[i], "--to=", 5) == 0) {
+            to = layout_parse(argv[i] + 5);
+        } else if (argv[i][0] != '-' && trashdir == NULL) {
+            trashdir = argv[i];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (from < 0 || to < 0 || trashdir == NULL) {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    set_tracing(0);
+
+    /* Find everything first so nothing moved gets found again */
+    find_versions(trashdir, "", from, 0, &versions);
+    for (v = 0; v < versions.count; v++) {
+        int rstatus = migrate(trashdir, versions.relpaths[v], from, to, dry_run);
+        moved += rstatus > 0;
+        failed += rstatus < 0;
+        free(versions.relpaths[v]);
+    }
+    free(versions.relpaths);
+    if (!dry_run) {
+        remove_empty(trashdir, "", 0);
+    }
+    printf("%s %d of %zu versions from the %s layout to the %s layout, %d failed\n", dry_run ? "would move" : "moved",
+           moved, versions.count, layout_name(from), layout_name(to), failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
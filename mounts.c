@@ -0,0 +1,308 @@
+/**
+ * Many mounts from one process.
+ *
+ * A host with dozens of protected project trees would otherwise run a
+ * collectfs per tree, each with its own threads, heap and logging.
+ * With --mounts=FILE a single collectfs serves every mount listed in
+ * FILE, one per line:
+ *
+ *     rootdir mountpoint [option ...]
+ *
+ * Paths are absolute, the options are those of collectfs (and fuse -o
+ * options), separated by white space, and # starts a comment.  Options
+ * given on the command line apply to every mount, ahead of the line's
+ * own.  Each mount has its own local_context, trash and settings, and
+ * its own fuse session, whose threads come and go with the load.
+ *
+ * The file is reread on SIGHUP, and whenever it changes: mounts no
+ * longer listed are unmounted, new ones mounted, and ones whose line
+ * changed remounted - the rest are left alone.  SIGINT and SIGTERM
+ * unmount everything and exit.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define FUSE_USE_VERSION 26
+#include <fuse.h>
+
+#include "collectfs.h"
+#include "log.h"
+#include "mounts.h"
+
+#define MOUNTS_LINE_MAX (PATH_MAX * 4)
+#define MOUNTS_WORDS_MAX 256
+
+struct mount {
+    char *mountpoint;
+    /** Its line in the mounts file, to notice when it changes */
+    char *line;
+    struct local_context *context;
+    struct fuse_chan *chan;
+    struct fuse *fuse;
+    pthread_t thread;
+    /** Still listed in the mounts file */
+    int listed;
+    struct mount *next;
+};
+
+struct mounts {
+    const char *mountsfile;
+    struct fuse_args *defaults;
+    const struct fuse_operations *ops;
+    mounts_context_fn new_context;
+    mounts_free_fn free_context;
+    struct mount *list;
+    /** The mounts file as last read */
+    time_t mtime;
+    off_t size;
+};
+
+static void *serve(void *arg)
+{
+    struct mount *mount = arg;
+
+    fuse_loop_mt(mount->fuse);
+    return NULL;
+}
+
+/**
+ * Mount what line, already split into words, asks for.
+ */
+static struct mount *add_mount(struct mounts *mounts, const char *line, char *words[], int nwords)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(0, NULL);
+    struct mount *mount = calloc(1, sizeof(struct mount));
+    struct stat sb;
+    int i;
+
+    if (mount == NULL) {
+        log_errno("mounts: cannot mount %s", words[1]);
+        return NULL;
+    }
+    mount->line = strdup(line);
+    mount->mountpoint = realpath(words[1], NULL);
+    if (mount->line == NULL || mount->mountpoint == NULL) {
+        log_errno("mounts: cannot mount %s", words[1]);
+        goto fail;
+    }
+    if (stat(mount->mountpoint, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
+        log_info("mounts: mount point must be a directory: %s", mount->mountpoint);
+        goto fail;
+    }
+    for (i = 0; i < mounts->defaults->argc; i++) {
+        fuse_opt_add_arg(&args, mounts->defaults->argv[i]);
+    }
+    for (i = 2; i < nwords; i++) {
+        fuse_opt_add_arg(&args, words[i]);
+    }
+    mount->context = mounts->new_context(words[0], &args);
+    if (mount->context == NULL) {
+        goto fail;
+    }
+    if (strcmp(mount->mountpoint, mount->context->rootdir) == 0) {
+        log_info("mounts: mount point and root path cannot be the same directory: %s", mount->mountpoint);
+        goto fail;
+    }
+    mount->chan = fuse_mount(mount->mountpoint, &args);
+    if (mount->chan == NULL) {
+        log_info("mounts: cannot mount %s on %s", mount->context->rootdir, mount->mountpoint);
+        goto fail;
+    }
+    mount->fuse = fuse_new(mount->chan, &args, mounts->ops, sizeof(struct fuse_operations), mount->context);
+    if (mount->fuse == NULL) {
+        log_info("mounts: cannot start serving %s", mount->mountpoint);
+        fuse_unmount(mount->mountpoint, mount->chan);
+        goto fail;
+    }
+    if ((errno = pthread_create(&mount->thread, NULL, serve, mount)) != 0) {
+        log_errno("mounts: cannot start serving %s", mount->mountpoint);
+        fuse_unmount(mount->mountpoint, mount->chan);
+        fuse_destroy(mount->fuse);
+        goto fail;
+    }
+    fuse_opt_free_args(&args);
+    log_info("mounts: serving %s on %s", mount->context->rootdir, mount->mountpoint);
+    return mount;
+
+  fail:
+    fuse_opt_free_args(&args);
+    if (mount->context != NULL) {
+        mounts->free_context(mount->context);
+    }
+    free(mount->mountpoint);
+    free(mount->line);
+    free(mount);
+    return NULL;
+}
+
+static void remove_mount(struct mounts *mounts, struct mount *mount)
+{
+    log_info("mounts: unmounting %s", mount->mountpoint);
+    fuse_exit(mount->fuse);
+    /* Wakes its threads waiting for requests */
+    fuse_unmount(mount->mountpoint, mount->chan);
+    pthread_join(mount->thread, NULL);
+    /* Calls fop_destroy to stop its background work */
+    fuse_destroy(mount->fuse);
+    mounts->free_context(mount->context);
+    free(mount->mountpoint);
+    free(mount->line);
+    free(mount);
+}
+
+/**
+ * Cut the comment off line and split it into words, copied to buf.
+ * Returns how many.
+ */
+static int split_line(char *line, char *buf, char *words[MOUNTS_WORDS_MAX])
+{
+    char *save;
+    int nwords = 0;
+
+    line[strcspn(line, "#\n")] = '\0';
+    strcpy(buf, line);
+    for (words[0] = strtok_r(buf, " \t", &save); words[nwords] != NULL && nwords < MOUNTS_WORDS_MAX - 1;
+         words[nwords] = strtok_r(NULL, " \t", &save)) {
+        nwords++;
+    }
+    return nwords;
+}
+
+/**
+ * Bring the mounts into line with the mounts file.
+ */
+static void reload(struct mounts *mounts)
+{
+    char line[MOUNTS_LINE_MAX], buf[MOUNTS_LINE_MAX], *words[MOUNTS_WORDS_MAX];
+    struct mount *mount, **link;
+    struct stat sb;
+    FILE *fp;
+    int nwords;
+
+    fp = fopen(mounts->mountsfile, "r");
+    if (fp == NULL || fstat(fileno(fp), &sb) != 0) {
+        log_errno("mounts: cannot read %s - mounts left as they are", mounts->mountsfile);
+        if (fp != NULL) {
+            fclose(fp);
+        }
+        return;
+    }
+    mounts->mtime = sb.st_mtime;
+    mounts->size = sb.st_size;
+    for (mount = mounts->list; mount != NULL; mount = mount->next) {
+        mount->listed = 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        nwords = split_line(line, buf, words);
+        if (nwords == 0) {
+            continue;
+        }
+        if (nwords < 2 || words[0][0] != '/' || words[1][0] != '/') {
+            log_info("mounts: %s: need an absolute rootdir and mountpoint: %s", mounts->mountsfile, line);
+            continue;
+        }
+        for (mount = mounts->list; mount != NULL && strcmp(mount->line, line) != 0; mount = mount->next) {
+        }
+        if (mount != NULL) {
+            mount->listed = 1;
+        }
+    }
+    /* Unmount what has gone or changed before mounting what replaces it */
+    for (link = &mounts->list; *link != NULL;) {
+        mount = *link;
+        if (mount->listed) {
+            link = &mount->next;
+        } else {
+            *link = mount->next;
+            remove_mount(mounts, mount);
+        }
+    }
+    rewind(fp);
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        nwords = split_line(line, buf, words);
+        if (nwords < 2 || words[0][0] != '/' || words[1][0] != '/') {
+            continue;
+        }
+        for (mount = mounts->list; mount != NULL && strcmp(mount->line, line) != 0; mount = mount->next) {
+        }
+        if (mount == NULL && (mount = add_mount(mounts, line, words, nwords)) != NULL) {
+            mount->listed = 1;
+            mount->next = mounts->list;
+            mounts->list = mount;
+        }
+    }
+    fclose(fp);
+}
+
+static int changed(struct mounts *mounts)
+{
+    struct stat sb;
+
+    return stat(mounts->mountsfile, &sb) == 0 && (sb.st_mtime != mounts->mtime || sb.st_size != mounts->size);
+}
+
+/**
+ * Serve the mounts in mountsfile until told to stop.  defaults are
+ * the options given on the command line, the program name first.
+ */
+int mounts_serve(const char *mountsfile, struct fuse_args *defaults, const struct fuse_operations *ops,
+                 mounts_context_fn new_context, mounts_free_fn free_context)
+{
+    struct mounts mounts;
+    struct timespec timeout = { MOUNTS_CHECK_SECONDS, 0 };
+    sigset_t signals;
+    int sig;
+
+    memset(&mounts, 0, sizeof(mounts));
+    mounts.mountsfile = mountsfile;
+    mounts.defaults = defaults;
+    mounts.ops = ops;
+    mounts.new_context = new_context;
+    mounts.free_context = free_context;
+
+    /* Every thread started from here on leaves these to sigtimedwait below */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    reload(&mounts);
+    if (mounts.list == NULL) {
+        log_info("mounts: nothing mounted from %s yet", mountsfile);
+    }
+    for (;;) {
+        sig = sigtimedwait(&signals, NULL, &timeout);
+        if (sig == SIGINT || sig == SIGTERM) {
+            break;
+        }
+        if (sig == SIGHUP || changed(&mounts)) {
+            log_info("mounts: rereading %s", mountsfile);
+            reload(&mounts);
+        }
+    }
+    while (mounts.list != NULL) {
+        struct mount *mount = mounts.list;
+
+        mounts.list = mount->next;
+        remove_mount(&mounts, mount);
+    }
+    return 0;
+}
@@ -0,0 +1,29 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _MOUNTS_H_
+#define _MOUNTS_H_
+
+#include <fuse.h>
+
+#include "collectfs.h"
+
+/**
+ * How often, in seconds, the mounts file is checked for changes
+ * (SIGHUP rereads it at once).
+ */
+#define MOUNTS_CHECK_SECONDS 2
+
+/**
+ * Builds the context for a mount of rootdir, taking the collectfs
+ * options out of args and leaving those for fuse, or says why not and
+ * returns NULL.
+ */
+typedef struct local_context *(*mounts_context_fn)(const char *rootdir, struct fuse_args *args);
+typedef void (*mounts_free_fn)(struct local_context *context);
+
+int mounts_serve(const char *mountsfile, struct fuse_args *defaults, const struct fuse_operations *ops,
+                 mounts_context_fn new_context, mounts_free_fn free_context);
+
+#endif
@@ -0,0 +1,1256 @@
+/**
+ * Pack files - small trash versions stored inside large files.
+ *
+ * Collecting tens of thousands of tiny files (rm -rf of a source
+ * tree) puts tens of thousands of inodes and directory entries in
+ * the trash.  With --pack, versions of at most a given size are moved
+ * into append-only pack files by a background thread and removed
+ * from the trash folders:
+ *
+ *     trashdir/.packs/pack-000001.pack    the versions
+ *     trashdir/.packs/pack-000001.idx     where each one starts
+ *
+ * Collection itself is unchanged - a rename into the trash - and the
+ * thread packs what was collected in batches.  Each batch is
+ * appended, the pack is flushed with a single fdatasync(), the index
+ * lines are appended and only then are the batch's trash files
+ * removed.  A crash at any point leaves each version in the trash, in
+ * a pack, or both.
+ *
+ * A pack is a sequence of records, each a fixed header (which holds
+ * the version's metadata and an XXH64 of the whole record), the
+ * version's path relative to trashdir, then its content.  The index
+ * is just a cache of the record positions:
+ *
+ *     <offset> <record length> <collection time> <path length>\n<path>\n
+ *
+ * When a pack is opened any records beyond the end of its index are
+ * checked one by one and indexed, and a torn record at the end of
+ * the newest pack is cut off.
+ *
+ * With --expire=DAYS versions collected more than DAYS ago are
+ * removed from the trash, packed or not (a whole bucket at a time with
+ * the time layout).  Every hour the thread walks
+ * the trash to remove expired versions (and to pack any small ones
+ * missed, e.g. after a crash), then compacts packs: a pack that has
+ * become more than half expired has its live versions copied to the
+ * newest pack and is removed.
+ *
+ * collectfs-unpack lists and extracts packed versions.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "compress.h"
+#include "delta.h"
+#include "governor.h"
+#include "hash.h"
+#include "index.h"
+#include "layout.h"
+#include "log.h"
+#include "pack.h"
+
+#define PACK_MAGIC 0x4b504643u  /* "CFPK" */
+#define PACK_NAME "pack-%06u"
+/** Start a new pack beyond this size */
+#define PACK_MAX_SIZE (256ULL * 1024 * 1024)
+/** Versions appended before flushing */
+#define PACK_BATCH_MAX 1024
+/** Seconds to let a batch build up, and the least age of a version the walk packs */
+#define PACK_BATCH_DELAY 2
+/** Seconds between walks of the trash */
+#define PACK_MAINTAIN_INTERVAL 3600
+/** Versions waiting beyond this are left for the next walk */
+#define PACK_MAX_QUEUE 65536
+
+struct pack_header {
+    uint32_t magic;
+    uint32_t pathlen;
+    uint64_t datalen;
+    /** When the version was collected */
+    int64_t when;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t reserved;
+    /** XXH64 of the header (with this zero), path and data */
+    uint64_t hash;
+};
+
+/**
+ * A packed version.
+ */
+struct pack_entry {
+    struct pack_entry *next;
+    unsigned number;
+    uint64_t offset;
+    uint64_t length;
+    time_t when;
+    char path[];
+};
+
+struct pack_file {
+    unsigned number;
+    /** Bytes of valid records */
+    uint64_t size;
+    /** Bytes of records no longer wanted */
+    uint64_t dead;
+};
+
+struct pack_store {
+    /** Short enough for any pack file name to fit in PATH_MAX */
+    char dir[PATH_MAX - 32];
+    int repair;
+    struct pack_entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    struct pack_file *files;
+    int nfiles;
+    /** The pack being appended to - repair mode only */
+    unsigned current;
+    int fd;
+    int idxfd;
+};
+
+/**
+ * A version waiting to be flushed - appended to the pack, not yet
+ * indexed.
+ */
+struct pack_item {
+    char *path;
+    /** Where it was in the trash, or NULL if moved from another pack */
+    char *fpath;
+    struct stat statbuf;
+    uint64_t offset;
+    uint64_t length;
+    time_t when;
+};
+
+struct pack_batch {
+    struct pack_item items[PACK_BATCH_MAX];
+    int count;
+};
+
+struct pack_pending {
+    struct pack_pending *next;
+    char path[];
+};
+
+struct pack {
+    struct local_context *context;
+    struct pack_store *store;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct pack_pending *head;
+    struct pack_pending *tail;
+    int queued;
+    int stopping;
+    /* Belong to the worker */
+    struct pack_batch batch;
+    unsigned long long packed, packed_bytes, expired, compacted;
+};
+
+static size_t path_hash(const char *path)
+{
+    size_t h = 2166136261u;
+
+    for (; *path != '\0'; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+static struct pack_entry **find_entry(struct pack_store *store, const char *path)
+{
+    struct pack_entry **link;
+
+    if (store->nbuckets == 0) {
+        return NULL;
+    }
+    link = &store->buckets[path_hash(path) & (store->nbuckets - 1)];
+    while (*link != NULL && strcmp((*link)->path, path) != 0) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static struct pack_file *find_file(struct pack_store *store, unsigned number)
+{
+    int i;
+
+    for (i = 0; i < store->nfiles; i++) {
+        if (store->files[i].number == number) {
+            return &store->files[i];
+        }
+    }
+    return NULL;
+}
+
+static struct pack_file *add_file(struct pack_store *store, unsigned number)
+{
+    struct pack_file *files = realloc(store->files, (store->nfiles + 1) * sizeof(struct pack_file));
+
+    if (files == NULL) {
+        return NULL;
+    }
+    store->files = files;
+    files[store->nfiles].number = number;
+    files[store->nfiles].size = 0;
+    files[store->nfiles].dead = 0;
+    return &files[store->nfiles++];
+}
+
+/**
+ * Index a record.  If the path is already indexed (a compaction was
+ * interrupted) the older copy is kept and this one counts as dead.
+ */
+static int add_entry(struct pack_store *store, unsigned number, uint64_t offset, uint64_t length, time_t when,
+                     const char *path, size_t pathlen)
+{
+    struct pack_entry **link, *entry;
+    size_t i;
+
+    if (store->nentries >= store->nbuckets) {
+        size_t nbuckets = store->nbuckets ? store->nbuckets * 2 : 1024;
+        struct pack_entry **buckets = calloc(nbuckets, sizeof(struct pack_entry *));
+        if (buckets == NULL) {
+            return -1;
+        }
+        for (i = 0; i < store->nbuckets; i++) {
+            while ((entry = store->buckets[i]) != NULL) {
+                store->buckets[i] = entry->next;
+                entry->next = buckets[path_hash(entry->path) & (nbuckets - 1)];
+                buckets[path_hash(entry->path) & (nbuckets - 1)] = entry;
+            }
+        }
+        free(store->buckets);
+        store->buckets = buckets;
+        store->nbuckets = nbuckets;
+    }
+    entry = malloc(sizeof(struct pack_entry) + pathlen + 1);
+    if (entry == NULL) {
+        return -1;
+    }
+    memcpy(entry->path, path, pathlen);
+    entry->path[pathlen] = '\0';
+    link = find_entry(store, entry->path);
+    if (*link != NULL) {
+        free(entry);
+        find_file(store, number)->dead += length;
+        return 0;
+    }
+    entry->next = NULL;
+    entry->number = number;
+    entry->offset = offset;
+    entry->length = length;
+    entry->when = when;
+    *link = entry;
+    store->nentries++;
+    return 0;
+}
+
+static void pack_path(char path[PATH_MAX], struct pack_store *store, unsigned number, const char *suffix)
+{
+    snprintf(path, PATH_MAX, "%s/" PACK_NAME "%s", store->dir, number, suffix);
+}
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        buf = (char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static uint64_t record_hash(const struct pack_header *header, const char *path, const void *data)
+{
+    struct pack_header copy = *header;
+    struct hash_state state;
+
+    copy.hash = 0;
+    hash_init(&state);
+    hash_update(&state, &copy, sizeof(copy));
+    hash_update(&state, path, header->pathlen);
+    hash_update(&state, data, header->datalen);
+    return hash_digest(&state);
+}
+
+/**
+ * Read and check the record at offset in fd, of at most limit bytes.
+ * The caller frees *path and *data.
+ */
+static int read_record(int fd, uint64_t offset, uint64_t limit, struct pack_header *header, char **path,
+                       unsigned char **data)
+{
+    *path = NULL;
+    *data = NULL;
+    if (limit < sizeof(*header) || pread_all(fd, header, sizeof(*header), offset) != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (header->magic != PACK_MAGIC || header->pathlen == 0 || header->pathlen >= PATH_MAX
+        || header->datalen > limit - sizeof(*header) - header->pathlen) {
+        errno = EINVAL;
+        return -1;
+    }
+    *path = malloc(header->pathlen + 1);
+    *data = malloc(header->datalen + 1);
+    if (*path == NULL || *data == NULL
+        || pread_all(fd, *path, header->pathlen, offset + sizeof(*header)) != 0
+        || pread_all(fd, *data, header->datalen, offset + sizeof(*header) + header->pathlen) != 0) {
+        goto fail;
+    }
+    (*path)[header->pathlen] = '\0';
+    if (record_hash(header, *path, *data) != header->hash) {
+        errno = EINVAL;
+        goto fail;
+    }
+    return 0;
+
+  fail:
+    free(*path);
+    free(*data);
+    *path = NULL;
+    *data = NULL;
+    return -1;
+}
+
+/**
+ * Index the records in fd from offset up to size, checking each one.
+ * Returns the end of the last good record.
+ */
+static uint64_t scan_pack(struct pack_store *store, unsigned number, int fd, uint64_t offset, uint64_t size)
+{
+    struct pack_header header;
+    unsigned char *data;
+    char *path;
+
+    while (offset < size && read_record(fd, offset, size - offset, &header, &path, &data) == 0) {
+        uint64_t length = sizeof(header) + header.pathlen + header.datalen;
+        add_entry(store, number, offset, length, header.when, path, header.pathlen);
+        free(path);
+        free(data);
+        offset += length;
+    }
+    return offset;
+}
+
+/**
+ * Index the records listed in a pack's index file.  Returns the end
+ * of the last one.
+ */
+static uint64_t load_index(struct pack_store *store, unsigned number, uint64_t size)
+{
+    char idxpath[PATH_MAX];
+    struct stat sb;
+    uint64_t covered = 0;
+    int fd;
+
+    pack_path(idxpath, store, number, ".idx");
+    fd = open(idxpath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &sb) != 0 || sb.st_size == 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 0;
+    }
+    char *idx = malloc(sb.st_size + 1);
+    if (idx == NULL || pread_all(fd, idx, sb.st_size, 0) != 0) {
+        free(idx);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    idx[sb.st_size] = '\0';
+
+    char *p = idx, *end = idx + sb.st_size;
+    while (p < end) {
+        unsigned long long offset, length;
+        long when;
+        size_t pathlen;
+        int used;
+        if (sscanf(p, "%llu %llu %ld %zu\n%n", &offset, &length, &when, &pathlen, &used) != 4
+            || p + used + pathlen >= end || p[used + pathlen] != '\n' || offset != covered
+            || offset + length > size) {
+            /* Torn by a crash - the records from here on get scanned */
+            break;
+        }
+        add_entry(store, number, offset, length, when, p + used, pathlen);
+        covered = offset + length;
+        p += used + pathlen + 1;
+    }
+    free(idx);
+    return covered;
+}
+
+static int write_index_line(int idxfd, uint64_t offset, uint64_t length, time_t when, const char *path)
+{
+    char line[PATH_MAX + 100];
+    int n = snprintf(line, sizeof(line), "%llu %llu %ld %zu\n%s\n", (unsigned long long)offset,
+                     (unsigned long long)length, (long)when, strlen(path), path);
+
+    if (n >= sizeof(line)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return write(idxfd, line, n) == n ? 0 : -1;
+}
+
+/**
+ * Rewrite a pack's index from the entries in memory.
+ */
+static void rewrite_index(struct pack_store *store, unsigned number)
+{
+    char idxpath[PATH_MAX], tmppath[PATH_MAX];
+    struct pack_entry **sorted, *entry;
+    size_t i, n = 0, j;
+    int fd;
+
+    pack_path(idxpath, store, number, ".idx");
+    pack_path(tmppath, store, number, ".idx.tmp");
+    sorted = malloc((store->nentries + 1) * sizeof(struct pack_entry *));
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (sorted == NULL || fd < 0) {
+        log_errno("Collectfs: cannot rewrite %s", idxpath);
+        free(sorted);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+    for (i = 0; i < store->nbuckets; i++) {
+        for (entry = store->buckets[i]; entry != NULL; entry = entry->next) {
+            if (entry->number == number) {
+                /* Insertion sort by offset - index lines must be in order */
+                for (j = n; j > 0 && sorted[j - 1]->offset > entry->offset; j--) {
+                    sorted[j] = sorted[j - 1];
+                }
+                sorted[j] = entry;
+                n++;
+            }
+        }
+    }
+    /* Dead records leave gaps that would read as a torn index, so only
+     * the run from the start is written - the rest is rescanned.
+     */
+    uint64_t covered = 0;
+    for (i = 0; i < n && sorted[i]->offset == covered; i++) {
+        write_index_line(fd, sorted[i]->offset, sorted[i]->length, sorted[i]->when, sorted[i]->path);
+        covered += sorted[i]->length;
+    }
+    free(sorted);
+    if (fsync(fd) != 0 || close(fd) != 0 || rename(tmppath, idxpath) != 0) {
+        log_errno("Collectfs: cannot rewrite %s", idxpath);
+        unlink(tmppath);
+    }
+}
+
+static int compare_unsigned(const void *a, const void *b)
+{
+    unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Open the pack for appending - a new one if number is beyond the
+ * last.
+ */
+static int open_current(struct pack_store *store, unsigned number)
+{
+    char packpath[PATH_MAX], idxpath[PATH_MAX];
+
+    if (store->fd >= 0) {
+        close(store->fd);
+        close(store->idxfd);
+        store->fd = store->idxfd = -1;
+    }
+    if (find_file(store, number) == NULL && add_file(store, number) == NULL) {
+        return -1;
+    }
+    pack_path(packpath, store, number, ".pack");
+    pack_path(idxpath, store, number, ".idx");
+    store->fd = open(packpath, O_RDWR | O_CREAT, 0600);
+    store->idxfd = open(idxpath, O_WRONLY | O_CREAT | O_APPEND, 0600);
+    if (store->fd < 0 || store->idxfd < 0) {
+        log_errno("Collectfs: cannot open %s", packpath);
+        if (store->fd >= 0) {
+            close(store->fd);
+        }
+        if (store->idxfd >= 0) {
+            close(store->idxfd);
+        }
+        store->fd = store->idxfd = -1;
+        return -1;
+    }
+    store->current = number;
+    return 0;
+}
+
+/**
+ * Load the packs in trashdir.  With repair the store can be appended
+ * to: a torn record at the end of a pack is cut off and records
+ * missing from an index are added to it.
+ */
+struct pack_store *pack_store_open(const char *trashdir, int repair)
+{
+    struct pack_store *store = calloc(1, sizeof(struct pack_store));
+    unsigned *numbers = NULL, number;
+    int nnumbers = 0, i;
+    struct dirent *dirent;
+    DIR *dp;
+
+    if (store == NULL) {
+        return NULL;
+    }
+    store->fd = store->idxfd = -1;
+    store->repair = repair;
+    if (snprintf(store->dir, sizeof(store->dir), "%s/%s", trashdir, PACK_FOLDER) >= sizeof(store->dir)) {
+        free(store);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    /* Nothing may have been collected yet */
+    if (repair && ((mkdir(trashdir, 0700) != 0 && errno != EEXIST)
+                   || (mkdir(store->dir, 0700) != 0 && errno != EEXIST))) {
+        log_errno("Collectfs: cannot create %s", store->dir);
+        free(store);
+        return NULL;
+    }
+    dp = opendir(store->dir);
+    if (dp == NULL) {
+        if (errno == ENOENT) {
+            return store;
+        }
+        free(store);
+        return NULL;
+    }
+    while ((dirent = readdir(dp)) != NULL) {
+        char suffix[8];
+        if (sscanf(dirent->d_name, "pack-%u.%7s", &number, suffix) == 2 && strcmp(suffix, "pack") == 0) {
+            unsigned *more = realloc(numbers, (nnumbers + 1) * sizeof(unsigned));
+            if (more != NULL) {
+                numbers = more;
+                numbers[nnumbers++] = number;
+            }
+        }
+    }
+    closedir(dp);
+    qsort(numbers, nnumbers, sizeof(unsigned), compare_unsigned);
+
+    for (i = 0; i < nnumbers; i++) {
+        char packpath[PATH_MAX];
+        struct pack_file *file;
+        struct stat sb;
+        uint64_t covered, end;
+        int fd;
+
+        pack_path(packpath, store, numbers[i], ".pack");
+        fd = open(packpath, repair ? O_RDWR : O_RDONLY);
+        if (fd < 0 || fstat(fd, &sb) != 0 || (file = add_file(store, numbers[i])) == NULL) {
+            log_errno("Collectfs: cannot open %s", packpath);
+            if (fd >= 0) {
+                close(fd);
+            }
+            continue;
+        }
+        covered = load_index(store, numbers[i], sb.st_size);
+        end = covered < sb.st_size ? scan_pack(store, numbers[i], fd, covered, sb.st_size) : covered;
+        file->size = end;
+        if (repair && end != covered) {
+            rewrite_index(store, numbers[i]);
+        }
+        if (repair && end < sb.st_size) {
+            log_info("Collectfs: cutting a torn record from the end of %s", packpath);
+            if (ftruncate(fd, end) != 0) {
+                log_errno("Collectfs: cannot truncate %s", packpath);
+            }
+        }
+        close(fd);
+    }
+    if (repair) {
+        number = nnumbers > 0 ? numbers[nnumbers - 1] : 1;
+        if (nnumbers > 0 && find_file(store, number) != NULL && find_file(store, number)->size >= PACK_MAX_SIZE) {
+            number++;
+        }
+        if (open_current(store, number) != 0) {
+            free(numbers);
+            pack_store_close(store);
+            return NULL;
+        }
+    }
+    free(numbers);
+    return store;
+}
+
+void pack_store_close(struct pack_store *store)
+{
+    struct pack_entry *entry;
+    size_t i;
+
+    if (store == NULL) {
+        return;
+    }
+    for (i = 0; i < store->nbuckets; i++) {
+        while ((entry = store->buckets[i]) != NULL) {
+            store->buckets[i] = entry->next;
+            free(entry);
+        }
+    }
+    if (store->fd >= 0) {
+        close(store->fd);
+        close(store->idxfd);
+    }
+    free(store->buckets);
+    free(store->files);
+    free(store);
+}
+
+static int read_entry(struct pack_store *store, struct pack_entry *entry, struct pack_header *header, char **path,
+                      unsigned char **data)
+{
+    char packpath[PATH_MAX];
+    int fd, rstatus;
+
+    pack_path(packpath, store, entry->number, ".pack");
+    fd = open(packpath, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    rstatus = read_record(fd, entry->offset, entry->length, header, path, data);
+    close(fd);
+    return rstatus;
+}
+
+static void fill_version(struct pack_version *version, const struct pack_header *header, const char *path)
+{
+    version->path = path;
+    version->size = header->datalen;
+    version->when = header->when;
+    version->mode = header->mode;
+    version->uid = header->uid;
+    version->gid = header->gid;
+    version->mtime.tv_sec = header->mtime_sec;
+    version->mtime.tv_nsec = header->mtime_nsec;
+}
+
+/**
+ * Call callback for every packed version until it returns non-zero.
+ */
+int pack_store_foreach(struct pack_store *store, int (*callback)(void *arg, const struct pack_version *version),
+                       void *arg)
+{
+    struct pack_version version;
+    struct pack_header header;
+    struct pack_entry *entry;
+    char packpath[PATH_MAX];
+    unsigned number = 0;
+    int fd = -1, rstatus = 0;
+    size_t i;
+
+    for (i = 0; i < store->nbuckets && rstatus == 0; i++) {
+        for (entry = store->buckets[i]; entry != NULL && rstatus == 0; entry = entry->next) {
+            if (fd < 0 || entry->number != number) {
+                if (fd >= 0) {
+                    close(fd);
+                }
+                number = entry->number;
+                pack_path(packpath, store, number, ".pack");
+                if ((fd = open(packpath, O_RDONLY)) < 0) {
+                    continue;
+                }
+            }
+            if (pread_all(fd, &header, sizeof(header), entry->offset) == 0 && header.magic == PACK_MAGIC) {
+                fill_version(&version, &header, entry->path);
+                rstatus = callback(arg, &version);
+            }
+        }
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return rstatus;
+}
+
+/**
+ * Write the content of the packed version at path (relative to
+ * trashdir) to outfd and, if version isn't NULL, fill it in.  Fails
+ * with ENOENT if there's no such version and EINVAL if it's damaged.
+ */
+int pack_store_extract(struct pack_store *store, const char *path, int outfd, struct pack_version *version)
+{
+    struct pack_entry **link = find_entry(store, path);
+    struct pack_header header;
+    unsigned char *data;
+    char *recpath;
+    const char *p;
+    size_t len;
+
+    if (link == NULL || *link == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (read_entry(store, *link, &header, &recpath, &data) != 0) {
+        return -1;
+    }
+    for (p = (const char *)data, len = header.datalen; len > 0;) {
+        ssize_t n = write(outfd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            free(recpath);
+            free(data);
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    if (version != NULL) {
+        fill_version(version, &header, (*link)->path);
+    }
+    free(recpath);
+    free(data);
+    return 0;
+}
+
+/**
+ * Append a record to the current pack, returning its offset.
+ */
+static int append(struct pack_store *store, struct pack_header *header, const char *path, const void *data,
+                  uint64_t *offset)
+{
+    struct pack_file *file = find_file(store, store->current);
+    uint64_t length = sizeof(*header) + header->pathlen + header->datalen;
+
+    header->magic = PACK_MAGIC;
+    header->reserved = 0;
+    header->hash = record_hash(header, path, data);
+    *offset = file->size;
+    if (pwrite_all(store->fd, header, sizeof(*header), *offset) != 0
+        || pwrite_all(store->fd, path, header->pathlen, *offset + sizeof(*header)) != 0
+        || pwrite_all(store->fd, data, header->datalen, *offset + sizeof(*header) + header->pathlen) != 0) {
+        return -1;
+    }
+    file->size += length;
+    return 0;
+}
+
+/**
+ * Make the batch durable: flush the pack, index the batch, then
+ * remove the trash files (or the index entries in other packs) it
+ * replaces.
+ */
+static void flush_batch(struct pack *pack)
+{
+    struct pack_store *store = pack->store;
+    struct pack_batch *batch = &pack->batch;
+    struct stat sb;
+    int i;
+
+    if (batch->count == 0) {
+        return;
+    }
+    if (fdatasync(store->fd) != 0) {
+        log_errno("Collectfs: cannot flush pack %u - versions left in the trash", store->current);
+        goto done;
+    }
+    for (i = 0; i < batch->count; i++) {
+        struct pack_item *item = &batch->items[i];
+        struct pack_entry **link = find_entry(store, item->path);
+        if (write_index_line(store->idxfd, item->offset, item->length, item->when, item->path) != 0) {
+            log_errno("Collectfs: cannot write index for pack %u", store->current);
+        }
+        if (item->fpath == NULL && link != NULL && *link != NULL) {
+            /* Moved by compaction - point the entry at the new copy */
+            find_file(store, (*link)->number)->dead += (*link)->length;
+            (*link)->number = store->current;
+            (*link)->offset = item->offset;
+            continue;
+        }
+        add_entry(store, store->current, item->offset, item->length, item->when, item->path, strlen(item->path));
+        /* Only remove the trash file if it's the one we packed */
+        if (lstat(item->fpath, &sb) == 0 && sb.st_ino == item->statbuf.st_ino && sb.st_size == item->statbuf.st_size
+            && sb.st_mtim.tv_sec == item->statbuf.st_mtim.tv_sec
+            && sb.st_mtim.tv_nsec == item->statbuf.st_mtim.tv_nsec && unlink(item->fpath) == 0) {
+            pack->packed++;
+            pack->packed_bytes += item->statbuf.st_size;
+        }
+    }
+  done:
+    for (i = 0; i < batch->count; i++) {
+        free(batch->items[i].path);
+        free(batch->items[i].fpath);
+    }
+    batch->count = 0;
+}
+
+/**
+ * Make room in the batch and the current pack for a record of length
+ * bytes.
+ */
+static int make_room(struct pack *pack, uint64_t length)
+{
+    struct pack_store *store = pack->store;
+
+    if (pack->batch.count == PACK_BATCH_MAX) {
+        flush_batch(pack);
+    }
+    if (find_file(store, store->current)->size + length > PACK_MAX_SIZE
+        && find_file(store, store->current)->size > 0) {
+        flush_batch(pack);
+        return open_current(store, store->current + 1);
+    }
+    return 0;
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+
+    return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+/**
+ * Is path (relative to trashdir) one of collectfs's own files - the
+ * dedup index, delta bases or packs - rather than a version?  Versions
+ * of hidden files start with a dot too, but always have a stamp.
+ */
+static int is_internal(const char *path)
+{
+    return path[0] == '.' && (strchr(path, '/') != NULL || strchr(path + 1, '.') == NULL);
+}
+
+/**
+ * Append the trash version at fpath to the batch if it's small enough
+ * to pack.
+ */
+static void pack_file(struct pack *pack, const char *fpath)
+{
+    const char *trashdir = pack->context->trashdir;
+    size_t trashlen = strlen(trashdir);
+    struct pack_entry **link;
+    struct pack_header header;
+    struct pack_item *item;
+    struct stat statbuf;
+    unsigned char *data = NULL;
+    const char *path;
+    int fd;
+
+    if (strncmp(fpath, trashdir, trashlen) != 0 || fpath[trashlen] != '/' || pack->store->fd < 0) {
+        return;
+    }
+    path = fpath + trashlen + 1;
+    link = find_entry(pack->store, path);
+    if (pack->context->pack_size <= 0 || is_internal(path) || has_suffix(path, DELTA_SUFFIX)
+        || has_suffix(path, COMPRESS_SUFFIX) || (link != NULL && *link != NULL)) {
+        return;
+    }
+    fd = open(fpath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return;
+    }
+    /* Versions sharing blocks (--dedup) are already cheap */
+    if (fstat(fd, &statbuf) != 0 || !S_ISREG(statbuf.st_mode) || statbuf.st_nlink != 1
+        || statbuf.st_size > pack->context->pack_size
+        || make_room(pack, sizeof(header) + strlen(path) + statbuf.st_size) != 0
+        || (data = malloc(statbuf.st_size + 1)) == NULL || pread_all(fd, data, statbuf.st_size, 0) != 0) {
+        free(data);
+        close(fd);
+        return;
+    }
+    close(fd);
+    governor_io(pack->context, GOVERNOR_MAINTAIN, statbuf.st_size);
+
+    memset(&header, 0, sizeof(header));
+    header.pathlen = strlen(path);
+    header.datalen = statbuf.st_size;
+    header.when = statbuf.st_ctime;
+    header.mtime_sec = statbuf.st_mtim.tv_sec;
+    header.mtime_nsec = statbuf.st_mtim.tv_nsec;
+    header.mode = statbuf.st_mode;
+    header.uid = statbuf.st_uid;
+    header.gid = statbuf.st_gid;
+    item = &pack->batch.items[pack->batch.count];
+    if (append(pack->store, &header, path, data, &item->offset) != 0) {
+        log_errno("Collectfs: cannot append to pack %u", pack->store->current);
+        free(data);
+        return;
+    }
+    free(data);
+    item->path = strdup(path);
+    item->fpath = strdup(fpath);
+    if (item->path == NULL || item->fpath == NULL) {
+        free(item->path);
+        free(item->fpath);
+        return;
+    }
+    item->statbuf = statbuf;
+    item->length = sizeof(header) + header.pathlen + header.datalen;
+    item->when = header.when;
+    pack->batch.count++;
+}
+
+/**
+ * Remove a whole time layout bucket.
+ */
+static void remove_bucket(struct pack *pack, const char *dir)
+{
+    struct dirent *dirent;
+    char fpath[PATH_MAX];
+    struct stat sb;
+    DIR *dp = opendir(dir);
+
+    if (dp == NULL) {
+        return;
+    }
+    while ((dirent = readdir(dp)) != NULL) {
+        if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0
+            || snprintf(fpath, sizeof(fpath), "%s/%s", dir, dirent->d_name) >= sizeof(fpath)
+            || lstat(fpath, &sb) != 0) {
+            continue;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            remove_bucket(pack, fpath);
+        } else if (unlink(fpath) == 0) {
+            index_forget(pack->context, fpath);
+            pack->expired++;
+        }
+    }
+    closedir(dp);
+    if (rmdir(dir) != 0) {
+        log_errno("Collectfs: cannot remove expired %s", dir);
+    }
+}
+
+/**
+ * Walk the trash removing expired versions and packing small ones
+ * that were missed.
+ */
+static void walk_trash(struct pack *pack, const char *dir, int top, time_t expired_before)
+{
+    time_t recent = time(NULL) - PACK_BATCH_DELAY;
+    struct dirent *dirent;
+    char fpath[PATH_MAX];
+    struct stat sb;
+    time_t start;
+    DIR *dp = opendir(dir);
+
+    if (dp == NULL) {
+        return;
+    }
+    while ((dirent = readdir(dp)) != NULL && !pack->stopping) {
+        const char *name = dirent->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(fpath, sizeof(fpath), "%s/%s", dir, name) >= sizeof(fpath) || lstat(fpath, &sb) != 0) {
+            continue;
+        }
+        if (top && name[0] == '.' && (S_ISDIR(sb.st_mode) || is_internal(name))) {
+            continue;
+        }
+        if (top && S_ISDIR(sb.st_mode) && pack->context->layout == LAYOUT_TIME
+            && layout_bucket_time(name, &start) && start + 3600 <= expired_before) {
+            /* Everything in the bucket was collected within its hour */
+            remove_bucket(pack, fpath);
+        } else if (S_ISDIR(sb.st_mode)) {
+            walk_trash(pack, fpath, 0, expired_before);
+        } else if (sb.st_ctime < expired_before) {
+            if (unlink(fpath) == 0) {
+                index_forget(pack->context, fpath);
+                pack->expired++;
+            }
+        } else if (S_ISREG(sb.st_mode) && sb.st_size <= pack->context->pack_size && sb.st_ctime < recent) {
+            pack_file(pack, fpath);
+        }
+    }
+    closedir(dp);
+}
+
+/**
+ * Forget packed versions collected before expired_before, then
+ * compact packs that are mostly expired.
+ */
+static void compact(struct pack *pack, time_t expired_before)
+{
+    struct pack_store *store = pack->store;
+    struct pack_entry **link, *entry;
+    size_t i;
+    int f;
+
+    for (i = 0; i < store->nbuckets; i++) {
+        for (link = &store->buckets[i]; (entry = *link) != NULL;) {
+            if (entry->when < expired_before) {
+                char fpath[PATH_MAX];
+                if (snprintf(fpath, sizeof(fpath), "%s/%s", pack->context->trashdir, entry->path) < sizeof(fpath)) {
+                    index_forget(pack->context, fpath);
+                }
+                *link = entry->next;
+                find_file(store, entry->number)->dead += entry->length;
+                store->nentries--;
+                pack->expired++;
+                free(entry);
+            } else {
+                link = &entry->next;
+            }
+        }
+    }
+
+    for (f = 0; f < store->nfiles && !pack->stopping;) {
+        struct pack_file file = store->files[f];
+        char packpath[PATH_MAX], idxpath[PATH_MAX];
+
+        if (file.number == store->current && file.size > 0 && file.dead == file.size) {
+            /* Everything in the newest pack has expired - start it again */
+            if (ftruncate(store->fd, 0) == 0 && ftruncate(store->idxfd, 0) == 0) {
+                store->files[f].size = store->files[f].dead = 0;
+            }
+            f++;
+            continue;
+        }
+        if (file.number == store->current || file.dead * 2 <= file.size) {
+            f++;
+            continue;
+        }
+        /* Move the live versions to the current pack */
+        for (i = 0; i < store->nbuckets; i++) {
+            for (entry = store->buckets[i]; entry != NULL; entry = entry->next) {
+                struct pack_header header;
+                unsigned char *data;
+                char *path;
+                if (entry->number != file.number || read_entry(store, entry, &header, &path, &data) != 0) {
+                    continue;
+                }
+                governor_io(pack->context, GOVERNOR_MAINTAIN, entry->length);
+                if (make_room(pack, entry->length) == 0) {
+                    struct pack_item *item = &pack->batch.items[pack->batch.count];
+                    if (append(store, &header, path, data, &item->offset) == 0
+                        && (item->path = strdup(entry->path)) != NULL) {
+                        item->fpath = NULL;
+                        item->length = entry->length;
+                        item->when = entry->when;
+                        pack->batch.count++;
+                    }
+                }
+                free(path);
+                free(data);
+            }
+        }
+        flush_batch(pack);
+
+        /* Only remove the pack if nothing live is left in it */
+        for (i = 0; i < store->nbuckets; i++) {
+            for (entry = store->buckets[i]; entry != NULL && entry->number != file.number; entry = entry->next) {
+            }
+            if (entry != NULL) {
+                break;
+            }
+        }
+        if (i < store->nbuckets) {
+            log_info("Collectfs: could not compact pack %u", file.number);
+            f++;
+            continue;
+        }
+        pack_path(packpath, store, file.number, ".pack");
+        pack_path(idxpath, store, file.number, ".idx");
+        unlink(idxpath);
+        unlink(packpath);
+        pack->compacted += file.size - file.dead;
+        store->files[f] = store->files[--store->nfiles];
+    }
+}
+
+static void *pack_worker(void *arg)
+{
+    struct pack *pack = (struct pack *)arg;
+    struct pack_pending *pending;
+    time_t next_walk = 0;
+
+    governor_enter(pack->context, GOVERNOR_MAINTAIN);
+    pthread_mutex_lock(&pack->lock);
+    while (!pack->stopping) {
+        struct timespec wait;
+
+        if (time(NULL) >= next_walk) {
+            time_t expired_before = pack->context->expire_age > 0 ? time(NULL) - pack->context->expire_age : 0;
+            pthread_mutex_unlock(&pack->lock);
+            pack->expired = pack->compacted = 0;
+            walk_trash(pack, pack->context->trashdir, 1, expired_before);
+            flush_batch(pack);
+            compact(pack, expired_before);
+            if (pack->expired > 0 || pack->compacted > 0) {
+                log_info("Collectfs: expired %llu versions, compacting moved %llu bytes", pack->expired,
+                         pack->compacted);
+            }
+            next_walk = time(NULL) + PACK_MAINTAIN_INTERVAL;
+            pthread_mutex_lock(&pack->lock);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &wait);
+        if (pack->head == NULL) {
+            wait.tv_sec += next_walk - time(NULL);
+            pthread_cond_timedwait(&pack->work, &pack->lock, &wait);
+            continue;
+        }
+        /* Let a batch build up, then take everything */
+        wait.tv_sec += PACK_BATCH_DELAY;
+        while (!pack->stopping && pack->queued < PACK_BATCH_MAX
+               && pthread_cond_timedwait(&pack->work, &pack->lock, &wait) != ETIMEDOUT) {
+        }
+        pending = pack->head;
+        pack->head = pack->tail = NULL;
+        governor_queued(pack->context, GOVERNOR_MAINTAIN, -pack->queued);
+        pack->queued = 0;
+        pthread_mutex_unlock(&pack->lock);
+
+        while (pending != NULL) {
+            struct pack_pending *next = pending->next;
+            pack_file(pack, pending->path);
+            free(pending);
+            pending = next;
+        }
+        flush_batch(pack);
+
+        pthread_mutex_lock(&pack->lock);
+    }
+    pthread_mutex_unlock(&pack->lock);
+    return NULL;
+}
+
+int pack_start(struct local_context *context)
+{
+    struct pack *pack = calloc(1, sizeof(struct pack));
+
+    if (pack == NULL) {
+        return log_errno("pack_start");
+    }
+    pack->context = context;
+    pack->store = pack_store_open(context->trashdir, 1);
+    if (pack->store == NULL) {
+        free(pack);
+        return -1;
+    }
+    pthread_mutex_init(&pack->lock, NULL);
+    pthread_cond_init(&pack->work, NULL);
+    if (pthread_create(&pack->thread, NULL, pack_worker, pack) != 0) {
+        log_errno("Collectfs: cannot start pack thread");
+        pthread_cond_destroy(&pack->work);
+        pthread_mutex_destroy(&pack->lock);
+        pack_store_close(pack->store);
+        free(pack);
+        return -1;
+    }
+    context->pack = pack;
+    log_info("Collectfs: packing versions of up to %lld bytes (%zu packed)", (long long)context->pack_size,
+             pack->store->nentries);
+    return 0;
+}
+
+void pack_stop(struct local_context *context)
+{
+    struct pack *pack = context->pack;
+    struct pack_pending *pending;
+
+    if (pack == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pack->lock);
+    pack->stopping = 1;
+    pthread_cond_signal(&pack->work);
+    pthread_mutex_unlock(&pack->lock);
+    pthread_join(pack->thread, NULL);
+    context->pack = NULL;
+
+    flush_batch(pack);
+    log_info("Collectfs: packed %llu versions, %llu bytes", pack->packed, pack->packed_bytes);
+    while ((pending = pack->head) != NULL) {
+        pack->head = pending->next;
+        free(pending);
+    }
+    pack_store_close(pack->store);
+    pthread_cond_destroy(&pack->work);
+    pthread_mutex_destroy(&pack->lock);
+    free(pack);
+}
+
+/**
+ * Queue a version just put in the trash at trashed (a full path) for
+ * packing.
+ */
+void pack_queue(struct local_context *context, const char *trashed)
+{
+    struct pack *pack = context->pack;
+    struct pack_pending *pending;
+
+    if (pack == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&pack->lock);
+    if (pack->queued < PACK_MAX_QUEUE
+        && (pending = malloc(sizeof(struct pack_pending) + strlen(trashed) + 1)) != NULL) {
+        strcpy(pending->path, trashed);
+        pending->next = NULL;
+        if (pack->tail != NULL) {
+            pack->tail->next = pending;
+        } else {
+            pack->head = pending;
+        }
+        pack->tail = pending;
+        pack->queued++;
+        governor_queued(context, GOVERNOR_MAINTAIN, 1);
+        pthread_cond_signal(&pack->work);
+    }
+    pthread_mutex_unlock(&pack->lock);
+}
@@ -0,0 +1,44 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#include "collectfs.h"
+
+/**
+ * The packs live in this folder at the top of the trash.
+ */
+#define PACK_FOLDER ".packs"
+
+struct pack_store;
+
+/**
+ * What the pack holds about a version besides its content.
+ */
+struct pack_version {
+    const char *path;
+    off_t size;
+    time_t when;
+    mode_t mode;
+    uid_t uid;
+    gid_t gid;
+    struct timespec mtime;
+};
+
+struct pack_store *pack_store_open(const char *trashdir, int repair);
+void pack_store_close(struct pack_store *store);
+int pack_store_foreach(struct pack_store *store, int (*callback)(void *arg, const struct pack_version *version),
+                       void *arg);
+int pack_store_extract(struct pack_store *store, const char *path, int outfd, struct pack_version *version);
+
+int pack_start(struct local_context *context);
+void pack_stop(struct local_context *context);
+
+void pack_queue(struct local_context *context, const char *trashed);
+
+#endif
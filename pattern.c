@@ -0,0 +1,381 @@
+/**
+ * Patterns that decide which files are not worth collecting - build
+ * output and the like.
+ *
+ * The syntax is a subset of .gitignore:
+ *
+ *     *.o            any file (or directory) whose name matches
+ *     node_modules/  a trailing / only matches directories - so
+ *                    everything under any node_modules directory
+ *     /build/        a leading (or inner) / anchors the pattern to
+ *                    the top of the hierarchy
+ *     !keep.o        re-include something an exclude matched
+ *     # comment      blank lines and comments are ignored
+ *
+ * A file is excluded if an exclude pattern matches its name or the
+ * name of any directory above it, unless an include pattern matches
+ * too (includes always win, whatever the order).
+ *
+ * The patterns are compiled by shape so that the cost of checking a
+ * path barely depends on the number of rules.  Plain names, *.ext
+ * patterns and anchored plain paths go into hash tables that are
+ * probed once per path level (once per dot for extensions).  Only
+ * patterns with wildcards anywhere else are checked one by one with
+ * fnmatch().
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pattern.h"
+
+/**
+ * A set of strings - open addressing, FNV-1a hashed.
+ */
+struct strset {
+    char **keys;
+    size_t *lens;
+    size_t capacity;
+    size_t count;
+};
+
+/**
+ * A pattern that has to be checked with fnmatch().
+ */
+struct glob {
+    struct glob *next;
+    int dir_only;
+    int anchored;
+    char pattern[];
+};
+
+/**
+ * The compiled form of one list of patterns, excludes or includes.
+ * The _dir tables hold patterns that only match directories.
+ */
+struct pattern_set {
+    struct strset names;
+    struct strset names_dir;
+    struct strset exts;
+    struct strset exts_dir;
+    struct strset prefixes;
+    struct strset prefixes_dir;
+    struct glob *globs;
+    int count;
+};
+
+struct pattern_list {
+    struct pattern_set exclude;
+    struct pattern_set include;
+};
+
+static size_t hash(const char *key, size_t len)
+{
+    size_t h = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static int strset_has(const struct strset *set, const char *key, size_t len)
+{
+    size_t i;
+
+    if (set->count == 0) {
+        return 0;
+    }
+    for (i = hash(key, len) & (set->capacity - 1); set->keys[i] != NULL; i = (i + 1) & (set->capacity - 1)) {
+        if (set->lens[i] == len && memcmp(set->keys[i], key, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int strset_insert(struct strset *set, char *key, size_t len)
+{
+    size_t i;
+
+    for (i = hash(key, len) & (set->capacity - 1); set->keys[i] != NULL; i = (i + 1) & (set->capacity - 1)) {
+        if (set->lens[i] == len && memcmp(set->keys[i], key, len) == 0) {
+            free(key);
+            return 0;
+        }
+    }
+    set->keys[i] = key;
+    set->lens[i] = len;
+    set->count++;
+    return 0;
+}
+
+static int strset_add(struct strset *set, const char *key)
+{
+    size_t i;
+
+    if ((set->count + 1) * 2 > set->capacity) {
+        struct strset bigger;
+        bigger.capacity = set->capacity ? set->capacity * 2 : 16;
+        bigger.count = 0;
+        bigger.keys = calloc(bigger.capacity, sizeof(char *));
+        bigger.lens = calloc(bigger.capacity, sizeof(size_t));
+        if (bigger.keys == NULL || bigger.lens == NULL) {
+            free(bigger.keys);
+            free(bigger.lens);
+            return -1;
+        }
+        for (i = 0; i < set->capacity; i++) {
+            if (set->keys[i] != NULL) {
+                strset_insert(&bigger, set->keys[i], set->lens[i]);
+            }
+        }
+        free(set->keys);
+        free(set->lens);
+        *set = bigger;
+    }
+    char *copy = strdup(key);
+    if (copy == NULL) {
+        return -1;
+    }
+    return strset_insert(set, copy, strlen(copy));
+}
+
+static void strset_free(struct strset *set)
+{
+    size_t i;
+
+    for (i = 0; i < set->capacity; i++) {
+        free(set->keys[i]);
+    }
+    free(set->keys);
+    free(set->lens);
+}
+
+struct pattern_list *pattern_new(void)
+{
+    return calloc(1, sizeof(struct pattern_list));
+}
+
+static void pattern_set_free(struct pattern_set *set)
+{
+    struct glob *glob;
+
+    strset_free(&set->names);
+    strset_free(&set->names_dir);
+    strset_free(&set->exts);
+    strset_free(&set->exts_dir);
+    strset_free(&set->prefixes);
+    strset_free(&set->prefixes_dir);
+    while ((glob = set->globs) != NULL) {
+        set->globs = glob->next;
+        free(glob);
+    }
+}
+
+void pattern_free(struct pattern_list *patterns)
+{
+    if (patterns != NULL) {
+        pattern_set_free(&patterns->exclude);
+        pattern_set_free(&patterns->include);
+        free(patterns);
+    }
+}
+
+/**
+ * Compile one pattern into the list.  include is 1 for a pattern that
+ * re-includes files (as does a leading !).
+ * Sets errno on error.
+ */
+int pattern_add(struct pattern_list *patterns, const char *pattern, int include)
+{
+    /* buf[0] is kept free so an anchored path can have its slash put back */
+    char buf[4096];
+    char *p = buf + 1;
+    int dir_only = 0, anchored = 0;
+    size_t len;
+    int rstatus;
+
+    if (pattern[0] == '!') {
+        include = !include;
+        pattern++;
+    }
+    len = strlen(pattern);
+    if (len == 0 || len >= sizeof(buf) - 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    strcpy(p, pattern);
+    while (len > 1 && p[len - 1] == '/') {
+        p[--len] = '\0';
+        dir_only = 1;
+    }
+    if (strchr(p, '/') != NULL) {
+        anchored = 1;
+        while (*p == '/') {
+            p++;
+        }
+    }
+    if (*p == '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct pattern_set *set = include ? &patterns->include : &patterns->exclude;
+    int wild = strpbrk(p, "*?[\\") != NULL;
+
+    if (!wild && anchored) {
+        /* Held with the leading slash, the way fuse hands us paths */
+        *--p = '/';
+        rstatus = strset_add(dir_only ? &set->prefixes_dir : &set->prefixes, p);
+    } else if (!wild) {
+        rstatus = strset_add(dir_only ? &set->names_dir : &set->names, p);
+    } else if (!anchored && p[0] == '*' && p[1] == '.' && strpbrk(p + 2, "*?[\\") == NULL) {
+        rstatus = strset_add(dir_only ? &set->exts_dir : &set->exts, p + 2);
+    } else {
+        struct glob *glob = malloc(sizeof(struct glob) + strlen(p) + 1);
+        if (glob == NULL) {
+            return -1;
+        }
+        glob->dir_only = dir_only;
+        glob->anchored = anchored;
+        strcpy(glob->pattern, p);
+        glob->next = set->globs;
+        set->globs = glob;
+        rstatus = 0;
+    }
+    if (rstatus == 0) {
+        set->count++;
+    }
+    return rstatus;
+}
+
+/**
+ * Add every pattern in a file, one per line.
+ * Sets errno on error.
+ */
+int pattern_add_file(struct pattern_list *patterns, const char *filename)
+{
+    char line[4096];
+    FILE *fp = fopen(filename, "r");
+
+    if (fp == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' || line[len - 1] == ' '
+                           || line[len - 1] == '\t')) {
+            line[--len] = '\0';
+        }
+        if (len == 0 || line[0] == '#') {
+            continue;
+        }
+        if (pattern_add(patterns, line, 0) != 0) {
+            int err = errno;
+            fclose(fp);
+            errno = err;
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+int pattern_count(struct pattern_list *patterns)
+{
+    return patterns == NULL ? 0 : patterns->exclude.count + patterns->include.count;
+}
+
+/**
+ * Does anything in set match path (a fuse path, starting with /)?
+ * Each level of the path is checked as a name, and the path up to
+ * and including that level as an anchored prefix.  All but the last
+ * level are directories.
+ */
+static int pattern_set_matches(const struct pattern_set *set, const char *path)
+{
+    const char *name = path;
+    const char *end;
+    const struct glob *glob;
+    char buf[4096];
+
+    if (set->count == 0) {
+        return 0;
+    }
+    while (*name == '/') {
+        name++;
+    }
+    for (; *name != '\0'; name = *end ? end + 1 : end) {
+        end = strchrnul(name, '/');
+        size_t len = end - name;
+        int is_dir = *end != '\0';
+        const char *dot;
+
+        if (len == 0) {
+            continue;
+        }
+        if (strset_has(&set->names, name, len) || (is_dir && strset_has(&set->names_dir, name, len))) {
+            return 1;
+        }
+        for (dot = memchr(name, '.', len); dot != NULL; dot = memchr(dot + 1, '.', end - dot - 1)) {
+            size_t extlen = end - dot - 1;
+            if (strset_has(&set->exts, dot + 1, extlen) || (is_dir && strset_has(&set->exts_dir, dot + 1, extlen))) {
+                return 1;
+            }
+        }
+        if (strset_has(&set->prefixes, path, end - path) ||
+            (is_dir && strset_has(&set->prefixes_dir, path, end - path))) {
+            return 1;
+        }
+        if (set->globs == NULL) {
+            continue;
+        }
+        if (len >= sizeof(buf) || end - path >= sizeof(buf)) {
+            continue;
+        }
+        for (glob = set->globs; glob != NULL; glob = glob->next) {
+            if (glob->dir_only && !is_dir) {
+                continue;
+            }
+            if (glob->anchored) {
+                /* Match against the path so far, without its leading slash */
+                const char *from = path;
+                while (*from == '/') {
+                    from++;
+                }
+                memcpy(buf, from, end - from);
+                buf[end - from] = '\0';
+                if (fnmatch(glob->pattern, buf, FNM_PATHNAME) == 0) {
+                    return 1;
+                }
+            } else {
+                memcpy(buf, name, len);
+                buf[len] = '\0';
+                if (fnmatch(glob->pattern, buf, 0) == 0) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Should path be left uncollected?
+ */
+int pattern_excluded(struct pattern_list *patterns, const char *path)
+{
+    if (patterns == NULL || !pattern_set_matches(&patterns->exclude, path)) {
+        return 0;
+    }
+    return !pattern_set_matches(&patterns->include, path);
+}
@@ -0,0 +1,18 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _PATTERN_H_
+#define _PATTERN_H_
+
+struct pattern_list;
+
+struct pattern_list *pattern_new(void);
+void pattern_free(struct pattern_list *patterns);
+int pattern_add(struct pattern_list *patterns, const char *pattern, int include);
+int pattern_add_file(struct pattern_list *patterns, const char *filename);
+int pattern_count(struct pattern_list *patterns);
+
+int pattern_excluded(struct pattern_list *patterns, const char *path);
+
+#endif
@@ -0,0 +1,513 @@
+/**
+ * libcollectfs-preload - collection without the mount.
+ *
+ * Going through fuse costs a pair of context switches for every read,
+ * write and stat, even though only a handful of operations can clobber
+ * a file.  For trusted tools (build and CI jobs) that only need to be
+ * protected from their own unlinks, renames and truncating opens this
+ * library can be preloaded instead:
+ *
+ *     COLLECTFS_ROOT=my_project LD_PRELOAD=libcollectfs-preload.so make
+ *
+ * unlink, unlinkat, remove, rename, renameat, renameat2, link, linkat,
+ * symlink, symlinkat and the opens with O_TRUNC (open, openat, creat,
+ * fopen with "w" and their 64 bit and fortified versions) collect a
+ * regular file they would clobber under COLLECTFS_ROOT into its trash,
+ * just as collectfs would, in the calling process.  Everything else
+ * goes straight to libc.
+ *
+ * The trash is the same as a mount's, so COLLECTFS_TRASH and
+ * COLLECTFS_LAYOUT must agree with how it is mounted, if it is, and
+ * COLLECTFS_EXCLUDE_FROM names a file of --exclude-from patterns.
+ * The background work of a mount (dedup, delta, pack, index, scrub,
+ * events) is left for the next mount to catch up on.  Programs that
+ * make system calls themselves rather than through libc, and files on
+ * other filesystems mounted beneath the root, are not protected.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+/* The wrappers are the unsuffixed names and the 64 bit ones both */
+#undef _FILE_OFFSET_BITS
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "layout.h"
+#include "log.h"
+#include "pattern.h"
+#include "trash.h"
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
+
+/** The libc function wrapped by name, looked up on first use */
+#define REAL(name) ((__typeof__(real_##name))lookup((void **)&real_##name, #name))
+
+static int (*real_unlink)(const char *);
+static int (*real_unlinkat)(int, const char *, int);
+static int (*real_remove)(const char *);
+static int (*real_rename)(const char *, const char *);
+static int (*real_renameat)(int, const char *, int, const char *);
+static int (*real_renameat2)(int, const char *, int, const char *, unsigned int);
+static int (*real_link)(const char *, const char *);
+static int (*real_linkat)(int, const char *, int, const char *, int);
+static int (*real_symlink)(const char *, const char *);
+static int (*real_symlinkat)(const char *, int, const char *);
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_openat)(int, const char *, int, ...);
+static int (*real_openat64)(int, const char *, int, ...);
+static int (*real___open_2)(const char *, int);
+static int (*real___open64_2)(const char *, int);
+static int (*real___openat_2)(int, const char *, int);
+static int (*real___openat64_2)(int, const char *, int);
+static int (*real_creat)(const char *, mode_t);
+static int (*real_creat64)(const char *, mode_t);
+static FILE *(*real_fopen)(const char *, const char *);
+static FILE *(*real_fopen64)(const char *, const char *);
+
+/** Set up from the environment when the library is loaded - rootdir is NULL if there is nothing to protect */
+static struct local_context context;
+static size_t rootlen;
+static dev_t rootdev;
+
+/**
+ * Collecting calls back into the wrapped functions (trash.c renames,
+ * links and opens) - those must go straight through.
+ */
+static __thread int collecting;
+
+static void *lookup(void **fn, const char *name)
+{
+    if (*fn == NULL) {
+        *fn = dlsym(RTLD_NEXT, name);
+    }
+    return *fn;
+}
+
+__attribute__ ((constructor))
+static void preload_init(void)
+{
+    const char *root = getenv("COLLECTFS_ROOT");
+    const char *trashname = getenv("COLLECTFS_TRASH") != NULL ? getenv("COLLECTFS_TRASH") : ".trash";
+    const char *option;
+    struct stat sb;
+    char *rootdir;
+
+    if (root == NULL) {
+        return;
+    }
+    set_tracing(getenv("COLLECTFS_TRACE") != NULL);
+    if (strchr(trashname, '/') != NULL) {
+        log_info("collectfs-preload: COLLECTFS_TRASH must be a name, not a path - nothing collected");
+        return;
+    }
+    rootdir = realpath(root, NULL);
+    if (rootdir == NULL || stat(rootdir, &sb) != 0) {
+        log_errno("collectfs-preload: cannot use COLLECTFS_ROOT %s - nothing collected", root);
+        free(rootdir);
+        return;
+    }
+    context.trashname = trashname;
+    context.trashdir = malloc(strlen(rootdir) + strlen(trashname) + 2);
+    if (context.trashdir == NULL) {
+        free(rootdir);
+        return;
+    }
+    sprintf(context.trashdir, "%s/%s", strcmp(rootdir, "/") == 0 ? "" : rootdir, trashname);
+    if ((option = getenv("COLLECTFS_LAYOUT")) != NULL && (context.layout = layout_parse(option)) < 0) {
+        log_info("collectfs-preload: COLLECTFS_LAYOUT needs mirrored, time or hashed - nothing collected");
+        return;
+    }
+    if ((option = getenv("COLLECTFS_EXCLUDE_FROM")) != NULL) {
+        context.patterns = pattern_new();
+        if (context.patterns == NULL || pattern_add_file(context.patterns, option) != 0) {
+            log_errno("collectfs-preload: cannot read COLLECTFS_EXCLUDE_FROM %s - nothing collected", option);
+            return;
+        }
+    }
+    rootdev = sb.st_dev;
+    rootlen = strcmp(rootdir, "/") == 0 ? 0 : strlen(rootdir);
+    context.rootdir = rootdir;
+}
+
+/**
+ * Make fpath the absolute path, with symlinked directories resolved,
+ * of path relative to dirfd.  Returns 0 or -1 if it can't be named.
+ */
+static int resolve(int dirfd, const char *path, char fpath[PATH_MAX])
+{
+    char dir[PATH_MAX], real[PATH_MAX];
+    const char *name = strrchr(path, '/');
+    int len;
+
+    if (name == NULL) {
+        strcpy(dir, ".");
+        name = path;
+    } else {
+        if (name - path >= sizeof(dir)) {
+            return -1;
+        }
+        if (name == path) {
+            strcpy(dir, "/");
+        } else {
+            memcpy(dir, path, name - path);
+            dir[name - path] = '\0';
+        }
+        name++;
+    }
+    if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -1;
+    }
+    if (dir[0] != '/' && dirfd != AT_FDCWD) {
+        char link[64], base[PATH_MAX];
+
+        snprintf(link, sizeof(link), "/proc/self/fd/%d", dirfd);
+        len = readlink(link, base, sizeof(base) - 1);
+        if (len < 0) {
+            return -1;
+        }
+        base[len] = '\0';
+        if (snprintf(fpath, PATH_MAX, "%s/%s", base, dir) >= PATH_MAX) {
+            return -1;
+        }
+        strcpy(dir, fpath);
+    }
+    if (realpath(dir, real) == NULL) {
+        return -1;
+    }
+    len = snprintf(fpath, PATH_MAX, "%s/%s", strcmp(real, "/") == 0 ? "" : real, name);
+    return len < PATH_MAX ? 0 : -1;
+}
+
+/**
+ * Collect the regular file at path relative to dirfd if it is under
+ * the root, outside the trash.  Returns a COLLECT_ value, with the
+ * file's stat in sb when it exists.
+ */
+static int collect_at(const char *op, int dirfd, const char *path, struct stat *sb)
+{
+    char fpath[PATH_MAX], trashed[PATH_MAX];
+    const char *relpath;
+    int rstatus;
+
+    if (context.rootdir == NULL || collecting) {
+        return COLLECT_NOT_COLLECTABLE;
+    }
+    /* One system call sees off most of what isn't ours */
+    if (fstatat(dirfd, path, sb, AT_SYMLINK_NOFOLLOW) != 0) {
+        return COLLECT_DOES_NOT_EXIST;
+    }
+    if (!S_ISREG(sb->st_mode) || sb->st_dev != rootdev || resolve(dirfd, path, fpath) != 0) {
+        return COLLECT_NOT_COLLECTABLE;
+    }
+    if (strncmp(fpath, context.rootdir, rootlen) != 0 || fpath[rootlen] != '/') {
+        return COLLECT_NOT_COLLECTABLE;
+    }
+    relpath = fpath + rootlen;
+    if (strncmp(relpath + 1, context.trashname, strlen(context.trashname)) == 0
+        && (relpath[strlen(context.trashname) + 1] == '/' || relpath[strlen(context.trashname) + 1] == '\0')) {
+        return COLLECT_NOT_COLLECTABLE;
+    }
+    if (pattern_excluded(context.patterns, relpath)) {
+        return COLLECT_NOT_COLLECTABLE;
+    }
+    collecting = 1;
+    rstatus = trash_collect_file(&context, fpath, relpath, time(NULL), trashed);
+    collecting = 0;
+    if (rstatus == COLLECT_COLLECTED) {
+        trace_info("collectfs-preload: %s collected %s as %s", op, fpath, trashed);
+    }
+    return rstatus;
+}
+
+/**
+ * Collect what renaming or linking onto newpath would replace, unless
+ * it is oldpath itself (where rename does nothing).  Returns 0, or -1
+ * if the operation must not go ahead.
+ */
+static int collect_replaced(const char *op, int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+    struct stat sb, oldsb;
+
+    if (context.rootdir == NULL || collecting) {
+        return 0;
+    }
+    if (fstatat(olddirfd, oldpath, &oldsb, AT_SYMLINK_NOFOLLOW) == 0
+        && fstatat(newdirfd, newpath, &sb, AT_SYMLINK_NOFOLLOW) == 0
+        && oldsb.st_dev == sb.st_dev && oldsb.st_ino == sb.st_ino) {
+        return 0;
+    }
+    return collect_at(op, newdirfd, newpath, &sb) == COLLECT_ERROR ? -1 : 0;
+}
+
+/**
+ * For an open that will truncate, collect the file and put a new empty
+ * one with the same permissions in its place.  Returns 0, or -1 if
+ * the open must not go ahead.
+ */
+static int collect_truncated(int dirfd, const char *path, int flags)
+{
+    struct stat sb;
+    int fd;
+
+    if (!(flags & O_TRUNC) || (flags & O_ACCMODE) == O_RDONLY || (flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+        return 0;
+    }
+    switch (collect_at("truncate", dirfd, path, &sb)) {
+    case COLLECT_ERROR:
+        return -1;
+    case COLLECT_COLLECTED:
+        /* If this fails so will the open - leave it to report it */
+        fd = REAL(openat)(dirfd, path, O_WRONLY | O_CREAT | O_EXCL, sb.st_mode & 07777);
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+int unlinkat(int dirfd, const char *path, int flags)
+{
+    struct stat sb;
+
+    if (!(flags & AT_REMOVEDIR)) {
+        switch (collect_at("unlink", dirfd, path, &sb)) {
+        case COLLECT_COLLECTED:
+            return 0;
+        case COLLECT_ERROR:
+            return -1;
+        }
+    }
+    return REAL(unlinkat)(dirfd, path, flags);
+}
+
+int unlink(const char *path)
+{
+    struct stat sb;
+
+    switch (collect_at("unlink", AT_FDCWD, path, &sb)) {
+    case COLLECT_COLLECTED:
+        return 0;
+    case COLLECT_ERROR:
+        return -1;
+    }
+    return REAL(unlink)(path);
+}
+
+int remove(const char *path)
+{
+    struct stat sb;
+
+    /* libc's remove unlinks without going through unlink */
+    switch (collect_at("unlink", AT_FDCWD, path, &sb)) {
+    case COLLECT_COLLECTED:
+        return 0;
+    case COLLECT_ERROR:
+        return -1;
+    }
+    return REAL(remove)(path);
+}
+
+int renameat2(int olddirfd, const char *oldpath, int newdirfd, const char *newpath, unsigned int flags)
+{
+    /* Neither of these can lose newpath */
+    if (!(flags & (RENAME_NOREPLACE | RENAME_EXCHANGE))
+        && collect_replaced("rename", olddirfd, oldpath, newdirfd, newpath) != 0) {
+        return -1;
+    }
+    return REAL(renameat2)(olddirfd, oldpath, newdirfd, newpath, flags);
+}
+
+int renameat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath)
+{
+    if (collect_replaced("rename", olddirfd, oldpath, newdirfd, newpath) != 0) {
+        return -1;
+    }
+    return REAL(renameat)(olddirfd, oldpath, newdirfd, newpath);
+}
+
+int rename(const char *oldpath, const char *newpath)
+{
+    if (collect_replaced("rename", AT_FDCWD, oldpath, AT_FDCWD, newpath) != 0) {
+        return -1;
+    }
+    return REAL(rename)(oldpath, newpath);
+}
+
+int linkat(int olddirfd, const char *oldpath, int newdirfd, const char *newpath, int flags)
+{
+    if (collect_replaced("link", olddirfd, oldpath, newdirfd, newpath) != 0) {
+        return -1;
+    }
+    return REAL(linkat)(olddirfd, oldpath, newdirfd, newpath, flags);
+}
+
+int link(const char *oldpath, const char *newpath)
+{
+    if (collect_replaced("link", AT_FDCWD, oldpath, AT_FDCWD, newpath) != 0) {
+        return -1;
+    }
+    return REAL(link)(oldpath, newpath);
+}
+
+int symlinkat(const char *target, int newdirfd, const char *linkpath)
+{
+    struct stat sb;
+
+    if (collect_at("symlink", newdirfd, linkpath, &sb) == COLLECT_ERROR) {
+        return -1;
+    }
+    return REAL(symlinkat)(target, newdirfd, linkpath);
+}
+
+int symlink(const char *target, const char *linkpath)
+{
+    struct stat sb;
+
+    if (collect_at("symlink", AT_FDCWD, linkpath, &sb) == COLLECT_ERROR) {
+        return -1;
+    }
+    return REAL(symlink)(target, linkpath);
+}
+
+/** Whether open's flags say a mode follows them */
+#define NEEDS_MODE(flags) (((flags) & O_CREAT) != 0 || ((flags) & O_TMPFILE) == O_TMPFILE)
+
+#define OPEN_MODE(flags, mode) do { \
+        va_list ap; \
+        va_start(ap, flags); \
+        mode = NEEDS_MODE(flags) ? va_arg(ap, int) : 0; \
+        va_end(ap); \
+    } while (0)
+
+int open(const char *path, int flags, ...)
+{
+    mode_t mode;
+
+    OPEN_MODE(flags, mode);
+    if (collect_truncated(AT_FDCWD, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(open)(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...)
+{
+    mode_t mode;
+
+    OPEN_MODE(flags, mode);
+    if (collect_truncated(AT_FDCWD, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(open64)(path, flags, mode);
+}
+
+int openat(int dirfd, const char *path, int flags, ...)
+{
+    mode_t mode;
+
+    OPEN_MODE(flags, mode);
+    if (collect_truncated(dirfd, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(openat)(dirfd, path, flags, mode);
+}
+
+int openat64(int dirfd, const char *path, int flags, ...)
+{
+    mode_t mode;
+
+    OPEN_MODE(flags, mode);
+    if (collect_truncated(dirfd, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(openat64)(dirfd, path, flags, mode);
+}
+
+/* What _FORTIFY_SOURCE turns an open without a mode into */
+
+int __open_2(const char *path, int flags)
+{
+    if (collect_truncated(AT_FDCWD, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(__open_2)(path, flags);
+}
+
+int __open64_2(const char *path, int flags)
+{
+    if (collect_truncated(AT_FDCWD, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(__open64_2)(path, flags);
+}
+
+int __openat_2(int dirfd, const char *path, int flags)
+{
+    if (collect_truncated(dirfd, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(__openat_2)(dirfd, path, flags);
+}
+
+int __openat64_2(int dirfd, const char *path, int flags)
+{
+    if (collect_truncated(dirfd, path, flags) != 0) {
+        return -1;
+    }
+    return REAL(__openat64_2)(dirfd, path, flags);
+}
+
+int creat(const char *path, mode_t mode)
+{
+    if (collect_truncated(AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+        return -1;
+    }
+    return REAL(creat)(path, mode);
+}
+
+int creat64(const char *path, mode_t mode)
+{
+    if (collect_truncated(AT_FDCWD, path, O_WRONLY | O_CREAT | O_TRUNC) != 0) {
+        return -1;
+    }
+    return REAL(creat64)(path, mode);
+}
+
+/* libc's fopen opens without going through open */
+
+FILE *fopen(const char *path, const char *mode)
+{
+    if (mode[0] == 'w' && strchr(mode, 'x') == NULL && collect_truncated(AT_FDCWD, path, O_WRONLY | O_TRUNC) != 0) {
+        return NULL;
+    }
+    return REAL(fopen)(path, mode);
+}
+
+FILE *fopen64(const char *path, const char *mode)
+{
+    if (mode[0] == 'w' && strchr(mode, 'x') == NULL && collect_truncated(AT_FDCWD, path, O_WRONLY | O_TRUNC) != 0) {
+        return NULL;
+    }
+    return REAL(fopen64)(path, mode);
+}
@@ -0,0 +1,493 @@
+/**
+ * collectfs-replay - issue a captured workload again and time it.
+ *
+ * Reads a capture written by collectfs --capture=FILE (see capture.c)
+ * and makes the same calls, in the order they returned, on the same
+ * paths under dir - a fresh collectfs mount, or the plain directory
+ * to see what collectfs costs.  Reads and writes move as many bytes as
+ * they did, writes and extended attributes with made-up content.
+ * Calls on a file handle go to whatever the replay opened for the call
+ * that opened it; calls on handles opened before the capture started
+ * are skipped.  Each call is timed on its own, one at a time, so the
+ * replay is the same every time.
+ *
+ *     collectfs-replay [-s speed] [-d] capture dir
+ *
+ * By default each call is made no sooner after the start than it was
+ * in the capture.  -s 2 replays twice as fast, -s 0 as fast as
+ * possible.  Afterwards the latency distribution of each operation is
+ * printed, as captured and as replayed, with how many calls got a
+ * different result - that many means dir didn't start out as the
+ * captured tree did (restore a checkpoint taken when the capture
+ * started, see collectfs-checkpoint).  -d prints the capture instead.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <utime.h>
+
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "capture.h"
+
+/** Latencies are kept in buckets this many to a doubling - within 6% */
+#define REPLAY_SUB_BUCKETS 16
+#define REPLAY_BUCKETS (64 * REPLAY_SUB_BUCKETS)
+#define REPLAY_HANDLES 4096
+/** replay_call couldn't make the call */
+#define REPLAY_SKIPPED INT_MIN
+
+static const char *op_names[CAPTURE_OPS] = {
+    "getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir", "symlink", "rename", "link", "chmod", "chown",
+    "truncate", "utime", "open", "read", "write", "statfs", "flush", "release", "fsync", "setxattr", "getxattr",
+    "listxattr", "removexattr", "opendir", "readdir", "releasedir", "fsyncdir", "access", "create", "ftruncate",
+    "fgetattr"
+};
+
+struct histogram {
+    unsigned long long count;
+    uint64_t total;
+    uint64_t max;
+    unsigned long long buckets[REPLAY_BUCKETS];
+};
+
+static struct histogram captured[CAPTURE_OPS];
+static struct histogram replayed[CAPTURE_OPS];
+static unsigned long long differed[CAPTURE_OPS];
+
+/**
+ * What a captured handle is in the replay - a file descriptor, or a
+ * directory stream for opendir.
+ */
+struct handle {
+    uint64_t fh;
+    int fd;
+    DIR *dir;
+    struct handle *next;
+};
+
+static struct handle *handles[REPLAY_HANDLES];
+static unsigned long long skipped;
+
+/** Grown to the biggest read, write or attribute */
+static char *buffer;
+static size_t buffer_size;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-s speed] [-d] capture dir\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bucket_of(uint64_t ns)
+{
+    int octave;
+
+    if (ns < REPLAY_SUB_BUCKETS) {
+        return ns;
+    }
+    octave = 63 - __builtin_clzll(ns);
+    /* The four bits below the top one pick the sub-bucket */
+    return (octave - 3) * REPLAY_SUB_BUCKETS + ((ns >> (octave - 4)) & (REPLAY_SUB_BUCKETS - 1));
+}
+
+static uint64_t bucket_value(int bucket)
+{
+    int octave = bucket / REPLAY_SUB_BUCKETS + 3;
+
+    if (bucket < REPLAY_SUB_BUCKETS) {
+        return bucket;
+    }
+    return (uint64_t)(REPLAY_SUB_BUCKETS + bucket % REPLAY_SUB_BUCKETS) << (octave - 4);
+}
+
+static void histogram_add(struct histogram *histogram, uint64_t ns)
+{
+    histogram->count++;
+    histogram->total += ns;
+    if (ns > histogram->max) {
+        histogram->max = ns;
+    }
+    histogram->buckets[bucket_of(ns)]++;
+}
+
+static double percentile_us(const struct histogram *histogram, double fraction)
+{
+    unsigned long long wanted = histogram->count * fraction, seen = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < REPLAY_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen > wanted) {
+            return bucket_value(bucket) / 1000.0;
+        }
+    }
+    return histogram->max / 1000.0;
+}
+
+static void print_histogram(const char *op, const char *source, const struct histogram *histogram,
+                            unsigned long long differ)
+{
+    printf("%-12s %-9s %10llu %8llu %9.1f %9.1f %9.1f %9.1f %9.1f %10.1f\n", op, source, histogram->count, differ,
+           histogram->total / 1000.0 / histogram->count, percentile_us(histogram, 0.5),
+           percentile_us(histogram, 0.9), percentile_us(histogram, 0.99), percentile_us(histogram, 0.999),
+           histogram->max / 1000.0);
+}
+
+static struct handle **handle_slot(uint64_t fh)
+{
+    struct handle **slot = &handles[fh % REPLAY_HANDLES];
+
+    while (*slot != NULL && (*slot)->fh != fh) {
+        slot = &(*slot)->next;
+    }
+    return slot;
+}
+
+static void handle_add(uint64_t fh, int fd, DIR *dir)
+{
+    struct handle **slot = handle_slot(fh);
+    struct handle *handle = *slot;
+
+    if (handle == NULL) {
+        handle = calloc(1, sizeof(struct handle));
+        if (handle == NULL) {
+            perror("handle");
+            exit(EXIT_FAILURE);
+        }
+        handle->fh = fh;
+        *slot = handle;
+    }
+    handle->fd = fd;
+    handle->dir = dir;
+}
+
+static void handle_remove(uint64_t fh)
+{
+    struct handle **slot = handle_slot(fh);
+    struct handle *handle = *slot;
+
+    if (handle != NULL) {
+        *slot = handle->next;
+        free(handle);
+    }
+}
+
+static char *grow_buffer(size_t size)
+{
+    if (size > buffer_size) {
+        char *grown = realloc(buffer, size);
+        if (grown == NULL) {
+            perror("buffer");
+            exit(EXIT_FAILURE);
+        }
+        /* Something that won't compress or deduplicate away */
+        for (; buffer_size < size; buffer_size++) {
+            grown[buffer_size] = (buffer_size * 2654435761U) >> 13;
+        }
+        buffer = grown;
+    }
+    return buffer;
+}
+
+/**
+ * The result the fuse operation would have given for a system call
+ * returning status.
+ */
+static int result(int status)
+{
+    return status < 0 ? -errno : status;
+}
+
+static int replay_open(const struct capture_record *record, const char *fpath, int flags, mode_t mode)
+{
+    int fd = open(fpath, flags, mode);
+
+    if (fd < 0) {
+        return -errno;
+    }
+    if (record->result < 0) {
+        /* Nothing in the capture will use it */
+        close(fd);
+    } else {
+        handle_add(record->fh, fd, NULL);
+    }
+    return 0;
+}
+
+/**
+ * Make the call, returning what the fuse operation would have, or
+ * REPLAY_SKIPPED if it needs a handle the replay doesn't have.
+ */
+static int replay_call(const struct capture_record *record, const char *fpath, const char *fpath2,
+                       const char *path2)
+{
+    struct handle *handle = NULL;
+    struct stat sb;
+    struct statvfs sv;
+    struct utimbuf ubuf;
+    DIR *dir;
+    int fd, rstatus;
+
+    switch (record->op) {
+    case CAPTURE_READ:
+    case CAPTURE_WRITE:
+    case CAPTURE_FLUSH:
+    case CAPTURE_RELEASE:
+    case CAPTURE_FSYNC:
+    case CAPTURE_READDIR:
+    case CAPTURE_RELEASEDIR:
+    case CAPTURE_FSYNCDIR:
+    case CAPTURE_FTRUNCATE:
+    case CAPTURE_FGETATTR:
+        handle = *handle_slot(record->fh);
+        if (handle == NULL) {
+            return REPLAY_SKIPPED;
+        }
+        break;
+    }
+
+    switch (record->op) {
+    case CAPTURE_GETATTR:
+        return result(lstat(fpath, &sb));
+    case CAPTURE_READLINK:
+        rstatus = result(readlink(fpath, grow_buffer(record->size), record->size > 0 ? record->size - 1 : 0));
+        return rstatus > 0 ? 0 : rstatus;
+    case CAPTURE_MKNOD:
+        return result(mknod(fpath, record->mode, record->size));
+    case CAPTURE_MKDIR:
+        return result(mkdir(fpath, record->mode));
+    case CAPTURE_UNLINK:
+        return result(unlink(fpath));
+    case CAPTURE_RMDIR:
+        return result(rmdir(fpath));
+    case CAPTURE_SYMLINK:
+        /* The target is kept as it was */
+        return result(symlink(path2, fpath));
+    case CAPTURE_RENAME:
+        return result(rename(fpath, fpath2));
+    case CAPTURE_LINK:
+        return result(link(fpath, fpath2));
+    case CAPTURE_CHMOD:
+        return result(chmod(fpath, record->mode));
+    case CAPTURE_CHOWN:
+        return result(chown(fpath, record->size, record->offset));
+    case CAPTURE_TRUNCATE:
+        return result(truncate(fpath, record->size));
+    case CAPTURE_UTIME:
+        ubuf.actime = record->size;
+        ubuf.modtime = record->offset;
+        return result(utime(fpath, &ubuf));
+    case CAPTURE_OPEN:
+        return replay_open(record, fpath, record->flags, 0);
+    case CAPTURE_CREATE:
+        return replay_open(record, fpath, record->flags | O_CREAT, record->mode);
+    case CAPTURE_READ:
+        return result(pread(handle->fd, grow_buffer(record->size), record->size, record->offset));
+    case CAPTURE_WRITE:
+        return result(pwrite(handle->fd, grow_buffer(record->size), record->size, record->offset));
+    case CAPTURE_STATFS:
+        return result(statvfs(fpath, &sv));
+    case CAPTURE_FLUSH:
+        fd = dup(handle->fd);
+        return fd < 0 ? -errno : result(close(fd));
+    case CAPTURE_RELEASE:
+        rstatus = result(close(handle->fd));
+        handle_remove(record->fh);
+        return rstatus;
+    case CAPTURE_FSYNC:
+        return result(record->flags ? fdatasync(handle->fd) : fsync(handle->fd));
+    case CAPTURE_SETXATTR:
+        return result(lsetxattr(fpath, path2, grow_buffer(record->size), record->size, record->flags));
+    case CAPTURE_GETXATTR:
+        return result(lgetxattr(fpath, path2, grow_buffer(record->size), record->size));
+    case CAPTURE_LISTXATTR:
+        return result(llistxattr(fpath, grow_buffer(record->size), record->size));
+    case CAPTURE_REMOVEXATTR:
+        return result(lremovexattr(fpath, path2));
+    case CAPTURE_OPENDIR:
+        dir = opendir(fpath);
+        if (dir == NULL) {
+            return -errno;
+        }
+        if (record->result < 0) {
+            closedir(dir);
+        } else {
+            handle_add(record->fh, -1, dir);
+        }
+        return 0;
+    case CAPTURE_READDIR:
+        /* collectfs lists the whole directory each time */
+        rewinddir(handle->dir);
+        errno = 0;
+        while (readdir(handle->dir) != NULL) {
+        }
+        return -errno;
+    case CAPTURE_RELEASEDIR:
+        rstatus = result(closedir(handle->dir));
+        handle_remove(record->fh);
+        return rstatus;
+    case CAPTURE_FSYNCDIR:
+        return result(record->flags ? fdatasync(dirfd(handle->dir)) : fsync(dirfd(handle->dir)));
+    case CAPTURE_ACCESS:
+        return result(access(fpath, record->flags));
+    case CAPTURE_FTRUNCATE:
+        return result(ftruncate(handle->fd, record->size));
+    case CAPTURE_FGETATTR:
+        return result(fstat(handle->fd, &sb));
+    }
+    return REPLAY_SKIPPED;
+}
+
+/**
+ * Reads the next record and its paths, or returns 0 at the end.
+ */
+static int read_record(FILE *fp, struct capture_record *record, char path[PATH_MAX], char path2[PATH_MAX])
+{
+    if (fread(record, sizeof(*record), 1, fp) != 1) {
+        return 0;
+    }
+    if (record->op >= CAPTURE_OPS || record->pathlen >= PATH_MAX || record->path2len >= PATH_MAX
+        || fread(path, 1, record->pathlen, fp) != record->pathlen
+        || fread(path2, 1, record->path2len, fp) != record->path2len) {
+        fprintf(stderr, "The capture is damaged or cut short\n");
+        return 0;
+    }
+    path[record->pathlen] = '\0';
+    path2[record->path2len] = '\0';
+    return 1;
+}
+
+static void dump_record(const struct capture_record *record, const char *path, const char *path2)
+{
+    printf("%12.6f %10.1fus %-11s %s%s%s result=%d", record->start / 1e9, record->duration / 1000.0,
+           op_names[record->op], path, record->path2len > 0 ? " " : "", path2, record->result);
+    if (record->fh != 0) {
+        printf(" fh=%llu", (unsigned long long)record->fh);
+    }
+    if (record->flags != 0) {
+        printf(" flags=0%o", record->flags);
+    }
+    if (record->mode != 0) {
+        printf(" mode=0%o", record->mode);
+    }
+    if (record->size != 0) {
+        printf(" size=%llu", (unsigned long long)record->size);
+    }
+    if (record->offset != 0) {
+        printf(" offset=%lld", (long long)record->offset);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1;
+    int dump = 0, i, op, rstatus;
+    struct capture_header header;
+    struct capture_record record;
+    char path[PATH_MAX], path2[PATH_MAX], fpath[PATH_MAX * 2], fpath2[PATH_MAX * 2];
+    unsigned long long calls = 0, differ = 0;
+    uint64_t started, before, after;
+    FILE *fp;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            speed = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "-d") == 0) {
+            dump = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - i != (dump ? 1 : 2) || speed < 0) {
+        usage(argv[0]);
+    }
+
+    fp = fopen(argv[i], "r");
+    if (fp == NULL) {
+        perror(argv[i]);
+        return EXIT_FAILURE;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != CAPTURE_MAGIC
+        || header.record_size != sizeof(struct capture_record)) {
+        fprintf(stderr, "%s isn't a capture this collectfs-replay can read\n", argv[i]);
+        return EXIT_FAILURE;
+    }
+    if (dump) {
+        time_t when = header.started;
+        printf("captured from %s", ctime(&when));
+        while (read_record(fp, &record, path, path2)) {
+            dump_record(&record, path, path2);
+        }
+        fclose(fp);
+        return EXIT_SUCCESS;
+    }
+
+    started = now_ns();
+    while (read_record(fp, &record, path, path2)) {
+        snprintf(fpath, sizeof(fpath), "%s%s", argv[i + 1], path);
+        snprintf(fpath2, sizeof(fpath2), "%s%s", argv[i + 1], path2);
+        if (speed > 0) {
+            /* No sooner than it was made in the capture */
+            uint64_t due = started + record.start / speed;
+            if ((before = now_ns()) < due) {
+                struct timespec wait = { (due - before) / 1000000000ULL, (due - before) % 1000000000ULL };
+                nanosleep(&wait, NULL);
+            }
+        }
+        before = now_ns();
+        rstatus = replay_call(&record, fpath, fpath2, path2);
+        after = now_ns();
+        if (rstatus == REPLAY_SKIPPED) {
+            skipped++;
+            continue;
+        }
+        calls++;
+        histogram_add(&captured[record.op], record.duration);
+        histogram_add(&replayed[record.op], after - before);
+        /* Counts may differ with the content - only whether and how it failed matters */
+        if ((rstatus < 0 || record.result < 0) && rstatus != record.result) {
+            differed[record.op]++;
+            differ++;
+        }
+    }
+    fclose(fp);
+    after = now_ns();
+
+    printf("%llu calls in %.3f seconds (%.0f/s), %llu with a different result, %llu skipped\n\n", calls,
+           (after - started) / 1e9, calls / ((after - started) / 1e9), differ, skipped);
+    printf("%-12s %-9s %10s %8s %9s %9s %9s %9s %9s %10s\n", "op", "latency", "calls", "differ", "mean us",
+           "p50", "p90", "p99", "p99.9", "max");
+    for (op = 0; op < CAPTURE_OPS; op++) {
+        if (captured[op].count > 0) {
+            print_histogram(op_names[op], "captured", &captured[op], 0);
+            print_histogram(op_names[op], "replayed", &replayed[op], differed[op]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
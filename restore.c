@@ -0,0 +1,149 @@
+/**
+ * collectfs-restore - turn delta encoded or compressed trash versions
+ * back into ordinary files.
+ *
+ * With --delta, collectfs stores older versions in the trash as
+ * deltas (name.YYYY-MM-DD.HH:MM:SS.delta) and with --compress it
+ * gzips aged ones (name.YYYY-MM-DD.HH:MM:SS.gz).  Given such files
+ * this rebuilds each one beside the original, with its owner,
+ * permissions and times, and removes the encoded file.  With -c the
+ * version is written to standard output instead and the encoded file
+ * is left alone:
+ *
+ *     collectfs-restore [-c] version.delta|version.gz...
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "compress.h"
+#include "delta.h"
+#include "log.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c] version%s|version%s...\n", prog, DELTA_SUFFIX, COMPRESS_SUFFIX);
+    exit(EXIT_FAILURE);
+}
+
+static int has_suffix(const char *name, const char *suffix)
+{
+    size_t len = strlen(name), slen = strlen(suffix);
+
+    return len > slen && strcmp(name + len - slen, suffix) == 0;
+}
+
+/**
+ * Write the version held in encoded to outfd.
+ */
+static int decode(const char *encoded, int outfd)
+{
+    if (has_suffix(encoded, DELTA_SUFFIX)) {
+        return delta_apply(encoded, outfd);
+    }
+    if (has_suffix(encoded, COMPRESS_SUFFIX)) {
+        return compress_restore(encoded, outfd);
+    }
+    errno = EINVAL;
+    return -1;
+}
+
+static int restore(const char *encoded)
+{
+    const char *suffix = has_suffix(encoded, DELTA_SUFFIX) ? DELTA_SUFFIX : COMPRESS_SUFFIX;
+    size_t len = strlen(encoded);
+    char path[PATH_MAX], tmppath[PATH_MAX];
+    struct stat statbuf;
+    int fd;
+
+    if (!has_suffix(encoded, suffix)) {
+        fprintf(stderr, "%s: not a delta or compressed version\n", encoded);
+        return -1;
+    }
+    if (len - strlen(suffix) >= sizeof(path)) {
+        fprintf(stderr, "%s: %s\n", encoded, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    memcpy(path, encoded, len - strlen(suffix));
+    path[len - strlen(suffix)] = '\0';
+    if (snprintf(tmppath, sizeof(tmppath), "%s.restore", path) >= sizeof(tmppath)) {
+        fprintf(stderr, "%s: %s\n", encoded, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    if (stat(encoded, &statbuf) != 0) {
+        perror(encoded);
+        return -1;
+    }
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror(tmppath);
+        return -1;
+    }
+    struct timespec times[2] = { statbuf.st_atim, statbuf.st_mtim };
+    if (decode(encoded, fd) != 0) {
+        fprintf(stderr, "%s: %s\n", encoded, strerror(errno));
+        goto fail;
+    }
+    if (fchown(fd, statbuf.st_uid, statbuf.st_gid) != 0 && errno != EPERM) {
+        perror(tmppath);
+        goto fail;
+    }
+    if (fchmod(fd, statbuf.st_mode & 07777) != 0 || futimens(fd, times) != 0 || fsync(fd) != 0) {
+        perror(tmppath);
+        goto fail;
+    }
+    close(fd);
+    if (rename(tmppath, path) != 0) {
+        perror(path);
+        unlink(tmppath);
+        return -1;
+    }
+    if (unlink(encoded) != 0) {
+        perror(encoded);
+        return -1;
+    }
+    return 0;
+
+  fail:
+    close(fd);
+    unlink(tmppath);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int to_stdout = 0, failed = 0, i = 1;
+
+    if (i < argc && strcmp(argv[i], "-c") == 0) {
+        to_stdout = 1;
+        i++;
+    }
+    if (i >= argc) {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    for (; i < argc; i++) {
+        if (to_stdout) {
+            if (decode(argv[i], STDOUT_FILENO) != 0) {
+                fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+                failed = 1;
+            }
+        } else if (restore(argv[i]) != 0) {
+            failed = 1;
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
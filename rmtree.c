@@ -0,0 +1,918 @@
+/**
+ * Whole-directory collection for recursive deletes.
+ *
+ * rm -rf reaches us as an unlink for every file and a rmdir for every
+ * directory, bottom up, and collecting each file is a trip through
+ * collect() and a rename into the trash.  With --rmtree removals are
+ * deferred instead: an unlink just remembers the path as removed, and
+ * a rmdir of a directory holding nothing but removed entries remembers
+ * the directory in their place.  Until the removal is carried out the
+ * mount behaves as if it had been - removed paths (and everything
+ * beneath removed directories) don't exist and don't appear in
+ * directory listings.
+ *
+ * Once nothing has been removed for RMTREE_DELAY seconds a background
+ * thread carries the removals out.  A removed file is collected as
+ * unlink would have.  A removed directory is renamed in one go into
+ * trashdir/.rmtree/<time>.<pid>.<seq>/tree, beside a file holding its
+ * path, and afterwards each of its files is moved to its own time
+ * stamped place in the trash, as if collected one by one when the
+ * directory was removed - so rm -rf of a tree costs the remover one
+ * rename.  A path that is created, or renamed over, while its removal
+ * is pending has the removal carried out first, as does a directory
+ * being renamed with removed entries in it.
+ *
+ * Pending removals are also appended to a journal in .rmtree, which
+ * the thread syncs at most every RMTREE_DELAY seconds and truncates
+ * once it has caught up.  On the next mount, removals found in it
+ * whose path still holds the same inode are pending again - an unlink
+ * that has returned isn't undone by a crash, short of losing the last
+ * second or so to a power cut.  A removal that can't be carried out is
+ * kept, so the path stays removed, and tried again RMTREE_RETRY
+ * seconds later.  Directories in .rmtree are finished on the next
+ * mount.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "checksum.h"
+#include "coalesce.h"
+#include "dedup.h"
+#include "delta.h"
+#include "events.h"
+#include "governor.h"
+#include "index.h"
+#include "log.h"
+#include "pack.h"
+#include "pattern.h"
+#include "rmtree.h"
+#include "trash.h"
+
+/** Seconds without a removal before pending removals are carried out */
+#define RMTREE_DELAY 1
+/** Beyond this many pending removals, unlinks happen straight away */
+#define RMTREE_MAX_PENDING (1024 * 1024)
+/** Seconds before removals that couldn't be carried out are tried again */
+#define RMTREE_RETRY 60
+#define RMTREE_PATH_FILE "path"
+#define RMTREE_TREE "tree"
+/** Hidden from retire_waiting by the dot */
+#define RMTREE_JOURNAL ".pending"
+
+/**
+ * A path removed as far as the mount is concerned.
+ */
+struct rmtree_entry {
+    struct rmtree_entry *next;
+    size_t hash;
+    time_t when;
+    int is_dir;
+    /** The inode removed - after a crash, the path must still hold it */
+    dev_t dev;
+    ino_t ino;
+    size_t len;
+    char path[];
+};
+
+struct rmtree {
+    struct local_context *context;
+    /** Protects the pending removals */
+    pthread_mutex_t lock;
+    /** Held while removals are carried out or absorbed by a rmdir */
+    pthread_mutex_t settling;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int stopping;
+    struct rmtree_entry **buckets;
+    size_t nbuckets;
+    /** Changed under lock, but read without it to skip the lock when nothing is pending */
+    size_t count;
+    /** When the last removal was deferred */
+    time_t last;
+    /** Not before this is the thread to try again after a failure */
+    time_t retry_at;
+    int journal_fd;
+    /** Something has gone into the journal since it was last synced */
+    int unsynced;
+    unsigned long seq;
+    char dir[PATH_MAX];
+    size_t trashlen;
+};
+
+static size_t hash_path(const char *path, size_t len)
+{
+    size_t h = 2166136261u, i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)path[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* Call with rmtree->lock held */
+static struct rmtree_entry *lookup(struct rmtree *rmtree, const char *path, size_t len)
+{
+    struct rmtree_entry *entry;
+    size_t h = hash_path(path, len);
+
+    if (rmtree->count == 0) {
+        return NULL;
+    }
+    for (entry = rmtree->buckets[h & (rmtree->nbuckets - 1)]; entry != NULL; entry = entry->next) {
+        if (entry->hash == h && entry->len == len && memcmp(entry->path, path, len) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/* Call with rmtree->lock held */
+static int add(struct rmtree *rmtree, const char *path, int is_dir, const struct stat *sb, time_t when)
+{
+    size_t len = strlen(path), i;
+    struct rmtree_entry *entry = malloc(sizeof(struct rmtree_entry) + len + 1);
+
+    if (entry == NULL) {
+        return -1;
+    }
+    if (rmtree->count >= rmtree->nbuckets) {
+        size_t nbuckets = rmtree->nbuckets * 2;
+        struct rmtree_entry **buckets = calloc(nbuckets, sizeof(struct rmtree_entry *));
+
+        if (buckets != NULL) {
+            for (i = 0; i < rmtree->nbuckets; i++) {
+                struct rmtree_entry *e, *next;
+
+                for (e = rmtree->buckets[i]; e != NULL; e = next) {
+                    next = e->next;
+                    e->next = buckets[e->hash & (nbuckets - 1)];
+                    buckets[e->hash & (nbuckets - 1)] = e;
+                }
+            }
+            free(rmtree->buckets);
+            rmtree->buckets = buckets;
+            rmtree->nbuckets = nbuckets;
+        }
+    }
+    entry->hash = hash_path(path, len);
+    entry->when = when;
+    entry->is_dir = is_dir;
+    entry->dev = sb->st_dev;
+    entry->ino = sb->st_ino;
+    entry->len = len;
+    memcpy(entry->path, path, len + 1);
+    entry->next = rmtree->buckets[entry->hash & (rmtree->nbuckets - 1)];
+    rmtree->buckets[entry->hash & (rmtree->nbuckets - 1)] = entry;
+    __atomic_add_fetch(&rmtree->count, 1, __ATOMIC_RELAXED);
+    rmtree->last = when;
+    return 0;
+}
+
+/* Call with rmtree->lock held */
+static void drop(struct rmtree *rmtree, struct rmtree_entry *entry)
+{
+    struct rmtree_entry **link = &rmtree->buckets[entry->hash & (rmtree->nbuckets - 1)];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    __atomic_sub_fetch(&rmtree->count, 1, __ATOMIC_RELAXED);
+    free(entry);
+}
+
+/* Call with rmtree->lock held.  Has path, or a directory above it,
+ * been removed?
+ */
+static int hidden(struct rmtree *rmtree, const char *path)
+{
+    const char *p;
+
+    for (p = path + 1;; p++) {
+        if (*p == '/' || *p == '\0') {
+            if (lookup(rmtree, path, p - path) != NULL) {
+                return 1;
+            }
+            if (*p == '\0') {
+                return 0;
+            }
+        }
+    }
+}
+
+/* Call with rmtree->lock held.  A record goes out in a single write
+ * to the O_APPEND journal.
+ */
+static int append_record(struct rmtree *rmtree, struct rmtree_entry *entry)
+{
+    char header[128];
+    int hlen = snprintf(header, sizeof(header), "%ld %d %llu %llu %zu\n", (long)entry->when, entry->is_dir,
+                        (unsigned long long)entry->dev, (unsigned long long)entry->ino, entry->len);
+    size_t len = hlen + entry->len + 1;
+    char *record = malloc(len);
+
+    if (record == NULL) {
+        return -1;
+    }
+    memcpy(record, header, hlen);
+    memcpy(record + hlen, entry->path, entry->len);
+    record[len - 1] = '\n';
+    ssize_t written = write(rmtree->journal_fd, record, len);
+    free(record);
+    if (written != (ssize_t)len) {
+        if (written >= 0) {
+            errno = EIO;
+        }
+        return log_errno("rmtree: cannot write %s/%s", rmtree->dir, RMTREE_JOURNAL);
+    }
+    rmtree->unsynced = 1;
+    return 0;
+}
+
+/* Call with rmtree->lock held.  Remember path as removed, in memory
+ * and in the journal - if it can't be journalled it isn't deferred.
+ */
+static int defer(struct rmtree *rmtree, const char *path, int is_dir, const struct stat *sb)
+{
+    if (rmtree->count >= RMTREE_MAX_PENDING || add(rmtree, path, is_dir, sb, time(NULL)) != 0) {
+        return -1;
+    }
+    if (append_record(rmtree, lookup(rmtree, path, strlen(path))) != 0) {
+        drop(rmtree, lookup(rmtree, path, strlen(path)));
+        return -1;
+    }
+    return 0;
+}
+
+/* Call with rmtree->lock held.  Drops every record apart from the
+ * removals still pending.
+ */
+static void rewrite_journal(struct rmtree *rmtree)
+{
+    struct rmtree_entry *entry;
+    size_t i;
+
+    if (ftruncate(rmtree->journal_fd, 0) != 0) {
+        log_errno("rmtree: cannot truncate %s/%s", rmtree->dir, RMTREE_JOURNAL);
+        return;
+    }
+    rmtree->unsynced = 1;
+    for (i = 0; i < rmtree->nbuckets; i++) {
+        for (entry = rmtree->buckets[i]; entry != NULL; entry = entry->next) {
+            append_record(rmtree, entry);
+        }
+    }
+}
+
+/* Call with rmtree->lock held.  The lock is let go while the disk
+ * catches up.
+ */
+static void sync_journal(struct rmtree *rmtree)
+{
+    if (!rmtree->unsynced) {
+        return;
+    }
+    rmtree->unsynced = 0;
+    pthread_mutex_unlock(&rmtree->lock);
+    if (fdatasync(rmtree->journal_fd) != 0) {
+        log_errno("rmtree: cannot sync %s/%s", rmtree->dir, RMTREE_JOURNAL);
+    }
+    pthread_mutex_lock(&rmtree->lock);
+}
+
+/**
+ * The pending removals that are path or beneath it (every one if path
+ * is NULL).  Only removals are taken out of the table, and only with
+ * rmtree->settling held, so the entries stay valid while it is.
+ */
+static struct rmtree_entry **pending(struct rmtree *rmtree, const char *path, size_t *n)
+{
+    size_t len = path != NULL ? strlen(path) : 0, i;
+    struct rmtree_entry **found, *entry;
+
+    *n = 0;
+    pthread_mutex_lock(&rmtree->lock);
+    found = malloc((rmtree->count + 1) * sizeof(struct rmtree_entry *));
+    for (i = 0; found != NULL && i < rmtree->nbuckets; i++) {
+        for (entry = rmtree->buckets[i]; entry != NULL; entry = entry->next) {
+            if (path == NULL || (entry->len >= len && memcmp(entry->path, path, len) == 0
+                                 && (entry->path[len] == '\0' || entry->path[len] == '/'))) {
+                found[(*n)++] = entry;
+            }
+        }
+    }
+    pthread_mutex_unlock(&rmtree->lock);
+    return found;
+}
+
+/**
+ * Read back the removals a crash left pending.  Ones whose path no
+ * longer holds the inode removed were carried out, or replaced, and
+ * ones beneath another pending removal were absorbed by a rmdir.
+ * Called before the thread starts.
+ */
+static void load_journal(struct rmtree *rmtree)
+{
+    struct rmtree_entry **entries;
+    struct stat sb;
+    char fpath[PATH_MAX];
+    size_t n, i;
+    int loaded = 0;
+
+    if (fstat(rmtree->journal_fd, &sb) != 0 || sb.st_size == 0) {
+        return;
+    }
+    char *journal = malloc(sb.st_size + 1);
+    if (journal == NULL) {
+        log_errno("rmtree: no memory to read %s/%s", rmtree->dir, RMTREE_JOURNAL);
+        return;
+    }
+    ssize_t len = pread(rmtree->journal_fd, journal, sb.st_size, 0);
+    if (len < 0) {
+        log_errno("rmtree: cannot read %s/%s", rmtree->dir, RMTREE_JOURNAL);
+        len = 0;
+    }
+    journal[len] = '\0';
+
+    char *p = journal;
+    char *end = journal + len;
+    while (p < end) {
+        long when;
+        int is_dir, used;
+        unsigned long long dev, ino;
+        size_t pathlen;
+
+        if (sscanf(p, "%ld %d %llu %llu %zu\n%n", &when, &is_dir, &dev, &ino, &pathlen, &used) != 5
+            || p + used + pathlen >= end) {
+            /* A torn record from a crash mid-write - nothing after it can be trusted. */
+            log_info("Collectfs: ignoring truncated rmtree journal record in %s", rmtree->dir);
+            break;
+        }
+        p += used;
+        p[pathlen] = '\0';
+        if (snprintf(fpath, sizeof(fpath), "%s%s", rmtree->context->rootdir, p) < sizeof(fpath)
+            && lstat(fpath, &sb) == 0 && sb.st_dev == (dev_t)dev && sb.st_ino == (ino_t)ino
+            && !S_ISDIR(sb.st_mode) == !is_dir && lookup(rmtree, p, pathlen) == NULL
+            && add(rmtree, p, is_dir, &sb, (time_t)when) == 0) {
+            loaded++;
+        }
+        p += pathlen + 1;
+    }
+    free(journal);
+
+    entries = pending(rmtree, NULL, &n);
+    for (i = 0; entries != NULL && i < n; i++) {
+        char *slash = strrchr(entries[i]->path, '/');
+
+        if (slash != NULL && slash != entries[i]->path) {
+            /* Trim to the parent to look above it */
+            *slash = '\0';
+            int absorbed = hidden(rmtree, entries[i]->path);
+            *slash = '/';
+            if (absorbed) {
+                drop(rmtree, entries[i]);
+                loaded--;
+            }
+        }
+    }
+    free(entries);
+    rewrite_journal(rmtree);
+    if (loaded > 0) {
+        log_info("Collectfs: %d removals were still pending in %s - carrying them out", loaded, rmtree->dir);
+    }
+}
+
+static int in_trash(struct rmtree *rmtree, const char *path)
+{
+    return strncmp(path + 1, rmtree->context->trashname, rmtree->trashlen) == 0
+        && (path[rmtree->trashlen + 1] == '\0' || path[rmtree->trashlen + 1] == '/');
+}
+
+/**
+ * Carry out the removal of one file - collect it, or just remove it if
+ * it isn't a regular file or is excluded from collection.  fpath is
+ * where the file is now, path where it was in the mount.  background
+ * is set on the rmtree thread, whose work is throttled - a removal
+ * carried out for a foreground operation isn't.
+ */
+static int retire_file(struct rmtree *rmtree, const char *fpath, const char *path, time_t when, int background)
+{
+    struct local_context *context = rmtree->context;
+    char trashed[PATH_MAX], tag[64];
+    struct stat sb;
+    int rstatus;
+
+    if (lstat(fpath, &sb) != 0) {
+        return errno == ENOENT ? 0 : log_errno("rmtree: cannot stat %s", fpath);
+    }
+    if (!S_ISREG(sb.st_mode) || pattern_excluded(context->patterns, path)) {
+        if (unlink(fpath) != 0 && errno != ENOENT) {
+            return log_errno("rmtree: cannot remove %s", fpath);
+        }
+        return 0;
+    }
+    if (background) {
+        /* Only a copy to a remote trash moves the content */
+        governor_io(context, GOVERNOR_MAINTAIN, context->trash_remote ? sb.st_size : 0);
+    }
+    if (context->trash_remote) {
+        snprintf(tag, sizeof(tag), "rmtree.%d.%lu", (int)getpid(),
+                 __atomic_add_fetch(&rmtree->seq, 1, __ATOMIC_RELAXED));
+        rstatus = trash_transfer_file(context, fpath, path, when, tag, trashed);
+    } else {
+        rstatus = trash_collect_file(context, fpath, path, when, trashed);
+    }
+    if (rstatus != COLLECT_COLLECTED) {
+        return -1;
+    }
+    coalesce_collected(context->coalesce, path, when);
+    dedup_queue(context, trashed);
+    delta_queue(context, trashed);
+    pack_queue(context, trashed);
+    index_queue(context, trashed);
+    checksum_queue(context, trashed);
+    events_record(context, "unlink", path, trashed, sb.st_size, when);
+    return 0;
+}
+
+/**
+ * Retire everything beneath the directory fpath, which was at path in
+ * the mount, and remove it.  Both buffers are extended and restored
+ * as we go down.
+ */
+static int retire_tree(struct rmtree *rmtree, char *fpath, char *path, time_t when, int background)
+{
+    size_t flen = strlen(fpath), plen = strlen(path);
+    struct dirent *de;
+    struct stat sb;
+    int rstatus = 0;
+    DIR *dp = opendir(fpath);
+
+    if (dp == NULL) {
+        return errno == ENOENT ? 0 : log_errno("rmtree: cannot read %s", fpath);
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (flen + strlen(de->d_name) + 2 > PATH_MAX || plen + strlen(de->d_name) + 2 > PATH_MAX) {
+            errno = ENAMETOOLONG;
+            rstatus = log_errno("rmtree: cannot retire %s/%s", fpath, de->d_name);
+            continue;
+        }
+        sprintf(fpath + flen, "/%s", de->d_name);
+        sprintf(path + plen, "/%s", de->d_name);
+        if (lstat(fpath, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+            rstatus |= retire_tree(rmtree, fpath, path, when, background);
+        } else {
+            rstatus |= retire_file(rmtree, fpath, path, when, background);
+        }
+        fpath[flen] = '\0';
+        path[plen] = '\0';
+    }
+    closedir(dp);
+    if (rstatus == 0 && rmdir(fpath) != 0 && errno != ENOENT) {
+        rstatus = log_errno("rmtree: cannot remove %s", fpath);
+    }
+    return rstatus;
+}
+
+/**
+ * Finish every removed directory waiting in the .rmtree folder.  Ones
+ * that can't be finished are left for the next mount.
+ */
+static void retire_waiting(struct rmtree *rmtree)
+{
+    char fpath[PATH_MAX], path[PATH_MAX];
+    struct dirent *de;
+    DIR *dp = opendir(rmtree->dir);
+
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        struct stat sb;
+        ssize_t len;
+        int fd;
+
+        if (de->d_name[0] == '.') {
+            continue;
+        }
+        if (snprintf(fpath, sizeof(fpath), "%s/%s/%s", rmtree->dir, de->d_name, RMTREE_PATH_FILE) >= sizeof(fpath)) {
+            continue;
+        }
+        fd = open(fpath, O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        len = read(fd, path, sizeof(path) - 1);
+        close(fd);
+        if (len <= 0 || fstatat(dirfd(dp), de->d_name, &sb, 0) != 0) {
+            continue;
+        }
+        path[len] = '\0';
+        /* Fits - the path file's name is longer */
+        sprintf(fpath + strlen(fpath) - strlen(RMTREE_PATH_FILE), "%s", RMTREE_TREE);
+        if (retire_tree(rmtree, fpath, path, sb.st_mtime, 1) == 0) {
+            sprintf(fpath + strlen(fpath) - strlen(RMTREE_TREE), "%s", RMTREE_PATH_FILE);
+            unlink(fpath);
+            fpath[strlen(fpath) - strlen(RMTREE_PATH_FILE) - 1] = '\0';
+            rmdir(fpath);
+            trace_info(LOG_INDENT("rmtree: retired %s"), path);
+        }
+    }
+    closedir(dp);
+}
+
+/**
+ * Move a removed directory out of the way in one rename.  Its files
+ * are retired later by retire_waiting.  If it can't be moved they are
+ * retired where they are.
+ */
+static int remove_tree(struct rmtree *rmtree, const char *fpath, const char *path, time_t when, int background)
+{
+    char holder[PATH_MAX], buf[PATH_MAX], bufpath[PATH_MAX];
+    struct timespec times[2];
+    int fd, holderfd = -1;
+
+    if (snprintf(holder, sizeof(holder), "%s/%ld.%d.%lu", rmtree->dir, (long)when, (int)getpid(),
+                 __atomic_add_fetch(&rmtree->seq, 1, __ATOMIC_RELAXED)) < sizeof(holder)
+        && mkdir(holder, 0700) == 0) {
+        holderfd = open(holder, O_RDONLY | O_DIRECTORY);
+    }
+    if (holderfd >= 0) {
+        fd = openat(holderfd, RMTREE_PATH_FILE, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (fd >= 0) {
+            int written = write(fd, path, strlen(path)) == strlen(path) && fsync(fd) == 0;
+
+            if (close(fd) == 0 && written && renameat(AT_FDCWD, fpath, holderfd, RMTREE_TREE) == 0) {
+                /* The holder's time is when it was removed */
+                times[0].tv_sec = times[1].tv_sec = when;
+                times[0].tv_nsec = times[1].tv_nsec = 0;
+                futimens(holderfd, times);
+                close(holderfd);
+                trace_info(LOG_INDENT("rmtree: moved %s to %s"), path, holder);
+                return 0;
+            }
+        }
+        log_errno("rmtree: cannot move %s into %s - retiring it in place", path, rmtree->dir);
+        unlinkat(holderfd, RMTREE_PATH_FILE, 0);
+        close(holderfd);
+        rmdir(holder);
+    }
+    strcpy(buf, fpath);
+    strcpy(bufpath, path);
+    return retire_tree(rmtree, buf, bufpath, when, background);
+}
+
+/**
+ * Carry out the given removals, throttled if in the background.  Call
+ * with rmtree->settling held.
+ */
+static int carry_out(struct rmtree *rmtree, struct rmtree_entry **entries, size_t n, int background)
+{
+    char fpath[PATH_MAX];
+    int rstatus = 0, err = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        struct rmtree_entry *entry = entries[i];
+        int removed;
+
+        if (snprintf(fpath, sizeof(fpath), "%s%s", rmtree->context->rootdir, entry->path) >= sizeof(fpath)) {
+            removed = -1;
+            errno = ENAMETOOLONG;
+        } else if (entry->is_dir) {
+            removed = remove_tree(rmtree, fpath, entry->path, entry->when, background);
+        } else {
+            removed = retire_file(rmtree, fpath, entry->path, entry->when, background);
+        }
+        if (removed != 0) {
+            /* Still removed as far as the mount is concerned - kept to try again */
+            err = errno;
+            rstatus = -1;
+            continue;
+        }
+        pthread_mutex_lock(&rmtree->lock);
+        drop(rmtree, entry);
+        pthread_mutex_unlock(&rmtree->lock);
+    }
+    errno = err;
+    return rstatus;
+}
+
+static void settle_all(struct rmtree *rmtree)
+{
+    struct rmtree_entry **entries;
+    size_t n;
+
+    int rstatus = 0;
+
+    pthread_mutex_lock(&rmtree->settling);
+    entries = pending(rmtree, NULL, &n);
+    if (entries != NULL) {
+        rstatus = carry_out(rmtree, entries, n, 1);
+        free(entries);
+    }
+    pthread_mutex_lock(&rmtree->lock);
+    if (rstatus != 0) {
+        rmtree->retry_at = time(NULL) + RMTREE_RETRY;
+        log_info("Collectfs: %zu removals could not be carried out - trying again in %d seconds",
+                 rmtree->count, RMTREE_RETRY);
+    }
+    rewrite_journal(rmtree);
+    pthread_mutex_unlock(&rmtree->lock);
+    pthread_mutex_unlock(&rmtree->settling);
+}
+
+static void *rmtree_worker(void *arg)
+{
+    struct rmtree *rmtree = (struct rmtree *)arg;
+    struct timespec wake;
+
+    governor_enter(rmtree->context, GOVERNOR_MAINTAIN);
+    /* Left by an earlier mount */
+    retire_waiting(rmtree);
+    pthread_mutex_lock(&rmtree->lock);
+    while (!rmtree->stopping) {
+        sync_journal(rmtree);
+        if (rmtree->count > 0 && time(NULL) - rmtree->last >= RMTREE_DELAY && time(NULL) >= rmtree->retry_at) {
+            pthread_mutex_unlock(&rmtree->lock);
+            settle_all(rmtree);
+            retire_waiting(rmtree);
+            pthread_mutex_lock(&rmtree->lock);
+            continue;
+        }
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += RMTREE_DELAY;
+        pthread_cond_timedwait(&rmtree->cond, &rmtree->lock, &wake);
+    }
+    pthread_mutex_unlock(&rmtree->lock);
+    settle_all(rmtree);
+    retire_waiting(rmtree);
+    /* Whatever is left is picked up from the journal on the next mount */
+    fdatasync(rmtree->journal_fd);
+    return NULL;
+}
+
+/**
+ * Forget whatever is still pending - the journal keeps it.
+ */
+static void free_entries(struct rmtree *rmtree)
+{
+    struct rmtree_entry *entry, *next;
+    size_t i;
+
+    for (i = 0; i < rmtree->nbuckets; i++) {
+        for (entry = rmtree->buckets[i]; entry != NULL; entry = next) {
+            next = entry->next;
+            free(entry);
+        }
+    }
+    free(rmtree->buckets);
+}
+
+int rmtree_start(struct local_context *context)
+{
+    struct rmtree *rmtree = calloc(1, sizeof(struct rmtree));
+    char journal[PATH_MAX];
+
+    if (rmtree == NULL) {
+        return log_errno("rmtree_start");
+    }
+    rmtree->context = context;
+    rmtree->trashlen = strlen(context->trashname);
+    rmtree->nbuckets = 1024;
+    rmtree->buckets = calloc(rmtree->nbuckets, sizeof(struct rmtree_entry *));
+    /* Beside the trash folder at the top of rootdir, so a directory can be renamed in */
+    if (rmtree->buckets == NULL
+        || snprintf(rmtree->dir, sizeof(rmtree->dir), "%s/%s/%s/", context->rootdir, context->trashname,
+                    RMTREE_FOLDER) >= sizeof(rmtree->dir)
+        || mkdir_trash_path(rmtree->dir) != 0) {
+        log_errno("Collectfs: cannot create %s", rmtree->dir);
+        free(rmtree->buckets);
+        free(rmtree);
+        return -1;
+    }
+    rmtree->dir[strlen(rmtree->dir) - 1] = '\0';
+    snprintf(journal, sizeof(journal), "%s/%s", rmtree->dir, RMTREE_JOURNAL);
+    rmtree->journal_fd = open(journal, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (rmtree->journal_fd < 0) {
+        log_errno("Collectfs: cannot open %s", journal);
+        free(rmtree->buckets);
+        free(rmtree);
+        return -1;
+    }
+    pthread_mutex_init(&rmtree->lock, NULL);
+    pthread_mutex_init(&rmtree->settling, NULL);
+    pthread_cond_init(&rmtree->cond, NULL);
+    load_journal(rmtree);
+    if (pthread_create(&rmtree->thread, NULL, rmtree_worker, rmtree) != 0) {
+        log_errno("Collectfs: cannot start rmtree thread");
+        free_entries(rmtree);
+        close(rmtree->journal_fd);
+        pthread_mutex_destroy(&rmtree->lock);
+        pthread_mutex_destroy(&rmtree->settling);
+        pthread_cond_destroy(&rmtree->cond);
+        free(rmtree);
+        return -1;
+    }
+    context->rmtree = rmtree;
+    log_info("Collectfs: collecting removed directories whole via %s", rmtree->dir);
+    return 0;
+}
+
+/**
+ * Carry out every pending removal and stop the thread.
+ */
+void rmtree_stop(struct local_context *context)
+{
+    struct rmtree *rmtree = context->rmtree;
+
+    if (rmtree == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&rmtree->lock);
+    rmtree->stopping = 1;
+    pthread_cond_signal(&rmtree->cond);
+    pthread_mutex_unlock(&rmtree->lock);
+    pthread_join(rmtree->thread, NULL);
+    context->rmtree = NULL;
+    free_entries(rmtree);
+    close(rmtree->journal_fd);
+    pthread_mutex_destroy(&rmtree->lock);
+    pthread_mutex_destroy(&rmtree->settling);
+    pthread_cond_destroy(&rmtree->cond);
+    free(rmtree);
+}
+
+/**
+ * Has path, or a directory above it, been removed?
+ */
+int rmtree_hidden(struct local_context *context, const char *path)
+{
+    struct rmtree *rmtree = context->rmtree;
+    int removed;
+
+    if (rmtree == NULL || __atomic_load_n(&rmtree->count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&rmtree->lock);
+    removed = hidden(rmtree, path);
+    pthread_mutex_unlock(&rmtree->lock);
+    return removed;
+}
+
+/**
+ * Has name in directory dir been removed?  For directory listings -
+ * dir itself is known to be there.
+ */
+int rmtree_hidden_entry(struct local_context *context, const char *dir, const char *name)
+{
+    struct rmtree *rmtree = context->rmtree;
+    char path[PATH_MAX];
+    int len, removed;
+
+    if (rmtree == NULL || __atomic_load_n(&rmtree->count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    len = snprintf(path, sizeof(path), "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, name);
+    if (len >= sizeof(path)) {
+        return 0;
+    }
+    pthread_mutex_lock(&rmtree->lock);
+    removed = lookup(rmtree, path, len) != NULL;
+    pthread_mutex_unlock(&rmtree->lock);
+    return removed;
+}
+
+/**
+ * Defer unlinking path.  Returns 1 if it has been removed as far as
+ * the mount is concerned, 0 if it should be unlinked now, or -1 with
+ * errno ENOENT if it had already been removed.
+ */
+int rmtree_unlink(struct local_context *context, const char *path)
+{
+    struct rmtree *rmtree = context->rmtree;
+    char fpath[PATH_MAX];
+    struct stat sb;
+    int deferred = 0;
+
+    if (rmtree == NULL || in_trash(rmtree, path)
+        || snprintf(fpath, sizeof(fpath), "%s%s", context->rootdir, path) >= sizeof(fpath)
+        || lstat(fpath, &sb) != 0 || S_ISDIR(sb.st_mode)) {
+        return 0;
+    }
+    pthread_mutex_lock(&rmtree->lock);
+    /* Looked at and added in one go - two unlinks racing can't both succeed */
+    if (hidden(rmtree, path)) {
+        errno = ENOENT;
+        deferred = -1;
+    } else if (defer(rmtree, path, 0, &sb) == 0) {
+        deferred = 1;
+    }
+    pthread_mutex_unlock(&rmtree->lock);
+    return deferred;
+}
+
+/**
+ * Defer removing the directory path if everything in it has been
+ * removed.  Returns 1 if it has, or 0 if it should be removed now.
+ */
+int rmtree_rmdir(struct local_context *context, const char *path)
+{
+    struct rmtree *rmtree = context->rmtree;
+    struct rmtree_entry **children = NULL;
+    char fpath[PATH_MAX];
+    size_t n = 0, i;
+    struct dirent *de;
+    struct stat sb;
+    int deferred = 0, all = 1;
+    DIR *dp;
+
+    if (rmtree == NULL || __atomic_load_n(&rmtree->count, __ATOMIC_RELAXED) == 0 || in_trash(rmtree, path)
+        || snprintf(fpath, sizeof(fpath), "%s%s", context->rootdir, path) >= sizeof(fpath)) {
+        return 0;
+    }
+    pthread_mutex_lock(&rmtree->settling);
+    dp = opendir(fpath);
+    while (dp != NULL && all && (de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+            all = rmtree_hidden_entry(context, path, de->d_name);
+            n++;
+        }
+    }
+    if (dp != NULL) {
+        closedir(dp);
+    }
+    if (dp != NULL && all && n > 0 && lstat(fpath, &sb) == 0) {
+        /* Its removed entries are now part of it */
+        children = pending(rmtree, path, &n);
+    }
+    pthread_mutex_lock(&rmtree->lock);
+    if (children != NULL && defer(rmtree, path, 1, &sb) == 0) {
+        for (i = 0; i < n; i++) {
+            if (children[i]->len > strlen(path)) {
+                drop(rmtree, children[i]);
+            }
+        }
+        deferred = 1;
+    }
+    pthread_mutex_unlock(&rmtree->lock);
+    pthread_mutex_unlock(&rmtree->settling);
+    free(children);
+    return deferred;
+}
+
+/**
+ * path is about to be created, replaced or renamed - carry out any
+ * pending removal of it or of anything beneath it.  Returns 0, or -1
+ * with errno set (ENOENT if a directory above it has been removed).
+ */
+int rmtree_settle(struct local_context *context, const char *path)
+{
+    struct rmtree *rmtree = context->rmtree;
+    struct rmtree_entry **entries;
+    const char *slash;
+    size_t n;
+    int rstatus = 0;
+
+    if (rmtree == NULL || __atomic_load_n(&rmtree->count, __ATOMIC_RELAXED) == 0) {
+        return 0;
+    }
+    slash = strrchr(path, '/');
+    if (slash != NULL && slash != path) {
+        char parent[PATH_MAX];
+
+        snprintf(parent, sizeof(parent), "%.*s", (int)(slash - path), path);
+        if (rmtree_hidden(context, parent)) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+    pthread_mutex_lock(&rmtree->settling);
+    entries = pending(rmtree, path, &n);
+    if (entries != NULL && n > 0) {
+        rstatus = carry_out(rmtree, entries, n, 0);
+    }
+    pthread_mutex_unlock(&rmtree->settling);
+    free(entries);
+    return rstatus;
+}
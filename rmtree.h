@@ -0,0 +1,25 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _RMTREE_H_
+#define _RMTREE_H_
+
+#include "collectfs.h"
+
+/**
+ * Removed directories wait in this folder at the top of the trash
+ * while their files are moved to their places in the trash.
+ */
+#define RMTREE_FOLDER ".rmtree"
+
+int rmtree_start(struct local_context *context);
+void rmtree_stop(struct local_context *context);
+
+int rmtree_hidden(struct local_context *context, const char *path);
+int rmtree_hidden_entry(struct local_context *context, const char *dir, const char *name);
+int rmtree_unlink(struct local_context *context, const char *path);
+int rmtree_rmdir(struct local_context *context, const char *path);
+int rmtree_settle(struct local_context *context, const char *path);
+
+#endif
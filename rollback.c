@@ -0,0 +1,229 @@
+/**
+ * collectfs-rollback - put back what was overwritten in a large file.
+ *
+ * With --undo, collectfs keeps an undo log of the bytes overwritten
+ * in place in large files, in .undo at the top of the trash mirroring
+ * the rootdir (name.undo).  Given just a log this lists its sessions -
+ * one starts each time the file is opened, or a checkpoint is taken
+ * while it is open.  Given the file as well this writes a copy of it
+ * as it was at the start of a session, the last one unless -s says
+ * otherwise:
+ *
+ *     collectfs-rollback undolog
+ *     collectfs-rollback [-s session] undolog file output
+ *
+ * The file is left alone.  Rolling back past a session in which the
+ * file was changed other than through the mount gives a mixture.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "copy.h"
+#include "log.h"
+#include "undo.h"
+
+#define ROLLBACK_CHUNK (1024 * 1024)
+
+struct rollback_range {
+    /** Where the saved bytes are in the log */
+    off_t at;
+    off_t offset;
+    uint32_t length;
+};
+
+struct rollback_session {
+    time_t when;
+    off_t size;
+    /** Index of its first range */
+    size_t first;
+    unsigned long long bytes;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s undolog\n       %s [-s session] undolog file output\n", prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * Read the sessions and ranges in the log.  A record cut short by a
+ * crash ends it.
+ */
+static int read_log(int fd, struct rollback_session **sessions, size_t *nsessions, struct rollback_range **ranges,
+                    size_t *nranges)
+{
+    size_t sessions_size = 0, ranges_size = 0;
+    struct undo_record record;
+    struct stat sb;
+    off_t at = 0;
+
+    *sessions = NULL;
+    *ranges = NULL;
+    *nsessions = *nranges = 0;
+    if (fstat(fd, &sb) != 0) {
+        return -1;
+    }
+    while (pread(fd, &record, sizeof(record), at) == sizeof(record)) {
+        at += sizeof(record);
+        if (record.magic == UNDO_SESSION_MAGIC) {
+            if (*nsessions == sessions_size) {
+                sessions_size = sessions_size > 0 ? sessions_size * 2 : 64;
+                *sessions = realloc(*sessions, sessions_size * sizeof(struct rollback_session));
+                if (*sessions == NULL) {
+                    return -1;
+                }
+            }
+            (*sessions)[*nsessions].when = record.when;
+            (*sessions)[*nsessions].size = record.offset;
+            (*sessions)[*nsessions].first = *nranges;
+            (*sessions)[*nsessions].bytes = 0;
+            (*nsessions)++;
+        } else if (record.magic == UNDO_RANGE_MAGIC && *nsessions > 0) {
+            if (at + record.length > sb.st_size) {
+                break;
+            }
+            if (*nranges == ranges_size) {
+                ranges_size = ranges_size > 0 ? ranges_size * 2 : 1024;
+                *ranges = realloc(*ranges, ranges_size * sizeof(struct rollback_range));
+                if (*ranges == NULL) {
+                    return -1;
+                }
+            }
+            (*ranges)[*nranges].at = at;
+            (*ranges)[*nranges].offset = record.offset;
+            (*ranges)[*nranges].length = record.length;
+            (*nranges)++;
+            (*sessions)[*nsessions - 1].bytes += record.length;
+            at += record.length;
+        } else {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Copy file to output and undo every write since session started.
+ * Newer ranges are put back first so the oldest bytes win.
+ */
+static int roll_back(int logfd, const char *file, const char *output, const struct rollback_session *session,
+                     const struct rollback_range *ranges, size_t nranges)
+{
+    char *buf = malloc(ROLLBACK_CHUNK);
+    size_t i;
+    int fd;
+
+    if (buf == NULL || copy_file(file, output) != 0) {
+        perror(output);
+        free(buf);
+        return -1;
+    }
+    fd = open(output, O_WRONLY);
+    if (fd < 0) {
+        perror(output);
+        free(buf);
+        return -1;
+    }
+    for (i = nranges; i > session->first; i--) {
+        const struct rollback_range *range = &ranges[i - 1];
+        uint32_t done, want;
+
+        for (done = 0; done < range->length; done += want) {
+            want = range->length - done < ROLLBACK_CHUNK ? range->length - done : ROLLBACK_CHUNK;
+            if (pread(logfd, buf, want, range->at + done) != want) {
+                fprintf(stderr, "undo log: %s\n", errno != 0 ? strerror(errno) : "truncated");
+                goto fail;
+            }
+            if (pwrite(fd, buf, want, range->offset + done) != want) {
+                perror(output);
+                goto fail;
+            }
+        }
+    }
+    if (ftruncate(fd, session->size) != 0 || fsync(fd) != 0 || close(fd) != 0) {
+        perror(output);
+        unlink(output);
+        free(buf);
+        return -1;
+    }
+    free(buf);
+    return 0;
+
+  fail:
+    close(fd);
+    unlink(output);
+    free(buf);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct rollback_session *sessions;
+    struct rollback_range *ranges;
+    size_t nsessions, nranges, i;
+    long chosen = 0;
+    int opt, fd, rstatus = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "s:")) != -1) {
+        if (opt != 's' || (chosen = atol(optarg)) <= 0) {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 3) {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    fd = open(argv[optind], O_RDONLY);
+    if (fd < 0) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (read_log(fd, &sessions, &nsessions, &ranges, &nranges) != 0) {
+        fprintf(stderr, "%s: %s\n", argv[optind], errno == EINVAL ? "not an undo log" : strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (nsessions == 0) {
+        fprintf(stderr, "%s: nothing to undo\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if (optind == argc - 1) {
+        for (i = 0; i < nsessions; i++) {
+            char when[32];
+            size_t last = i + 1 < nsessions ? sessions[i + 1].first : nranges;
+
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&sessions[i].when));
+            printf("%4zu  %s  size %12lld  %zu ranges, %llu bytes saved\n", i + 1, when,
+                   (long long)sessions[i].size, last - sessions[i].first, sessions[i].bytes);
+        }
+    } else {
+        if (chosen == 0) {
+            chosen = nsessions;
+        }
+        if (chosen > nsessions) {
+            fprintf(stderr, "%s: there are only %zu sessions\n", argv[optind], nsessions);
+            return EXIT_FAILURE;
+        }
+        if (roll_back(fd, argv[optind + 1], argv[optind + 2], &sessions[chosen - 1], ranges, nranges) != 0) {
+            rstatus = EXIT_FAILURE;
+        }
+    }
+    close(fd);
+    free(sessions);
+    free(ranges);
+    return rstatus;
+}
@@ -0,0 +1,140 @@
+/**
+ * collectfs-scrub - check every trash version against its recorded
+ * checksum, as fast as the disks allow.
+ *
+ * With --scrub, collectfs records a checksum of each version it
+ * collects and checks them slowly in the background.  This checks
+ * them all at once, a thread per CPU (or -j threads) each taking the
+ * next version as it finishes one, and lists the damaged ones:
+ *
+ *     collectfs-scrub [-j threads] trashdir
+ *
+ * Delta encoded, compressed and packed versions are decoded and
+ * checked.  Exits with failure if anything was damaged.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "checksum.h"
+#include "log.h"
+#include "pack.h"
+
+#define SCRUB_CHUNK (1024 * 1024)
+
+struct scrub {
+    const char *trashdir;
+    struct pack_store *store;
+    struct checksum_record *records;
+    size_t nrecords;
+    size_t next;
+    pthread_mutex_t lock;
+    unsigned long long bytes;
+    unsigned long long results[CHECKSUM_GONE + 1];
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-j threads] trashdir\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static void *scrub_worker(void *arg)
+{
+    struct scrub *scrub = (struct scrub *)arg;
+    unsigned char *buf = malloc(SCRUB_CHUNK);
+    size_t i;
+
+    if (buf == NULL) {
+        perror("collectfs-scrub");
+        return NULL;
+    }
+    while ((i = __atomic_fetch_add(&scrub->next, 1, __ATOMIC_RELAXED)) < scrub->nrecords) {
+        off_t checked;
+        int result = checksum_check(scrub->trashdir, scrub->store, &scrub->records[i], buf, SCRUB_CHUNK, 0, &checked);
+
+        pthread_mutex_lock(&scrub->lock);
+        scrub->bytes += checked;
+        scrub->results[result]++;
+        if (result != CHECKSUM_GOOD && result != CHECKSUM_GONE) {
+            printf("%s %s\n", checksum_result_name(result), scrub->records[i].path);
+        }
+        pthread_mutex_unlock(&scrub->lock);
+    }
+    free(buf);
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    struct scrub scrub;
+    struct timespec started, finished;
+    pthread_t *threads;
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i;
+    double elapsed;
+    int opt, t;
+
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt != 'j' || (nthreads = atol(optarg)) <= 0) {
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    memset(&scrub, 0, sizeof(scrub));
+    scrub.trashdir = argv[optind];
+    scrub.nrecords = checksum_load(scrub.trashdir, &scrub.records);
+    if (scrub.nrecords == 0) {
+        fprintf(stderr, "%s: no checksums recorded - mount with --scrub\n", scrub.trashdir);
+        return EXIT_FAILURE;
+    }
+    scrub.store = pack_store_open(scrub.trashdir, 0);
+    pthread_mutex_init(&scrub.lock, NULL);
+    if (nthreads > scrub.nrecords) {
+        nthreads = scrub.nrecords;
+    }
+    threads = calloc(nthreads, sizeof(pthread_t));
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for (t = 0; threads != NULL && t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, scrub_worker, &scrub) != 0) {
+            break;
+        }
+    }
+    if (threads == NULL || t == 0) {
+        scrub_worker(&scrub);
+    }
+    while (threads != NULL && --t >= 0) {
+        pthread_join(threads[t], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    elapsed = (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9;
+
+    printf("checked %zu versions, %llu bytes in %.1fs (%.0f MB/s): %llu corrupt, %llu truncated, %llu unreadable, "
+           "%llu gone\n", scrub.nrecords - (size_t)scrub.results[CHECKSUM_GONE], scrub.bytes, elapsed,
+           elapsed > 0 ? scrub.bytes / elapsed / (1024 * 1024) : 0.0, scrub.results[CHECKSUM_CORRUPT],
+           scrub.results[CHECKSUM_TRUNCATED], scrub.results[CHECKSUM_UNREADABLE], scrub.results[CHECKSUM_GONE]);
+    if (scrub.store != NULL) {
+        pack_store_close(scrub.store);
+    }
+    for (i = 0; i < scrub.nrecords; i++) {
+        free(scrub.records[i].path);
+    }
+    free(scrub.records);
+    free(threads);
+    pthread_mutex_destroy(&scrub.lock);
+    return scrub.results[CHECKSUM_CORRUPT] + scrub.results[CHECKSUM_TRUNCATED] + scrub.results[CHECKSUM_UNREADABLE]
+        ? EXIT_FAILURE : EXIT_SUCCESS;
+}
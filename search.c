@@ -0,0 +1,83 @@
+/**
+ * collectfs-search - find trash versions by name or content.
+ *
+ * With --index, collectfs keeps a trigram index of the trash in
+ * .search at the top of the trash.  This lists the versions whose
+ * original path contains text (ignoring case) or whose content
+ * contains it exactly, newest segment last:
+ *
+ *     collectfs-search [-n|-c] trashdir text
+ *
+ * -n looks at names only and -c at content only.  Each match is
+ * shown with its collection time, size, what matched and its path
+ * relative to the trash folder, which collectfs-restore or
+ * collectfs-unpack take as they are if the version has since been
+ * encoded or packed.  Content is only indexed for versions up to the
+ * size given to --index, and content searches need three or more
+ * characters.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "index.h"
+#include "log.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n|-c] trashdir text\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int show_match(void *arg, const struct index_match *match)
+{
+    static const char *matched[] = { "", "name", "content", "both" };
+    char when[32];
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&match->when));
+    printf("%s %10lld %-7s  %s\n", when, (long long)match->size, matched[match->where & 3], match->relpath);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int where = INDEX_NAMES | INDEX_CONTENT, matches, i = 1;
+    struct index_reader *reader;
+    const char *trashdir;
+
+    if (i < argc && strcmp(argv[i], "-n") == 0) {
+        where = INDEX_NAMES;
+        i++;
+    } else if (i < argc && strcmp(argv[i], "-c") == 0) {
+        where = INDEX_CONTENT;
+        i++;
+    }
+    if (argc - i != 2 || argv[i + 1][0] == '\0') {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    trashdir = argv[i];
+    reader = index_reader_open(trashdir);
+    if (reader == NULL) {
+        fprintf(stderr, "%s: no search index (%s) - mount with --index\n", trashdir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    if (where == (INDEX_NAMES | INDEX_CONTENT) && strlen(argv[i + 1]) < 3) {
+        /* Too short to look for in content */
+        where = INDEX_NAMES;
+    }
+    matches = index_reader_search(reader, argv[i + 1], where, show_match, NULL);
+    if (matches < 0) {
+        fprintf(stderr, "%s: %s\n", argv[i + 1],
+                errno == EINVAL ? "content searches need three or more characters" : strerror(errno));
+    }
+    index_reader_close(reader);
+    return matches > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,622 @@
+/**
+ * Two-phase collection - a fast path for unlink and rename.
+ *
+ * Phase one (stage_collect) appends a record to the staging journal
+ * and renames the victim into a flat staging folder inside the trash:
+ *
+ *     trashdir/.staging/<time>.<pid>.<seq>
+ *
+ * That is a single rename in a directory that always exists, so the
+ * fuse operation can return straight away.  Phase two runs on a
+ * background thread and moves each staged file to its proper time
+ * stamped place in the trash hierarchy (see trash.c).
+ *
+ * The staging folder is always in the trash folder at the top of the
+ * hierarchy, even when the trash proper is on another filesystem.
+ * Then phase two copies each file across instead of renaming it and
+ * the bytes waiting in staging are bounded - collection blocks until
+ * the copier has caught up.
+ *
+ * The journal is written before the rename, so after a crash every
+ * staged file can be matched with its original path and finalised on
+ * the next mount.  Collection doesn't wait for the record to reach the
+ * disk - that would cost an unlink a disk flush.  Instead the worker
+ * syncs whatever has been appended, at most every STAGE_SYNC_SECONDS,
+ * while it has files to finalise, so one fdatasync covers the records
+ * of every collection since the last.  A staged file whose record was
+ * lost in a crash is finalised all the same, under its staged name at
+ * the top of the trash.  The journal is truncated whenever the worker
+ * catches up.
+ *
+ * Journal records are a text header followed by the raw path (paths
+ * may contain any character other than nul):
+ *
+ *     <time> <staged name> <path length>\n<path>\n
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <dirent.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "checksum.h"
+#include "collectfs.h"
+#include "dedup.h"
+#include "delta.h"
+#include "events.h"
+#include "governor.h"
+#include "index.h"
+#include "log.h"
+#include "pack.h"
+#include "stage.h"
+#include "trash.h"
+
+#define STAGE_FOLDER "/.staging"
+#define STAGE_JOURNAL "journal"
+/** Most often the worker syncs the journal */
+#define STAGE_SYNC_SECONDS 1
+
+/**
+ * A file waiting in the staging folder.
+ */
+struct stage_entry {
+    struct stage_entry *next;
+    /** What caused the collection - not journalled, so "recovered" after a crash */
+    const char *op;
+    time_t when;
+    off_t size;
+    char staged[NAME_MAX + 1];
+    char path[];
+};
+
+struct stage {
+    struct local_context *context;
+    char dir[PATH_MAX];
+    int journal_fd;
+    unsigned long seq;
+    /** Records appended to the journal, and how many of them are known to be on disk */
+    unsigned long appended;
+    unsigned long synced;
+    time_t synced_at;
+    /** Number of collections between journal write and enqueue */
+    int inflight;
+    /** Bytes staged and not yet finalised */
+    unsigned long long pending_bytes;
+    /** The journal holds records that are no longer needed */
+    int dirty;
+    int stopping;
+    int worker_started;
+    struct stage_entry *head;
+    struct stage_entry *tail;
+    /** Entries that could not be finalised - retried next mount */
+    struct stage_entry *failed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    /** Signalled as pending_bytes goes down */
+    pthread_cond_t space;
+    pthread_t worker;
+};
+
+static struct stage_entry *new_entry(const char *op, time_t when, off_t size, const char *staged, const char *path,
+                                     size_t pathlen)
+{
+    struct stage_entry *entry = malloc(sizeof(struct stage_entry) + pathlen + 1);
+
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->next = NULL;
+    entry->op = op;
+    entry->when = when;
+    entry->size = size;
+    strncpy(entry->staged, staged, NAME_MAX);
+    entry->staged[NAME_MAX] = '\0';
+    memcpy(entry->path, path, pathlen);
+    entry->path[pathlen] = '\0';
+    return entry;
+}
+
+/* Call with stage->lock held */
+static void enqueue(struct stage *stage, struct stage_entry *entry)
+{
+    stage->pending_bytes += entry->size;
+    governor_queued(stage->context, GOVERNOR_FINISH, 1);
+    if (stage->tail == NULL) {
+        stage->head = entry;
+    } else {
+        stage->tail->next = entry;
+    }
+    stage->tail = entry;
+}
+
+/* Call with stage->lock held */
+static struct stage_entry *dequeue(struct stage *stage)
+{
+    struct stage_entry *entry = stage->head;
+
+    if (entry != NULL) {
+        stage->head = entry->next;
+        if (stage->head == NULL) {
+            stage->tail = NULL;
+        }
+        entry->next = NULL;
+    }
+    return entry;
+}
+
+/* Call with stage->lock held.  A record goes out in a single write
+ * to the O_APPEND journal.
+ */
+static int append_record(struct stage *stage, time_t when, const char *staged, const char *path)
+{
+    size_t pathlen = strlen(path);
+    char header[NAME_MAX + 64];
+    int hlen = snprintf(header, sizeof(header), "%ld %s %zu\n", (long)when, staged, pathlen);
+    size_t len = hlen + pathlen + 1;
+    char *record = malloc(len);
+
+    if (record == NULL) {
+        return -1;
+    }
+    memcpy(record, header, hlen);
+    memcpy(record + hlen, path, pathlen);
+    record[len - 1] = '\n';
+    ssize_t written = write(stage->journal_fd, record, len);
+    free(record);
+    if (written != (ssize_t)len) {
+        if (written >= 0) {
+            errno = EIO;
+        }
+        return log_errno("Failed to write staging journal %s/%s", stage->dir, STAGE_JOURNAL);
+    }
+    stage->appended++;
+    return 0;
+}
+
+/* Call with stage->lock held, from the worker.  Puts every record
+ * appended so far on disk - collections go on appending while the
+ * lock is let go for the sync.
+ */
+static void sync_journal(struct stage *stage)
+{
+    unsigned long covered = stage->appended;
+
+    if (stage->synced == covered) {
+        return;
+    }
+    pthread_mutex_unlock(&stage->lock);
+    if (fdatasync(stage->journal_fd) != 0) {
+        log_errno("Failed to sync staging journal %s/%s", stage->dir, STAGE_JOURNAL);
+    }
+    pthread_mutex_lock(&stage->lock);
+    stage->synced = covered;
+    stage->synced_at = time(NULL);
+}
+
+/* Call with stage->lock held.  Drops every record apart from the
+ * ones for entries we failed to finalise.
+ */
+static void rewrite_journal(struct stage *stage)
+{
+    struct stage_entry *entry;
+
+    if (ftruncate(stage->journal_fd, 0) != 0) {
+        log_errno("Failed to truncate staging journal %s/%s", stage->dir, STAGE_JOURNAL);
+        return;
+    }
+    for (entry = stage->failed; entry != NULL; entry = entry->next) {
+        append_record(stage, entry->when, entry->staged, entry->path);
+    }
+    if (stage->failed != NULL) {
+        sync_journal(stage);
+    }
+    stage->dirty = 0;
+}
+
+/**
+ * Move one staged file to its place in the trash.
+ */
+static int finalise(struct stage *stage, struct stage_entry *entry)
+{
+    char fpath[PATH_MAX];
+    char trashed[PATH_MAX];
+    int rstatus;
+
+    if (snprintf(fpath, sizeof(fpath), "%s/%s", stage->dir, entry->staged) >= sizeof(fpath)) {
+        errno = ENAMETOOLONG;
+        return log_errno("Staged path too long %s/%s", stage->dir, entry->staged);
+    }
+    trace_info(LOG_INDENT("stage finalise(staged='%s', path='%s')"), entry->staged, entry->path);
+    if (stage->context->trash_remote) {
+        rstatus = trash_transfer_file(stage->context, fpath, entry->path, entry->when, entry->staged, trashed);
+    } else {
+        rstatus = trash_collect_file(stage->context, fpath, entry->path, entry->when, trashed);
+    }
+    if (rstatus != COLLECT_COLLECTED) {
+        return -1;
+    }
+    dedup_queue(stage->context, trashed);
+    delta_queue(stage->context, trashed);
+    pack_queue(stage->context, trashed);
+    index_queue(stage->context, trashed);
+    checksum_queue(stage->context, trashed);
+    events_record(stage->context, entry->op, entry->path, trashed, entry->size, entry->when);
+    return 0;
+}
+
+/**
+ * Finalise staged files as they are queued, until stopping and there
+ * are none left.
+ */
+static void drain(struct stage *stage)
+{
+    struct stage_entry *entry;
+
+    pthread_mutex_lock(&stage->lock);
+    for (;;) {
+        while (stage->head == NULL) {
+            if (stage->dirty && stage->inflight == 0) {
+                rewrite_journal(stage);
+            }
+            if (stage->stopping) {
+                pthread_mutex_unlock(&stage->lock);
+                return;
+            }
+            pthread_cond_wait(&stage->cond, &stage->lock);
+        }
+        if (time(NULL) - stage->synced_at >= STAGE_SYNC_SECONDS) {
+            sync_journal(stage);
+        }
+        entry = dequeue(stage);
+        governor_queued(stage->context, GOVERNOR_FINISH, -1);
+        pthread_mutex_unlock(&stage->lock);
+
+        governor_io(stage->context, GOVERNOR_FINISH, entry->size);
+        int rstatus = finalise(stage, entry);
+
+        pthread_mutex_lock(&stage->lock);
+        stage->pending_bytes -= entry->size;
+        pthread_cond_broadcast(&stage->space);
+        if (rstatus == 0) {
+            free(entry);
+        } else {
+            entry->next = stage->failed;
+            stage->failed = entry;
+        }
+        stage->dirty = 1;
+    }
+}
+
+static void *stage_worker(void *arg)
+{
+    struct stage *stage = (struct stage *)arg;
+
+    governor_enter(stage->context, GOVERNOR_FINISH);
+    drain(stage);
+    return NULL;
+}
+
+static int by_staged(const void *a, const void *b)
+{
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+/**
+ * Queue the staged files the journal has no record of, under their
+ * staged names - the time they were staged is at the front of it.
+ * Called with the names of those it has, sorted.
+ */
+static int queue_orphans(struct stage *stage, char **known, int nknown)
+{
+    struct dirent *de;
+    int orphans = 0;
+    DIR *dp = opendir(stage->dir);
+
+    if (dp == NULL) {
+        return 0;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        char *name = de->d_name;
+        if (name[0] == '.' || strcmp(name, STAGE_JOURNAL) == 0
+            || bsearch(&name, known, nknown, sizeof(char *), by_staged) != NULL) {
+            continue;
+        }
+        char fpath[PATH_MAX], path[NAME_MAX + 2];
+        struct stat sb;
+        snprintf(fpath, sizeof(fpath), "%s/%s", stage->dir, name);
+        snprintf(path, sizeof(path), "/%s", name);
+        if (lstat(fpath, &sb) != 0) {
+            continue;
+        }
+        time_t when = strtol(name, NULL, 10);
+        struct stage_entry *entry = new_entry("recovered", when > 0 ? when : sb.st_mtime, sb.st_size, name, path,
+                                              strlen(path));
+        if (entry != NULL) {
+            enqueue(stage, entry);
+            orphans++;
+        }
+    }
+    closedir(dp);
+    return orphans;
+}
+
+/**
+ * Read the journal left by a previous mount and queue every staged
+ * file that is still waiting.  Staged files without a journal record
+ * are queued too, but their original paths are lost - they go to the
+ * top of the trash under their staged names.
+ */
+static void load_journal(struct stage *stage)
+{
+    struct stat sb;
+    int queued = 0, orphans = 0;
+    char **known = NULL;
+
+    if (fstat(stage->journal_fd, &sb) != 0) {
+        return;
+    }
+    char *journal = malloc(sb.st_size + 1);
+    if (journal == NULL) {
+        log_errno("No memory to read staging journal %s/%s", stage->dir, STAGE_JOURNAL);
+        return;
+    }
+    ssize_t len = pread(stage->journal_fd, journal, sb.st_size, 0);
+    if (len < 0) {
+        log_errno("Failed to read staging journal %s/%s", stage->dir, STAGE_JOURNAL);
+        len = 0;
+    }
+    journal[len] = '\0';
+    /* Every record takes at least 6 bytes */
+    known = malloc((len / 6 + 1) * sizeof(char *));
+
+    char *p = journal;
+    char *end = journal + len;
+    while (p < end) {
+        long when;
+        char staged[NAME_MAX + 1];
+        size_t pathlen;
+        int used;
+        if (sscanf(p, "%ld %255s %zu\n%n", &when, staged, &pathlen, &used) != 3 || p + used + pathlen >= end) {
+            /* A torn record from a crash mid-write - nothing after it can be trusted. */
+            log_info("Collectfs: ignoring truncated staging journal record in %s", stage->dir);
+            break;
+        }
+        p += used;
+        char fpath[PATH_MAX];
+        snprintf(fpath, sizeof(fpath), "%s/%s", stage->dir, staged);
+        struct stat staged_sb;
+        if (lstat(fpath, &staged_sb) == 0) {
+            struct stage_entry *entry = new_entry("recovered", when, staged_sb.st_size, staged, p, pathlen);
+            if (entry != NULL) {
+                enqueue(stage, entry);
+                if (known != NULL) {
+                    known[queued] = entry->staged;
+                }
+                queued++;
+            }
+        }
+        p += pathlen + 1;
+    }
+    free(journal);
+    stage->dirty = 1;
+
+    if (known == NULL) {
+        log_errno("No memory to look for unjournalled staged files in %s - left in place", stage->dir);
+    } else {
+        qsort(known, queued, sizeof(char *), by_staged);
+        orphans = queue_orphans(stage, known, queued);
+        free(known);
+    }
+    if (queued + orphans > 0) {
+        log_info("Collectfs: recovered %d staged files from %s", queued, stage->dir);
+    }
+    if (orphans > 0) {
+        log_info("Collectfs: WARNING, %d staged files in %s have no journal record - collected under their"
+                 " staged names", orphans, stage->dir);
+    }
+}
+
+static struct stage *stage_open(struct local_context *context)
+{
+    struct stage *stage = calloc(1, sizeof(struct stage));
+
+    if (stage == NULL) {
+        log_errno("No memory for staging");
+        return NULL;
+    }
+    stage->context = context;
+    stage->journal_fd = -1;
+    pthread_mutex_init(&stage->lock, NULL);
+    pthread_cond_init(&stage->cond, NULL);
+    pthread_cond_init(&stage->space, NULL);
+
+    if (snprintf(stage->dir, sizeof(stage->dir), "%s/%s%s/", context->rootdir, context->trashname, STAGE_FOLDER) >=
+        sizeof(stage->dir)) {
+        errno = ENAMETOOLONG;
+        log_errno("Staging folder path too long %s/%s%s", context->rootdir, context->trashname, STAGE_FOLDER);
+        goto fail;
+    }
+    if (mkdir_trash_path(stage->dir) != 0) {
+        goto fail;
+    }
+    stage->dir[strlen(stage->dir) - 1] = '\0';  /* drop the trailing slash mkdir_trash_path needed */
+
+    char journal[PATH_MAX];
+    snprintf(journal, sizeof(journal), "%s/%s", stage->dir, STAGE_JOURNAL);
+    stage->journal_fd = open(journal, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (stage->journal_fd < 0) {
+        log_errno("Cannot open staging journal %s", journal);
+        goto fail;
+    }
+    if (context->trash_remote) {
+        trash_clear_incoming(context);
+    }
+    load_journal(stage);
+    return stage;
+
+  fail:
+    pthread_mutex_destroy(&stage->lock);
+    pthread_cond_destroy(&stage->cond);
+    pthread_cond_destroy(&stage->space);
+    free(stage);
+    return NULL;
+}
+
+static void stage_free(struct stage *stage)
+{
+    struct stage_entry *entry;
+
+    while ((entry = dequeue(stage)) != NULL) {
+        free(entry);
+    }
+    while ((entry = stage->failed) != NULL) {
+        stage->failed = entry->next;
+        free(entry);
+    }
+    if (stage->journal_fd >= 0) {
+        close(stage->journal_fd);
+    }
+    pthread_mutex_destroy(&stage->lock);
+    pthread_cond_destroy(&stage->cond);
+    pthread_cond_destroy(&stage->space);
+    free(stage);
+}
+
+/**
+ * Open the staging area and start the background worker.  Files left
+ * staged by a previous mount are queued first.  Called from fop_init.
+ */
+int stage_start(struct local_context *context)
+{
+    struct stage *stage = stage_open(context);
+
+    if (stage == NULL) {
+        return -1;
+    }
+    if (pthread_create(&stage->worker, NULL, stage_worker, stage) != 0) {
+        log_errno("Cannot start staging worker");
+        stage_free(stage);
+        return -1;
+    }
+    stage->worker_started = 1;
+    context->stage = stage;
+    return 0;
+}
+
+/**
+ * Finalise everything still staged and stop the worker.
+ */
+void stage_stop(struct local_context *context)
+{
+    struct stage *stage = context->stage;
+
+    if (stage == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&stage->lock);
+    stage->stopping = 1;
+    pthread_cond_signal(&stage->cond);
+    pthread_cond_broadcast(&stage->space);
+    pthread_mutex_unlock(&stage->lock);
+    if (stage->worker_started) {
+        pthread_join(stage->worker, NULL);
+    }
+    context->stage = NULL;
+    stage_free(stage);
+}
+
+/**
+ * Synchronously finalise anything left staged by an earlier mount
+ * that used asynchronous collection.  Used when this mount doesn't.
+ */
+int stage_recover(struct local_context *context)
+{
+    char journal[PATH_MAX];
+
+    snprintf(journal, sizeof(journal), "%s/%s%s/%s", context->rootdir, context->trashname, STAGE_FOLDER, STAGE_JOURNAL);
+    if (access(journal, F_OK) != 0) {
+        return 0;
+    }
+    struct stage *stage = stage_open(context);
+    if (stage == NULL) {
+        return -1;
+    }
+    /* Drain the queue on this thread - not as the worker, which would lower this thread's priority for good */
+    stage->stopping = 1;
+    drain(stage);
+    stage_free(stage);
+    return 0;
+}
+
+/**
+ * The fast path - journal the collection and rename fpath into the
+ * staging folder.  The worker does the rest.  size is the size of
+ * the file, used to hold back collection while the copier to a
+ * remote trash has too much to do.  op is passed on to the event
+ * journal.
+ * Sets errno on error.
+ */
+int stage_collect(struct local_context *context, const char *op, const char *fpath, const char *path, off_t size)
+{
+    struct stage *stage = context->stage;
+    time_t now;
+    char staged[NAME_MAX + 1];
+    char stagedpath[PATH_MAX];
+
+    pthread_mutex_lock(&stage->lock);
+    while (context->trash_remote && context->copy_backlog > 0 && stage->pending_bytes > 0 &&
+           stage->pending_bytes + size > context->copy_backlog && !stage->stopping) {
+        trace_info(LOG_INDENT("staging backlog full (%llu bytes) - waiting"), stage->pending_bytes);
+        pthread_cond_wait(&stage->space, &stage->lock);
+    }
+    now = time(NULL);
+    snprintf(staged, sizeof(staged), "%ld.%d.%lu", (long)now, (int)getpid(), ++stage->seq);
+    if (append_record(stage, now, staged, path) != 0) {
+        pthread_mutex_unlock(&stage->lock);
+        return COLLECT_ERROR;
+    }
+    stage->inflight++;
+    pthread_mutex_unlock(&stage->lock);
+
+    int rstatus = -1;
+    int err = ENAMETOOLONG;
+    if (snprintf(stagedpath, sizeof(stagedpath), "%s/%s", stage->dir, staged) < sizeof(stagedpath)) {
+        rstatus = rename(fpath, stagedpath);
+        err = errno;
+    }
+
+    pthread_mutex_lock(&stage->lock);
+    if (rstatus == 0) {
+        struct stage_entry *entry = new_entry(op, now, size, staged, path, strlen(path));
+        if (entry != NULL) {
+            enqueue(stage, entry);
+        } else {
+            /* Can't track it now, the journal will find it next mount. */
+            log_errno("No memory to queue staged file %s", stagedpath);
+        }
+    }
+    stage->dirty = 1;
+    stage->inflight--;
+    pthread_cond_signal(&stage->cond);
+    pthread_mutex_unlock(&stage->lock);
+
+    if (rstatus != 0) {
+        errno = err;
+        log_errno("collect rename to staging %s", path);
+        return COLLECT_ERROR;
+    }
+    trace_info(LOG_INDENT("staged '%s' as '%s'"), path, staged);
+    return COLLECT_COLLECTED;
+}
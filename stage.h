@@ -0,0 +1,18 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _STAGE_H_
+#define _STAGE_H_
+
+#include <sys/types.h>
+
+#include "collectfs.h"
+
+int stage_start(struct local_context *context);
+void stage_stop(struct local_context *context);
+int stage_recover(struct local_context *context);
+
+int stage_collect(struct local_context *context, const char *op, const char *fpath, const char *path, off_t size);
+
+#endif
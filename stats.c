@@ -0,0 +1,141 @@
+/**
+ * Statistics.
+ *
+ * With --stats, what the mount is doing is written to trashdir/.stats
+ * every STATS_INTERVAL seconds, and once more when it is unmounted.  The
+ * file is replaced whole each time, so it can be read at any moment:
+ *
+ *     written 1318032000
+ *     foreground ops 81234 recent 0.210ms usual 0.190ms
+ *     background class    threads  queued ...
+ *
+ * followed by a line for each class of background work (see governor.c)
+ * giving its threads, queued items, I/Os and bytes done, and seconds
+ * spent waiting for its budget and backing off for the foreground,
+ * then the programs that have collected and read and written the most
+ * lately (see tally.c).
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "governor.h"
+#include "log.h"
+#include "stats.h"
+#include "tally.h"
+
+struct stats {
+    struct local_context *context;
+    char path[PATH_MAX];
+    char tmppath[PATH_MAX];
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stopping;
+};
+
+static void write_stats(struct stats *stats)
+{
+    FILE *fp = fopen(stats->tmppath, "w");
+
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "written %lld\n", (long long)time(NULL));
+    governor_report(stats->context, fp);
+    tally_report(stats->context, fp);
+    if (fclose(fp) != 0 || rename(stats->tmppath, stats->path) != 0) {
+        unlink(stats->tmppath);
+    }
+}
+
+static void *stats_worker(void *arg)
+{
+    struct stats *stats = (struct stats *)arg;
+    struct timespec wait;
+
+    pthread_mutex_lock(&stats->lock);
+    while (!stats->stopping) {
+        pthread_mutex_unlock(&stats->lock);
+        write_stats(stats);
+        pthread_mutex_lock(&stats->lock);
+        clock_gettime(CLOCK_REALTIME, &wait);
+        wait.tv_sec += STATS_INTERVAL;
+        while (!stats->stopping && pthread_cond_timedwait(&stats->wake, &stats->lock, &wait) != ETIMEDOUT) {
+        }
+    }
+    pthread_mutex_unlock(&stats->lock);
+    return NULL;
+}
+
+int stats_start(struct local_context *context)
+{
+    struct stats *stats = calloc(1, sizeof(struct stats));
+
+    if (stats == NULL) {
+        return log_errno("stats_start");
+    }
+    stats->context = context;
+    if (snprintf(stats->tmppath, sizeof(stats->tmppath), "%s/%s.tmp", context->trashdir, STATS_FILE)
+        >= sizeof(stats->tmppath)) {
+        free(stats);
+        errno = ENAMETOOLONG;
+        return log_errno("Collectfs: cannot write stats in %s", context->trashdir);
+    }
+    snprintf(stats->path, sizeof(stats->path), "%s/%s", context->trashdir, STATS_FILE);
+    /* Nothing may have been collected yet */
+    if (mkdir(context->trashdir, 0700) != 0 && errno != EEXIST) {
+        log_errno("Collectfs: cannot create %s", context->trashdir);
+        free(stats);
+        return -1;
+    }
+    pthread_mutex_init(&stats->lock, NULL);
+    pthread_cond_init(&stats->wake, NULL);
+    if ((errno = pthread_create(&stats->thread, NULL, stats_worker, stats)) != 0) {
+        log_errno("Collectfs: cannot start stats thread");
+        pthread_cond_destroy(&stats->wake);
+        pthread_mutex_destroy(&stats->lock);
+        free(stats);
+        return -1;
+    }
+    context->stats = stats;
+    log_info("Collectfs: writing stats to %s every %d seconds", stats->path, STATS_INTERVAL);
+    return 0;
+}
+
+/**
+ * Called before the modules it reports on stop, to write their last
+ * stats.
+ */
+void stats_stop(struct local_context *context)
+{
+    struct stats *stats = context->stats;
+
+    if (stats == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&stats->lock);
+    stats->stopping = 1;
+    pthread_cond_signal(&stats->wake);
+    pthread_mutex_unlock(&stats->lock);
+    pthread_join(stats->thread, NULL);
+    write_stats(stats);
+    context->stats = NULL;
+    pthread_cond_destroy(&stats->wake);
+    pthread_mutex_destroy(&stats->lock);
+    free(stats);
+}
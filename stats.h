@@ -0,0 +1,22 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include "collectfs.h"
+
+/**
+ * The stats are written to this file at the top of the trash...
+ */
+#define STATS_FILE ".stats"
+/**
+ * ...every this many seconds.
+ */
+#define STATS_INTERVAL 10
+
+int stats_start(struct local_context *context);
+void stats_stop(struct local_context *context);
+
+#endif
@@ -0,0 +1,661 @@
+/**
+ * collectfs-stress - check collectfs loses nothing under contention.
+ *
+ * Runs threads that unlink, rename over, hardlink, symlink, truncate on
+ * open (O_TRUNC) and write files in one directory of a mounted
+ * collectfs, all at once, for a while.  Each thread has its own set
+ * of names, so it knows exactly what it did, and keeps a model of what
+ * should now be in the directory and what should have been collected.
+ * Every file written starts with a line naming the run, its inode in
+ * the model and how many times it has been written, so afterwards:
+ *
+ *  - every name in the directory is checked against the model - the
+ *    right file, at the right generation, or the right symlink, or
+ *    nothing;
+ *
+ *  - the trash is walked and the versions found are matched against
+ *    the versions that should have been collected - none missing, none
+ *    extra.  With --async the walk is repeated until staging has
+ *    caught up or -w seconds have passed.
+ *
+ * The run is repeated for each thread count given, in a fresh
+ * directory, to show how throughput scales:
+ *
+ *     collectfs-stress [-t threads[,threads...]] [-s seconds] [-n files] [-b bytes]
+ *                      [-S seed] [-w seconds] [-T trashdir] mountpoint
+ *
+ * Use a scratch mount: the versions have to stay as collected, so it
+ * must not use --coalesce, --delta, --compress, --pack, --expire or
+ * --rmtree, and the kernel must support atomic O_TRUNC (collectfs logs
+ * whether it does).  Symlinks collected in place of the file they point
+ * to aren't counted.  "make stress" mounts one and runs this on it.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define STRESS_MAGIC "collectfs-stress"
+/** Enough for the first line of a file, however it's formatted */
+#define STRESS_LINE_MAX 128
+/** Unexpected failures reported per thread before it gives up */
+#define STRESS_MAX_FAILURES 10
+#define STRESS_MAX_RUNS 32
+
+enum { NAME_NONE, NAME_FILE, NAME_SYMLINK };
+
+struct stress_inode {
+    unsigned long id;
+    unsigned long gen;
+    /** Live names linked to it */
+    int names;
+    /** Also in the trash - writing it in place would change a collected version */
+    int trashed;
+};
+
+struct stress_name {
+    int kind;
+    /** NAME_FILE */
+    struct stress_inode *inode;
+    /** NAME_SYMLINK - the name it points to */
+    int target;
+};
+
+struct stress_version {
+    unsigned long id;
+    unsigned long gen;
+};
+
+struct versions {
+    struct stress_version *v;
+    size_t n;
+    size_t allocated;
+};
+
+struct worker {
+    int number;
+    pthread_t thread;
+    unsigned int seed;
+    struct stress_name *names;
+    /** What this thread's operations should have put in the trash */
+    struct versions expected;
+    unsigned long next_inode;
+    unsigned long long ops;
+    int failures;
+    char *pad;
+};
+
+/** The directory of the current run, leaving room for names in it */
+static char dir[PATH_MAX - NAME_MAX];
+static char run[64];
+static int nfiles = 16;
+static int maxbytes = 4096;
+static volatile int stopping;
+
+static double now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t threads[,threads...]] [-s seconds] [-n files] [-b bytes] [-S seed] [-w seconds]"
+            " [-T trashdir] mountpoint\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static int add_version(struct versions *versions, unsigned long id, unsigned long gen)
+{
+    if (versions->n == versions->allocated) {
+        size_t allocated = versions->allocated ? versions->allocated * 2 : 256;
+        struct stress_version *v = realloc(versions->v, allocated * sizeof(struct stress_version));
+
+        if (v == NULL) {
+            return -1;
+        }
+        versions->v = v;
+        versions->allocated = allocated;
+    }
+    versions->v[versions->n].id = id;
+    versions->v[versions->n].gen = gen;
+    versions->n++;
+    return 0;
+}
+
+static int compare_versions(const void *a, const void *b)
+{
+    const struct stress_version *x = a, *y = b;
+
+    if (x->id != y->id) {
+        return x->id < y->id ? -1 : 1;
+    }
+    return x->gen < y->gen ? -1 : x->gen > y->gen;
+}
+
+static void name_path(char path[PATH_MAX], int worker, int i)
+{
+    snprintf(path, PATH_MAX, "%s/t%d-%d", dir, worker, i);
+}
+
+static int header(char line[STRESS_LINE_MAX], const struct stress_inode *inode)
+{
+    return snprintf(line, STRESS_LINE_MAX, "%s %s %016lx %016lx\n", STRESS_MAGIC, run, inode->id, inode->gen);
+}
+
+/**
+ * Read the first line of fpath as a version of this run.  Returns 0,
+ * or -1 if it isn't one.
+ */
+static int read_header(const char *fpath, struct stress_version *version)
+{
+    char line[STRESS_LINE_MAX], magic[STRESS_LINE_MAX], id[STRESS_LINE_MAX];
+    ssize_t len;
+    int fd;
+
+    fd = open(fpath, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0) {
+        return -1;
+    }
+    len = pread(fd, line, sizeof(line) - 1, 0);
+    close(fd);
+    if (len <= 0) {
+        return -1;
+    }
+    line[len] = '\0';
+    if (sscanf(line, "%127s %127s %lx %lx", magic, id, &version->id, &version->gen) != 4
+        || strcmp(magic, STRESS_MAGIC) != 0 || strcmp(id, run) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+static void failed(struct worker *worker, const char *what, int i)
+{
+    char path[PATH_MAX];
+
+    name_path(path, worker->number, i);
+    fprintf(stderr, "collectfs-stress: %s %s: %s\n", what, path, strerror(errno));
+    worker->failures++;
+}
+
+static struct stress_inode *new_inode(struct worker *worker)
+{
+    struct stress_inode *inode = calloc(1, sizeof(struct stress_inode));
+
+    if (inode != NULL) {
+        inode->id = ((unsigned long)worker->number << 40) | ++worker->next_inode;
+        inode->gen = 1;
+        inode->names = 1;
+    }
+    return inode;
+}
+
+/**
+ * The file at name i is going to the trash.
+ */
+static void collected(struct worker *worker, int i)
+{
+    struct stress_inode *inode = worker->names[i].inode;
+
+    add_version(&worker->expected, inode->id, inode->gen);
+    inode->trashed = 1;
+    inode->names--;
+    worker->names[i].kind = NAME_NONE;
+    worker->names[i].inode = NULL;
+}
+
+/**
+ * Fill a new file: its first line, then up to maxbytes of padding.
+ */
+static int fill(struct worker *worker, int fd, const struct stress_inode *inode)
+{
+    char line[STRESS_LINE_MAX];
+    int n = header(line, inode);
+    int pad = rand_r(&worker->seed) % (maxbytes + 1);
+
+    return write(fd, line, n) == n && write(fd, worker->pad, pad) == pad ? 0 : -1;
+}
+
+static void op_create(struct worker *worker, int i)
+{
+    struct stress_inode *inode;
+    char path[PATH_MAX];
+    int fd;
+
+    name_path(path, worker->number, i);
+    if ((inode = new_inode(worker)) == NULL) {
+        return;
+    }
+    fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0 || fill(worker, fd, inode) != 0) {
+        failed(worker, "create", i);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    worker->names[i].kind = NAME_FILE;
+    worker->names[i].inode = inode;
+}
+
+/**
+ * open(O_TRUNC) - collectfs collects the old file and creates a new one.
+ */
+static void op_truncate(struct worker *worker, int i)
+{
+    struct stress_inode *inode;
+    char path[PATH_MAX];
+    int fd;
+
+    name_path(path, worker->number, i);
+    if ((inode = new_inode(worker)) == NULL) {
+        return;
+    }
+    fd = open(path, O_WRONLY | O_TRUNC);
+    if (fd < 0 || fill(worker, fd, inode) != 0) {
+        failed(worker, "open(O_TRUNC)", i);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    collected(worker, i);
+    worker->names[i].kind = NAME_FILE;
+    worker->names[i].inode = inode;
+}
+
+/**
+ * Rewrite the first line in place - nothing is collected.
+ */
+static void op_write(struct worker *worker, int i)
+{
+    struct stress_inode *inode = worker->names[i].inode;
+    char path[PATH_MAX], line[STRESS_LINE_MAX];
+    int fd, n;
+
+    name_path(path, worker->number, i);
+    inode->gen++;
+    n = header(line, inode);
+    fd = open(path, O_WRONLY);
+    if (fd < 0 || pwrite(fd, line, n, 0) != n) {
+        failed(worker, "write", i);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+static void op_unlink(struct worker *worker, int i)
+{
+    char path[PATH_MAX];
+
+    name_path(path, worker->number, i);
+    if (unlink(path) != 0) {
+        failed(worker, "unlink", i);
+    }
+    if (worker->names[i].kind == NAME_FILE) {
+        collected(worker, i);
+    }
+    worker->names[i].kind = NAME_NONE;
+}
+
+static void op_rename(struct worker *worker, int i, int j)
+{
+    char path[PATH_MAX], newpath[PATH_MAX];
+
+    name_path(path, worker->number, i);
+    name_path(newpath, worker->number, j);
+    if (rename(path, newpath) != 0) {
+        failed(worker, "rename over", j);
+    }
+    if (worker->names[j].kind == NAME_FILE) {
+        collected(worker, j);
+    }
+    worker->names[j] = worker->names[i];
+    worker->names[i].kind = NAME_NONE;
+    worker->names[i].inode = NULL;
+}
+
+static void op_link(struct worker *worker, int i, int j)
+{
+    char path[PATH_MAX], newpath[PATH_MAX];
+
+    name_path(path, worker->number, i);
+    name_path(newpath, worker->number, j);
+    if (link(path, newpath) != 0) {
+        failed(worker, "link", j);
+    }
+    worker->names[j] = worker->names[i];
+    worker->names[j].inode->names++;
+}
+
+static void op_symlink(struct worker *worker, int i, int j)
+{
+    char target[PATH_MAX], newpath[PATH_MAX];
+
+    snprintf(target, sizeof(target), "t%d-%d", worker->number, i);
+    name_path(newpath, worker->number, j);
+    if (symlink(target, newpath) != 0) {
+        failed(worker, "symlink", j);
+    }
+    worker->names[j].kind = NAME_SYMLINK;
+    worker->names[j].inode = NULL;
+    worker->names[j].target = i;
+}
+
+/**
+ * Pick an operation and names it makes sense for.  Returns 0 if
+ * nothing was done.
+ */
+static int step(struct worker *worker)
+{
+    int i = rand_r(&worker->seed) % nfiles, j = rand_r(&worker->seed) % nfiles;
+    struct stress_name *a = &worker->names[i], *b = &worker->names[j];
+    int op = rand_r(&worker->seed) % 100;
+
+    if (a->kind == NAME_NONE) {
+        op_create(worker, i);
+    } else if (op < 20) {
+        if (a->kind != NAME_FILE) {
+            return 0;
+        }
+        op_truncate(worker, i);
+    } else if (op < 35) {
+        if (a->kind != NAME_FILE || a->inode->names != 1 || a->inode->trashed) {
+            return 0;
+        }
+        op_write(worker, i);
+    } else if (op < 55) {
+        op_unlink(worker, i);
+    } else if (op < 75) {
+        /* Renaming a hardlink over itself does nothing - not worth modelling */
+        if (i == j || (a->kind == NAME_FILE && b->kind == NAME_FILE && a->inode == b->inode)) {
+            return 0;
+        }
+        op_rename(worker, i, j);
+    } else if (op < 90) {
+        if (a->kind != NAME_FILE || b->kind != NAME_NONE) {
+            return 0;
+        }
+        op_link(worker, i, j);
+    } else {
+        if (b->kind != NAME_NONE) {
+            return 0;
+        }
+        op_symlink(worker, i, j);
+    }
+    return 1;
+}
+
+static void *stress_worker(void *arg)
+{
+    struct worker *worker = (struct worker *)arg;
+
+    while (!stopping && worker->failures < STRESS_MAX_FAILURES) {
+        worker->ops += step(worker);
+    }
+    return NULL;
+}
+
+/**
+ * Check each name against the model.  Returns the number wrong.
+ */
+static int check_names(struct worker *worker)
+{
+    char path[PATH_MAX], link[PATH_MAX], target[PATH_MAX];
+    struct stress_version version;
+    struct stat sb;
+    int i, wrong = 0;
+    ssize_t len;
+
+    for (i = 0; i < nfiles; i++) {
+        struct stress_name *name = &worker->names[i];
+        const char *problem = NULL;
+
+        name_path(path, worker->number, i);
+        if (lstat(path, &sb) != 0) {
+            if (name->kind != NAME_NONE) {
+                problem = "missing";
+            }
+        } else if (name->kind == NAME_NONE) {
+            problem = "should have gone";
+        } else if (name->kind == NAME_SYMLINK) {
+            snprintf(target, sizeof(target), "t%d-%d", worker->number, name->target);
+            if (!S_ISLNK(sb.st_mode) || (len = readlink(path, link, sizeof(link) - 1)) < 0
+                || (link[len] = '\0', strcmp(link, target) != 0)) {
+                problem = "not the symlink written";
+            }
+        } else if (!S_ISREG(sb.st_mode) || read_header(path, &version) != 0 || version.id != name->inode->id
+                   || version.gen != name->inode->gen) {
+            problem = "not the file written";
+        }
+        if (problem != NULL) {
+            fprintf(stderr, "collectfs-stress: %s: %s\n", path, problem);
+            wrong++;
+        }
+    }
+    return wrong;
+}
+
+static void walk_trash(const char *trashdir, int top, struct versions *found)
+{
+    struct stress_version version;
+    char path[PATH_MAX];
+    struct dirent *de;
+    DIR *dp = opendir(trashdir);
+
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        /* Staging, scrub records and the like at the top aren't versions yet */
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || (top && de->d_name[0] == '.')) {
+            continue;
+        }
+        if (snprintf(path, sizeof(path), "%s/%s", trashdir, de->d_name) >= sizeof(path)) {
+            continue;
+        }
+        if (de->d_type == DT_DIR) {
+            walk_trash(path, 0, found);
+        } else if ((de->d_type == DT_REG || de->d_type == DT_UNKNOWN) && read_header(path, &version) == 0) {
+            add_version(found, version.id, version.gen);
+        }
+    }
+    closedir(dp);
+}
+
+/**
+ * Match the versions in the trash against those expected, both sorted.
+ * Returns the number of discrepancies, reporting the first few if
+ * report is set.
+ */
+static size_t match(const struct versions *expected, const struct versions *found, int report,
+                    size_t *missing, size_t *extra)
+{
+    size_t e = 0, f = 0, shown = 0;
+
+    *missing = *extra = 0;
+    while (e < expected->n || f < found->n) {
+        int c = e == expected->n ? 1 : f == found->n ? -1 : compare_versions(&expected->v[e], &found->v[f]);
+
+        if (c == 0) {
+            e++;
+            f++;
+            continue;
+        }
+        if (report && shown++ < 10) {
+            const struct stress_version *v = c < 0 ? &expected->v[e] : &found->v[f];
+            fprintf(stderr, "collectfs-stress: %s version %016lx generation %lu\n",
+                    c < 0 ? "missing" : "unexpected", v->id, v->gen);
+        }
+        if (c < 0) {
+            (*missing)++;
+            e++;
+        } else {
+            (*extra)++;
+            f++;
+        }
+    }
+    return *missing + *extra;
+}
+
+/**
+ * One run with nthreads threads.  Returns the number of problems found.
+ */
+static int stress(const char *mountpoint, const char *trashdir, int nthreads, int seconds, unsigned int seed,
+                  int settle, double *rate)
+{
+    struct worker *workers = calloc(nthreads, sizeof(struct worker));
+    struct versions expected = { NULL, 0, 0 }, found = { NULL, 0, 0 };
+    unsigned long long ops = 0;
+    size_t missing, extra;
+    double started, elapsed, deadline;
+    int t, problems = 0;
+
+    snprintf(run, sizeof(run), "%d.%d.%ld", (int)getpid(), nthreads, (long)time(NULL));
+    snprintf(dir, sizeof(dir), "%s/%s.%s", mountpoint, STRESS_MAGIC, run);
+    if (workers == NULL || mkdir(dir, 0755) != 0) {
+        fprintf(stderr, "collectfs-stress: cannot create %s: %s\n", dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    for (t = 0; t < nthreads; t++) {
+        workers[t].number = t;
+        workers[t].seed = seed + t;
+        workers[t].names = calloc(nfiles, sizeof(struct stress_name));
+        workers[t].pad = malloc(maxbytes + 1);
+        if (workers[t].names == NULL || workers[t].pad == NULL) {
+            fprintf(stderr, "collectfs-stress: out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(workers[t].pad, 'x', maxbytes);
+    }
+
+    stopping = 0;
+    started = now_s();
+    for (t = 0; t < nthreads; t++) {
+        if ((errno = pthread_create(&workers[t].thread, NULL, stress_worker, &workers[t])) != 0) {
+            perror("collectfs-stress: pthread_create");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sleep(seconds);
+    stopping = 1;
+    for (t = 0; t < nthreads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        ops += workers[t].ops;
+        problems += workers[t].failures;
+    }
+    elapsed = now_s() - started;
+    *rate = ops / elapsed;
+
+    for (t = 0; t < nthreads; t++) {
+        problems += check_names(&workers[t]);
+        for (size_t v = 0; v < workers[t].expected.n; v++) {
+            add_version(&expected, workers[t].expected.v[v].id, workers[t].expected.v[v].gen);
+        }
+    }
+    qsort(expected.v, expected.n, sizeof(struct stress_version), compare_versions);
+
+    /* Staged collections may still be on their way */
+    deadline = now_s() + settle;
+    for (;;) {
+        found.n = 0;
+        walk_trash(trashdir, 1, &found);
+        qsort(found.v, found.n, sizeof(struct stress_version), compare_versions);
+        if (match(&expected, &found, 0, &missing, &extra) == 0 || now_s() >= deadline) {
+            break;
+        }
+        sleep(1);
+    }
+    problems += match(&expected, &found, 1, &missing, &extra);
+    printf("%7d %10llu %10.0f %10zu %10zu %10zu %10zu  %s\n", nthreads, ops, *rate, expected.n, found.n, missing,
+           extra, dir);
+    fflush(stdout);
+
+    for (t = 0; t < nthreads; t++) {
+        free(workers[t].names);
+        free(workers[t].pad);
+        free(workers[t].expected.v);
+        /* The model's inodes are left - there are few, and they're shared between names */
+    }
+    free(workers);
+    free(expected.v);
+    free(found.v);
+    return problems;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads[STRESS_MAX_RUNS] = { 1, 2, 4, 8 }, nruns = 4, seconds = 5, settle = 30;
+    unsigned int seed = (unsigned int)time(NULL);
+    char trashdir[PATH_MAX] = "", *p;
+    const char *trashname = getenv("COLLECTFS_TRASH") != NULL ? getenv("COLLECTFS_TRASH") : ".trash";
+    double rate, base = 0;
+    int i, r, problems = 0;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            for (nruns = 0, p = strtok(argv[++i], ","); p != NULL && nruns < STRESS_MAX_RUNS;
+                 p = strtok(NULL, ",")) {
+                if ((threads[nruns++] = atoi(p)) <= 0) {
+                    usage(argv[0]);
+                }
+            }
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            nfiles = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            maxbytes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            settle = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+            snprintf(trashdir, sizeof(trashdir), "%s", argv[++i]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (i != argc - 1 || nruns == 0 || seconds <= 0 || nfiles < 2 || maxbytes < 0) {
+        usage(argv[0]);
+    }
+    if (trashdir[0] == '\0') {
+        snprintf(trashdir, sizeof(trashdir), "%s/%s", argv[i], trashname);
+    }
+
+    printf("seed %u, %d names a thread, %d seconds a run, trash %s\n", seed, nfiles, seconds, trashdir);
+    printf("%7s %10s %10s %10s %10s %10s %10s  %s\n", "threads", "ops", "ops/s", "collected", "in-trash",
+           "missing", "extra", "directory");
+    for (r = 0; r < nruns; r++) {
+        problems += stress(argv[i], trashdir, threads[r], seconds, seed, settle, &rate);
+        if (r == 0) {
+            base = rate;
+        } else if (base > 0) {
+            printf("%7s %.2fx the throughput of %d thread%s\n", "", rate / base, threads[0],
+                   threads[0] == 1 ? "" : "s");
+        }
+    }
+    if (problems > 0) {
+        printf("FAILED: %d problems\n", problems);
+        return EXIT_FAILURE;
+    }
+    printf("OK: every version accounted for\n");
+    return EXIT_SUCCESS;
+}
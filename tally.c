@@ -0,0 +1,290 @@
+/**
+ * Who is doing it.
+ *
+ * When the trash suddenly grows by gigabytes the question is which
+ * tool did it.  With --stats each collection, and the bytes each read
+ * and write move, are put down to the program that asked - its name
+ * from /proc/PID/comm and the uid it runs as, both taken from the fuse
+ * request - so the culprit can be found and --exclude'd.
+ *
+ * A build runs thousands of short lived processes, so programs rather
+ * than processes are tallied.  Names are cached by pid, TALLY_PIDS of
+ * them, and read again after TALLY_PID_SECONDS.  At most TALLY_PROGRAMS
+ * programs are tallied: recent counts halve every TALLY_HALF_LIFE
+ * seconds, and when the table is full the program least active lately
+ * makes room, its counts going to an "(others)" line so the totals
+ * still add up.
+ *
+ * The stats (see stats.c) list the TALLY_TOP programs that have
+ * collected most lately and the TALLY_TOP that have read and written
+ * most lately:
+ *
+ *     collecting program              uid   collects            bytes     recent-bytes
+ *     collecting cc1                 1000       5123        812345678         12345678
+ *     io         program              uid             read          written     recent-bytes
+ *     io         ld                  1000        123456789         23456789          3456789
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#include "collectfs.h"
+#include "log.h"
+#include "tally.h"
+
+/** Long enough for /proc/PID/comm */
+#define TALLY_COMM 16
+
+struct tally_program {
+    char comm[TALLY_COMM];
+    uid_t uid;
+    unsigned long long collects;
+    unsigned long long collected;
+    unsigned long long read;
+    unsigned long long written;
+    /** Collected and read or written lately - halved every TALLY_HALF_LIFE */
+    unsigned long long recent_collected;
+    unsigned long long recent_io;
+};
+
+struct tally_pid {
+    pid_t pid;
+    time_t checked;
+    char comm[TALLY_COMM];
+    /** Where its program was last found in programs - may since have been replaced */
+    int program;
+};
+
+struct tally {
+    pthread_mutex_t lock;
+    time_t halved;
+    int count;
+    struct tally_program programs[TALLY_PROGRAMS];
+    /** Everything tallied to programs that have made room for others */
+    struct tally_program others;
+    struct tally_pid pids[TALLY_PIDS];
+};
+
+static void read_comm(pid_t pid, char comm[TALLY_COMM])
+{
+    char path[64];
+    ssize_t len;
+    int fd;
+
+    strcpy(comm, pid == 0 ? "(kernel)" : "(gone)");
+    snprintf(path, sizeof(path), "/proc/%d/comm", (int)pid);
+    if (pid == 0 || (fd = open(path, O_RDONLY)) < 0) {
+        return;
+    }
+    len = read(fd, comm, TALLY_COMM - 1);
+    close(fd);
+    if (len > 0) {
+        comm[len] = '\0';
+        comm[strcspn(comm, "\n")] = '\0';
+    }
+}
+
+static void halve(struct tally *tally, time_t now)
+{
+    int i;
+
+    while (now - tally->halved >= TALLY_HALF_LIFE) {
+        for (i = 0; i < tally->count; i++) {
+            tally->programs[i].recent_collected /= 2;
+            tally->programs[i].recent_io /= 2;
+        }
+        tally->halved += TALLY_HALF_LIFE;
+    }
+}
+
+/**
+ * Make room by folding the program least active lately into others.
+ */
+static int make_room(struct tally *tally)
+{
+    struct tally_program *program;
+    int i, least = 0;
+
+    for (i = 1; i < tally->count; i++) {
+        if (tally->programs[i].recent_collected + tally->programs[i].recent_io
+            < tally->programs[least].recent_collected + tally->programs[least].recent_io) {
+            least = i;
+        }
+    }
+    program = &tally->programs[least];
+    tally->others.collects += program->collects;
+    tally->others.collected += program->collected;
+    tally->others.read += program->read;
+    tally->others.written += program->written;
+    return least;
+}
+
+/**
+ * The program pid is running, called with the lock held.
+ */
+static struct tally_program *program_of(struct tally *tally, pid_t pid, uid_t uid, time_t now)
+{
+    struct tally_pid *cached = &tally->pids[pid % TALLY_PIDS];
+    struct tally_program *program;
+    int i;
+
+    if (cached->pid != pid || now - cached->checked >= TALLY_PID_SECONDS) {
+        cached->pid = pid;
+        cached->checked = now;
+        cached->program = -1;
+        read_comm(pid, cached->comm);
+    }
+    if (cached->program >= 0) {
+        program = &tally->programs[cached->program];
+        if (program->uid == uid && strcmp(program->comm, cached->comm) == 0) {
+            return program;
+        }
+    }
+    for (i = 0; i < tally->count; i++) {
+        program = &tally->programs[i];
+        if (program->uid == uid && strcmp(program->comm, cached->comm) == 0) {
+            cached->program = i;
+            return program;
+        }
+    }
+    i = tally->count < TALLY_PROGRAMS ? tally->count++ : make_room(tally);
+    program = &tally->programs[i];
+    memset(program, 0, sizeof(*program));
+    strcpy(program->comm, cached->comm);
+    program->uid = uid;
+    cached->program = i;
+    return program;
+}
+
+void tally_collect(struct local_context *context, pid_t pid, uid_t uid, off_t bytes)
+{
+    struct tally *tally = context->tally;
+    struct tally_program *program;
+    time_t now = time(NULL);
+
+    if (tally == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&tally->lock);
+    halve(tally, now);
+    program = program_of(tally, pid, uid, now);
+    program->collects++;
+    program->collected += bytes;
+    program->recent_collected += bytes;
+    pthread_mutex_unlock(&tally->lock);
+}
+
+void tally_io(struct local_context *context, pid_t pid, uid_t uid, size_t read, size_t written)
+{
+    struct tally *tally = context->tally;
+    struct tally_program *program;
+    time_t now = time(NULL);
+
+    if (tally == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&tally->lock);
+    halve(tally, now);
+    program = program_of(tally, pid, uid, now);
+    program->read += read;
+    program->written += written;
+    program->recent_io += read + written;
+    pthread_mutex_unlock(&tally->lock);
+}
+
+static int by_recent_collected(const void *a, const void *b)
+{
+    const struct tally_program *x = a, *y = b;
+
+    return x->recent_collected < y->recent_collected ? 1 : x->recent_collected > y->recent_collected ? -1 : 0;
+}
+
+static int by_recent_io(const void *a, const void *b)
+{
+    const struct tally_program *x = a, *y = b;
+
+    return x->recent_io < y->recent_io ? 1 : x->recent_io > y->recent_io ? -1 : 0;
+}
+
+void tally_report(struct local_context *context, FILE *fp)
+{
+    struct tally *tally = context->tally;
+    struct tally_program programs[TALLY_PROGRAMS], others;
+    int count, i;
+
+    if (tally == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&tally->lock);
+    halve(tally, time(NULL));
+    count = tally->count;
+    memcpy(programs, tally->programs, count * sizeof(struct tally_program));
+    others = tally->others;
+    pthread_mutex_unlock(&tally->lock);
+
+    qsort(programs, count, sizeof(struct tally_program), by_recent_collected);
+    fprintf(fp, "collecting %-16s %7s %10s %16s %16s\n", "program", "uid", "collects", "bytes", "recent-bytes");
+    for (i = 0; i < count && i < TALLY_TOP && programs[i].collects > 0; i++) {
+        fprintf(fp, "collecting %-16s %7u %10llu %16llu %16llu\n", programs[i].comm, (unsigned)programs[i].uid,
+                programs[i].collects, programs[i].collected, programs[i].recent_collected);
+    }
+    if (others.collects > 0) {
+        fprintf(fp, "collecting %-16s %7s %10llu %16llu %16s\n", "(others)", "-", others.collects, others.collected,
+                "-");
+    }
+
+    qsort(programs, count, sizeof(struct tally_program), by_recent_io);
+    fprintf(fp, "io         %-16s %7s %16s %16s %16s\n", "program", "uid", "read", "written", "recent-bytes");
+    for (i = 0; i < count && i < TALLY_TOP && programs[i].read + programs[i].written > 0; i++) {
+        fprintf(fp, "io         %-16s %7u %16llu %16llu %16llu\n", programs[i].comm, (unsigned)programs[i].uid,
+                programs[i].read, programs[i].written, programs[i].recent_io);
+    }
+    if (others.read + others.written > 0) {
+        fprintf(fp, "io         %-16s %7s %16llu %16llu %16s\n", "(others)", "-", others.read, others.written, "-");
+    }
+}
+
+int tally_start(struct local_context *context)
+{
+    struct tally *tally = calloc(1, sizeof(struct tally));
+    int i;
+
+    if (tally == NULL) {
+        return log_errno("tally_start");
+    }
+    for (i = 0; i < TALLY_PIDS; i++) {
+        tally->pids[i].pid = -1;
+    }
+    tally->halved = time(NULL);
+    pthread_mutex_init(&tally->lock, NULL);
+    context->tally = tally;
+    return 0;
+}
+
+/**
+ * Called once nothing more can be tallied or reported.
+ */
+void tally_stop(struct local_context *context)
+{
+    struct tally *tally = context->tally;
+
+    if (tally == NULL) {
+        return;
+    }
+    context->tally = NULL;
+    pthread_mutex_destroy(&tally->lock);
+    free(tally);
+}
@@ -0,0 +1,43 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _TALLY_H_
+#define _TALLY_H_
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+
+/**
+ * Programs tallied at once
+ */
+#define TALLY_PROGRAMS 128
+/**
+ * Program names cached by pid
+ */
+#define TALLY_PIDS 1024
+/**
+ * Seconds before a cached name is read again, in case the pid has
+ * exec'ed or been reused
+ */
+#define TALLY_PID_SECONDS 30
+/**
+ * Recent counts halve every this many seconds
+ */
+#define TALLY_HALF_LIFE 600
+/**
+ * Programs listed in each table of the stats
+ */
+#define TALLY_TOP 10
+
+int tally_start(struct local_context *context);
+void tally_stop(struct local_context *context);
+
+void tally_collect(struct local_context *context, pid_t pid, uid_t uid, off_t bytes);
+void tally_io(struct local_context *context, pid_t pid, uid_t uid, size_t read, size_t written);
+
+void tally_report(struct local_context *context, FILE *fp);
+
+#endif
@@ -0,0 +1,378 @@
+/**
+ * Trash layout - where collected files end up.
+ *
+ * By default the trash duplicates the directory structure of the
+ * original hierarchy and date-time stamps each collected file:
+ *
+ *     trashdir/<original path>.<YYYY-MM-DD.HH:MM:SS>[-NNNN]
+ *
+ * (see layout.c for the others).
+ *
+ * Nothing in here depends on fuse - everything needed is passed in
+ * via the local_context so that these functions can also be called
+ * from background threads.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "collectfs.h"
+#include "copy.h"
+#include "layout.h"
+#include "log.h"
+#include "trash.h"
+#include "uring.h"
+
+/**
+ * Where copies to a trash on another filesystem are assembled before
+ * being renamed into place.
+ */
+#define INCOMING_FOLDER "/.incoming"
+
+/**
+ * collect_uring() couldn't do the job - use plain system calls.
+ */
+#define URING_FALLBACK -2
+
+/**
+ * Deepest trash path collect_uring() will handle.
+ */
+#define URING_MAX_DIRS 48
+
+/**
+ * Replicate the original path for the file being trashed
+ * rooted in the trash folder.
+ *
+ * Based on code from GNU mkdir with the -p option.
+ */
+int mkdir_trash_path(char *fspath)
+{
+    /* TODO copy permissions from the original path */
+    int parent_mode = 0700;
+    struct stat sb;
+    char *p;
+
+    char npath[PATH_MAX];
+
+    trace_info(LOG_INDENT("make path=%s"), fspath);
+
+    strcpy(npath, fspath);      /* So we can write to it. */
+
+    /* Check whether or not we need to do anything with intermediate dirs. */
+
+    /* Skip leading slashes. */
+    p = npath;
+    while (*p == '/') {
+        p++;
+    }
+
+    while ((p = strchr(p, '/'))) {
+        *p = '\0';
+        if (stat(npath, &sb) != 0) {
+            if (mkdir(npath, parent_mode) && errno != EEXIST) {
+                log_errno("Cannot create directory: '%s'", npath);
+                return -1;
+            }
+        } else if (S_ISDIR(sb.st_mode) == 0) {
+            errno = ENOTDIR;
+            log_errno("File exists but is not a directory: '%s'", npath);
+            return -1;
+        }
+
+        *p++ = '/';             /* restore slash */
+        while (*p == '/') {
+            p++;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Build the name for the i'th attempt at a free trash name:
+ * trashpath.<time>, then trashpath.<time>-0001 and so on.
+ */
+static int candidate_name(char fnewpath[PATH_MAX], const char *trashpath, const char *time_suffix, int i)
+{
+    char suffix[15] = "";       /* will fit maxint */
+
+    if (i > 0) {
+        sprintf(suffix, "-%04d", i);
+    }
+    if (strlen(trashpath) + strlen(time_suffix) + strlen(suffix) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(fnewpath, trashpath);
+    strcat(fnewpath, time_suffix);
+    strcat(fnewpath, suffix);
+    return 0;
+}
+
+/**
+ * The io_uring slow path of collection, for when the trash path
+ * needs creating.  The mkdir of each level of the trash path (below
+ * the trash folder, whose parent always exists) and the rename into
+ * place go to the kernel as one linked batch, starting with the
+ * attempt'th trash name.
+ */
+static int collect_uring(struct local_context *context, const char *fpath, const char *path,
+                         const char *trashpath, const char *time_suffix, int attempt, char fnewpath[PATH_MAX])
+{
+    struct uring_op ops[URING_MAX_DIRS + 1];
+    char *dirs[URING_MAX_DIRS];
+    size_t base = strlen(context->trashdir);
+    int ndirs = 0, nops, i;
+    int rstatus = URING_FALLBACK;
+    const char *p;
+
+    memset(ops, 0, sizeof(ops));
+    for (p = trashpath + base; p != NULL; p = strchr(p + 1, '/')) {
+        if (ndirs == URING_MAX_DIRS) {
+            goto done;
+        }
+        dirs[ndirs] = strndup(trashpath, p - trashpath);
+        if (dirs[ndirs] == NULL) {
+            goto done;
+        }
+        ops[ndirs].opcode = URING_MKDIR;
+        ops[ndirs].path = dirs[ndirs];
+        ops[ndirs].mode = 0700;
+        ndirs++;
+    }
+    if (candidate_name(fnewpath, trashpath, time_suffix, attempt) != 0) {
+        log_errno("Path too long to use trash %s", path);
+        rstatus = COLLECT_ERROR;
+        goto done;
+    }
+    nops = ndirs + 1;
+    ops[ndirs].opcode = URING_RENAME_NOREPLACE;
+    ops[ndirs].path = fpath;
+    ops[ndirs].newpath = fnewpath;
+
+    for (i = attempt + 1;; i++) {
+        if (uring_run(ops + ndirs + 1 - nops, nops) != 0) {
+            goto done;
+        }
+        if (nops > 1) {
+            int d;
+            for (d = 0; d < ndirs; d++) {
+                if (ops[d].result != 0 && ops[d].result != -EEXIST) {
+                    errno = -ops[d].result;
+                    log_errno("Cannot create directory: '%s'", dirs[d]);
+                    rstatus = COLLECT_ERROR;
+                    goto done;
+                }
+            }
+            nops = 1;
+        }
+        if (ops[ndirs].result == 0) {
+            rstatus = COLLECT_COLLECTED;
+            break;
+        }
+        if (ops[ndirs].result == -EINVAL) {
+            /* This filesystem doesn't do RENAME_NOREPLACE */
+            goto done;
+        }
+        if (ops[ndirs].result != -EEXIST) {
+            errno = -ops[ndirs].result;
+            log_errno("collect rename %s", path);
+            rstatus = COLLECT_ERROR;
+            break;
+        }
+        /* If date-time is not unique, add a counter */
+        if (candidate_name(fnewpath, trashpath, time_suffix, i) != 0) {
+            log_errno("Path too long to use trash %s", path);
+            rstatus = COLLECT_ERROR;
+            break;
+        }
+    }
+
+  done:
+    while (ndirs > 0) {
+        free(dirs[--ndirs]);
+    }
+    return rstatus;
+}
+
+/**
+ * Rename fpath into the trash as the collected version of path,
+ * time stamped with when.  The name actually used is returned in
+ * trashed (if it isn't NULL).
+ *
+ * fpath need not be the file's original location - the staging
+ * worker passes the staged copy of the file here.
+ * Sets errno on error.
+ */
+int trash_collect_file(struct local_context *context, const char *fpath, const char *path, time_t when,
+                       char trashed[PATH_MAX])
+{
+    struct tm tmbuf;
+
+    if (localtime_r(&when, &tmbuf) == NULL) {
+        log_errno("failed to obtain localtime");
+        return COLLECT_ERROR;
+    }
+    char time_suffix[strlen("-YYYY-MM-DD.HH:MM:SS") + 1];
+    if (strftime(time_suffix, sizeof(time_suffix), ".%Y-%m-%d.%H:%M:%S", &tmbuf) == 0) {
+        log_errno("strftime returned 0");
+        return COLLECT_ERROR;
+    }
+    char trashpath[PATH_MAX];
+    if (layout_trash_path(context->layout, context->trashdir, path, when, trashpath) != 0) {
+        log_errno("Path too long to use trash %s%s", context->trashdir, path);
+        return COLLECT_ERROR;
+    }
+    char fnewpath[PATH_MAX];
+    int made_dirs = 0;
+    int i;
+
+    /* Rename straight into place - usually the trash path exists and
+     * the name is free, making collection a single system call.
+     * RENAME_NOREPLACE means there's no need to probe for a free name.
+     */
+    for (i = 0;; i++) {
+        if (candidate_name(fnewpath, trashpath, time_suffix, i) != 0) {
+            log_errno("Path too long to use trash %s", path);
+            return COLLECT_ERROR;
+        }
+        if (renameat2(AT_FDCWD, fpath, AT_FDCWD, fnewpath, RENAME_NOREPLACE) == 0) {
+            goto collected;
+        }
+        if (errno == EEXIST) {
+            continue;           /* If date-time is not unique, add a counter */
+        }
+        if (errno == ENOENT && !made_dirs) {
+            made_dirs = 1;
+            if (context->use_uring) {
+                int rstatus = collect_uring(context, fpath, path, trashpath, time_suffix, i, fnewpath);
+                if (rstatus == COLLECT_COLLECTED) {
+                    goto collected;
+                }
+                if (rstatus != URING_FALLBACK) {
+                    return rstatus;
+                }
+            }
+            if (mkdir_trash_path(trashpath) != 0) {
+                /* errno will have been set and logged */
+                return COLLECT_ERROR;
+            }
+            i--;                /* try the same name again */
+            continue;
+        }
+        if (errno == EINVAL || errno == ENOSYS) {
+            break;              /* no RENAME_NOREPLACE here - probe for a free name instead */
+        }
+        log_errno("collect rename %s", path);
+        return COLLECT_ERROR;
+    }
+
+    if (mkdir_trash_path(trashpath) != 0) {
+        /* errno will have been set and logged */
+        return COLLECT_ERROR;
+    }
+    for (i = 0;; i++) {         /* If date-time is not unique, add a counter */
+        if (candidate_name(fnewpath, trashpath, time_suffix, i) != 0) {
+            log_errno("Path too long to use trash %s", path);
+            return COLLECT_ERROR;
+        }
+        struct stat sb;
+        if (lstat(fnewpath, &sb) != 0) {
+            break;
+        }
+    }
+
+    if (rename(fpath, fnewpath) < 0) {
+        log_errno("collect rename %s", path);
+        return COLLECT_ERROR;
+    }
+
+  collected:
+    if (trashed != NULL) {
+        strcpy(trashed, fnewpath);
+    }
+
+    return COLLECT_COLLECTED;
+}
+
+/**
+ * Collect fpath into a trash on another filesystem.  The file is
+ * copied into the incoming folder of the trash, renamed into its
+ * time stamped place, and only then removed from its source - a
+ * crash at any point leaves at least one complete copy.  tag must
+ * make the incoming name unique.
+ * Sets errno on error.
+ */
+int trash_transfer_file(struct local_context *context, const char *fpath, const char *path, time_t when,
+                        const char *tag, char trashed[PATH_MAX])
+{
+    char incoming[PATH_MAX];
+
+    if (snprintf(incoming, sizeof(incoming), "%s%s/%s", context->trashdir, INCOMING_FOLDER, tag) >= sizeof(incoming)) {
+        errno = ENAMETOOLONG;
+        log_errno("Incoming path too long %s%s/%s", context->trashdir, INCOMING_FOLDER, tag);
+        return COLLECT_ERROR;
+    }
+    if (mkdir_trash_path(incoming) != 0) {
+        return COLLECT_ERROR;
+    }
+    unlink(incoming);           /* a leftover from an earlier failed attempt */
+    if (copy_file(fpath, incoming) != 0) {
+        return COLLECT_ERROR;
+    }
+    int rstatus = trash_collect_file(context, incoming, path, when, trashed);
+    if (rstatus != COLLECT_COLLECTED) {
+        unlink(incoming);
+        return rstatus;
+    }
+    if (unlink(fpath) != 0) {
+        log_errno("Collected copy of %s but cannot remove %s", path, fpath);
+    }
+    return COLLECT_COLLECTED;
+}
+
+/**
+ * Throw away copies that were half way into a remote trash when
+ * collectfs last stopped.  Their sources are still staged and will
+ * be copied again.
+ */
+void trash_clear_incoming(struct local_context *context)
+{
+    char incoming[PATH_MAX];
+    char fpath[PATH_MAX];
+    struct dirent *de;
+    int cleared = 0;
+
+    snprintf(incoming, sizeof(incoming), "%s%s", context->trashdir, INCOMING_FOLDER);
+    DIR *dp = opendir(incoming);
+    if (dp == NULL) {
+        return;
+    }
+    while ((de = readdir(dp)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (snprintf(fpath, sizeof(fpath), "%s/%s", incoming, de->d_name) < sizeof(fpath) && unlink(fpath) == 0) {
+            cleared++;
+        }
+    }
+    closedir(dp);
+    if (cleared > 0) {
+        log_info("Collectfs: discarded %d incomplete copies in %s", cleared, incoming);
+    }
+}
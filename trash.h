@@ -0,0 +1,20 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _TRASH_H_
+#define _TRASH_H_
+#include <limits.h>
+#include <time.h>
+
+#include "collectfs.h"
+
+int mkdir_trash_path(char *fspath);
+
+int trash_collect_file(struct local_context *context, const char *fpath, const char *path, time_t when,
+                       char trashed[PATH_MAX]);
+int trash_transfer_file(struct local_context *context, const char *fpath, const char *path, time_t when,
+                        const char *tag, char trashed[PATH_MAX]);
+void trash_clear_incoming(struct local_context *context);
+
+#endif
@@ -0,0 +1,558 @@
+/**
+ * Undo logs for in-place writes to large files.
+ *
+ * Collection keeps a file when it is replaced, but a database or disk
+ * image is written in place, a few blocks at a time, and copying the
+ * whole file for each change would cost far more than the change.
+ * With --undo, files of at least the given size that are opened for
+ * writing get an undo log instead: before a write first overwrites a
+ * range of the file, the bytes that were there are appended to the
+ * log.  collectfs-rollback puts them back.
+ *
+ * A log is a series of sessions.  One starts when the file is opened
+ * and nobody else has it open, and again when a checkpoint is taken
+ * (see checkpoint.c) while it is open; each session can be rolled
+ * back to its start.  Within a session only the first write to each
+ * byte saves anything - the ranges already saved are kept in an
+ * interval tree (a treap of disjoint ranges, merged as they touch) so
+ * a database rewriting the same pages costs one lookup per write.
+ * Bytes beyond the size the file had when the session began were not
+ * there to lose and aren't saved.
+ *
+ * The old bytes are synced to the log before the write that overwrites
+ * them goes ahead, so whatever of the file reaches the disk its old
+ * bytes do too - even if writeback gets to the file first.  Only the
+ * first write to a range saves anything, so only it waits.
+ * Truncating a file by path, rather than through an open file, doesn't
+ * save what is cut off.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "cow.h"
+#include "log.h"
+#include "trash.h"
+#include "undo.h"
+
+#define UNDO_CHUNK (256 * 1024)
+
+/**
+ * A range of the file already saved this session - [start, end).
+ */
+struct undo_range {
+    struct undo_range *left;
+    struct undo_range *right;
+    unsigned priority;
+    off_t start;
+    off_t end;
+};
+
+/**
+ * A file with an undo log, shared by every handle open on it.
+ */
+struct undo_file {
+    struct undo_file *next;
+    pthread_mutex_t lock;
+    int refs;
+    dev_t dev;
+    ino_t ino;
+    /** Reads the old bytes - the handle being written may be write only */
+    int rdfd;
+    int logfd;
+    /** Size of the file when the session began */
+    off_t base;
+    /** The checkpoint generation the session began in */
+    unsigned generation;
+    struct undo_range *saved;
+    /** Appended to since the log was last synced */
+    int unsynced;
+    unsigned seed;
+    char *buf;
+};
+
+struct undo {
+    pthread_mutex_t lock;
+    /** Open files and, by descriptor, the handles on them */
+    struct undo_file *files;
+    struct undo_file **fds;
+    int nfds;
+    pthread_rwlock_t fds_lock;
+    /** Bumped when a checkpoint is taken */
+    unsigned generation;
+    time_t generation_checked;
+    struct timespec checkpoints_mtime;
+    char checkpoints[PATH_MAX];
+    char dir[PATH_MAX];
+};
+
+/**
+ * Split tree into the ranges starting before key and the rest.
+ */
+static void split(struct undo_range *tree, off_t key, struct undo_range **before, struct undo_range **rest)
+{
+    if (tree == NULL) {
+        *before = *rest = NULL;
+    } else if (tree->start < key) {
+        split(tree->right, key, &tree->right, rest);
+        *before = tree;
+    } else {
+        split(tree->left, key, before, &tree->left);
+        *rest = tree;
+    }
+}
+
+/**
+ * Join two trees, every range in before starting before any in after.
+ */
+static struct undo_range *merge(struct undo_range *before, struct undo_range *after)
+{
+    if (before == NULL) {
+        return after;
+    }
+    if (after == NULL) {
+        return before;
+    }
+    if (before->priority > after->priority) {
+        before->right = merge(before->right, after);
+        return before;
+    }
+    after->left = merge(before, after->left);
+    return after;
+}
+
+/**
+ * Take the last range out of tree.
+ */
+static struct undo_range *pop_last(struct undo_range *tree, struct undo_range **last)
+{
+    if (tree->right == NULL) {
+        struct undo_range *rest = tree->left;
+
+        tree->left = NULL;
+        *last = tree;
+        return rest;
+    }
+    tree->right = pop_last(tree->right, last);
+    return tree;
+}
+
+static void free_ranges(struct undo_range *tree)
+{
+    if (tree != NULL) {
+        free_ranges(tree->left);
+        free_ranges(tree->right);
+        free(tree);
+    }
+}
+
+static int append(struct undo_file *file, uint32_t magic, off_t offset, const char *data, size_t length)
+{
+    struct undo_record record = { magic, length, offset, time(NULL) };
+    struct iovec iov[2] = { { &record, sizeof(record) }, { (void *)data, length } };
+
+    if (writev(file->logfd, iov, 2) != sizeof(record) + length) {
+        if (errno == 0) {
+            errno = ENOSPC;
+        }
+        return -1;
+    }
+    file->unsynced = 1;
+    return 0;
+}
+
+/**
+ * Make what has been appended to the log durable.
+ */
+static int sync_log(struct undo_file *file)
+{
+    if (file->unsynced && fdatasync(file->logfd) != 0) {
+        return -1;
+    }
+    file->unsynced = 0;
+    return 0;
+}
+
+/**
+ * Append the bytes now in [start, end) to the log.
+ */
+static int save(struct undo_file *file, off_t start, off_t end)
+{
+    while (start < end) {
+        size_t want = end - start < UNDO_CHUNK ? end - start : UNDO_CHUNK;
+        ssize_t got = pread(file->rdfd, file->buf, want, start);
+
+        if (got <= 0) {
+            /* Shorter than it was - what's missing was cut off and saved then */
+            return got < 0 ? -1 : 0;
+        }
+        if (append(file, UNDO_RANGE_MAGIC, start, file->buf, got) != 0) {
+            return -1;
+        }
+        start += got;
+    }
+    return 0;
+}
+
+/**
+ * Save the parts of [*pos, end) that fall between the ranges in tree,
+ * walking them in order.  *pos is how far we have got and *last the
+ * end of the furthest range seen.
+ */
+static int save_gaps(struct undo_file *file, struct undo_range *tree, off_t *pos, off_t end, off_t *last)
+{
+    if (tree == NULL) {
+        return 0;
+    }
+    if (save_gaps(file, tree->left, pos, end, last) != 0) {
+        return -1;
+    }
+    if (tree->start > *pos && save(file, *pos, tree->start) != 0) {
+        return -1;
+    }
+    if (tree->end > *pos) {
+        *pos = tree->end;
+    }
+    if (tree->end > *last) {
+        *last = tree->end;
+    }
+    return save_gaps(file, tree->right, pos, end, last);
+}
+
+/**
+ * Save whatever of [start, end) this session hasn't, durably, and
+ * remember it is saved.
+ */
+static int cover(struct undo_file *file, off_t start, off_t end)
+{
+    struct undo_range *before, *within, *after, *touching = NULL, *range;
+    off_t pos = start, first = start, last = end;
+
+    /* Ranges starting in [start, end] overlap or touch the new one */
+    split(file->saved, start, &before, &within);
+    split(within, end + 1, &within, &after);
+    if (before != NULL) {
+        before = pop_last(before, &touching);
+        if (touching->end >= start) {
+            first = touching->start;
+            if (touching->end > pos) {
+                pos = touching->end;
+            }
+            if (touching->end > last) {
+                last = touching->end;
+            }
+        } else {
+            before = merge(before, touching);
+            touching = NULL;
+        }
+    }
+    if (save_gaps(file, within, &pos, end, &last) != 0 || (pos < end && save(file, pos, end) != 0)
+        || sync_log(file) != 0) {
+        if (touching != NULL) {
+            before = merge(before, touching);
+        }
+        file->saved = merge(merge(before, within), after);
+        return -1;
+    }
+    free_ranges(within);
+    range = touching != NULL ? touching : malloc(sizeof(struct undo_range));
+    if (range == NULL) {
+        /* Forgetting is safe - the bytes are saved again next time */
+        file->saved = merge(before, after);
+        return 0;
+    }
+    range->left = range->right = NULL;
+    if (touching == NULL) {
+        range->priority = rand_r(&file->seed);
+    }
+    range->start = first;
+    range->end = last;
+    file->saved = merge(merge(before, range), after);
+    return 0;
+}
+
+/**
+ * Start a new session if this is the first write since the file was
+ * opened or a checkpoint was taken.  Called with the file locked.
+ */
+static int begin_session(struct undo *undo, struct undo_file *file)
+{
+    time_t now = time(NULL);
+    struct stat sb;
+
+    pthread_mutex_lock(&undo->lock);
+    if (now != undo->generation_checked) {
+        /* A new checkpoint changes the folder - look at most once a second */
+        undo->generation_checked = now;
+        if (stat(undo->checkpoints, &sb) == 0 && (sb.st_mtim.tv_sec != undo->checkpoints_mtime.tv_sec
+                                                  || sb.st_mtim.tv_nsec != undo->checkpoints_mtime.tv_nsec)) {
+            undo->checkpoints_mtime = sb.st_mtim;
+            undo->generation++;
+        }
+    }
+    pthread_mutex_unlock(&undo->lock);
+
+    if (file->base >= 0 && file->generation == undo->generation) {
+        return 0;
+    }
+    if (fstat(file->rdfd, &sb) != 0) {
+        return -1;
+    }
+    free_ranges(file->saved);
+    file->saved = NULL;
+    file->base = sb.st_size;
+    file->generation = undo->generation;
+    return append(file, UNDO_SESSION_MAGIC, file->base, NULL, 0);
+}
+
+static struct undo_file *find_handle(struct undo *undo, int fd)
+{
+    struct undo_file *file = NULL;
+
+    pthread_rwlock_rdlock(&undo->fds_lock);
+    if (fd >= 0 && fd < undo->nfds) {
+        file = undo->fds[fd];
+    }
+    pthread_rwlock_unlock(&undo->fds_lock);
+    return file;
+}
+
+static void close_file(struct undo_file *file)
+{
+    if (fdatasync(file->logfd) != 0) {
+        log_errno("undo: cannot sync an undo log");
+    }
+    close(file->logfd);
+    close(file->rdfd);
+    free_ranges(file->saved);
+    free(file->buf);
+    pthread_mutex_destroy(&file->lock);
+    free(file);
+}
+
+int undo_start(struct local_context *context)
+{
+    struct undo *undo = calloc(1, sizeof(struct undo));
+    struct stat sb;
+
+    if (undo == NULL) {
+        return log_errno("undo_start");
+    }
+    snprintf(undo->dir, sizeof(undo->dir), "%s/%s", context->trashdir, UNDO_FOLDER);
+    snprintf(undo->checkpoints, sizeof(undo->checkpoints), "%s/%s", context->trashdir, COW_FOLDER);
+    if (stat(undo->checkpoints, &sb) == 0) {
+        undo->checkpoints_mtime = sb.st_mtim;
+    }
+    undo->generation_checked = time(NULL);
+    pthread_mutex_init(&undo->lock, NULL);
+    pthread_rwlock_init(&undo->fds_lock, NULL);
+    context->undo = undo;
+    log_info("Collectfs: keeping undo logs of writes to files of %lld MB or more in %s",
+             (long long)(context->undo_size / (1024 * 1024)), undo->dir);
+    return 0;
+}
+
+void undo_stop(struct local_context *context)
+{
+    struct undo *undo = context->undo;
+    struct undo_file *file, *next;
+
+    if (undo == NULL) {
+        return;
+    }
+    context->undo = NULL;
+    for (file = undo->files; file != NULL; file = next) {
+        next = file->next;
+        close_file(file);
+    }
+    free(undo->fds);
+    pthread_rwlock_destroy(&undo->fds_lock);
+    pthread_mutex_destroy(&undo->lock);
+    free(undo);
+}
+
+/**
+ * fd has just been opened for writing on fpath (path within the
+ * mount).  Start logging it if it is big enough.  Returns 0, or -1
+ * with errno set if it should have a log but can't.
+ */
+int undo_open(struct local_context *context, const char *fpath, const char *path, int fd)
+{
+    struct undo *undo = context->undo;
+    struct undo_file *file;
+    char logpath[PATH_MAX];
+    struct stat sb;
+    int err;
+
+    if (undo == NULL || fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size < context->undo_size) {
+        return 0;
+    }
+    pthread_mutex_lock(&undo->lock);
+    for (file = undo->files; file != NULL; file = file->next) {
+        if (file->dev == sb.st_dev && file->ino == sb.st_ino) {
+            break;
+        }
+    }
+    if (file == NULL) {
+        if (snprintf(logpath, sizeof(logpath), "%s%s%s", undo->dir, path, UNDO_SUFFIX) >= sizeof(logpath)) {
+            errno = ENAMETOOLONG;
+            goto fail;
+        }
+        file = calloc(1, sizeof(struct undo_file));
+        if (file == NULL || (file->buf = malloc(UNDO_CHUNK)) == NULL) {
+            free(file);
+            goto fail;
+        }
+        file->dev = sb.st_dev;
+        file->ino = sb.st_ino;
+        file->seed = sb.st_ino;
+        file->base = -1;
+        file->generation = undo->generation;
+        file->rdfd = open(fpath, O_RDONLY);
+        file->logfd = -1;
+        if (file->rdfd >= 0 && mkdir_trash_path(logpath) == 0) {
+            file->logfd = open(logpath, O_WRONLY | O_CREAT | O_APPEND, 0600);
+        }
+        if (file->rdfd < 0 || file->logfd < 0) {
+            err = log_errno("undo: cannot start an undo log for %s", fpath);
+            if (file->rdfd >= 0) {
+                close(file->rdfd);
+            }
+            free(file->buf);
+            free(file);
+            errno = err;
+            goto fail;
+        }
+        pthread_mutex_init(&file->lock, NULL);
+        file->next = undo->files;
+        undo->files = file;
+        trace_info(LOG_INDENT("undo: logging writes to %s in %s"), fpath, logpath);
+    }
+    pthread_rwlock_wrlock(&undo->fds_lock);
+    if (fd >= undo->nfds) {
+        int nfds = fd + 64;
+        struct undo_file **fds = realloc(undo->fds, nfds * sizeof(struct undo_file *));
+
+        if (fds == NULL) {
+            pthread_rwlock_unlock(&undo->fds_lock);
+            if (file->refs == 0) {
+                undo->files = file->next;
+                close_file(file);
+            }
+            goto fail;
+        }
+        memset(fds + undo->nfds, 0, (nfds - undo->nfds) * sizeof(struct undo_file *));
+        undo->fds = fds;
+        undo->nfds = nfds;
+    }
+    undo->fds[fd] = file;
+    file->refs++;
+    pthread_rwlock_unlock(&undo->fds_lock);
+    pthread_mutex_unlock(&undo->lock);
+    return 0;
+
+  fail:
+    err = errno;
+    pthread_mutex_unlock(&undo->lock);
+    errno = err;
+    return -1;
+}
+
+/**
+ * size bytes are about to be written to fd at offset - save what they
+ * will overwrite.  Returns 0, or -1 with errno set if the old bytes
+ * couldn't be saved.
+ */
+int undo_write(struct local_context *context, int fd, off_t offset, size_t size)
+{
+    struct undo_file *file;
+    off_t end = offset + size;
+    int rstatus;
+
+    if (context->undo == NULL || (file = find_handle(context->undo, fd)) == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&file->lock);
+    rstatus = begin_session(context->undo, file);
+    if (end > file->base) {
+        end = file->base;
+    }
+    if (rstatus == 0 && offset < end) {
+        rstatus = cover(file, offset, end);
+    }
+    pthread_mutex_unlock(&file->lock);
+    return rstatus;
+}
+
+/**
+ * fd is about to be truncated to size - save what will be cut off.
+ */
+int undo_truncate(struct local_context *context, int fd, off_t size)
+{
+    struct undo_file *file;
+    int rstatus;
+
+    if (context->undo == NULL || (file = find_handle(context->undo, fd)) == NULL) {
+        return 0;
+    }
+    pthread_mutex_lock(&file->lock);
+    rstatus = begin_session(context->undo, file);
+    if (rstatus == 0 && size < file->base) {
+        rstatus = cover(file, size, file->base);
+    }
+    pthread_mutex_unlock(&file->lock);
+    return rstatus;
+}
+
+/**
+ * fd is about to be synced - its undo log must reach the disk first.
+ */
+int undo_sync(struct local_context *context, int fd)
+{
+    struct undo_file *file;
+
+    if (context->undo == NULL || (file = find_handle(context->undo, fd)) == NULL) {
+        return 0;
+    }
+    return fdatasync(file->logfd);
+}
+
+/**
+ * fd is being closed.
+ */
+void undo_release(struct local_context *context, int fd)
+{
+    struct undo *undo = context->undo;
+    struct undo_file *file, **link;
+
+    if (undo == NULL || (file = find_handle(undo, fd)) == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&undo->lock);
+    pthread_rwlock_wrlock(&undo->fds_lock);
+    undo->fds[fd] = NULL;
+    pthread_rwlock_unlock(&undo->fds_lock);
+    if (--file->refs == 0) {
+        for (link = &undo->files; *link != file; link = &(*link)->next) {
+        }
+        *link = file->next;
+        close_file(file);
+    }
+    pthread_mutex_unlock(&undo->lock);
+}
@@ -0,0 +1,45 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _UNDO_H_
+#define _UNDO_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "collectfs.h"
+
+/**
+ * Undo logs live in this folder at the top of the trash, mirroring
+ * the rootdir, each named after its file plus UNDO_SUFFIX.
+ */
+#define UNDO_FOLDER ".undo"
+#define UNDO_SUFFIX ".undo"
+
+#define UNDO_SESSION_MAGIC 0x53554643   /* "CFUS" */
+#define UNDO_RANGE_MAGIC 0x52554643     /* "CFUR" */
+
+/**
+ * An undo log is a sequence of these.  A session record (length 0,
+ * offset the file size) starts each session; each range record is
+ * followed by length bytes that were at offset before the session
+ * first overwrote them.
+ */
+struct undo_record {
+    uint32_t magic;
+    uint32_t length;
+    uint64_t offset;
+    int64_t when;
+};
+
+int undo_start(struct local_context *context);
+void undo_stop(struct local_context *context);
+
+int undo_open(struct local_context *context, const char *fpath, const char *path, int fd);
+int undo_write(struct local_context *context, int fd, off_t offset, size_t size);
+int undo_truncate(struct local_context *context, int fd, off_t size);
+int undo_sync(struct local_context *context, int fd);
+void undo_release(struct local_context *context, int fd);
+
+#endif
@@ -0,0 +1,162 @@
+/**
+ * collectfs-unpack - list and get back versions held in pack files.
+ *
+ * With --pack, collectfs moves small trash versions into pack files
+ * at the top of the trash.  This lists them (-l), optionally only
+ * those under a path, or puts the named ones back where they were in
+ * the trash with their owner, permissions and modification time.
+ * With -c the versions are written to standard output instead.
+ * Versions are named by their path relative to the trash folder, as
+ * -l shows them:
+ *
+ *     collectfs-unpack -l trashdir [path]
+ *     collectfs-unpack [-c] trashdir version...
+ *
+ * Unpacked versions stay in their pack until they expire.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "log.h"
+#include "pack.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s -l trashdir [path]\n       %s [-c] trashdir version...\n", prog, prog);
+    exit(EXIT_FAILURE);
+}
+
+static int list_version(void *arg, const struct pack_version *version)
+{
+    const char *prefix = (const char *)arg;
+    char when[32];
+
+    if (prefix != NULL && strncmp(version->path, prefix, strlen(prefix)) != 0) {
+        return 0;
+    }
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&version->when));
+    printf("%04o %5d %5d %10lld  %s  %s\n", (unsigned)(version->mode & 07777), (int)version->uid,
+           (int)version->gid, (long long)version->size, when, version->path);
+    return 0;
+}
+
+/**
+ * Make the directories above path, which is relative to dir.
+ */
+static void make_parents(const char *dir, const char *path)
+{
+    char fpath[PATH_MAX];
+    char *slash;
+
+    if (snprintf(fpath, sizeof(fpath), "%s/%s", dir, path) >= sizeof(fpath)) {
+        return;
+    }
+    for (slash = strchr(fpath + strlen(dir) + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(fpath, 0700);
+        *slash = '/';
+    }
+}
+
+static int unpack(struct pack_store *store, const char *trashdir, const char *path)
+{
+    char fpath[PATH_MAX], tmppath[PATH_MAX];
+    struct pack_version version;
+    int fd;
+
+    if (snprintf(fpath, sizeof(fpath), "%s/%s", trashdir, path) >= sizeof(fpath)
+        || snprintf(tmppath, sizeof(tmppath), "%s.unpack", fpath) >= sizeof(tmppath)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    if (access(fpath, F_OK) == 0) {
+        fprintf(stderr, "%s: %s\n", fpath, strerror(EEXIST));
+        return -1;
+    }
+    make_parents(trashdir, path);
+    fd = open(tmppath, O_WRONLY | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror(tmppath);
+        return -1;
+    }
+    if (pack_store_extract(store, path, fd, &version) != 0) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        goto fail;
+    }
+    struct timespec times[2] = { version.mtime, version.mtime };
+    if (fchown(fd, version.uid, version.gid) != 0 && errno != EPERM) {
+        perror(tmppath);
+        goto fail;
+    }
+    if (fchmod(fd, version.mode & 07777) != 0 || futimens(fd, times) != 0 || fsync(fd) != 0) {
+        perror(tmppath);
+        goto fail;
+    }
+    close(fd);
+    if (rename(tmppath, fpath) != 0) {
+        perror(fpath);
+        unlink(tmppath);
+        return -1;
+    }
+    return 0;
+
+  fail:
+    close(fd);
+    unlink(tmppath);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    int list = 0, to_stdout = 0, failed = 0, i = 1;
+    struct pack_store *store;
+    const char *trashdir;
+
+    if (i < argc && strcmp(argv[i], "-l") == 0) {
+        list = 1;
+        i++;
+    } else if (i < argc && strcmp(argv[i], "-c") == 0) {
+        to_stdout = 1;
+        i++;
+    }
+    if (i >= argc || (list && argc - i > 2) || (!list && argc - i < 2)) {
+        usage(argv[0]);
+    }
+    set_use_syslog(0);
+    trashdir = argv[i++];
+    store = pack_store_open(trashdir, 0);
+    if (store == NULL) {
+        perror(trashdir);
+        return EXIT_FAILURE;
+    }
+    if (list) {
+        pack_store_foreach(store, list_version, i < argc ? argv[i] : NULL);
+    }
+    for (; !list && i < argc; i++) {
+        if (to_stdout) {
+            if (pack_store_extract(store, argv[i], STDOUT_FILENO, NULL) != 0) {
+                fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+                failed = 1;
+            }
+        } else if (unpack(store, trashdir, argv[i]) != 0) {
+            failed = 1;
+        }
+    }
+    pack_store_close(store);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
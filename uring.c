@@ -0,0 +1,298 @@
+/**
+ * A minimal io_uring backend for the metadata heavy parts of
+ * collection.
+ *
+ * Collecting a file is a chain of dependent metadata operations -
+ * mkdir for each level of the trash path then a rename.  Done one
+ * system call at a time that's a stat and maybe a mkdir per level
+ * plus stat probes for a free name.  Here the whole chain is
+ * submitted as hard-linked SQEs (each runs in order after the
+ * previous one, whatever its result) and reaped with a single
+ * io_uring_enter().
+ *
+ * Each thread gets its own small ring the first time it needs one.
+ * The raw system calls are used so there is no dependency on
+ * liburing.  Where io_uring or the opcodes we need aren't available
+ * (old kernels, seccomp filtered containers) uring_available()
+ * returns 0 and callers use plain system calls.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "log.h"
+#include "uring.h"
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+#define URING_ENTRIES 64
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned entries;
+};
+
+static pthread_once_t probe_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static int available = 0;
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ring_free(void *arg)
+{
+    struct uring *ring = (struct uring *)arg;
+
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    free(ring);
+}
+
+static struct uring *ring_new(void)
+{
+    struct io_uring_params params;
+    struct uring *ring = calloc(1, sizeof(struct uring));
+
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(&params, 0, sizeof(params));
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+    if (ring->fd < 0) {
+        free(ring);
+        return NULL;
+    }
+    ring->entries = params.sq_entries;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        goto fail;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            goto fail;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        goto fail;
+    }
+    ring->sq_head = (unsigned *)((char *)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail = (unsigned *)((char *)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)((char *)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)((char *)ring->sq_ring + params.sq_off.array);
+    ring->cq_head = (unsigned *)((char *)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail = (unsigned *)((char *)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)((char *)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)((char *)ring->cq_ring + params.cq_off.cqes);
+    return ring;
+
+  fail:
+    ring_free(ring);
+    return NULL;
+}
+
+/**
+ * Check, once per process, that we can set up a ring and that the
+ * kernel knows every opcode we use.
+ */
+static void probe(void)
+{
+    const int needed[] = { IORING_OP_MKDIRAT, IORING_OP_RENAMEAT, IORING_OP_STATX };
+    size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe;
+    struct uring *ring;
+    int i;
+
+    pthread_key_create(&ring_key, ring_free);
+    ring = ring_new();
+    if (ring == NULL) {
+        log_info("Collectfs: io_uring is not available (%s) - using plain system calls", strerror(errno));
+        return;
+    }
+    probe = calloc(1, len);
+    if (probe != NULL && sys_io_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+        available = 1;
+        for (i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+            if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+                available = 0;
+            }
+        }
+    }
+    free(probe);
+    if (available) {
+        pthread_setspecific(ring_key, ring);
+        log_info("Collectfs: using io_uring for collection");
+    } else {
+        ring_free(ring);
+        log_info("Collectfs: io_uring lacks mkdirat/renameat/statx - using plain system calls");
+    }
+}
+
+int uring_available(void)
+{
+    pthread_once(&probe_once, probe);
+    return available;
+}
+
+static struct uring *thread_ring(void)
+{
+    struct uring *ring = pthread_getspecific(ring_key);
+
+    if (ring == NULL) {
+        ring = ring_new();
+        if (ring != NULL) {
+            pthread_setspecific(ring_key, ring);
+        }
+    }
+    return ring;
+}
+
+static void prep(struct io_uring_sqe *sqe, struct uring_op *op, int link)
+{
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (unsigned long)op->path;
+    switch (op->opcode) {
+    case URING_MKDIR:
+        sqe->opcode = IORING_OP_MKDIRAT;
+        sqe->len = op->mode;
+        break;
+    case URING_RENAME_NOREPLACE:
+        sqe->opcode = IORING_OP_RENAMEAT;
+        sqe->len = AT_FDCWD;
+        sqe->addr2 = (unsigned long)op->newpath;
+        sqe->rename_flags = RENAME_NOREPLACE;
+        break;
+    case URING_STATX:
+        sqe->opcode = IORING_OP_STATX;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (unsigned long)op->statxbuf;
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        break;
+    }
+    sqe->user_data = (unsigned long)op;
+    if (link) {
+        /* Run the next op after this one even if this one fails (EEXIST from mkdir is normal) */
+        sqe->flags |= IOSQE_IO_HARDLINK;
+    }
+}
+
+/**
+ * Run ops in order as one linked submission and wait for all of them.
+ * The result of each op is left in its result field.  Returns 0 if
+ * the batch ran (whatever the individual results) or -1 with errno
+ * set if it couldn't be run - the caller should fall back to plain
+ * system calls.
+ */
+int uring_run(struct uring_op *ops, int nops)
+{
+    struct uring *ring;
+    unsigned tail, head;
+    int i, done = 0;
+
+    if (!uring_available() || (ring = thread_ring()) == NULL) {
+        errno = ENOSYS;
+        return -1;
+    }
+    if (nops > ring->entries) {
+        errno = E2BIG;
+        return -1;
+    }
+    tail = *ring->sq_tail;
+    for (i = 0; i < nops; i++) {
+        unsigned index = (tail + i) & *ring->sq_mask;
+        prep(&ring->sqes[index], &ops[i], i < nops - 1);
+        ring->sq_array[index] = index;
+    }
+    __atomic_store_n(ring->sq_tail, tail + nops, __ATOMIC_RELEASE);
+
+    while (done < nops) {
+        unsigned unsubmitted = tail + nops - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        int rstatus = sys_io_uring_enter(ring->fd, unsubmitted, nops - done, IORING_ENTER_GETEVENTS);
+        if (rstatus < 0 && errno != EINTR) {
+            if (__atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == tail) {
+                /* The kernel took none of them - take them back and give up. */
+                log_errno("io_uring_enter");
+                __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+                return -1;
+            }
+            trace_errno(LOG_INDENT("io_uring_enter - retrying"));
+        }
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            ((struct uring_op *)(unsigned long)cqe->user_data)->result = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
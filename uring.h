@@ -0,0 +1,35 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _URING_H_
+#define _URING_H_
+
+#include <sys/types.h>
+
+/**
+ * Operations that can be batched through uring_run().
+ */
+enum uring_opcode {
+    URING_MKDIR,
+    URING_RENAME_NOREPLACE,
+    URING_STATX
+};
+
+struct uring_op {
+    enum uring_opcode opcode;
+    const char *path;
+    /** URING_RENAME_NOREPLACE: the new name */
+    const char *newpath;
+    /** URING_MKDIR: permissions */
+    mode_t mode;
+    /** URING_STATX: where the result goes (a struct statx) */
+    void *statxbuf;
+    /** Filled in on completion: 0 or a negated errno */
+    int result;
+};
+
+int uring_available(void);
+int uring_run(struct uring_op *ops, int nops);
+
+#endif
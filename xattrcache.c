@@ -0,0 +1,500 @@
+/**
+ * Extended attribute cache.
+ *
+ * Before most writes the kernel asks whether the file has a
+ * security.capability attribute to clear, and with ACLs or SELinux it
+ * asks after others too.  Each question went to lgetxattr on the real
+ * file, doubling the requests a stream of small writes makes.  With
+ * --xattrcache the answers from lgetxattr and llistxattr - including
+ * "no such attribute", the usual one - are kept, looked up by full path
+ * and attribute name, and given again for XATTRCACHE_SECONDS.
+ *
+ * Attributes belong to the inode, not the name, so each answer also
+ * records the device and inode it was read from.  When collectfs sets
+ * or removes an attribute, or changes a file's mode or owner, it forgets
+ * the answers for that inode under every name it has - so a capability
+ * set through one hardlink is seen at once through the others
+ * (xattrcache_changed).  When a path is added, removed or collected,
+ * the answers for that path go (xattrcache_replaced).
+ *
+ * A rename would otherwise mean searching every answer for paths under
+ * the one renamed away.  Instead the renamed path is noted, with the
+ * count of changes at the time, for XATTRCACHE_SECONDS - no answer kept
+ * before that outlives it - and an answer is only given if none of its
+ * directories has been renamed since it was kept (xattrcache_moved).
+ *
+ * Changes made beside the mount show once the answer expires.  An
+ * answer read while anything was being forgotten isn't kept, in case it
+ * was read from before the change.
+ *
+ * As in the directory listing cache (see dircache.c), answers are held
+ * in a hash table, up to a total size, with the least recently used
+ * thrown out first.  Values longer than XATTRCACHE_VALUE_MAX aren't
+ * kept.
+ *
+ * Copyright 2011, Michael Hamilton
+ * GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/xattr.h>
+
+#include "xattrcache.h"
+
+#define XATTRCACHE_BUCKETS 4096
+
+/** Start of the FNV-1a hash - hash() continued from here gives the hash of a whole path */
+#define HASH_START 2166136261u
+
+struct xattrcache_entry {
+    /** Hash chain on fpath, so all of a path's answers share one */
+    struct xattrcache_entry *next;
+    /** Hash chain on the inode, so all of an inode's answers share one */
+    struct xattrcache_entry *next_inode;
+    /** LRU list - most recently used first */
+    struct xattrcache_entry *newer;
+    struct xattrcache_entry *older;
+    size_t hash;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    time_t expires;
+    /** The count of changes when the answer was read */
+    unsigned long kept;
+    /** What lgetxattr or llistxattr returned - the length of value, or -errno */
+    ssize_t result;
+    /** The attribute, or NULL for the list of them */
+    char *name;
+    char *value;
+    char fpath[];
+};
+
+/**
+ * A path renamed away, remembered until every answer kept before the
+ * rename has expired.
+ */
+struct xattrcache_moved {
+    /** Hash chain on fpath */
+    struct xattrcache_moved *next;
+    /** In the order renamed - oldest first */
+    struct xattrcache_moved *later;
+    size_t hash;
+    size_t len;
+    time_t expires;
+    /** The count of changes once renamed - answers kept before then are out of date */
+    unsigned long changes;
+    char fpath[];
+};
+
+struct xattrcache {
+    pthread_mutex_t lock;
+    size_t max_size;
+    size_t size;
+    /** Counts what has been forgotten - an answer read meanwhile isn't kept */
+    unsigned long changes;
+    struct xattrcache_entry *buckets[XATTRCACHE_BUCKETS];
+    struct xattrcache_entry *inodes[XATTRCACHE_BUCKETS];
+    struct xattrcache_entry *newest;
+    struct xattrcache_entry *oldest;
+    struct xattrcache_moved *moves[XATTRCACHE_BUCKETS];
+    struct xattrcache_moved *first_move;
+    struct xattrcache_moved *last_move;
+};
+
+/**
+ * FNV-1a hash of len bytes of path, continuing from h.
+ */
+static size_t hash(size_t h, const char *path, size_t len)
+{
+    const char *end = path + len;
+
+    for (; path < end; path++) {
+        h = (h ^ (unsigned char)*path) * 16777619u;
+    }
+    return h;
+}
+
+static size_t hash_inode(dev_t dev, ino_t ino)
+{
+    return (size_t)(ino * 2654435761u) ^ (size_t)dev;
+}
+
+struct xattrcache *xattrcache_new(size_t size)
+{
+    struct xattrcache *xattrcache = calloc(1, sizeof(struct xattrcache));
+
+    if (xattrcache == NULL) {
+        return NULL;
+    }
+    pthread_mutex_init(&xattrcache->lock, NULL);
+    xattrcache->max_size = size;
+    return xattrcache;
+}
+
+/**
+ * Take entry out of the table and free it.  Called with the lock held.
+ */
+static void drop(struct xattrcache *xattrcache, struct xattrcache_entry *entry)
+{
+    struct xattrcache_entry **link = &xattrcache->buckets[entry->hash % XATTRCACHE_BUCKETS];
+
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    link = &xattrcache->inodes[hash_inode(entry->dev, entry->ino) % XATTRCACHE_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->next_inode;
+    }
+    *link = entry->next_inode;
+    if (entry->newer != NULL) {
+        entry->newer->older = entry->older;
+    } else {
+        xattrcache->newest = entry->older;
+    }
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        xattrcache->oldest = entry->newer;
+    }
+    xattrcache->size -= entry->size;
+    free(entry);
+}
+
+/**
+ * Forget renames no answer still kept can predate.  Called with the
+ * lock held.
+ */
+static void expire_moves(struct xattrcache *xattrcache, time_t now)
+{
+    struct xattrcache_moved *moved, **link;
+
+    while ((moved = xattrcache->first_move) != NULL && (now < 0 || moved->expires <= now)) {
+        link = &xattrcache->moves[moved->hash % XATTRCACHE_BUCKETS];
+        while (*link != moved) {
+            link = &(*link)->next;
+        }
+        *link = moved->next;
+        xattrcache->first_move = moved->later;
+        if (xattrcache->first_move == NULL) {
+            xattrcache->last_move = NULL;
+        }
+        free(moved);
+    }
+}
+
+void xattrcache_free(struct xattrcache *xattrcache)
+{
+    if (xattrcache == NULL) {
+        return;
+    }
+    while (xattrcache->oldest != NULL) {
+        drop(xattrcache, xattrcache->oldest);
+    }
+    expire_moves(xattrcache, -1);
+    pthread_mutex_destroy(&xattrcache->lock);
+    free(xattrcache);
+}
+
+/**
+ * Has a directory above entry been renamed since its answer was kept?
+ * Called with the lock held.
+ */
+static int moved_since(struct xattrcache *xattrcache, struct xattrcache_entry *entry)
+{
+    struct xattrcache_moved *moved;
+    const char *p;
+    size_t h = HASH_START;
+    const char *start = entry->fpath;
+
+    if (xattrcache->first_move == NULL) {
+        return 0;
+    }
+    for (p = strchr(entry->fpath + 1, '/'); p != NULL; p = strchr(p + 1, '/')) {
+        h = hash(h, start, p - start);
+        start = p;
+        for (moved = xattrcache->moves[h % XATTRCACHE_BUCKETS]; moved != NULL; moved = moved->next) {
+            if (moved->hash == h && moved->len == (size_t)(p - entry->fpath)
+                && strncmp(moved->fpath, entry->fpath, moved->len) == 0 && moved->changes > entry->kept) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static struct xattrcache_entry *find(struct xattrcache *xattrcache, const char *fpath, const char *name, size_t h)
+{
+    struct xattrcache_entry *entry;
+
+    for (entry = xattrcache->buckets[h % XATTRCACHE_BUCKETS]; entry != NULL; entry = entry->next) {
+        if (entry->hash == h && strcmp(entry->fpath, fpath) == 0
+            && (name == NULL ? entry->name == NULL : entry->name != NULL && strcmp(entry->name, name) == 0)) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Move entry to the front of the LRU list.  Called with the lock held.
+ */
+static void touch(struct xattrcache *xattrcache, struct xattrcache_entry *entry)
+{
+    if (entry == xattrcache->newest) {
+        return;
+    }
+    entry->newer->older = entry->older;
+    if (entry->older != NULL) {
+        entry->older->newer = entry->newer;
+    } else {
+        xattrcache->oldest = entry->newer;
+    }
+    entry->newer = NULL;
+    entry->older = xattrcache->newest;
+    xattrcache->newest->newer = entry;
+    xattrcache->newest = entry;
+}
+
+/**
+ * Give the answer lgetxattr or llistxattr would have, for a value of
+ * size bytes, from result and the value it was read with.
+ */
+static ssize_t answer(ssize_t result, const char *found, char *value, size_t size)
+{
+    if (result < 0) {
+        errno = -result;
+        return -1;
+    }
+    if (size == 0) {
+        return result;
+    }
+    if (size < (size_t)result) {
+        errno = ERANGE;
+        return -1;
+    }
+    memcpy(value, found, result);
+    return result;
+}
+
+/**
+ * Keep an answer read from the inode st describes when changes was as
+ * given.
+ */
+static void keep(struct xattrcache *xattrcache, const char *fpath, const char *name, size_t h, const struct stat *st,
+                 ssize_t result, const char *value, unsigned long changes)
+{
+    size_t pathlen = strlen(fpath) + 1, namelen = name != NULL ? strlen(name) + 1 : 0;
+    size_t len = result > 0 ? result : 0;
+    struct xattrcache_entry *entry, *other;
+    size_t i;
+
+    entry = malloc(sizeof(struct xattrcache_entry) + pathlen + namelen + len);
+    if (entry == NULL) {
+        return;
+    }
+    memset(entry, 0, sizeof(struct xattrcache_entry));
+    memcpy(entry->fpath, fpath, pathlen);
+    if (name != NULL) {
+        entry->name = entry->fpath + pathlen;
+        memcpy(entry->name, name, namelen);
+    }
+    entry->value = entry->fpath + pathlen + namelen;
+    memcpy(entry->value, value, len);
+    entry->size = sizeof(struct xattrcache_entry) + pathlen + namelen + len;
+    entry->hash = h;
+    entry->dev = st->st_dev;
+    entry->ino = st->st_ino;
+    entry->kept = changes;
+    entry->result = result;
+    entry->expires = time(NULL) + XATTRCACHE_SECONDS;
+    if (entry->size > xattrcache->max_size / 4) {
+        free(entry);
+        return;
+    }
+
+    pthread_mutex_lock(&xattrcache->lock);
+    if (xattrcache->changes != changes) {
+        pthread_mutex_unlock(&xattrcache->lock);
+        free(entry);
+        return;
+    }
+    other = find(xattrcache, fpath, name, h);
+    if (other != NULL) {
+        drop(xattrcache, other);
+    }
+    entry->next = xattrcache->buckets[h % XATTRCACHE_BUCKETS];
+    xattrcache->buckets[h % XATTRCACHE_BUCKETS] = entry;
+    i = hash_inode(entry->dev, entry->ino) % XATTRCACHE_BUCKETS;
+    entry->next_inode = xattrcache->inodes[i];
+    xattrcache->inodes[i] = entry;
+    entry->older = xattrcache->newest;
+    if (xattrcache->newest != NULL) {
+        xattrcache->newest->newer = entry;
+    } else {
+        xattrcache->oldest = entry;
+    }
+    xattrcache->newest = entry;
+    xattrcache->size += entry->size;
+    while (xattrcache->size > xattrcache->max_size) {
+        drop(xattrcache, xattrcache->oldest);
+    }
+    pthread_mutex_unlock(&xattrcache->lock);
+}
+
+/**
+ * lgetxattr(fpath, name, value, size), or llistxattr(fpath, value,
+ * size) if name is NULL, answered from the cache where it can be.
+ */
+ssize_t xattrcache_get(struct xattrcache *xattrcache, const char *fpath, const char *name, char *value, size_t size)
+{
+    char found[XATTRCACHE_VALUE_MAX];
+    struct xattrcache_entry *entry;
+    size_t h = hash(HASH_START, fpath, strlen(fpath));
+    unsigned long changes;
+    struct stat st;
+    ssize_t result;
+
+    pthread_mutex_lock(&xattrcache->lock);
+    entry = find(xattrcache, fpath, name, h);
+    if (entry != NULL && entry->expires > time(NULL) && !moved_since(xattrcache, entry)) {
+        touch(xattrcache, entry);
+        result = answer(entry->result, entry->value, value, size);
+        pthread_mutex_unlock(&xattrcache->lock);
+        return result;
+    }
+    if (entry != NULL) {
+        drop(xattrcache, entry);
+    }
+    changes = xattrcache->changes;
+    pthread_mutex_unlock(&xattrcache->lock);
+
+    if (lstat(fpath, &st) != 0) {
+        return -1;
+    }
+    result = name != NULL ? lgetxattr(fpath, name, found, sizeof(found)) : llistxattr(fpath, found, sizeof(found));
+    if (result < 0 && errno == ERANGE) {
+        /* Too long to keep */
+        return name != NULL ? lgetxattr(fpath, name, value, size) : llistxattr(fpath, value, size);
+    }
+    if (result < 0 && errno != ENODATA && errno != ENOTSUP) {
+        /* Such as the file not being there - not an answer about its attributes */
+        return result;
+    }
+    if (result < 0) {
+        result = -errno;
+    }
+    keep(xattrcache, fpath, name, h, &st, result, found, changes);
+    return answer(result, found, value, size);
+}
+
+/**
+ * Forget the answers for fpath.  Called with the lock held.
+ */
+static void drop_path(struct xattrcache *xattrcache, const char *fpath)
+{
+    struct xattrcache_entry *entry, *next;
+    size_t h = hash(HASH_START, fpath, strlen(fpath));
+
+    for (entry = xattrcache->buckets[h % XATTRCACHE_BUCKETS]; entry != NULL; entry = next) {
+        next = entry->next;
+        if (entry->hash == h && strcmp(entry->fpath, fpath) == 0) {
+            drop(xattrcache, entry);
+        }
+    }
+}
+
+/**
+ * Something else is now at fpath, or nothing is - forget the answers
+ * for it.
+ */
+void xattrcache_replaced(struct xattrcache *xattrcache, const char *fpath)
+{
+    if (xattrcache == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&xattrcache->lock);
+    xattrcache->changes++;
+    drop_path(xattrcache, fpath);
+    pthread_mutex_unlock(&xattrcache->lock);
+}
+
+/**
+ * Collectfs has changed the attributes, mode or owner of the file at
+ * fpath - forget the answers for it under every name it has.
+ */
+void xattrcache_changed(struct xattrcache *xattrcache, const char *fpath)
+{
+    struct xattrcache_entry *entry, *next;
+    struct stat st;
+    int found;
+
+    if (xattrcache == NULL) {
+        return;
+    }
+    found = lstat(fpath, &st) == 0;
+    pthread_mutex_lock(&xattrcache->lock);
+    xattrcache->changes++;
+    /* Even if it has since been replaced - by unsharing it from a checkpoint, say */
+    drop_path(xattrcache, fpath);
+    if (found) {
+        for (entry = xattrcache->inodes[hash_inode(st.st_dev, st.st_ino) % XATTRCACHE_BUCKETS]; entry != NULL;
+             entry = next) {
+            next = entry->next_inode;
+            if (entry->dev == st.st_dev && entry->ino == st.st_ino) {
+                drop(xattrcache, entry);
+            }
+        }
+    }
+    pthread_mutex_unlock(&xattrcache->lock);
+}
+
+/**
+ * Collectfs has renamed fpath away - forget the answers for it and, if
+ * it was a directory, everything beneath it.
+ */
+void xattrcache_moved(struct xattrcache *xattrcache, const char *fpath)
+{
+    size_t len = strlen(fpath);
+    struct xattrcache_moved *moved;
+    time_t now = time(NULL);
+
+    if (xattrcache == NULL) {
+        return;
+    }
+    moved = malloc(sizeof(struct xattrcache_moved) + len + 1);
+    pthread_mutex_lock(&xattrcache->lock);
+    xattrcache->changes++;
+    drop_path(xattrcache, fpath);
+    expire_moves(xattrcache, now);
+    if (moved == NULL) {
+        /* Nothing can say what was beneath it */
+        while (xattrcache->oldest != NULL) {
+            drop(xattrcache, xattrcache->oldest);
+        }
+    } else {
+        memcpy(moved->fpath, fpath, len + 1);
+        moved->len = len;
+        moved->hash = hash(HASH_START, fpath, len);
+        moved->changes = xattrcache->changes;
+        moved->expires = now + XATTRCACHE_SECONDS + 1;
+        moved->next = xattrcache->moves[moved->hash % XATTRCACHE_BUCKETS];
+        xattrcache->moves[moved->hash % XATTRCACHE_BUCKETS] = moved;
+        moved->later = NULL;
+        if (xattrcache->last_move != NULL) {
+            xattrcache->last_move->later = moved;
+        } else {
+            xattrcache->first_move = moved;
+        }
+        xattrcache->last_move = moved;
+    }
+    pthread_mutex_unlock(&xattrcache->lock);
+}
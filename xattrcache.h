@@ -0,0 +1,33 @@
+/**
+ *  Copyright 2011, Michael Hamilton
+ *  GPL 3.0(GNU General Public License) - see COPYING file
+ */
+#ifndef _XATTRCACHE_H_
+#define _XATTRCACHE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * Seconds an answer is kept - how long a change made beside the mount
+ * can go unseen.
+ */
+#define XATTRCACHE_SECONDS 5
+/**
+ * Longest value or attribute list kept - longer ones are always read
+ * from the file.
+ */
+#define XATTRCACHE_VALUE_MAX 4096
+
+struct xattrcache;
+
+struct xattrcache *xattrcache_new(size_t size);
+void xattrcache_free(struct xattrcache *xattrcache);
+
+ssize_t xattrcache_get(struct xattrcache *xattrcache, const char *fpath, const char *name, char *value, size_t size);
+
+void xattrcache_replaced(struct xattrcache *xattrcache, const char *fpath);
+void xattrcache_changed(struct xattrcache *xattrcache, const char *fpath);
+void xattrcache_moved(struct xattrcache *xattrcache, const char *fpath);
+
+#endif